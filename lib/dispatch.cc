@@ -27,6 +27,8 @@
 #include <zorpll/streamfd.h>
 #include <zorpll/thread.h>
 #include <zorp/ifmonitor.h>
+#include <zorp/tpsocket.h>
+#include <zorp/szig.h>
 
 #include <string.h>
 
@@ -38,10 +40,86 @@
  * Each such chain consists of elements, ordered by a priority value.
  * These elements contain callback functions that will be notified when a new
  * connection is established to the chain's input point.
+ *
+ * Entry snapshots
+ *
+ * The element list of a chain is only walked by writers (register and
+ * unregister) under the chain lock. Connections are dispatched using an
+ * immutable, reference counted array of the entries (the snapshot), which
+ * writers replace with a new one after each change. Dispatching only takes
+ * the chain lock to grab a reference to the current snapshot, thus the
+ * (possibly slow, Python) callbacks never run with the lock held. Entries
+ * are reference counted as well, an unregistered entry is marked as
+ * removed and freed once the last snapshot referring to it is dropped.
+ *
+ * As callbacks run on several threads (the dispatch threads and the
+ * accept shards), each entry counts the callbacks currently running on
+ * it. z_dispatch_unregister() waits until this count drains, so once it
+ * returns the callback data is not touched again and may be freed.
+ *
+ * Sharded chains
+ *
+ * A TCP chain bound to a socket address may use several SO_REUSEPORT
+ * listeners (accept_shards), each running in its own thread with a
+ * private main context. The kernel distributes incoming connections
+ * between the listeners, and each shard thread dispatches the
+ * connections it accepted itself, without going through the main loop.
  */
 
 #define MAX_DISPATCH_BIND_STRING 128
 
+#define Z_DISPATCH_ACCEPT_RING_SIZE   1024  /* must be a power of 2 */
+#define Z_DISPATCH_ACCEPT_BATCH         64  /* connections processed per ring drain */
+#define Z_DISPATCH_STATS_INTERVAL  1000000  /* accept queue stats are reported this often, in microseconds */
+#define Z_DISPATCH_ACCEPT_FULL_WAIT  10000  /* producers recheck a full ring this often, in microseconds */
+
+/*
+ * Accept ring
+ *
+ * Threaded chains hand accepted connections over to their dispatch thread
+ * through a bounded multi-producer, single-consumer ring. Producers claim
+ * a slot by advancing head with a compare-and-swap, and publish it by
+ * bumping the slot's sequence number. The consumer drains published
+ * slots in batches without taking any lock. The mutex and condition
+ * variables are only used to put an idle consumer or the producers of a
+ * full ring to sleep and to wake them up; the other side touches them
+ * only if someone is actually sleeping.
+ */
+typedef struct _ZDispatchAcceptSlot
+{
+  gint seq;
+  gpointer data;
+} ZDispatchAcceptSlot;
+
+typedef struct _ZDispatchAcceptRing
+{
+  ZDispatchAcceptSlot slots[Z_DISPATCH_ACCEPT_RING_SIZE];
+  gint head;
+  gint tail;
+  gint sleeping;
+  gint producers_waiting;
+  GMutex lock;
+  GCond cond;
+  GCond space_cond;
+} ZDispatchAcceptRing;
+
+/* a single SO_REUSEPORT listener of a sharded chain and its accept thread */
+typedef struct _ZDispatchShard
+{
+  ZDispatchChain *chain;
+  guint index;
+  GMainContext *context;
+  gboolean stop;
+} ZDispatchShard;
+
+/* immutable, priority ordered array of the entries of a chain */
+typedef struct _ZDispatchSnapshot
+{
+  ZRefCount ref_cnt;
+  guint count;
+  ZDispatchEntry *entries[];
+} ZDispatchSnapshot;
+
 /* our SockAddr based hash contains elements of this type */
 struct ZDispatchChain
 {
@@ -50,9 +128,13 @@ struct ZDispatchChain
   ZDispatchBind *registered_key;
   ZSockAddr *bound_addr;
   GList *elements;
+  ZDispatchSnapshot *snapshot;
   GRecMutex lock;
   gboolean threaded;
-  GAsyncQueue *accept_queue;
+  guint thread_refs;
+  ZDispatchAcceptRing *accept_ring;
+  ZDispatchShard *shards;
+  guint num_shards;
   ZDispatchParams params;
   GList *listeners;
   GList *iface_watches;
@@ -64,24 +146,36 @@ struct ZDispatchChain
 /* Each ZDispatchChain structure contains a list of instances of this type */
 struct ZDispatchEntry
 {
+  ZRefCount ref_cnt;
+  gboolean removed;
   gchar *session_id;
   gint prio;
   ZDispatchBind *chain_key;
   ZDispatchCallbackFunc callback;
   gpointer callback_data;
   GDestroyNotify data_destroy;
+  gint in_flight;
 };
 
 /* Global dispatch table and its mutex */
 GHashTable *dispatch_table;
 G_LOCK_DEFINE_STATIC(dispatch_lock);
 
+/* unregister waits on this for the running callbacks of an entry */
+static GMutex dispatch_drain_lock;
+static GCond dispatch_drain_cond;
+
+/* the entry whose callback is running in the current thread */
+static GPrivate dispatch_current_entry = G_PRIVATE_INIT(NULL);
+
 /*
  * Locking within the Dispatch module
  *
  * There are two level locking within Dispatch:
  * 1) a global lock protecting the Dispatch hash table
- * 2) a per-chain lock protecting the chain's linked list and its reference counter
+ * 2) a per-chain lock protecting the chain's linked list, its snapshot
+ *    pointer and its reference counter; it is never held while entry
+ *    callbacks run
  *
  * If both locks are needed the global lock must be acquired first.
  */
@@ -145,6 +239,199 @@ z_listener_entry_unref(ZListenerEntry *self)
   return FALSE;
 }
 
+static ZDispatchAcceptRing *
+z_dispatch_accept_ring_new(void)
+{
+  ZDispatchAcceptRing *self = g_new0(ZDispatchAcceptRing, 1);
+  gint i;
+
+  for (i = 0; i < Z_DISPATCH_ACCEPT_RING_SIZE; i++)
+    self->slots[i].seq = i;
+  g_mutex_init(&self->lock);
+  g_cond_init(&self->cond);
+  g_cond_init(&self->space_cond);
+  return self;
+}
+
+static void
+z_dispatch_accept_ring_free(ZDispatchAcceptRing *self)
+{
+  g_mutex_clear(&self->lock);
+  g_cond_clear(&self->cond);
+  g_cond_clear(&self->space_cond);
+  g_free(self);
+}
+
+/**
+ * Approximate number of items in the ring.
+ *
+ * @param self this
+ *
+ * Only meaningful when called from the consumer thread.
+ */
+static inline guint
+z_dispatch_accept_ring_length(ZDispatchAcceptRing *self)
+{
+  return (guint) g_atomic_int_get(&self->head) - (guint) self->tail;
+}
+
+/**
+ * Check whether the next slot is published, called by the consumer.
+ *
+ * @param self this
+ */
+static inline gboolean
+z_dispatch_accept_ring_ready(ZDispatchAcceptRing *self)
+{
+  ZDispatchAcceptSlot *slot = &self->slots[self->tail & (Z_DISPATCH_ACCEPT_RING_SIZE - 1)];
+
+  return (gint) ((guint) g_atomic_int_get(&slot->seq) - ((guint) self->tail + 1)) >= 0;
+}
+
+/**
+ * Check whether the slot at head is still in use, called by producers.
+ *
+ * @param self this
+ */
+static inline gboolean
+z_dispatch_accept_ring_full(ZDispatchAcceptRing *self)
+{
+  gint pos = g_atomic_int_get(&self->head);
+  ZDispatchAcceptSlot *slot = &self->slots[pos & (Z_DISPATCH_ACCEPT_RING_SIZE - 1)];
+
+  return (gint) ((guint) g_atomic_int_get(&slot->seq) - (guint) pos) < 0;
+}
+
+/**
+ * Add an item to the ring, called by producers.
+ *
+ * @param self this
+ * @param data item to add
+ *
+ * Never blocks, wakes the consumer up if it is sleeping.
+ *
+ * @return FALSE if the ring is full
+ */
+static gboolean
+z_dispatch_accept_ring_push(ZDispatchAcceptRing *self, gpointer data)
+{
+  ZDispatchAcceptSlot *slot;
+  gint pos, diff;
+
+  pos = g_atomic_int_get(&self->head);
+  while (1)
+    {
+      slot = &self->slots[pos & (Z_DISPATCH_ACCEPT_RING_SIZE - 1)];
+      diff = (gint) ((guint) g_atomic_int_get(&slot->seq) - (guint) pos);
+      if (diff == 0)
+        {
+          if (g_atomic_int_compare_and_exchange(&self->head, pos, (gint) ((guint) pos + 1)))
+            break;
+          pos = g_atomic_int_get(&self->head);
+        }
+      else if (diff < 0)
+        {
+          return FALSE;
+        }
+      else
+        {
+          pos = g_atomic_int_get(&self->head);
+        }
+    }
+
+  slot->data = data;
+  g_atomic_int_set(&slot->seq, (gint) ((guint) pos + 1));
+
+  if (g_atomic_int_get(&self->sleeping))
+    {
+      g_mutex_lock(&self->lock);
+      g_cond_signal(&self->cond);
+      g_mutex_unlock(&self->lock);
+    }
+  return TRUE;
+}
+
+/**
+ * Add an item to the ring, waiting for free space if necessary.
+ *
+ * @param self this
+ * @param data item to add
+ *
+ * A full ring means that the dispatch thread is lagging behind, so
+ * holding up the producer (and thereby the accepts) is the intended
+ * back-pressure.  The producer sleeps until the consumer frees a slot,
+ * rechecking the ring every Z_DISPATCH_ACCEPT_FULL_WAIT in case a
+ * wakeup was missed.
+ */
+static void
+z_dispatch_accept_ring_push_wait(ZDispatchAcceptRing *self, gpointer data)
+{
+  if (z_dispatch_accept_ring_push(self, data))
+    return;
+
+  g_atomic_int_inc(&self->producers_waiting);
+  while (!z_dispatch_accept_ring_push(self, data))
+    {
+      g_mutex_lock(&self->lock);
+      if (z_dispatch_accept_ring_full(self))
+        g_cond_wait_until(&self->space_cond, &self->lock, g_get_monotonic_time() + Z_DISPATCH_ACCEPT_FULL_WAIT);
+      g_mutex_unlock(&self->lock);
+    }
+  g_atomic_int_add(&self->producers_waiting, -1);
+}
+
+/**
+ * Remove up to max_items items from the ring, called by the consumer.
+ *
+ * @param self this
+ * @param items array to store the items in
+ * @param max_items size of items
+ *
+ * @return the number of items returned
+ */
+static guint
+z_dispatch_accept_ring_pop_batch(ZDispatchAcceptRing *self, gpointer *items, guint max_items)
+{
+  guint count = 0;
+
+  while (count < max_items && z_dispatch_accept_ring_ready(self))
+    {
+      ZDispatchAcceptSlot *slot = &self->slots[self->tail & (Z_DISPATCH_ACCEPT_RING_SIZE - 1)];
+
+      items[count++] = slot->data;
+      g_atomic_int_set(&slot->seq, (gint) ((guint) self->tail + Z_DISPATCH_ACCEPT_RING_SIZE));
+      self->tail = (gint) ((guint) self->tail + 1);
+    }
+
+  if (count && g_atomic_int_get(&self->producers_waiting))
+    {
+      g_mutex_lock(&self->lock);
+      g_cond_broadcast(&self->space_cond);
+      g_mutex_unlock(&self->lock);
+    }
+  return count;
+}
+
+/**
+ * Wait until the ring becomes non-empty or the deadline passes.
+ *
+ * @param self this
+ * @param end_time monotonic deadline
+ */
+static void
+z_dispatch_accept_ring_wait(ZDispatchAcceptRing *self, gint64 end_time)
+{
+  g_mutex_lock(&self->lock);
+  g_atomic_int_set(&self->sleeping, TRUE);
+  while (!z_dispatch_accept_ring_ready(self))
+    {
+      if (!g_cond_wait_until(&self->cond, &self->lock, end_time))
+        break;
+    }
+  g_atomic_int_set(&self->sleeping, FALSE);
+  g_mutex_unlock(&self->lock);
+}
+
 #define Z_DISPATCH_THREAD_EXIT_MAGIC ((ZConnection *) &z_dispatch_chain_thread)
 
 static gpointer z_dispatch_chain_thread(gpointer st);
@@ -408,25 +695,49 @@ z_dispatch_chain_unlock(ZDispatchChain *self)
 static inline ZDispatchChain *z_dispatch_chain_ref(ZDispatchChain *self);
 static inline void z_dispatch_chain_unref(ZDispatchChain *self);
 
+/**
+ * Publish the accept queue statistics of a threaded chain in SZIG.
+ *
+ * @param self this
+ * @param avg_length average accept queue length since the last report
+ *
+ * The values appear under stats.dispatch.<bind>.
+ */
+static void
+z_dispatch_chain_report_queue(ZDispatchChain *self, glong avg_length)
+{
+  gchar buf[MAX_DISPATCH_BIND_STRING];
+
+  z_szig_event(Z_SZIG_DISPATCH_QUEUE,
+               z_szig_value_new_props(z_dispatch_bind_format(self->registered_key, buf, sizeof(buf)),
+                                      "accept_queue_avg", z_szig_value_new_long(avg_length),
+                                      NULL));
+}
+
 /**
  * Thread function of dispatcher chain.
  *
  * @param st this
  *
- * Pops new connections from the accept_queue and processes them by
- * calling z_dispatch_connection.  When the popped connection is the
- * special value Z_DISPATCH_THREAD_EXIT_MAGIC, exits the processing
+ * Drains new connections from the accept ring in batches and processes
+ * them by calling z_dispatch_connection.  When the popped connection is
+ * the special value Z_DISPATCH_THREAD_EXIT_MAGIC, exits the processing
  * loop and finishes the thread.
  *
+ * The average length of the accept queue is sampled before each batch
+ * and reported to SZIG every Z_DISPATCH_STATS_INTERVAL.
+ *
  * @return NULL
  */
 static gpointer
 z_dispatch_chain_thread(gpointer st)
 {
   ZDispatchChain *self = (ZDispatchChain *) st;
-  ZConnection *conn;
-  glong acceptq_sum;
-  gint count;
+  gpointer batch[Z_DISPATCH_ACCEPT_BATCH];
+  gboolean exiting = FALSE;
+  glong acceptq_sum = 0, acceptq_samples = 0, last_avg = -1;
+  gint64 now, next_report;
+  guint count, i;
 
   /* g_thread_set_priority(g_thread_self(), G_THREAD_PRIORITY_HIGH); */
   /*LOG
@@ -435,24 +746,42 @@ z_dispatch_chain_thread(gpointer st)
    @see: Dispatcher
    */
   z_log(NULL, CORE_DEBUG, 4, "Dispatch thread starting;");
-  acceptq_sum = 0;
-  count = 0;
-  while (1)
+  next_report = g_get_monotonic_time() + Z_DISPATCH_STATS_INTERVAL;
+  while (!exiting)
     {
-      acceptq_sum += g_async_queue_length(self->accept_queue);
-      if (count % 1000 == 0)
+      acceptq_sum += z_dispatch_accept_ring_length(self->accept_ring);
+      acceptq_samples++;
+
+      count = z_dispatch_accept_ring_pop_batch(self->accept_ring, batch, Z_DISPATCH_ACCEPT_BATCH);
+      for (i = 0; i < count; i++)
         {
-          /*LOG
-	    This message reports the dispatcher average accept queue length status.
-	   */
-	  z_log(NULL, CORE_DEBUG, 4, "Accept queue stats; avg_length='%ld'", acceptq_sum / 1000);
+          ZConnection *conn = static_cast<ZConnection *>(batch[i]);
+
+          if (conn == Z_DISPATCH_THREAD_EXIT_MAGIC)
+            {
+              exiting = TRUE;
+              continue;
+            }
+          z_dispatch_connection(self, conn);
+        }
+
+      now = g_get_monotonic_time();
+      if (now >= next_report)
+        {
+          glong avg = acceptq_sum / acceptq_samples;
+
+          if (avg != last_avg)
+            {
+              z_dispatch_chain_report_queue(self, avg);
+              last_avg = avg;
+            }
           acceptq_sum = 0;
+          acceptq_samples = 0;
+          next_report = now + Z_DISPATCH_STATS_INTERVAL;
         }
-      conn = static_cast<ZConnection *>(g_async_queue_pop(self->accept_queue));
-      if (conn == Z_DISPATCH_THREAD_EXIT_MAGIC)
-        break;
-      z_dispatch_connection(self, conn);
-      count++;
+
+      if (count == 0 && !exiting)
+        z_dispatch_accept_ring_wait(self->accept_ring, next_report);
     }
   /*LOG
     This message reports that the dispatcher thread is exiting.
@@ -489,10 +818,31 @@ z_dispatch_chain_new(const gchar *session_id, ZDispatchBind *key, ZDispatchParam
   g_rec_mutex_init(&self->lock);
 
   memcpy(&self->params, params, sizeof(*params));
+  if (params->common.accept_shards > 0)
+    {
+      if (key->type == ZD_BIND_SOCKADDR && key->protocol == ZD_PROTO_TCP)
+        {
+          /* shard threads dispatch the connections they accept, no need for a separate dispatch thread */
+          self->num_shards = params->common.accept_shards;
+          self->threaded = FALSE;
+        }
+      else
+        {
+          /*LOG
+            This message indicates that accept_shards was specified for a
+            dispatcher that is not bound to a TCP socket address, and
+            that it is ignored.
+           */
+          z_log(session_id, CORE_ERROR, 3, "Accept shards are only supported for TCP socket address binds, using a single listener; dispatch='%s'",
+                z_dispatch_bind_format(key, buf, sizeof(buf)));
+        }
+    }
+
   if (self->threaded)
     {
-      self->accept_queue = g_async_queue_new();
+      self->accept_ring = z_dispatch_accept_ring_new();
       z_dispatch_chain_ref(self);
+      self->thread_refs++;
       g_snprintf(thread_name, sizeof(thread_name), "dispatch(%s)", z_dispatch_bind_format(key, buf, sizeof(buf)));
       if (!z_thread_new(thread_name, z_dispatch_chain_thread, self))
         {
@@ -504,10 +854,11 @@ z_dispatch_chain_new(const gchar *session_id, ZDispatchBind *key, ZDispatchParam
 	    for further information.
 	   */
           z_log(NULL, CORE_ERROR, 2, "Error creating dispatch thread, falling back to non-threaded mode;");
+          self->thread_refs--;
           z_dispatch_chain_unref(self);
           self->threaded = FALSE;
-          g_async_queue_unref(self->accept_queue);
-          self->accept_queue = NULL;
+          z_dispatch_accept_ring_free(self->accept_ring);
+          self->accept_ring = NULL;
         }
     }
   z_return(self);
@@ -542,9 +893,22 @@ z_dispatch_chain_unref(ZDispatchChain *self)
     {
       z_dispatch_chain_unlock(self);
 
-      if (self->accept_queue)
-        g_async_queue_unref(self->accept_queue);
+      if (self->accept_ring)
+        z_dispatch_accept_ring_free(self->accept_ring);
+
+      if (self->shards)
+        {
+          guint i;
+
+          for (i = 0; i < self->num_shards; i++)
+            {
+              if (self->shards[i].context)
+                g_main_context_unref(self->shards[i].context);
+            }
+          g_free(self->shards);
+        }
 
+      z_dispatch_snapshot_unref(self->snapshot);
       z_dispatch_bind_unref(self->registered_key);
       z_sockaddr_unref(self->bound_addr);
       g_free(self->session_id);
@@ -569,6 +933,96 @@ z_dispatch_entry_free(ZDispatchEntry *entry)
   g_free(entry);
 }
 
+static inline ZDispatchEntry *
+z_dispatch_entry_ref(ZDispatchEntry *entry)
+{
+  z_refcount_inc(&entry->ref_cnt);
+  return entry;
+}
+
+static inline void
+z_dispatch_entry_unref(ZDispatchEntry *entry)
+{
+  if (entry && z_refcount_dec(&entry->ref_cnt))
+    z_dispatch_entry_free(entry);
+}
+
+/**
+ * Create a snapshot of the entries of a chain.
+ *
+ * @param elements the priority ordered entry list of the chain
+ *
+ * @return the new snapshot, holding a reference to each entry
+ */
+static ZDispatchSnapshot *
+z_dispatch_snapshot_new(GList *elements)
+{
+  ZDispatchSnapshot *self;
+  guint count = g_list_length(elements), i;
+  GList *p;
+
+  self = (ZDispatchSnapshot *) g_malloc0(sizeof(ZDispatchSnapshot) + count * sizeof(ZDispatchEntry *));
+  z_refcount_set(&self->ref_cnt, 1);
+  self->count = count;
+  for (p = elements, i = 0; p; p = g_list_next(p), i++)
+    self->entries[i] = z_dispatch_entry_ref((ZDispatchEntry *) p->data);
+  return self;
+}
+
+static inline ZDispatchSnapshot *
+z_dispatch_snapshot_ref(ZDispatchSnapshot *self)
+{
+  z_refcount_inc(&self->ref_cnt);
+  return self;
+}
+
+static void
+z_dispatch_snapshot_unref(ZDispatchSnapshot *self)
+{
+  guint i;
+
+  if (self && z_refcount_dec(&self->ref_cnt))
+    {
+      for (i = 0; i < self->count; i++)
+        z_dispatch_entry_unref(self->entries[i]);
+      g_free(self);
+    }
+}
+
+/**
+ * Publish a new snapshot after the element list of the chain changed.
+ *
+ * @param chain this
+ *
+ * Must be called with the chain lock held. Readers still walking the
+ * previous snapshot keep it alive until they finish.
+ */
+static void
+z_dispatch_chain_publish(ZDispatchChain *chain)
+{
+  ZDispatchSnapshot *old = chain->snapshot;
+
+  chain->snapshot = z_dispatch_snapshot_new(chain->elements);
+  z_dispatch_snapshot_unref(old);
+}
+
+/**
+ * Get a reference to the current snapshot of the chain.
+ *
+ * @param chain this
+ */
+static ZDispatchSnapshot *
+z_dispatch_chain_get_snapshot(ZDispatchChain *chain)
+{
+  ZDispatchSnapshot *snapshot = NULL;
+
+  z_dispatch_chain_lock(chain);
+  if (chain->snapshot)
+    snapshot = z_dispatch_snapshot_ref(chain->snapshot);
+  z_dispatch_chain_unlock(chain);
+  return snapshot;
+}
+
 /**
  * Compare two dispatch entries by their priority.
  *
@@ -594,40 +1048,96 @@ z_dispatch_entry_compare_prio(ZDispatchEntry *a, ZDispatchEntry *b)
     return 1;
 }
 
+/**
+ * Mark the end of a callback running on an entry.
+ *
+ * @param entry this
+ *
+ * Wakes up z_dispatch_unregister() if it is waiting for the entry to
+ * drain.
+ */
+static void
+z_dispatch_entry_leave(ZDispatchEntry *entry)
+{
+  if (g_atomic_int_dec_and_test(&entry->in_flight) && g_atomic_int_get(&entry->removed))
+    {
+      g_mutex_lock(&dispatch_drain_lock);
+      g_cond_broadcast(&dispatch_drain_cond);
+      g_mutex_unlock(&dispatch_drain_lock);
+    }
+}
+
+/**
+ * Wait until no callback runs on an unregistered entry.
+ *
+ * @param entry this
+ *
+ * The callback running in the current thread (when the entry is
+ * unregistered from its own callback) is not waited for.
+ */
+static void
+z_dispatch_entry_drain(ZDispatchEntry *entry)
+{
+  gint own = g_private_get(&dispatch_current_entry) == entry ? 1 : 0;
+
+  g_mutex_lock(&dispatch_drain_lock);
+  while (g_atomic_int_get(&entry->in_flight) > own)
+    g_cond_wait(&dispatch_drain_cond, &dispatch_drain_lock);
+  g_mutex_unlock(&dispatch_drain_lock);
+}
+
 /**
  * Dispatch a new connection.
  *
  * @param chain this
  * @param conn The new connection to dispatch
  *
- * Iterates through the chain and dispatches the connection to the
- * chain items by passing it to their callbacks (for example to
- * z_py_zorp_dispatch_accept, which passes it to Dispatcher.accepted).
+ * Iterates through the current snapshot of the chain and dispatches the
+ * connection to the chain items by passing it to their callbacks (for
+ * example to z_py_zorp_dispatch_accept, which passes it to
+ * Dispatcher.accepted). The chain lock is not held while the callbacks
+ * run, entries unregistered in the meantime are skipped.
  */
 static void
 z_dispatch_connection(ZDispatchChain *chain, ZConnection *conn)
 {
-  GList *p;
+  ZDispatchSnapshot *snapshot;
   ZDispatchEntry *entry;
+  gpointer prev_entry;
   gchar buf[256];
+  guint i;
+  gboolean accepted;
 
   z_enter();
-  z_dispatch_chain_lock(chain);
-  /* the list is ordered by priority */
-  for (p = chain->elements; p; p = g_list_next(p))
+  snapshot = z_dispatch_chain_get_snapshot(chain);
+  /* the snapshot is ordered by priority */
+  for (i = 0; snapshot && i < snapshot->count; i++)
     {
-      entry = (ZDispatchEntry *) p->data;
+      entry = snapshot->entries[i];
+      /* counted before checking removed, so that unregister either sees
+       * the callback running or we see the entry removed */
+      g_atomic_int_inc(&entry->in_flight);
+      if (g_atomic_int_get(&entry->removed))
+        {
+          z_dispatch_entry_leave(entry);
+          continue;
+        }
       /*LOG
         This message reports that a new connections is coming.
        */
       z_log(entry->session_id, CORE_DEBUG, 6, "Incoming connection; %s", conn ? z_connection_format(conn, buf, sizeof(buf)) : "conn=NULL");
-      if ((entry->callback)(conn, entry->callback_data))
+      prev_entry = g_private_get(&dispatch_current_entry);
+      g_private_set(&dispatch_current_entry, entry);
+      accepted = (entry->callback)(conn, entry->callback_data);
+      g_private_set(&dispatch_current_entry, prev_entry);
+      z_dispatch_entry_leave(entry);
+      if (accepted)
         {
-          z_dispatch_chain_unlock(chain);
+          z_dispatch_snapshot_unref(snapshot);
           z_return();
         }
     }
-  z_dispatch_chain_unlock(chain);
+  z_dispatch_snapshot_unref(snapshot);
 
   /* nobody needed this connection, destroy it */
   /*LOG
@@ -653,7 +1163,8 @@ z_dispatch_connection(ZDispatchChain *chain, ZConnection *conn)
  * either synchronously by z_dispatch_connection or asynchronously by pushing
  * it to the chain's accept queue.
  *
- * Note: this function runs in the main thread.
+ * Note: this function runs in the main thread, or in the accept thread of
+ * the shard for sharded chains.
  *
  * @return TRUE
  */
@@ -736,7 +1247,7 @@ z_dispatch_accept(ZStream *fdstream, ZSockAddr *client, ZSockAddr *dest, gpointe
   conn->stream = fdstream;
 
   if (chain->threaded)
-    g_async_queue_push(chain->accept_queue, conn);
+    z_dispatch_accept_ring_push_wait(chain->accept_ring, conn);
   else
     z_dispatch_connection(chain, conn);
 
@@ -945,6 +1456,133 @@ z_dispatch_bind_iface_group_change(guint32 group, ZIfChangeType change, const gc
 }
 #endif
 
+/**
+ * Thread function of a dispatch shard.
+ *
+ * @param s ZDispatchShard instance
+ *
+ * Runs the private main context of the shard, which accepts and
+ * dispatches connections arriving at the shard's listener, until
+ * z_dispatch_unbind_listener() asks it to stop.
+ *
+ * @return NULL
+ */
+static gpointer
+z_dispatch_shard_thread(gpointer s)
+{
+  ZDispatchShard *shard = (ZDispatchShard *) s;
+
+  /*LOG
+    This message reports that a new accept thread is starting for a
+    sharded dispatcher.
+   */
+  z_log(NULL, CORE_DEBUG, 4, "Dispatch shard thread starting; shard='%u'", shard->index);
+  g_main_context_push_thread_default(shard->context);
+  while (!g_atomic_int_get(&shard->stop))
+    g_main_context_iteration(shard->context, TRUE);
+  g_main_context_pop_thread_default(shard->context);
+  /*LOG
+    This message reports that the accept thread of a sharded dispatcher
+    is exiting. It it likely that Zorp unbinds from that address.
+   */
+  z_log(NULL, CORE_DEBUG, 4, "Dispatch shard thread exiting; shard='%u'", shard->index);
+  z_dispatch_chain_unref(shard->chain);
+  return NULL;
+}
+
+/**
+ * Start the SO_REUSEPORT listeners and accept threads of a sharded chain.
+ *
+ * @param chain this
+ * @param first the already opened listener, used by the first shard
+ *
+ * Additional listeners are bound to chain->bound_addr so that wildcard
+ * ports resolve to the same port for all shards. If some of the shards
+ * cannot be started, the chain continues with the ones already running.
+ *
+ * @return TRUE if at least the first shard could be started
+ */
+static gboolean
+z_dispatch_start_shards(ZDispatchChain *chain, ZListener *first)
+{
+  gchar thread_name[256], buf[MAX_DISPATCH_BIND_STRING];
+  guint i;
+  gboolean res;
+
+  chain->shards = g_new0(ZDispatchShard, chain->num_shards);
+  for (i = 0; i < chain->num_shards; i++)
+    {
+      ZDispatchShard *shard = &chain->shards[i];
+      ZListenerEntry *entry = NULL;
+      ZListener *listener;
+
+      shard->chain = chain;
+      shard->index = i;
+      shard->context = g_main_context_new();
+
+      if (i == 0)
+        {
+          listener = z_listener_ref(first);
+        }
+      else
+        {
+          listener = z_dispatch_new_listener(chain, chain->bound_addr);
+          if (!listener)
+            break;
+          entry = z_listener_entry_new(listener);
+          chain->listeners = g_list_prepend(chain->listeners, entry);
+        }
+
+      /* the first listener is already bound */
+      z_tp_socket_set_reuseport(TRUE);
+      res = z_listener_start_in_context(listener, shard->context);
+      z_tp_socket_set_reuseport(FALSE);
+      if (!res)
+        {
+          z_listener_unref(listener);
+          if (entry)
+            {
+              chain->listeners = g_list_remove(chain->listeners, entry);
+              z_listener_entry_unref(entry);
+            }
+          break;
+        }
+      z_listener_unref(listener);
+
+      z_dispatch_chain_ref(chain);
+      chain->thread_refs++;
+      g_snprintf(thread_name, sizeof(thread_name), "dispatch(%s)/%u", z_dispatch_bind_format(chain->registered_key, buf, sizeof(buf)), i);
+      if (!z_thread_new(thread_name, z_dispatch_shard_thread, shard))
+        {
+          chain->thread_refs--;
+          z_dispatch_chain_unref(chain);
+          if (entry)
+            {
+              z_listener_cancel(entry->listener);
+              chain->listeners = g_list_remove(chain->listeners, entry);
+              z_listener_entry_unref(entry);
+            }
+          break;
+        }
+    }
+
+  if (i < chain->num_shards)
+    {
+      /*LOG
+        This message indicates that Zorp was unable to start all the
+        accept shards requested for a dispatcher, it continues with the
+        shards already running. It is likely that Zorp reached its thread
+        or resource limit. Check your logs for further information.
+       */
+      z_log(chain->session_id, CORE_ERROR, 2, "Error starting accept shard; dispatch='%s', requested='%u', running='%u'",
+            z_dispatch_bind_format(chain->registered_key, buf, sizeof(buf)), chain->num_shards, i);
+      g_main_context_unref(chain->shards[i].context);
+      chain->shards[i].context = NULL;
+      chain->num_shards = i;
+    }
+  return chain->num_shards > 0;
+}
+
 /**
  * z_dispatch_bind_listener:
  * @param session_id Session identifier
@@ -957,7 +1595,7 @@ z_dispatch_bind_iface_group_change(guint32 group, ZIfChangeType change, const gc
 static gboolean
 z_dispatch_bind_listener(ZDispatchChain *chain, ZDispatchBind **bound_key)
 {
-  gboolean rc = TRUE;
+  gboolean rc = TRUE, res;
   ZListener *listener;
 
   z_enter();
@@ -973,8 +1611,12 @@ z_dispatch_bind_listener(ZDispatchChain *chain, ZDispatchBind **bound_key)
           z_listener_unref(listener);
 
           chain->listeners = g_list_prepend(chain->listeners, entry);
-          /* open fd so that we can get the local address */
-          if (!z_listener_open(listener))
+          /* open fd so that we can get the local address; the shards
+           * share the address of the first listener */
+          z_tp_socket_set_reuseport(chain->num_shards > 0);
+          res = z_listener_open(listener);
+          z_tp_socket_set_reuseport(FALSE);
+          if (!res)
             {
               chain->listeners = g_list_remove(chain->listeners, entry);
               z_listener_entry_unref(entry);
@@ -982,7 +1624,7 @@ z_dispatch_bind_listener(ZDispatchChain *chain, ZDispatchBind **bound_key)
               break;
             }
           chain->bound_addr = z_sockaddr_ref(listener->local);
-          if (!z_listener_start(listener))
+          if (chain->num_shards ? !z_dispatch_start_shards(chain, listener) : !z_listener_start(listener))
             {
               chain->bound_addr = NULL;
               z_sockaddr_unref(listener->local);
@@ -1035,19 +1677,26 @@ z_dispatch_bind_listener(ZDispatchChain *chain, ZDispatchBind **bound_key)
  * @param chain this
  *
  * If the chain was using a processing thread, notifies it by sending
- * the special connection value Z_DISPATCH_THREAD_EXIT_MAGIC to it.
+ * the special connection value Z_DISPATCH_THREAD_EXIT_MAGIC to it. The
+ * accept threads of a sharded chain are asked to stop as well.
  */
 static void
 z_dispatch_unbind_listener(ZDispatchChain *chain)
 {
   GList *p;
+  guint i;
 
   z_enter();
 
   if (chain->threaded)
     {
       /* send exit magic to our threads */
-      g_async_queue_push(chain->accept_queue, Z_DISPATCH_THREAD_EXIT_MAGIC);
+      z_dispatch_accept_ring_push_wait(chain->accept_ring, Z_DISPATCH_THREAD_EXIT_MAGIC);
+    }
+  for (i = 0; i < chain->num_shards; i++)
+    {
+      g_atomic_int_set(&chain->shards[i].stop, TRUE);
+      g_main_context_wakeup(chain->shards[i].context);
     }
 #ifdef HAVE_LINUX_NETLINK_H
   if (chain->iface_group_watch)
@@ -1152,6 +1801,7 @@ z_dispatch_register(gchar *session_id,
     *bound_addr = z_sockaddr_ref(chain->bound_addr);
 
   entry = g_new0(ZDispatchEntry, 1);
+  z_refcount_set(&entry->ref_cnt, 1);
   entry->chain_key = bound_key;
   entry->session_id = g_strdup(session_id);
   entry->prio = prio;
@@ -1160,6 +1810,7 @@ z_dispatch_register(gchar *session_id,
   entry->data_destroy = data_destroy;
   z_dispatch_chain_lock(chain);
   chain->elements = g_list_insert_sorted(chain->elements, entry, (GCompareFunc) z_dispatch_entry_compare_prio);
+  z_dispatch_chain_publish(chain);
   z_dispatch_chain_unlock(chain);
 
  error:
@@ -1174,7 +1825,8 @@ z_dispatch_register(gchar *session_id,
  * @param entry this
  *
  * Removes the entry from its chain, destroying the chain if this was
- * the last entry in it.
+ * the last entry in it. Returns only after the callbacks already running
+ * on the entry in other threads have finished.
  */
 void
 z_dispatch_unregister(ZDispatchEntry *entry)
@@ -1183,6 +1835,7 @@ z_dispatch_unregister(ZDispatchEntry *entry)
   ZDispatchBind *key;
   gchar buf[MAX_DISPATCH_BIND_STRING];
   gboolean found, unbind;
+  gboolean drain = FALSE;
   gpointer orig_key, orig_chain;
 
   z_enter();
@@ -1199,7 +1852,11 @@ z_dispatch_unregister(ZDispatchEntry *entry)
       if (p)
         {
           chain->elements = g_list_delete_link(chain->elements, p);
-          z_dispatch_entry_free(entry);
+          g_atomic_int_set(&entry->removed, TRUE);
+          z_dispatch_chain_publish(chain);
+          /* the reference of the list is dropped once the callbacks have
+           * drained */
+          drain = TRUE;
         }
       else
         {
@@ -1212,8 +1869,8 @@ z_dispatch_unregister(ZDispatchEntry *entry)
                 z_dispatch_bind_format(entry->chain_key, buf, sizeof(buf)), entry);
         }
 
-      g_assert(chain->ref_cnt >= (guint) (1 + (guint) (!!chain->threaded)));
-      unbind = chain->ref_cnt == (guint) (1 + (guint) (!!chain->threaded));
+      g_assert(chain->ref_cnt >= 1 + chain->thread_refs);
+      unbind = chain->ref_cnt == 1 + chain->thread_refs;
       z_dispatch_chain_unlock(chain);
       if (unbind)
         {
@@ -1240,6 +1897,20 @@ z_dispatch_unregister(ZDispatchEntry *entry)
             z_dispatch_bind_format(entry->chain_key, buf, sizeof(buf)), entry);
     }
   G_UNLOCK(dispatch_lock);
+
+  if (drain)
+    {
+      z_dispatch_entry_drain(entry);
+      /* destroy the callback data here instead of in whichever thread
+       * drops the last snapshot, unless we were called from the callback
+       * itself, which still uses it */
+      if (entry->data_destroy && g_private_get(&dispatch_current_entry) != entry)
+        {
+          entry->data_destroy(entry->callback_data);
+          entry->data_destroy = NULL;
+        }
+      z_dispatch_entry_unref(entry);
+    }
   z_return();
 }
 
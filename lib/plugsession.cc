@@ -24,16 +24,29 @@
 
 #include <zorpll/log.h>
 #include <zorpll/stream.h>
+#include <zorpll/streamssl.h>
 #include <zorpll/source.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 /* FIXME: should be run-time configurable */
 #define MAX_READ_AT_A_TIME 30
 
+/* the default capacity of a pipe on Linux */
+#define MAX_SPLICE_AT_A_TIME 65536
+
 typedef struct _ZPlugIOBuffer
 {
   gchar *buf;
   gsize ofs, end;
   gsize packet_count, packet_bytes;
+
+  /* zero-copy mode, data read but not written yet is kept in the pipe */
+  gboolean splice;
+  gint pipe[2];
+  gsize pipe_pending;
 } ZPlugIOBuffer;
 
 struct _ZPlugSession
@@ -104,6 +117,40 @@ z_plug_update_eof_mask(ZPlugSession *self, guint add_mask)
     }
 }
 
+/**
+ * z_plug_account_packet:
+ * @self: ZPlugSession instance
+ * @buf: buffer of the direction the data was read for
+ * @bytes: number of bytes read
+ *
+ * Update the packet statistics after a successful read and call the
+ * packet_stats callback when packet_stats_interval_packet reads have been
+ * made.  Returns FALSE if the callback requested the session to be
+ * terminated.
+ **/
+static gboolean
+z_plug_account_packet(ZPlugSession *self, ZPlugIOBuffer *buf, gsize bytes)
+{
+  buf->packet_bytes += bytes;
+  buf->packet_count++;
+  self->global_packet_count++;
+  if (self->session_data->packet_stats_interval_packet &&
+     (self->global_packet_count % self->session_data->packet_stats_interval_packet) == 0)
+    {
+      if (!self->session_data->packet_stats(self,
+                                            self->buffers[EP_CLIENT].packet_bytes,
+                                            self->buffers[EP_CLIENT].packet_count,
+                                            self->buffers[EP_SERVER].packet_bytes,
+                                            self->buffers[EP_SERVER].packet_count,
+                                            self->user_data))
+        {
+          z_plug_update_eof_mask(self, EOF_ALL);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
 static GIOStatus
 z_plug_read_input(ZPlugSession *self, ZStream *input, ZPlugIOBuffer *buf)
 {
@@ -113,23 +160,8 @@ z_plug_read_input(ZPlugSession *self, ZStream *input, ZPlugIOBuffer *buf)
   rc = z_stream_read(input, buf->buf, self->session_data->buffer_size, &buf->end, NULL);
   if (rc == G_IO_STATUS_NORMAL)
     {
-      buf->packet_bytes += buf->end;
-      buf->packet_count++;
-      self->global_packet_count++;
-      if (self->session_data->packet_stats_interval_packet &&
-         (self->global_packet_count % self->session_data->packet_stats_interval_packet) == 0)
-        {
-          if (!self->session_data->packet_stats(self,
-                                                self->buffers[EP_CLIENT].packet_bytes,
-                                                self->buffers[EP_CLIENT].packet_count,
-                                                self->buffers[EP_SERVER].packet_bytes,
-                                                self->buffers[EP_SERVER].packet_count,
-                                                self->user_data))
-            {
-              z_plug_update_eof_mask(self, EOF_ALL);
-              rc = G_IO_STATUS_EOF;
-            }
-        }
+      if (!z_plug_account_packet(self, buf, buf->end))
+        rc = G_IO_STATUS_EOF;
     }
   z_return(rc);
 }
@@ -168,6 +200,90 @@ z_plug_write_output(ZPlugSession * /* self */, ZPlugIOBuffer *buf, ZStream *outp
   z_return(G_IO_STATUS_NORMAL);
 }
 
+#ifdef HAVE_SPLICE
+
+/**
+ * z_plug_splice_data:
+ * @self: ZPlugSession instance
+ * @from: source stream
+ * @to: destination stream
+ * @buf: buffer of this direction
+ *
+ * The zero-copy counterpart of z_plug_copy_data(): data is moved from the
+ * socket of @from to the socket of @to through the pipe of @buf using
+ * splice(), without copying it to userspace.  Each chunk read is accounted
+ * as a packet, thus packet_stats works the same way as in buffered mode.
+ **/
+static GIOStatus
+z_plug_splice_data(ZPlugSession *self, ZStream *from, ZStream *to, ZPlugIOBuffer *buf)
+{
+  GIOStatus rc = G_IO_STATUS_NORMAL;
+  int pkt_count = 0;
+  ssize_t len;
+
+  z_enter();
+  z_stream_set_cond(from, G_IO_IN, FALSE);
+  z_stream_set_cond(to, G_IO_OUT, FALSE);
+
+  while (pkt_count < MAX_READ_AT_A_TIME)
+    {
+      if (buf->pipe_pending == 0)
+        {
+          len = splice(z_stream_get_fd(from), NULL, buf->pipe[1], NULL, MAX_SPLICE_AT_A_TIME,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (len == 0)
+            {
+              z_return(G_IO_STATUS_EOF);
+            }
+          else if (len < 0)
+            {
+              if (errno != EAGAIN && errno != EINTR)
+                {
+                  /* let the stream stack read the record splice() refused
+                   * itself, e.g. the close_notify alert of a session
+                   * offloaded to the kernel, it is reported as EOF there */
+                  close(buf->pipe[0]);
+                  close(buf->pipe[1]);
+                  buf->splice = FALSE;
+                  z_stream_set_cond(from, G_IO_IN, TRUE);
+                  z_return(G_IO_STATUS_AGAIN);
+                }
+
+              rc = G_IO_STATUS_AGAIN;
+              break;
+            }
+
+          from->bytes_recvd += len;
+          buf->pipe_pending = len;
+          if (!z_plug_account_packet(self, buf, len))
+            z_return(G_IO_STATUS_EOF);
+        }
+
+      len = splice(buf->pipe[0], NULL, z_stream_get_fd(to), NULL, buf->pipe_pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (len < 0 && errno != EAGAIN && errno != EINTR)
+        z_return(G_IO_STATUS_ERROR);
+
+      if (len > 0)
+        {
+          to->bytes_sent += len;
+          buf->pipe_pending -= len;
+        }
+
+      if (buf->pipe_pending != 0)
+        {
+          z_stream_set_cond(to, G_IO_OUT, TRUE);
+          z_return(G_IO_STATUS_AGAIN);
+        }
+      pkt_count++;
+    }
+
+  z_stream_set_cond(from, G_IO_IN, TRUE);
+  z_return(rc);
+}
+
+#endif
+
 static GIOStatus
 z_plug_copy_data(ZPlugSession *self, ZStream *from, ZStream *to, ZPlugIOBuffer *buf)
 {
@@ -182,6 +298,13 @@ z_plug_copy_data(ZPlugSession *self, ZStream *from, ZStream *to, ZPlugIOBuffer *
   if (!from || !buf)
     z_return(G_IO_STATUS_ERROR);
 
+#ifdef HAVE_SPLICE
+  /* data already buffered by the source stream is copied first */
+  if (buf->splice && to && buf->ofs == buf->end &&
+      (buf->pipe_pending != 0 || z_stream_get_buffered_bytes(from) == 0))
+    z_return(z_plug_splice_data(self, from, to, buf));
+#endif
+
   z_stream_set_cond(from, G_IO_IN, FALSE);
 
   if (to)
@@ -485,6 +608,61 @@ z_plug_timeout(gpointer user_data)
   z_return(FALSE);
 }
 
+/**
+ * z_plug_session_init_splice:
+ * @self: ZPlugSession instance
+ *
+ * Switch both directions to zero-copy mode if the session is a plain
+ * socket to socket copy: nothing is stacked and neither endpoint is
+ * encrypted.
+ **/
+static void
+z_plug_session_init_splice(ZPlugSession *self)
+{
+#ifdef HAVE_SPLICE
+  gint i;
+
+  if (self->stacked)
+    return;
+
+  for (i = EP_CLIENT; i < EP_MAX; i++)
+    {
+      if (z_stream_get_fd(self->endpoints[i]) < 0 ||
+          z_stream_search_stack(self->endpoints[i], G_IO_IN, Z_CLASS(ZStreamSsl)) ||
+          z_stream_search_stack(self->endpoints[i], G_IO_OUT, Z_CLASS(ZStreamSsl)))
+        return;
+    }
+
+  for (i = EP_CLIENT; i < EP_MAX; i++)
+    {
+      if (pipe2(self->buffers[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+          /*LOG
+            This message indicates that the pipe used for zero-copy transfer
+            could not be created, data is copied through userspace buffers
+            instead.
+           */
+          z_log(NULL, CORE_ERROR, 3, "Error creating splice pipe; error='%s'", g_strerror(errno));
+          break;
+        }
+      self->buffers[i].splice = TRUE;
+    }
+
+  if (i < EP_MAX)
+    {
+      for (i = EP_CLIENT; i < EP_MAX; i++)
+        {
+          if (self->buffers[i].splice)
+            {
+              close(self->buffers[i].pipe[0]);
+              close(self->buffers[i].pipe[1]);
+              self->buffers[i].splice = FALSE;
+            }
+        }
+    }
+#endif
+}
+
 /* FIXME: merge these two functions */
 gboolean
 z_plug_session_init_streams(ZPlugSession *self)
@@ -492,6 +670,7 @@ z_plug_session_init_streams(ZPlugSession *self)
   z_enter();
   self->buffers[EP_CLIENT].buf = g_new0(char, self->session_data->buffer_size);
   self->buffers[EP_SERVER].buf = g_new0(char, self->session_data->buffer_size);
+  z_plug_session_init_splice(self);
 
   z_stream_set_nonblock(self->endpoints[EP_CLIENT], TRUE);
   z_stream_set_callback(self->endpoints[EP_CLIENT], G_IO_IN, z_plug_copy_client_to_server, z_plug_session_ref(self), (GDestroyNotify) z_plug_session_unref);
@@ -742,6 +921,12 @@ z_plug_session_destroy(ZPlugSession *self)
             }
           g_free(self->buffers[i].buf);
           self->buffers[i].buf = NULL;
+          if (self->buffers[i].splice)
+            {
+              close(self->buffers[i].pipe[0]);
+              close(self->buffers[i].pipe[1]);
+              self->buffers[i].splice = FALSE;
+            }
 
           z_stream_unref(self->endpoints[i]);
           self->endpoints[i] = NULL;
@@ -30,6 +30,8 @@
 #include <zorpll/io.h>
 #include <zorpll/thread.h>
 #include <zorp/proxygroup.h>
+#include <zorp/proxythreadpool.h>
+#include <zorp/proxypark.h>
 
 #include <zorp/policy.h>
 #include <zorp/pydict.h>
@@ -587,6 +589,7 @@ z_proxy_connect_server(ZProxy *self, const gchar *host, gint port)
   ZPolicyObj *res;
   gint rc;
   gboolean called;
+  gint64 connect_start;
 
   z_proxy_enter(self);
 
@@ -620,11 +623,13 @@ z_proxy_connect_server(ZProxy *self, const gchar *host, gint port)
       z_proxy_return(self, FALSE);
     }
 
+  connect_start = g_get_monotonic_time();
   res = z_policy_call(self->handler, "connectServer", NULL, &called, self->session_id);
 
   if (res && z_policy_stream_check(res))
     {
       self->endpoints[EP_SERVER] = z_policy_stream_get_stream(res);
+      z_szig_histogram_add("server_connect", (glong) (g_get_monotonic_time() - connect_start));
     }
   else
     {
@@ -653,6 +658,40 @@ z_proxy_connect_server(ZProxy *self, const gchar *host, gint port)
   z_proxy_return(self, FALSE);
 }
 
+/**
+ * z_proxy_reuse_server:
+ * @param self proxy instance
+ * @param stream an established server connection of an earlier session
+ * @param host host the connection leads to
+ * @param port port in host the connection leads to
+ *
+ * Use @stream as the server-side connection instead of calling
+ * connectServer, e.g. when the proxy keeps a pool of idle server
+ * connections.  The server address is still passed to the policy layer
+ * and @stream is renamed after this session.  Takes over the reference of
+ * @stream if it returns TRUE.
+ **/
+gboolean
+z_proxy_reuse_server(ZProxy *self, ZStream *stream, const gchar *host, gint port)
+{
+  gchar buf[Z_STREAM_MAX_NAME];
+
+  z_proxy_enter(self);
+
+  z_proxy_propagate_channel_props(self);
+
+  if (host && host[0] && !z_proxy_set_server_address(self, host, port))
+    z_proxy_return(self, FALSE);
+
+  g_snprintf(buf, sizeof(buf), "%s/server", self->session_id);
+  z_stream_set_name(stream, buf);
+  self->endpoints[EP_SERVER] = stream;
+
+  z_proxy_propagate_channel_props(self);
+
+  z_proxy_return(self, TRUE);
+}
+
 /**
  * Signal that user authentication has been completed.
  *
@@ -1360,6 +1399,13 @@ z_proxy_run(ZProxy *self)
       z_proxy_propagate_channel_props(self);
       z_szig_value_add_thread_id(self);
       z_proxy_main(self);
+
+      if (z_proxy_park_requested(self) && z_proxy_park_commit(self))
+        {
+          /* the proxy continues in another thread, see z_proxy_park() */
+          z_proxy_leave(self);
+          return;
+        }
     }
   z_proxy_shutdown(self);
   z_proxy_destroy(self);
@@ -1371,8 +1417,8 @@ z_proxy_run(ZProxy *self)
  *
  * @param s ZProxy instance as a general pointer
  *
- * This is the default thread function for proxies. The thread is started
- * in z_proxy_start().
+ * This is the default thread function for proxies. It is run by a proxy
+ * thread pool thread, scheduled in z_proxy_threaded_start().
  **/
 static gpointer
 z_proxy_thread_func(gpointer s)
@@ -1392,7 +1438,7 @@ z_proxy_thread_func(gpointer s)
  * @param self ZProxy instance
  * @param proxy_group proxy group to start the proxy in
  *
- * Starts the proxy by creating the new proxy thread. This function
+ * Starts the proxy in a thread of the proxy thread pool. This function
  * is usually called by proxy constructors.
  **/
 gboolean
@@ -1400,7 +1446,7 @@ z_proxy_threaded_start(ZProxy *self, ZProxyGroup *proxy_group)
 {
   z_proxy_set_group(self, proxy_group);
   z_proxy_ref(self);
-  if (!z_thread_new(self->session_id, z_proxy_thread_func, self))
+  if (!z_proxy_thread_pool_run(self->session_id, z_proxy_thread_func, self))
     {
       /*LOG
 	This message indicates that Zorp was unable to create a new thread for the new proxy instance.
@@ -1457,6 +1503,8 @@ z_proxy_wakeup_method(ZProxy *self)
 {
   if ((self->flags & ZPF_NONBLOCKING) != 0)
     z_proxy_group_wakeup(self->group);
+  else
+    z_proxy_park_wakeup(self);
 }
 
 /**
@@ -1546,6 +1594,7 @@ z_proxy_new(ZClass *proxy_class, ZProxyParams *params)
   z_policy_var_ref(params->handler);
   policy_thread = z_policy_thread_self();
   self->thread = z_policy_thread_new(policy_thread ? z_policy_thread_get_policy(policy_thread) : current_policy);
+  z_policy_thread_set_profile_name(self->thread, self->super.isa->name);
   z_python_unlock();
 
   z_proxy_register(self);
@@ -25,51 +25,118 @@
 #include <zorp/szig.h>
 #include <zorpll/thread.h>
 
+#include <unistd.h>
+
+/**
+ * ZProxyGroupWorker:
+ *
+ * A single poll loop of a ZProxyGroup. Nonblocking proxies are bound to
+ * the worker that started them and are never migrated once running,
+ * entries still waiting in @start_queue may be stolen by idle workers.
+ **/
+typedef struct _ZProxyGroupWorker
+{
+  ZProxyGroup *group;
+  guint index;
+  gboolean thread_started;
+  GAsyncQueue *start_queue;
+  GList *proxies;
+  ZPoll *poll;
+  gint sessions;
+} ZProxyGroupWorker;
+
 struct ZProxyGroup
 {
   ZRefCount ref_cnt;
   GMutex lock;
-  gboolean thread_started;
   gboolean orphaned;
-  GAsyncQueue *nonblocking_start_queue;
-  GList *nonblocking_proxies;
-  ZPoll *poll;
+  guint id;
   guint sessions;
   guint max_sessions;
+  guint num_workers;
+  ZProxyGroupWorker *workers;
 };
 
+/* number of poll loops per group when the caller does not specify it, 0 means one per CPU */
+gint z_proxy_group_default_threads = 1;
+
+/* the worker running in the current thread, NULL outside group threads */
+static GPrivate current_worker = G_PRIVATE_INIT(NULL);
+
+static gint proxy_group_id = 0;
+
+static ZProxyGroupWorker *
+z_proxy_group_get_worker(ZProxyGroup *self)
+{
+  ZProxyGroupWorker *worker = static_cast<ZProxyGroupWorker *>(g_private_get(&current_worker));
+
+  if (worker && worker->group == self)
+    return worker;
+  return &self->workers[0];
+}
+
+/**
+ * z_proxy_group_worker_report:
+ * @worker: worker whose session count changed
+ *
+ * Publish the current session count of @worker in SZIG as
+ * stats.proxy_groups.group<id>.worker<index>.
+ **/
+static void
+z_proxy_group_worker_report(ZProxyGroupWorker *worker)
+{
+  gchar group_name[32], worker_name[32];
+
+  g_snprintf(group_name, sizeof(group_name), "group%u", worker->group->id);
+  g_snprintf(worker_name, sizeof(worker_name), "worker%u", worker->index);
+  z_szig_event(Z_SZIG_PROXY_GROUP_WORKERS,
+               z_szig_value_new_props(group_name,
+                                      worker_name, z_szig_value_new_long(g_atomic_int_get(&worker->sessions)),
+                                      NULL));
+}
+
+static gboolean z_proxy_group_worker_iteration(ZProxyGroupWorker *worker);
+
 static gpointer
 z_proxy_group_thread_func(gpointer s)
 {
-  ZProxyGroup *self = (ZProxyGroup *) s;
+  ZProxyGroupWorker *worker = (ZProxyGroupWorker *) s;
+  ZProxyGroup *self = worker->group;
 
   z_enter();
+  g_private_set(&current_worker, worker);
   g_mutex_lock(&self->lock);
-  self->poll = z_poll_new();
+  worker->poll = z_poll_new();
   g_mutex_unlock(&self->lock);
 
-  while (!self->orphaned || self->sessions > 0)
+  while (!self->orphaned || g_atomic_int_get(&worker->sessions) > 0)
     {
-      z_proxy_group_iteration(self);
+      z_proxy_group_worker_iteration(worker);
     }
+  g_private_set(&current_worker, NULL);
   z_proxy_group_unref(self);
   z_leave();
   return NULL;
 }
 
 static gboolean
-z_proxy_group_start_thread(ZProxyGroup *self)
+z_proxy_group_start_thread(ZProxyGroupWorker *worker)
 {
+  ZProxyGroup *self = worker->group;
+
   z_enter();
   g_mutex_lock(&self->lock);
-  if (!self->thread_started)
+  if (!worker->thread_started)
     {
-      self->nonblocking_start_queue = g_async_queue_new();
-      self->thread_started = TRUE;
+      worker->thread_started = TRUE;
       g_mutex_unlock(&self->lock);
 
-      if (!z_thread_new("group", z_proxy_group_thread_func, z_proxy_group_ref(self)))
+      z_proxy_group_ref(self);
+      if (!z_thread_new("group", z_proxy_group_thread_func, worker))
         {
+          g_mutex_lock(&self->lock);
+          worker->thread_started = FALSE;
+          g_mutex_unlock(&self->lock);
           z_proxy_group_unref(self);
           z_leave();
           return FALSE;
@@ -83,6 +150,44 @@ z_proxy_group_start_thread(ZProxyGroup *self)
   return TRUE;
 }
 
+/**
+ * z_proxy_group_wakeup_worker:
+ * @worker: worker to wake up
+ *
+ * Interrupt the poll loop of @worker, if it is already running.
+ **/
+static void
+z_proxy_group_wakeup_worker(ZProxyGroupWorker *worker)
+{
+  g_mutex_lock(&worker->group->lock);
+  if (worker->poll)
+    z_poll_wakeup(worker->poll);
+  g_mutex_unlock(&worker->group->lock);
+}
+
+/**
+ * z_proxy_group_select_worker:
+ * @self: ZProxyGroup instance
+ *
+ * Select the worker with the fewest sessions (queued ones included) to
+ * run the next nonblocking session. Ties are broken in favour of the
+ * lowest index, so additional poll threads are only started once the
+ * existing ones carry load.
+ **/
+static ZProxyGroupWorker *
+z_proxy_group_select_worker(ZProxyGroup *self)
+{
+  ZProxyGroupWorker *best = &self->workers[0];
+  guint i;
+
+  for (i = 1; i < self->num_workers && g_atomic_int_get(&best->sessions) > 0; i++)
+    {
+      if (g_atomic_int_get(&self->workers[i].sessions) < g_atomic_int_get(&best->sessions))
+        best = &self->workers[i];
+    }
+  return best;
+}
+
 gboolean
 z_proxy_group_start_session(ZProxyGroup *self, ZProxy *proxy)
 {
@@ -102,16 +207,54 @@ z_proxy_group_start_session(ZProxyGroup *self, ZProxy *proxy)
 
   if (proxy->flags & ZPF_NONBLOCKING)
     {
-      if (!z_proxy_group_start_thread(self))
+      ZProxyGroupWorker *worker = z_proxy_group_select_worker(self);
+      gint queued;
+      guint i;
+
+      g_atomic_int_inc(&worker->sessions);
+      if (!z_proxy_group_start_thread(worker))
         {
+          g_atomic_int_add(&worker->sessions, -1);
+          g_mutex_lock(&self->lock);
+          self->sessions--;
+          g_mutex_unlock(&self->lock);
           z_leave();
           return FALSE;
         }
-      g_async_queue_push(self->nonblocking_start_queue, z_proxy_ref(proxy));
-      g_mutex_lock(&self->lock);
-      if (self->poll)
-        z_poll_wakeup(self->poll);
-      g_mutex_unlock(&self->lock);
+      g_async_queue_push(worker->start_queue, z_proxy_ref(proxy));
+      z_proxy_group_wakeup_worker(worker);
+
+      /* the selected worker is still busy with earlier requests, give
+       * the others a chance to steal them, and start another worker if
+       * there are more queued sessions than running workers */
+      queued = g_async_queue_length(worker->start_queue);
+      if (queued > 1)
+        {
+          ZProxyGroupWorker *idle = NULL;
+          gint running = 0;
+
+          g_mutex_lock(&self->lock);
+          for (i = 0; i < self->num_workers; i++)
+            {
+              if (self->workers[i].thread_started)
+                running++;
+              else if (!idle)
+                idle = &self->workers[i];
+            }
+          g_mutex_unlock(&self->lock);
+
+          for (i = 0; i < self->num_workers; i++)
+            {
+              if (&self->workers[i] != worker)
+                z_proxy_group_wakeup_worker(&self->workers[i]);
+            }
+
+          /* a new worker steals from the longest queue on its first
+           * iteration */
+          if (idle && queued > running)
+            z_proxy_group_start_thread(idle);
+        }
+      z_proxy_group_worker_report(worker);
       z_leave();
       return TRUE;
     }
@@ -141,21 +284,24 @@ z_proxy_group_stop_session(ZProxyGroup *self, ZProxy *proxy)
   z_enter();
   if (proxy->flags & ZPF_NONBLOCKING)
     {
+      ZProxyGroupWorker *worker = z_proxy_group_get_worker(self);
       GList *l;
 
-      /* NOTE: nonblocking proxies run in the same thread, thus this
-       * function is always called from the ZProxyGroup thread, no locking
-       * is necessary */
+      /* NOTE: nonblocking proxies are bound to the worker that started
+       * them, thus this function is always called from the thread of
+       * that worker, no locking is necessary for its proxy list */
 
       /* FIXME: use a better list deletion algorithm (like embed a list
        * header to ZProxy and use an O(1) deletion */
 
-      l = g_list_find(self->nonblocking_proxies, proxy);
+      l = g_list_find(worker->proxies, proxy);
       if (l)
         {
-          self->nonblocking_proxies = g_list_delete_link(self->nonblocking_proxies, l);
+          worker->proxies = g_list_delete_link(worker->proxies, l);
           z_proxy_unref(proxy);
         }
+      g_atomic_int_add(&worker->sessions, -1);
+      z_proxy_group_worker_report(worker);
     }
   g_mutex_lock(&self->lock);
   self->sessions--;
@@ -167,59 +313,136 @@ z_proxy_group_stop_session(ZProxyGroup *self, ZProxy *proxy)
 GMainContext *
 z_proxy_group_get_context(ZProxyGroup *self)
 {
-  if (self->poll)
-    return z_poll_get_context(self->poll);
+  ZProxyGroupWorker *worker = z_proxy_group_get_worker(self);
+
+  if (worker->poll)
+    return z_poll_get_context(worker->poll);
   return NULL;
 }
 
 ZPoll *
 z_proxy_group_get_poll(ZProxyGroup *self)
 {
-  return self->poll;
+  return z_proxy_group_get_worker(self)->poll;
 }
 
-gboolean
-z_proxy_group_iteration(ZProxyGroup *self)
+/**
+ * z_proxy_group_steal:
+ * @worker: the idle worker
+ *
+ * Take over a not yet started session from the worker with the longest
+ * start queue. The session count is moved along with the proxy, so that
+ * placement decisions remain accurate.
+ **/
+static ZProxy *
+z_proxy_group_steal(ZProxyGroupWorker *worker)
 {
+  ZProxyGroup *self = worker->group;
+  ZProxyGroupWorker *victim = NULL;
+  gint victim_length = 0;
   ZProxy *proxy;
-  GList *p;
-  gboolean res = FALSE;
+  guint i;
 
-  z_enter();
-  while ((proxy = static_cast<ZProxy *>(g_async_queue_try_pop(self->nonblocking_start_queue))))
+  for (i = 0; i < self->num_workers; i++)
     {
-      z_policy_thread_ready(proxy->thread);
-      if (!z_proxy_nonblocking_start(proxy, self))
-        {
-          z_proxy_nonblocking_stop(proxy);
-          z_proxy_unref(proxy);
-        }
-      else
+      ZProxyGroupWorker *other = &self->workers[i];
+      gint length;
+
+      if (other == worker || !other->start_queue)
+        continue;
+
+      length = g_async_queue_length(other->start_queue);
+      if (length > victim_length)
         {
-          z_szig_value_add_thread_id(proxy);
-          self->nonblocking_proxies = g_list_prepend(self->nonblocking_proxies, proxy);
+          victim = other;
+          victim_length = length;
         }
     }
-  for (p = self->nonblocking_proxies; p; p = p->next)
+
+  if (!victim)
+    return NULL;
+
+  proxy = static_cast<ZProxy *>(g_async_queue_try_pop(victim->start_queue));
+  if (proxy)
+    {
+      g_atomic_int_add(&victim->sessions, -1);
+      g_atomic_int_inc(&worker->sessions);
+      z_proxy_group_worker_report(victim);
+      z_proxy_group_worker_report(worker);
+    }
+  return proxy;
+}
+
+static gboolean
+z_proxy_group_worker_start_proxy(ZProxyGroupWorker *worker, ZProxy *proxy)
+{
+  z_policy_thread_ready(proxy->thread);
+  if (!z_proxy_nonblocking_start(proxy, worker->group))
+    {
+      z_proxy_nonblocking_stop(proxy);
+      z_proxy_unref(proxy);
+      return FALSE;
+    }
+
+  z_szig_value_add_thread_id(proxy);
+  worker->proxies = g_list_prepend(worker->proxies, proxy);
+  return TRUE;
+}
+
+static gboolean
+z_proxy_group_worker_iteration(ZProxyGroupWorker *worker)
+{
+  ZProxyGroup *self = worker->group;
+  ZProxy *proxy;
+  GList *p;
+  gboolean res = FALSE;
+
+  z_enter();
+  while ((proxy = static_cast<ZProxy *>(g_async_queue_try_pop(worker->start_queue))))
+    z_proxy_group_worker_start_proxy(worker, proxy);
+
+  if (!worker->proxies && (proxy = z_proxy_group_steal(worker)))
+    z_proxy_group_worker_start_proxy(worker, proxy);
+
+  for (p = worker->proxies; p; p = p->next)
     {
+      if (((ZProxy *) p->data)->offloaded)
+        continue;
+
       if (!z_proxy_loop_iteration((ZProxy *) p->data))
         {
           z_proxy_nonblocking_stop((ZProxy *) p->data);
         }
     }
-  if (!self->orphaned || self->sessions > 0)
-    res = z_poll_iter_timeout(self->poll, -1);
+  if (!self->orphaned || g_atomic_int_get(&worker->sessions) > 0)
+    res = z_poll_iter_timeout(worker->poll, -1);
 
   z_leave();
   return res;
 }
 
+/**
+ * z_proxy_group_iteration:
+ * @self: ZProxyGroup instance
+ *
+ * Run a single iteration of the poll loop of the calling worker thread.
+ * Used by nonblocking proxies to wait for the completion of operations
+ * (connect, SSL handshake) started in their own poll loop.
+ **/
+gboolean
+z_proxy_group_iteration(ZProxyGroup *self)
+{
+  return z_proxy_group_worker_iteration(z_proxy_group_get_worker(self));
+}
+
 void
 z_proxy_group_orphan(ZProxyGroup *self)
 {
+  guint i;
+
   self->orphaned = TRUE;
-  if (self->poll)
-    z_poll_wakeup(self->poll);
+  for (i = 0; i < self->num_workers; i++)
+    z_proxy_group_wakeup_worker(&self->workers[i]);
   z_proxy_group_unref(self);
 }
 
@@ -231,13 +454,26 @@ z_proxy_group_orphan(ZProxyGroup *self)
 void
 z_proxy_group_wakeup(ZProxyGroup *self)
 {
-  z_poll_wakeup(self->poll);
+  guint i;
+
+  for (i = 0; i < self->num_workers; i++)
+    z_proxy_group_wakeup_worker(&self->workers[i]);
 }
 
+/**
+ * z_proxy_group_new:
+ * @max_sessions: maximum number of concurrent sessions
+ * @threads: number of poll loops for nonblocking proxies, 0 to use
+ *           z_proxy_group_default_threads
+ *
+ * Create a new proxy group. Poll threads are started on demand, the
+ * number of them never exceeds @max_sessions.
+ **/
 ZProxyGroup *
-z_proxy_group_new(gint max_sessions)
+z_proxy_group_new(gint max_sessions, gint threads)
 {
   ZProxyGroup *self = g_new0(ZProxyGroup, 1);
+  guint i;
 
   g_mutex_init(&self->lock);
 
@@ -248,6 +484,23 @@ z_proxy_group_new(gint max_sessions)
   else
     self->max_sessions = 1;
 
+  if (threads <= 0)
+    threads = z_proxy_group_default_threads;
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+
+  self->num_workers = MIN((guint) threads, self->max_sessions);
+  self->workers = g_new0(ZProxyGroupWorker, self->num_workers);
+  for (i = 0; i < self->num_workers; i++)
+    {
+      self->workers[i].group = self;
+      self->workers[i].index = i;
+      self->workers[i].start_queue = g_async_queue_new();
+    }
+  self->id = g_atomic_int_add(&proxy_group_id, 1);
+
   return self;
 }
 
@@ -263,24 +516,29 @@ z_proxy_group_unref(ZProxyGroup *self)
 {
   if (self && z_refcount_dec(&self->ref_cnt))
     {
-      if (self->nonblocking_start_queue)
+      guint i;
+
+      for (i = 0; i < self->num_workers; i++)
         {
+          ZProxyGroupWorker *worker = &self->workers[i];
           ZProxy *proxy;
 
-          while ((proxy = static_cast<ZProxy *>(g_async_queue_try_pop(self->nonblocking_start_queue))))
+          while ((proxy = static_cast<ZProxy *>(g_async_queue_try_pop(worker->start_queue))))
             {
               z_proxy_unref(proxy);
             }
-          g_async_queue_unref(self->nonblocking_start_queue);
-        }
-      while (self->nonblocking_proxies)
-        {
-          z_proxy_unref((ZProxy *) self->nonblocking_proxies->data);
-          self->nonblocking_proxies = g_list_delete_link(self->nonblocking_proxies, self->nonblocking_proxies);
-        }
+          g_async_queue_unref(worker->start_queue);
 
-      if (self->poll)
-        z_poll_unref(self->poll);
+          while (worker->proxies)
+            {
+              z_proxy_unref((ZProxy *) worker->proxies->data);
+              worker->proxies = g_list_delete_link(worker->proxies, worker->proxies);
+            }
+
+          if (worker->poll)
+            z_poll_unref(worker->poll);
+        }
+      g_free(self->workers);
 
       g_mutex_clear(&self->lock);
 
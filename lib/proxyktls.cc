@@ -0,0 +1,708 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+
+#include <zorp/proxyktls.h>
+#include <zorp/proxyssl.h>
+#include <zorpll/stream.h>
+#include <zorpll/streamssl.h>
+#include <zorpll/log.h>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_LINUX_TLS_H
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
+#define Z_KTLS_RANDOM_LEN 32
+
+/*
+ * Kernel TLS offload of established sessions.
+ *
+ * The SSL stream of zorpll drives OpenSSL through a BIO reading and
+ * writing its child stream, so the kTLS support of OpenSSL itself
+ * (SSL_OP_ENABLE_KTLS) never triggers, as it needs a socket BIO.  Instead,
+ * right after the handshake the record keys of the session are derived
+ * here and passed to the tls ULP of the socket, then the SSL stream is
+ * replaced by a ZStreamKtls.  From that point on the proxy reads and
+ * writes plaintext, and the zero-copy transfer paths can be used on the
+ * endpoint.
+ *
+ * Only TLS 1.2 sessions with AEAD ciphers supported by the kernel are
+ * offloaded: the record sequence numbers of TLS 1.2 are known after the
+ * handshake (the Finished messages were the first records of the epoch),
+ * and the key block can be computed from the master secret.  Anything
+ * else, including kernels without the tls ULP, stays in userspace.
+ *
+ * The kernel does not process records other than application data: a
+ * plain read() fails with EIO when such a record is next.  ZStreamKtls
+ * reads the record with recvmsg() then, and reports a close_notify alert
+ * as EOF, so that truncated sessions can still be told apart from
+ * completed ones.  Any other record ends the session with an error, as
+ * renegotiation is not possible anymore.  When the stream is shut down
+ * for writing or closed, a close_notify alert is sent with sendmsg().
+ */
+
+/**
+ * z_ktls_derive_key_block:
+ * @ssl: established TLS 1.2 session
+ * @key_block: the key block is returned here
+ * @len: length of the key block
+ *
+ * Compute the TLS 1.2 key block of @ssl (RFC 5246, 6.3) from its master
+ * secret with the TLS PRF.
+ **/
+static gboolean
+z_ktls_derive_key_block(SSL *ssl, guchar *key_block, gsize len)
+{
+  static const guchar label[] = "key expansion";
+  guchar master_key[SSL_MAX_MASTER_KEY_LENGTH];
+  guchar client_random[Z_KTLS_RANDOM_LEN], server_random[Z_KTLS_RANDOM_LEN];
+  const EVP_MD *md = SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl));
+  EVP_PKEY_CTX *pctx;
+  gsize master_key_len;
+  gboolean res = FALSE;
+
+  master_key_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master_key, sizeof(master_key));
+  if (!md || master_key_len == 0 ||
+      SSL_get_client_random(ssl, client_random, sizeof(client_random)) != sizeof(client_random) ||
+      SSL_get_server_random(ssl, server_random, sizeof(server_random)) != sizeof(server_random))
+    return FALSE;
+
+  pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+  if (pctx &&
+      EVP_PKEY_derive_init(pctx) > 0 &&
+      EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+      EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master_key, master_key_len) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, label, sizeof(label) - 1) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof(server_random)) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof(client_random)) > 0 &&
+      EVP_PKEY_derive(pctx, key_block, &len) > 0)
+    res = TRUE;
+
+  EVP_PKEY_CTX_free(pctx);
+  OPENSSL_cleanse(master_key, sizeof(master_key));
+  return res;
+}
+
+/**
+ * z_ktls_derive_keys:
+ * @ssl: established TLS 1.2 session
+ * @server: whether we are the TLS server of @ssl
+ * @tx: the keys protecting the records we send are returned here
+ * @rx: the keys protecting the records we receive are returned here
+ *
+ * Split the key block of @ssl into the write keys and implicit nonces of
+ * the two directions.  The first record after the handshake has sequence
+ * number 1 in both directions, as the Finished message was record 0 of
+ * the epoch.  Only AES-GCM (RFC 5288) and ChaCha20-Poly1305 (RFC 7905)
+ * sessions are supported.
+ *
+ * Returns: FALSE if the keys cannot be derived
+ **/
+gboolean
+z_ktls_derive_keys(SSL *ssl, gboolean server, ZKtlsKeys *tx, ZKtlsKeys *rx)
+{
+  static const guchar rec_seq[Z_KTLS_SEQ_LEN] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+  const EVP_CIPHER *evp_cipher;
+  guchar key_block[2 * (Z_KTLS_MAX_KEY_LEN + Z_KTLS_MAX_IV_LEN)];
+  ZKtlsKeys *client_keys = server ? rx : tx;
+  ZKtlsKeys *server_keys = server ? tx : rx;
+  const guchar *p = key_block;
+  gsize key_len, iv_len;
+
+  if (SSL_version(ssl) != TLS1_2_VERSION || !cipher)
+    return FALSE;
+
+  evp_cipher = EVP_get_cipherbynid(SSL_CIPHER_get_cipher_nid(cipher));
+  if (!evp_cipher)
+    return FALSE;
+
+  if (EVP_CIPHER_mode(evp_cipher) == EVP_CIPH_GCM_MODE)
+    iv_len = 4;
+  else if (EVP_CIPHER_nid(evp_cipher) == NID_chacha20_poly1305)
+    iv_len = 12;
+  else
+    return FALSE;
+
+  key_len = EVP_CIPHER_key_length(evp_cipher);
+  if (key_len > Z_KTLS_MAX_KEY_LEN)
+    return FALSE;
+
+  /* AEAD ciphers have no MAC keys in the key block */
+  if (!z_ktls_derive_key_block(ssl, key_block, 2 * (key_len + iv_len)))
+    return FALSE;
+
+  memcpy(client_keys->key, p, key_len);
+  p += key_len;
+  memcpy(server_keys->key, p, key_len);
+  p += key_len;
+  memcpy(client_keys->iv, p, iv_len);
+  p += iv_len;
+  memcpy(server_keys->iv, p, iv_len);
+  OPENSSL_cleanse(key_block, sizeof(key_block));
+
+  tx->key_len = rx->key_len = key_len;
+  tx->iv_len = rx->iv_len = iv_len;
+  memcpy(tx->rec_seq, rec_seq, sizeof(rec_seq));
+  memcpy(rx->rec_seq, rec_seq, sizeof(rec_seq));
+  return TRUE;
+}
+
+#ifdef HAVE_LINUX_TLS_H
+
+#define Z_KTLS_RECORD_TYPE_ALERT 21
+#define Z_KTLS_ALERT_LEVEL_WARNING 1
+#define Z_KTLS_ALERT_CLOSE_NOTIFY 0
+
+typedef struct _ZKtlsCipher
+{
+  gint nid;
+  guint16 cipher_type;
+} ZKtlsCipher;
+
+static const ZKtlsCipher z_ktls_ciphers[] =
+{
+  { NID_aes_128_gcm, TLS_CIPHER_AES_GCM_128 },
+  { NID_aes_256_gcm, TLS_CIPHER_AES_GCM_256 },
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  { NID_chacha20_poly1305, TLS_CIPHER_CHACHA20_POLY1305 },
+#endif
+};
+
+/* the largest of the tls12_crypto_info_* structures */
+typedef union _ZKtlsCryptoInfo
+{
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+} ZKtlsCryptoInfo;
+
+/**
+ * ZStreamKtls:
+ *
+ * Stream stacked on the socket of a session offloaded to the kernel,
+ * handles the records the kernel does not.
+ **/
+typedef struct _ZStreamKtls
+{
+  ZStream super;
+  gboolean close_notify_received;
+  gboolean close_notify_sent;
+} ZStreamKtls;
+
+extern ZClass ZStreamKtls__class;
+
+/**
+ * z_stream_ktls_read_record:
+ * @self: ZStreamKtls instance
+ *
+ * Read the record the kernel refused to return as application data.
+ *
+ * Returns: G_IO_STATUS_EOF for a close_notify alert, G_IO_STATUS_ERROR
+ * otherwise
+ **/
+static GIOStatus
+z_stream_ktls_read_record(ZStreamKtls *self)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE(sizeof(guchar))];
+  } control;
+  guchar record[2];
+  struct iovec iov = { record, sizeof(record) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  len = recvmsg(z_stream_get_fd(&self->super), &msg, MSG_DONTWAIT);
+  if (len < 0)
+    return G_IO_STATUS_ERROR;
+
+  if (len == 0)
+    return G_IO_STATUS_EOF;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+      *CMSG_DATA(cmsg) == Z_KTLS_RECORD_TYPE_ALERT && len == 2)
+    {
+      if (record[1] == Z_KTLS_ALERT_CLOSE_NOTIFY)
+        {
+          self->close_notify_received = TRUE;
+          return G_IO_STATUS_EOF;
+        }
+
+      /*LOG
+        This message indicates that the peer of a TLS session offloaded
+        to the kernel sent an alert, the session is terminated.
+       */
+      z_log(self->super.name, CORE_ERROR, 3, "TLS alert received; level='%d', description='%d'", record[0], record[1]);
+    }
+  else
+    {
+      /*LOG
+        This message indicates that the peer of a TLS session offloaded
+        to the kernel sent a record other than application data or alert,
+        for example it tried to renegotiate, which is not possible
+        anymore.
+       */
+      z_log(self->super.name, CORE_ERROR, 3, "Unexpected TLS record received on kernel TLS session;");
+    }
+
+  errno = EPROTO;
+  return G_IO_STATUS_ERROR;
+}
+
+/**
+ * z_stream_ktls_send_close_notify:
+ * @self: ZStreamKtls instance
+ *
+ * Send a close_notify alert to the peer, at most once.
+ **/
+static void
+z_stream_ktls_send_close_notify(ZStreamKtls *self)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE(sizeof(guchar))];
+  } control;
+  guchar alert[2] = { Z_KTLS_ALERT_LEVEL_WARNING, Z_KTLS_ALERT_CLOSE_NOTIFY };
+  struct iovec iov = { alert, sizeof(alert) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  if (self->close_notify_sent)
+    return;
+
+  self->close_notify_sent = TRUE;
+
+  memset(&control, 0, sizeof(control));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(guchar));
+  *CMSG_DATA(cmsg) = Z_KTLS_RECORD_TYPE_ALERT;
+
+  if (sendmsg(z_stream_get_fd(&self->super), &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    z_log(self->super.name, CORE_DEBUG, 6, "Error sending TLS close_notify alert; error='%s'", g_strerror(errno));
+}
+
+static GIOStatus
+z_stream_ktls_read_method(ZStream *s, void *buf, gsize count, gsize *bytes_read, GError **error)
+{
+  ZStreamKtls *self = Z_CAST(s, ZStreamKtls);
+  GIOStatus res;
+
+  if (self->close_notify_received)
+    {
+      *bytes_read = 0;
+      return G_IO_STATUS_EOF;
+    }
+
+  res = z_stream_read(s->child, buf, count, bytes_read, error);
+  if (res == G_IO_STATUS_ERROR && errno == EIO)
+    {
+      g_clear_error(error);
+      *bytes_read = 0;
+      res = z_stream_ktls_read_record(self);
+      if (res == G_IO_STATUS_ERROR && error)
+        g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "%s", g_strerror(errno));
+    }
+  return res;
+}
+
+static GIOStatus
+z_stream_ktls_write_method(ZStream *s, const void *buf, gsize count, gsize *bytes_written, GError **error)
+{
+  return z_stream_write(s->child, buf, count, bytes_written, error);
+}
+
+static GIOStatus
+z_stream_ktls_shutdown_method(ZStream *s, int method, GError **error)
+{
+  if (method == SHUT_WR || method == SHUT_RDWR)
+    z_stream_ktls_send_close_notify(Z_CAST(s, ZStreamKtls));
+
+  return Z_SUPER(s, ZStream)->shutdown(s, method, error);
+}
+
+static GIOStatus
+z_stream_ktls_close_method(ZStream *s, GError **error)
+{
+  z_stream_ktls_send_close_notify(Z_CAST(s, ZStreamKtls));
+
+  return Z_SUPER(s, ZStream)->close(s, error);
+}
+
+static gboolean
+z_stream_ktls_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen)
+{
+  switch (ZST_CTRL_MSG(function))
+    {
+    case ZST_CTRL_SET_CALLBACK_READ:
+    case ZST_CTRL_SET_CALLBACK_WRITE:
+    case ZST_CTRL_SET_CALLBACK_PRI:
+      return z_stream_ctrl_method(s, function, value, vlen);
+
+    default:
+      return z_stream_ctrl_method(s, ZST_CTRL_MSG_FORWARD | function, value, vlen);
+    }
+}
+
+/* nothing is buffered here, the conditions are those of the socket */
+static gboolean
+z_stream_ktls_watch_prepare(ZStream *s, GSource * /* src */, gint *timeout)
+{
+  *timeout = -1;
+  z_stream_set_cond(s->child, G_IO_IN, s->want_read);
+  z_stream_set_cond(s->child, G_IO_OUT, s->want_write);
+  z_stream_set_cond(s->child, G_IO_PRI, s->want_pri);
+  return FALSE;
+}
+
+static gboolean
+z_stream_ktls_watch_check(ZStream *s, GSource *src)
+{
+  gint timeout;
+
+  return z_stream_ktls_watch_prepare(s, src, &timeout);
+}
+
+static gboolean
+z_stream_ktls_watch_dispatch(ZStream * /* s */, GSource * /* src */)
+{
+  return TRUE;
+}
+
+static gboolean
+z_stream_ktls_read_callback(ZStream * /* child */, GIOCondition cond, gpointer user_data)
+{
+  ZStream *s = (ZStream *) user_data;
+
+  return s->read_cb(s, cond, s->user_data_read);
+}
+
+static gboolean
+z_stream_ktls_write_callback(ZStream * /* child */, GIOCondition cond, gpointer user_data)
+{
+  ZStream *s = (ZStream *) user_data;
+
+  return s->write_cb(s, cond, s->user_data_write);
+}
+
+static gboolean
+z_stream_ktls_pri_callback(ZStream * /* child */, GIOCondition cond, gpointer user_data)
+{
+  ZStream *s = (ZStream *) user_data;
+
+  return s->pri_cb(s, cond, s->user_data_pri);
+}
+
+static void
+z_stream_ktls_set_child(ZStream *s, ZStream *new_child)
+{
+  z_stream_ref(s);
+  Z_SUPER(s, ZStream)->set_child(s, new_child);
+  if (new_child)
+    {
+      z_stream_set_callback(new_child, G_IO_IN, z_stream_ktls_read_callback, z_stream_ref(s), (GDestroyNotify) z_stream_unref);
+      z_stream_set_callback(new_child, G_IO_OUT, z_stream_ktls_write_callback, z_stream_ref(s), (GDestroyNotify) z_stream_unref);
+      z_stream_set_callback(new_child, G_IO_PRI, z_stream_ktls_pri_callback, z_stream_ref(s), (GDestroyNotify) z_stream_unref);
+    }
+  z_stream_unref(s);
+}
+
+static ZStreamFuncs z_stream_ktls_funcs =
+{
+  {
+    Z_FUNCS_COUNT(ZStream),
+    NULL,
+  },
+  z_stream_ktls_read_method,
+  z_stream_ktls_write_method,
+  NULL, /* read_pri */
+  NULL, /* write_pri */
+  z_stream_ktls_shutdown_method,
+  z_stream_ktls_close_method,
+  z_stream_ktls_ctrl_method,
+  NULL, /* attach_source */
+  NULL, /* detach_source */
+  z_stream_ktls_watch_prepare,
+  z_stream_ktls_watch_check,
+  z_stream_ktls_watch_dispatch,
+  NULL, /* watch_finalize */
+  NULL, /* extra_get_size */
+  NULL, /* extra_save */
+  NULL, /* extra_restore */
+  z_stream_ktls_set_child,
+  NULL, /* unget_packet */
+};
+
+Z_CLASS_DEF(ZStreamKtls, ZStream, z_stream_ktls_funcs);
+
+/**
+ * z_stream_ktls_new:
+ * @child: the socket stream of the offloaded session
+ *
+ * Create a stream handling the non-application data records of a session
+ * offloaded to the kernel.
+ **/
+static ZStream *
+z_stream_ktls_new(ZStream *child)
+{
+  ZStreamKtls *self;
+
+  self = Z_CAST(z_stream_new(Z_CLASS(ZStreamKtls), child ? child->name : "", G_IO_IN | G_IO_OUT), ZStreamKtls);
+  z_stream_set_child(&self->super, child);
+  return &self->super;
+}
+
+static const ZKtlsCipher *
+z_ktls_lookup_cipher(const SSL_CIPHER *cipher)
+{
+  gint nid = SSL_CIPHER_get_cipher_nid(cipher);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(z_ktls_ciphers); i++)
+    {
+      if (z_ktls_ciphers[i].nid == nid)
+        return &z_ktls_ciphers[i];
+    }
+  return NULL;
+}
+
+/**
+ * z_ktls_fill_crypto_info:
+ * @cipher: kernel cipher description
+ * @keys: keys of the direction
+ * @info: crypto info to fill
+ *
+ * Fill the kernel crypto info of one direction.
+ **/
+static gsize
+z_ktls_fill_crypto_info(const ZKtlsCipher *cipher, const ZKtlsKeys *keys, ZKtlsCryptoInfo *info)
+{
+  memset(info, 0, sizeof(*info));
+  info->info.version = TLS_1_2_VERSION;
+  info->info.cipher_type = cipher->cipher_type;
+
+  switch (cipher->cipher_type)
+    {
+    case TLS_CIPHER_AES_GCM_128:
+      memcpy(info->aes_gcm_128.key, keys->key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+      memcpy(info->aes_gcm_128.salt, keys->iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+      /* the explicit nonce, it only has to be unique */
+      memcpy(info->aes_gcm_128.iv, keys->rec_seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+      memcpy(info->aes_gcm_128.rec_seq, keys->rec_seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+      return sizeof(info->aes_gcm_128);
+
+    case TLS_CIPHER_AES_GCM_256:
+      memcpy(info->aes_gcm_256.key, keys->key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+      memcpy(info->aes_gcm_256.salt, keys->iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+      memcpy(info->aes_gcm_256.iv, keys->rec_seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+      memcpy(info->aes_gcm_256.rec_seq, keys->rec_seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+      return sizeof(info->aes_gcm_256);
+
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case TLS_CIPHER_CHACHA20_POLY1305:
+      memcpy(info->chacha20_poly1305.key, keys->key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+      memcpy(info->chacha20_poly1305.iv, keys->iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+      memcpy(info->chacha20_poly1305.rec_seq, keys->rec_seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+      return sizeof(info->chacha20_poly1305);
+#endif
+
+    default:
+      g_assert_not_reached();
+    }
+  return 0;
+}
+
+/**
+ * z_ktls_install:
+ * @self: proxy instance, used for logging
+ * @ssl: established session
+ * @fd: socket of the session
+ * @server: whether we are the TLS server of @ssl
+ * @fatal: set to TRUE if the socket became unusable
+ *
+ * Install the keys of @ssl on @fd.  Returns TRUE if the socket does the
+ * record layer from now on.  If FALSE is returned and @fatal is not set,
+ * the session can continue in userspace.
+ **/
+static gboolean
+z_ktls_install(ZProxy *self, SSL *ssl, gint fd, gboolean server, gboolean *fatal)
+{
+  const ZKtlsCipher *cipher;
+  ZKtlsKeys tx_keys, rx_keys;
+  ZKtlsCryptoInfo tx, rx;
+  gsize info_len;
+
+  *fatal = FALSE;
+
+  if (SSL_version(ssl) != TLS1_2_VERSION)
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Kernel TLS offload is not possible for this protocol version; version='%s'",
+                  SSL_get_version(ssl));
+      return FALSE;
+    }
+
+  cipher = z_ktls_lookup_cipher(SSL_get_current_cipher(ssl));
+  if (!cipher)
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Kernel TLS offload is not possible for this cipher; cipher='%s'",
+                  SSL_get_cipher_name(ssl));
+      return FALSE;
+    }
+
+  if (!z_ktls_derive_keys(ssl, server, &tx_keys, &rx_keys))
+    {
+      z_proxy_log(self, CORE_ERROR, 3, "Error deriving kernel TLS keys;");
+      return FALSE;
+    }
+
+  z_ktls_fill_crypto_info(cipher, &tx_keys, &tx);
+  info_len = z_ktls_fill_crypto_info(cipher, &rx_keys, &rx);
+  OPENSSL_cleanse(&tx_keys, sizeof(tx_keys));
+  OPENSSL_cleanse(&rx_keys, sizeof(rx_keys));
+
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+    {
+      /*LOG
+        This message indicates that the kernel does not support TLS
+        offload (the tls module is not loaded or not available), the TLS
+        session is handled in userspace.
+       */
+      z_proxy_log(self, CORE_INFO, 5, "Kernel TLS is not available, using userspace TLS; error='%s'", g_strerror(errno));
+      OPENSSL_cleanse(&tx, sizeof(tx));
+      OPENSSL_cleanse(&rx, sizeof(rx));
+      return FALSE;
+    }
+
+  /* the ULP cannot be removed, and once a direction is configured the
+   * userspace record layer cannot continue, thus a failure from here on
+   * makes the connection unusable */
+  if (setsockopt(fd, SOL_TLS, TLS_TX, &tx, info_len) < 0 ||
+      setsockopt(fd, SOL_TLS, TLS_RX, &rx, info_len) < 0)
+    {
+      z_proxy_log(self, CORE_ERROR, 3, "Error configuring kernel TLS keys; error='%s'", g_strerror(errno));
+      *fatal = TRUE;
+    }
+
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  return !*fatal;
+}
+
+#endif
+
+/**
+ * z_proxy_ktls_offload:
+ * @self: proxy instance
+ * @side: endpoint whose handshake has just been completed
+ *
+ * Move the record layer of the TLS session on @side to the kernel if it
+ * was enabled for the side, and remove the SSL stream from the endpoint.
+ * This is only done if the SSL stream is the topmost stream of the
+ * endpoint, as it is the case when the handshake is done when the
+ * endpoint is set up.
+ *
+ * Returns FALSE if the connection became unusable, TRUE otherwise,
+ * regardless of whether the session was offloaded.
+ **/
+gboolean
+z_proxy_ktls_offload(ZProxy *self, ZEndpoint side)
+{
+#ifdef HAVE_LINUX_TLS_H
+  ZStream *stream = self->endpoints[side];
+  ZSSLSession *session = self->tls_opts.ssl_sessions[side];
+  gboolean fatal;
+
+  z_proxy_enter(self);
+
+  if (!self->encryption->ssl_opts.enable_ktls[side] || !session || !stream)
+    z_proxy_return(self, TRUE);
+
+  if (z_stream_search_stack(stream, G_IO_IN, Z_CLASS(ZStreamSsl)) != stream)
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Kernel TLS offload is not possible, the SSL stream is not on the top of the stream stack; side='%s'",
+                  EP_STR(side));
+      z_proxy_return(self, TRUE);
+    }
+
+  /* records already read by OpenSSL would be lost */
+  if (SSL_has_pending(session->ssl) || z_stream_get_buffered_bytes(stream) > 0)
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Kernel TLS offload is not possible, data is buffered above the socket; side='%s'",
+                  EP_STR(side));
+      z_proxy_return(self, TRUE);
+    }
+
+  if (!z_ktls_install(self, session->ssl, z_stream_get_fd(stream), side == EP_CLIENT, &fatal))
+    z_proxy_return(self, !fatal);
+
+  /* the reference of the endpoint is passed to the child stream */
+  self->endpoints[side] = z_stream_push(z_stream_pop(stream), z_stream_ktls_new(NULL));
+
+  /*LOG
+    This message reports that the TLS record layer of the session is
+    handled by the kernel from now on.
+   */
+  z_proxy_log(self, CORE_INFO, 6, "TLS session offloaded to the kernel; side='%s', cipher='%s'",
+              EP_STR(side), SSL_get_cipher_name(session->ssl));
+  z_proxy_return(self, TRUE);
+#else
+  return TRUE;
+#endif
+}
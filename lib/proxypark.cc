@@ -0,0 +1,508 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include <zorp/proxypark.h>
+#include <zorp/proxythreadpool.h>
+#include <zorp/szig.h>
+#include <zorpll/thread.h>
+#include <zorpll/log.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*
+ * Proxy parking
+ *
+ * A blocking proxy waiting for its client to send something (typically an
+ * idle keep-alive session between two requests) occupies a thread without
+ * doing anything useful.  Such a proxy can park itself: it calls
+ * z_proxy_park() and returns from its main function, the thread goes back
+ * to the proxy thread pool.  The file descriptor of the client is watched
+ * by a single process-wide epoll loop, once it becomes readable, the
+ * timeout elapses or the proxy is woken up (e.g. by a stop request) the
+ * resume function of the proxy is run in a pool thread, which continues
+ * the session where it was left.
+ *
+ * The proxy is only registered in the loop by z_proxy_park_commit(), after
+ * its thread has completely returned from the main function, thus it is
+ * never run by two threads at the same time.
+ */
+
+#define Z_PROXY_PARK_MAX_EVENTS 64
+
+struct ZProxyParkEntry
+{
+  ZProxy *proxy;
+  gint fd;
+  gint64 deadline;
+  ZProxyParkResumeFunc resume;
+  ZProxyParkEvent event;
+  GSequenceIter *timer;
+  gboolean wakeup;
+};
+
+/* protects everything below */
+G_LOCK_DEFINE_STATIC(park_lock);
+static gint park_epoll_fd = -1;
+static gint park_event_fd = -1;
+static gboolean park_failed;
+/* parked proxies indexed by the ZProxy instance */
+static GHashTable *park_entries;
+/* parked proxies with a timeout, ordered by their deadline */
+static GSequence *park_timers;
+/* proxies woken up by z_proxy_park_wakeup() */
+static GList *park_wakeups;
+
+static gint
+z_proxy_park_deadline_compare(gconstpointer a, gconstpointer b, gpointer  /* user_data */)
+{
+  const ZProxyParkEntry *ea = static_cast<const ZProxyParkEntry *>(a);
+  const ZProxyParkEntry *eb = static_cast<const ZProxyParkEntry *>(b);
+
+  if (ea->deadline != eb->deadline)
+    return ea->deadline < eb->deadline ? -1 : 1;
+
+  return ea < eb ? -1 : (ea > eb ? 1 : 0);
+}
+
+/**
+ * z_proxy_park_report:
+ *
+ * Publish the number of parked proxies as stats.proxy_park.parked in SZIG.
+ *
+ * NOTE: must be called with park_lock held.
+ **/
+static void
+z_proxy_park_report(void)
+{
+  z_szig_event(Z_SZIG_PROXY_THREAD_POOL,
+               z_szig_value_new_props("proxy_park",
+                                      "parked", z_szig_value_new_long(g_hash_table_size(park_entries)),
+                                      NULL));
+}
+
+/**
+ * z_proxy_park_detach:
+ * @entry: parked proxy
+ * @event: the reason the proxy is resumed
+ *
+ * Remove @entry from the parking loop.
+ *
+ * NOTE: must be called with park_lock held.
+ **/
+static void
+z_proxy_park_detach(ZProxyParkEntry *entry, ZProxyParkEvent event)
+{
+  epoll_ctl(park_epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+  g_hash_table_remove(park_entries, entry->proxy);
+
+  if (entry->timer)
+    g_sequence_remove(entry->timer);
+  entry->timer = NULL;
+
+  if (entry->wakeup)
+    park_wakeups = g_list_remove(park_wakeups, entry);
+
+  entry->event = event;
+}
+
+/**
+ * z_proxy_park_resume:
+ * @s: ZProxyParkEntry of the proxy
+ *
+ * Pool thread function continuing a parked proxy.  Unless the proxy parks
+ * itself again it is shut down and destroyed, just like at the end of
+ * z_proxy_run().
+ **/
+static gpointer
+z_proxy_park_resume(gpointer s)
+{
+  ZProxyParkEntry *entry = static_cast<ZProxyParkEntry *>(s);
+  ZProxy *self = entry->proxy;
+  ZProxyParkResumeFunc resume = entry->resume;
+  ZProxyParkEvent event = entry->event;
+
+  g_free(entry);
+
+  self->proxy_thread = z_thread_self();
+  resume(self, event);
+
+  if (!z_proxy_park_requested(self) || !z_proxy_park_commit(self))
+    {
+      z_proxy_shutdown(self);
+      z_proxy_destroy(self);
+    }
+
+  /* drop the reference of the parking loop */
+  z_proxy_unref(self);
+  return NULL;
+}
+
+/**
+ * z_proxy_park_thread:
+ * @s: not used
+ *
+ * Main function of the parking loop, hands proxies with a pending event
+ * over to the proxy thread pool.
+ **/
+static gpointer
+z_proxy_park_thread(gpointer  /* s */)
+{
+  struct epoll_event events[Z_PROXY_PARK_MAX_EVENTS];
+
+  z_enter();
+  while (1)
+    {
+      ZProxyParkEntry *entry;
+      GList *ready = NULL, *p;
+      gint timeout = -1;
+      gint64 now;
+      gint n, i;
+
+      G_LOCK(park_lock);
+      if (!g_sequence_is_empty(park_timers))
+        {
+          entry = static_cast<ZProxyParkEntry *>(g_sequence_get(g_sequence_get_begin_iter(park_timers)));
+          timeout = MAX(0, (entry->deadline - g_get_monotonic_time() + 999) / 1000);
+        }
+      G_UNLOCK(park_lock);
+
+      n = epoll_wait(park_epoll_fd, events, Z_PROXY_PARK_MAX_EVENTS, timeout);
+      if (n < 0 && errno != EINTR)
+        {
+          /*LOG
+            This message indicates that waiting for parked proxies failed.
+           */
+          z_log(NULL, CORE_ERROR, 1, "Error waiting for parked proxies; error='%s'", g_strerror(errno));
+          g_usleep(G_USEC_PER_SEC / 10);
+          continue;
+        }
+
+      G_LOCK(park_lock);
+      for (i = 0; i < n; i++)
+        {
+          if (events[i].data.ptr == NULL)
+            {
+              guint64 counter;
+
+              if (read(park_event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+                z_log(NULL, CORE_ERROR, 3, "Error reading parking loop eventfd; error='%s'", g_strerror(errno));
+              continue;
+            }
+
+          entry = static_cast<ZProxyParkEntry *>(events[i].data.ptr);
+          z_proxy_park_detach(entry, Z_PROXY_PARK_READABLE);
+          ready = g_list_prepend(ready, entry);
+        }
+
+      while (park_wakeups)
+        {
+          entry = static_cast<ZProxyParkEntry *>(park_wakeups->data);
+          z_proxy_park_detach(entry, Z_PROXY_PARK_WAKEUP);
+          ready = g_list_prepend(ready, entry);
+        }
+
+      now = g_get_monotonic_time();
+      while (!g_sequence_is_empty(park_timers))
+        {
+          entry = static_cast<ZProxyParkEntry *>(g_sequence_get(g_sequence_get_begin_iter(park_timers)));
+          if (entry->deadline > now)
+            break;
+
+          z_proxy_park_detach(entry, Z_PROXY_PARK_TIMEOUT);
+          ready = g_list_prepend(ready, entry);
+        }
+
+      if (ready)
+        z_proxy_park_report();
+      G_UNLOCK(park_lock);
+
+      for (p = ready; p; p = p->next)
+        {
+          entry = static_cast<ZProxyParkEntry *>(p->data);
+
+          if (!z_proxy_thread_pool_run(entry->proxy->session_id, z_proxy_park_resume, entry))
+            {
+              /*LOG
+                This message indicates that no thread could be started to
+                continue a parked proxy, it is run in the parking loop
+                instead, delaying the other parked proxies.
+               */
+              z_proxy_log(entry->proxy, CORE_ERROR, 2, "Error starting thread for parked proxy, resuming in the parking loop;");
+              z_proxy_park_resume(entry);
+            }
+        }
+      g_list_free(ready);
+    }
+  z_leave();
+  return NULL;
+}
+
+/**
+ * z_proxy_park_init:
+ *
+ * Create the epoll instance and start the parking loop on first use.
+ *
+ * NOTE: must be called with park_lock held.
+ **/
+static gboolean
+z_proxy_park_init(void)
+{
+  struct epoll_event ev;
+
+  if (park_epoll_fd >= 0)
+    return TRUE;
+
+  if (park_failed)
+    return FALSE;
+
+  park_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  park_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (park_epoll_fd < 0 || park_event_fd < 0)
+    goto error;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(park_epoll_fd, EPOLL_CTL_ADD, park_event_fd, &ev) < 0)
+    goto error;
+
+  park_entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+  park_timers = g_sequence_new(NULL);
+
+  if (!z_thread_new("park", z_proxy_park_thread, NULL))
+    {
+      g_hash_table_destroy(park_entries);
+      g_sequence_free(park_timers);
+      park_entries = NULL;
+      park_timers = NULL;
+      goto error;
+    }
+
+  return TRUE;
+
+ error:
+  /*LOG
+    This message indicates that the parking loop could not be started,
+    proxies keep their threads while waiting for their clients.
+   */
+  z_log(NULL, CORE_ERROR, 1, "Error starting proxy parking loop; error='%s'", g_strerror(errno));
+  if (park_epoll_fd >= 0)
+    close(park_epoll_fd);
+  if (park_event_fd >= 0)
+    close(park_event_fd);
+  park_epoll_fd = park_event_fd = -1;
+  park_failed = TRUE;
+  return FALSE;
+}
+
+/**
+ * z_proxy_park_kick:
+ *
+ * Make the parking loop recalculate its timeout and check for wakeups.
+ **/
+static void
+z_proxy_park_kick(void)
+{
+  guint64 one = 1;
+
+  if (write(park_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    z_log(NULL, CORE_ERROR, 3, "Error waking up parking loop; error='%s'", g_strerror(errno));
+}
+
+/**
+ * z_proxy_park:
+ * @self: proxy instance
+ * @stream: stream to wait for
+ * @timeout: timeout in milliseconds, -1 for no timeout
+ * @resume: function to continue the proxy with
+ *
+ * Request the proxy to be parked until @stream becomes readable or
+ * @timeout elapses.  The proxy has to return from its main function right
+ * after calling this function, it is actually parked by z_proxy_run() or
+ * by the resume logic with z_proxy_park_commit().  @stream must not have
+ * any buffered data, as only its file descriptor is watched.
+ **/
+void
+z_proxy_park(ZProxy *self, ZStream *stream, gint timeout, ZProxyParkResumeFunc resume)
+{
+  ZProxyParkEntry *entry;
+
+  z_proxy_enter(self);
+  g_assert(!self->parking && (self->flags & ZPF_NONBLOCKING) == 0);
+
+  entry = g_new0(ZProxyParkEntry, 1);
+  entry->proxy = self;
+  entry->fd = z_stream_get_fd(stream);
+  entry->deadline = timeout >= 0 ? g_get_monotonic_time() + (gint64) timeout * 1000 : -1;
+  entry->resume = resume;
+  self->parking = entry;
+  z_proxy_leave(self);
+}
+
+/**
+ * z_proxy_park_register:
+ * @self: proxy instance
+ *
+ * Register the parking request of @self in the parking loop, which takes
+ * a reference to the proxy.  Returns FALSE if the loop is not available
+ * or cannot watch the file descriptor, the request is left in place in
+ * this case.
+ **/
+static gboolean
+z_proxy_park_register(ZProxy *self)
+{
+  ZProxyParkEntry *entry = self->parking;
+  struct epoll_event ev;
+  gboolean kick = FALSE;
+
+  G_LOCK(park_lock);
+  if (entry->fd < 0 || !z_proxy_park_init())
+    {
+      G_UNLOCK(park_lock);
+      return FALSE;
+    }
+
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = entry;
+  if (epoll_ctl(park_epoll_fd, EPOLL_CTL_ADD, entry->fd, &ev) < 0)
+    {
+      /*LOG
+        This message indicates that the file descriptor of a proxy could
+        not be added to the parking loop, the proxy keeps its thread while
+        waiting.
+       */
+      z_proxy_log(self, CORE_ERROR, 3, "Error parking proxy; fd='%d', error='%s'", entry->fd, g_strerror(errno));
+      G_UNLOCK(park_lock);
+      return FALSE;
+    }
+
+  /* the loop cannot pick up the entry before the lock is released */
+  self->parking = NULL;
+  z_proxy_ref(self);
+  g_hash_table_insert(park_entries, self, entry);
+
+  if (entry->deadline >= 0)
+    {
+      entry->timer = g_sequence_insert_sorted(park_timers, entry, z_proxy_park_deadline_compare, NULL);
+      kick = g_sequence_iter_is_begin(entry->timer);
+    }
+
+  if (kick)
+    z_proxy_park_kick();
+
+  z_proxy_park_report();
+  G_UNLOCK(park_lock);
+  return TRUE;
+}
+
+/**
+ * z_proxy_park_poll:
+ * @entry: parking request
+ *
+ * Wait for the parking request in the current thread, used when the proxy
+ * cannot be parked.
+ **/
+static ZProxyParkEvent
+z_proxy_park_poll(ZProxyParkEntry *entry)
+{
+  struct pollfd pfd;
+  gint timeout = -1;
+  gint rc;
+
+  pfd.fd = entry->fd;
+  pfd.events = POLLIN;
+
+  do
+    {
+      if (entry->deadline >= 0)
+        timeout = MAX(0, (entry->deadline - g_get_monotonic_time() + 999) / 1000);
+
+      rc = poll(&pfd, 1, timeout);
+    }
+  while (rc < 0 && errno == EINTR);
+
+  return rc == 0 ? Z_PROXY_PARK_TIMEOUT : Z_PROXY_PARK_READABLE;
+}
+
+/**
+ * z_proxy_park_commit:
+ * @self: proxy instance
+ *
+ * Hand a proxy which requested parking over to the parking loop.  From
+ * this point on the proxy may be resumed in another thread at any time,
+ * the caller must not touch it except for dropping its own reference.  If
+ * the proxy cannot be parked it keeps running in the current thread until
+ * it either gets parked or finishes.
+ *
+ * Returns: TRUE if the proxy is parked, FALSE if it has finished and has
+ * to be shut down by the caller.
+ **/
+gboolean
+z_proxy_park_commit(ZProxy *self)
+{
+  while (z_proxy_park_requested(self))
+    {
+      ZProxyParkEntry *entry;
+      ZProxyParkResumeFunc resume;
+      ZProxyParkEvent event;
+
+      if (z_proxy_park_register(self))
+        return TRUE;
+
+      entry = self->parking;
+      self->parking = NULL;
+      event = z_proxy_park_poll(entry);
+      resume = entry->resume;
+      g_free(entry);
+
+      resume(self, event);
+    }
+
+  return FALSE;
+}
+
+/**
+ * z_proxy_park_wakeup:
+ * @self: proxy instance
+ *
+ * Resume @self with Z_PROXY_PARK_WAKEUP if it is parked, used to deliver
+ * stop requests to parked proxies.
+ *
+ * NOTE: this runs in a separate thread
+ **/
+void
+z_proxy_park_wakeup(ZProxy *self)
+{
+  ZProxyParkEntry *entry;
+
+  G_LOCK(park_lock);
+  if (park_entries &&
+      (entry = static_cast<ZProxyParkEntry *>(g_hash_table_lookup(park_entries, self))) &&
+      !entry->wakeup)
+    {
+      entry->wakeup = TRUE;
+      park_wakeups = g_list_prepend(park_wakeups, entry);
+      z_proxy_park_kick();
+    }
+  G_UNLOCK(park_lock);
+}
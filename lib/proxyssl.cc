@@ -29,7 +29,11 @@
 #include <zorp/pystruct.h>
 #include <zorp/pysockaddr.h>
 #include <zorp/proxysslhostiface.h>
+#include <zorp/proxyktls.h>
+#include <zorp/proxysslcache.h>
+#include <zorp/tlshello.h>
 #include <zorp/proxygroup.h>
+#include <zorp/szig.h>
 #include <zorpll/source.h>
 #include <zorpll/error.h>
 #include <openssl/err.h>
@@ -433,12 +437,74 @@ z_proxy_ssl_callback(ZProxy *self, gint ndx, const gchar *name, ZPolicyObj *args
   z_proxy_return(self, rc);
 }
 
+/**
+ * z_proxy_ssl_keybridge_setup_key:
+ * @self: the proxy instance
+ * @side: the side we're doing the SSL handshake on
+ *
+ * Set the local certificate of @side to the one generated by the keybridge
+ * configured in the encryption policy, mimicking the certificate of the
+ * other side.  Runs without the interpreter lock, so the handshakes of
+ * other proxies proceed while the certificate is generated.
+ **/
+static gboolean
+z_proxy_ssl_keybridge_setup_key(ZProxy *self, ZEndpoint side)
+{
+  std::shared_ptr<X509KeyBridge> keybridge = *self->encryption->keybridge[side];
+  X509 *peer_cert = self->tls_opts.peer_cert[EP_OTHER(side)];
+  gboolean trusted = self->tls_opts.certificate_trusted[EP_OTHER(side)];
+
+  z_proxy_enter(self);
+
+  if (!peer_cert)
+    {
+      /*LOG
+        This message indicates that the certificate of the other side is
+        not available, so the keybridged certificate cannot be generated.
+        The certificate configured for the side is used instead.
+       */
+      z_proxy_log(self, CORE_ERROR, 4, "Unable to generate certificate, no peer certificate present, using configured certificate; side='%s'",
+                  EP_STR(side));
+      z_proxy_return(self, TRUE);
+    }
+
+  z_proxy_log(self, CORE_DEBUG, 4, "Generating key; side='%s', trusted='%d'", EP_STR(side), trusted);
+
+  X509 *cert = keybridge->get_certificate(peer_cert, trusted, self->session_id);
+  if (!cert)
+    z_proxy_return(self, FALSE);
+
+  ZCertificateChain *chain = z_certificate_chain_new();
+  gboolean success = z_certificate_chain_set_cert(chain, cert);
+  X509_free(cert);
+
+  EVP_PKEY *key = keybridge->get_private_key();
+  if (!success || !EVP_PKEY_up_ref(key))
+    {
+      z_proxy_log(self, CORE_ERROR, 3, "Unable to set up keybridged certificate; side='%s'", EP_STR(side));
+      z_object_unref(&chain->super);
+      z_proxy_return(self, FALSE);
+    }
+
+  if (self->tls_opts.local_cert[side])
+    z_object_unref(&self->tls_opts.local_cert[side]->super);
+  self->tls_opts.local_cert[side] = chain;
+
+  EVP_PKEY_free(self->tls_opts.local_privkey[side]);
+  self->tls_opts.local_privkey[side] = key;
+
+  z_proxy_return(self, TRUE);
+}
+
 static gboolean
 z_proxy_ssl_policy_setup_key(ZProxy *self, ZEndpoint side)
 {
   guint policy_type;
   gboolean callback_result;
 
+  if (self->encryption->keybridge[side])
+    return z_proxy_ssl_keybridge_setup_key(self, side);
+
   z_proxy_enter(self);
 
   z_policy_lock(self->thread);
@@ -663,6 +729,11 @@ z_proxy_ssl_app_verify_cb(X509_STORE_CTX *ctx, void * /* user_data */)
     }
 
 exit:
+  /* sessions accepted by a policy decision are not cached, as resuming
+     them would skip the decision */
+  if (side == EP_SERVER && (!ok || verify_failed || !self->tls_opts.certificate_trusted[side]))
+    z_proxy_ssl_session_cache_detach(ssl);
+
   z_proxy_return(self, ok);
 }
 
@@ -912,6 +983,14 @@ z_proxy_ssl_handshake_cb(ZStream *stream, GIOCondition  /* poll_cond */, gpointe
 
   self->tls_opts.peer_cert[side] = SSL_get_peer_certificate(handshake->session->ssl);
 
+  /* only trusted sessions are cached, the verification callbacks are not
+     called when a session is resumed */
+  if (side == EP_SERVER && SSL_session_reused(handshake->session->ssl))
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Resumed cached TLS session; side='%s'", EP_STR(side));
+      self->tls_opts.certificate_trusted[side] = true;
+    }
+
   if (self->tls_opts.peer_cert[side] && z_log_enabled(CORE_DEBUG, 4))
     {
       gchar name[1024];
@@ -1191,6 +1270,16 @@ z_proxy_ssl_setup_handshake(ZProxySSLHandshake *handshake)
           SSL_set_tlsext_host_name(tmpssl, self->tls_opts.tlsext_server_host_name->str);
         }
 
+      /* the client certificate selected by a setup_key callback is not
+       * known before the handshake, thus it cannot be part of the key */
+      if (self->encryption->ssl_opts.server_session_cache &&
+          !z_proxy_ssl_callback_exists(self, EP_SERVER, "setup_key"))
+        {
+          std::string cache_key = z_policy_encryption_get_server_cache_key(self);
+
+          if (z_proxy_ssl_session_cache_attach(tmpssl, cache_key.c_str()))
+            z_proxy_log(self, CORE_DEBUG, 6, "Offering cached TLS session to the server; key='%s'", cache_key.c_str());
+        }
     }
 
   /* Give the SSL context to the handshake class after
@@ -1242,13 +1331,17 @@ z_proxy_ssl_perform_handshake(ZProxySSLHandshake *handshake)
   ZProxy *self = handshake->proxy;
   gboolean res;
   gsize buffered_bytes;
+  gint64 handshake_start;
 
   z_proxy_enter(self);
 
   if (!z_proxy_ssl_setup_handshake(handshake))
     z_proxy_return(self, FALSE);
 
+  handshake_start = g_get_monotonic_time();
   res = z_proxy_ssl_do_handshake(handshake, self->flags & ZPF_NONBLOCKING);
+  if (res)
+    z_szig_histogram_add("tls_handshake", (glong) (g_get_monotonic_time() - handshake_start));
 
   /* SSL plain injection check: although we do check that the stream
    * buffers above the SSL stream are empty, but if there's a bug
@@ -1391,7 +1484,8 @@ z_proxy_ssl_init_completed(ZProxySSLHandshake *handshake, gpointer user_data)
       self->tls_opts.ssl_sessions[handshake->side] = z_ssl_session_ref(handshake->session);
 
       /* call the nonblocking init callback of the proxy */
-      success = z_proxy_nonblocking_init(self, z_proxy_group_get_poll(z_proxy_get_group(self)));
+      success = z_proxy_ktls_offload(self, handshake->side) &&
+                z_proxy_nonblocking_init(self, z_proxy_group_get_poll(z_proxy_get_group(self)));
     }
 
   if (!success)
@@ -1460,34 +1554,36 @@ z_proxy_ssl_init_stream_nonblocking(ZProxy *self, ZEndpoint side)
 }
 
 static void
-z_proxy_ssl_sni_do_handshake(ZProxy *self, ZPktBuf *buf, gsize bytes_read)
+z_proxy_ssl_sni_set_from_hello(ZProxy *self, ZTlsClientHello *hello)
 {
-  if (self->tls_opts.tlsext_server_host_name->len)
+  if (hello->server_name->len)
     {
-      g_string_truncate(self->tls_opts.tlsext_server_host_name, 0);
-    }
-
-  //z_proxy_log_data_dump(self, CORE_DEBUG, 6, (gchar *) buf->data, bytes_read);
-
-  SSL *ssl_connection = SSL_new(self->encryption->ssl_client_context);
-  ZProxySSLHandshake *handshake = g_new0(ZProxySSLHandshake, 1);
-  handshake->proxy = z_proxy_ref(self);
-
-  SSL_set_app_data(ssl_connection, handshake);
-  SSL_set_accept_state(ssl_connection);
-  BIO *bio_in = BIO_new(BIO_s_mem());
-  BIO *bio_out = BIO_new(BIO_s_mem());
+      g_string_assign(self->tls_opts.tlsext_server_host_name, hello->server_name->str);
 
-  SSL_set_bio(ssl_connection, bio_in, bio_out);
-
-  BIO_write(bio_in, buf->data, bytes_read);
-  SSL_do_handshake(ssl_connection);
-  SSL_free(ssl_connection);
+      /*LOG
+        This message reports the server name the client requested in the
+        TLS Server Name Indication extension of its ClientHello.
+       */
+      z_proxy_log(self, CORE_INFO, 6, "TLS Server Name Indication extension; side='%s', server_name='%s'",
+                  EP_STR(EP_CLIENT), hello->server_name->str);
+    }
 
-  z_proxy_unref(handshake->proxy);
-  g_free(handshake);
+  if (hello->alpn_protocols->len)
+    z_proxy_log(self, CORE_DEBUG, 6, "TLS Application Layer Protocol Negotiation extension; side='%s', first_protocol='%s', protocols='%u'",
+                EP_STR(EP_CLIENT), (const gchar *) g_ptr_array_index(hello->alpn_protocols, 0), hello->alpn_protocols->len);
 }
 
+/**
+ * Find out the server name requested by the client before the handshake.
+ *
+ * @param self          the proxy instance
+ * @param stream        the client stream, with an SSL stream on its stack
+ *
+ * The first record sent by the client is read and parsed as a ClientHello,
+ * the server name found in it is stored in tls_opts.tlsext_server_host_name.
+ * The data read is pushed back to the stream, the handshake sees it as
+ * usual.
+ */
 void
 z_proxy_ssl_get_sni_from_client(ZProxy *self, ZStream *stream)
 {
@@ -1502,24 +1598,46 @@ z_proxy_ssl_get_sni_from_client(ZProxy *self, ZStream *stream)
     z_pktbuf_new(),
     &z_pktbuf_unref
   );
-  z_pktbuf_resize(buf.get(), 1024);
+  std::unique_ptr<ZTlsClientHello, decltype(&z_tls_client_hello_free)> hello(
+    z_tls_client_hello_new(),
+    &z_tls_client_hello_free
+  );
+  z_pktbuf_resize(buf.get(), Z_TLS_RECORD_HEADER_LEN + Z_TLS_RECORD_MAX_LEN);
   gsize bytes_read = 0;
+  GIOStatus status = G_IO_STATUS_NORMAL;
+  ZTlsHelloParseResult result = Z_TLS_HELLO_INCOMPLETE;
+  const gchar *error = NULL;
+
+  /* the ClientHello may arrive in more than one segment */
+  while (result == Z_TLS_HELLO_INCOMPLETE && bytes_read < buf->allocated)
+    {
+      gsize length = 0;
 
-  GIOStatus status = z_stream_read(ssl_stream, buf->data, buf->allocated, &bytes_read, NULL);
-  if (status == G_IO_STATUS_ERROR || status == G_IO_STATUS_EOF)
+      status = z_stream_read(ssl_stream, buf->data + bytes_read, buf->allocated - bytes_read, &length, NULL);
+      if (status != G_IO_STATUS_NORMAL)
+        break;
+
+      bytes_read += length;
+      result = z_tls_client_hello_parse(hello.get(), (const guchar *) buf->data, bytes_read, &error);
+    }
+
+  if (bytes_read == 0 && (status == G_IO_STATUS_ERROR || status == G_IO_STATUS_EOF))
     {
       z_proxy_log(self, CORE_ERROR, 0, "Error reading from ssl stream; status=%d", status);
       return;
     }
-  else
-    {
-      z_proxy_ssl_sni_do_handshake(self, buf.get(), bytes_read);
 
-      z_stream_ref(ssl_stream);
-      ZStream *fd_stream = z_stream_pop(ssl_stream);
-      z_stream_unget(fd_stream, buf->data, bytes_read, NULL);
-      z_stream_push(fd_stream, ssl_stream);
-    }
+  g_string_truncate(self->tls_opts.tlsext_server_host_name, 0);
+
+  if (result == Z_TLS_HELLO_OK)
+    z_proxy_ssl_sni_set_from_hello(self, hello.get());
+  else if (result == Z_TLS_HELLO_INVALID)
+    z_proxy_log(self, CORE_DEBUG, 6, "TLS client hello message cannot be parsed; error='%s'", error);
+
+  z_stream_ref(ssl_stream);
+  ZStream *fd_stream = z_stream_pop(ssl_stream);
+  z_stream_unget(fd_stream, buf->data, bytes_read, NULL);
+  z_stream_push(fd_stream, ssl_stream);
 }
 
 /**
@@ -1607,6 +1725,9 @@ z_proxy_ssl_request_handshake(ZProxy *self, ZEndpoint side, gboolean forced)
   if (side == EP_SERVER)
     z_proxy_ssl_register_host_iface(self);
 
+  if (!z_proxy_ktls_offload(self, side))
+    z_proxy_return(self, FALSE);
+
   /* in case there's a pending handshake request on the other endpoint
      make sure we complete that */
   side = EP_OTHER(side);
@@ -1626,6 +1747,9 @@ z_proxy_ssl_request_handshake(ZProxy *self, ZEndpoint side, gboolean forced)
 
       if (side == EP_SERVER)
         z_proxy_ssl_register_host_iface(self);
+
+      if (rc)
+        rc = z_proxy_ktls_offload(self, side);
     }
 
   z_proxy_return(self, rc);
@@ -0,0 +1,337 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+
+#include <zorp/proxysslcache.h>
+#include <zorp/szig.h>
+
+#include <time.h>
+
+/*
+ * Process-wide cache of the TLS sessions established with servers, so
+ * that a new connection to the same server can be resumed instead of
+ * doing a full handshake, even if it is made by another proxy instance.
+ *
+ * The key of a session describes everything the server side handshake
+ * depends on (see z_policy_encryption_get_server_cache_key()), it is
+ * attached to the SSL object of the connection as ex_data.  Sessions are
+ * stored by the new session callback of OpenSSL, as with TLS 1.3 they are
+ * only available after the server sends a ticket, some time after the
+ * handshake.
+ *
+ * The cache holds the most recent session of each key, and at most
+ * Z_PROXY_SSL_SESSION_CACHE_SIZE keys, the least recently used ones are
+ * evicted.  TLS 1.3 sessions are handed out only once, as recommended by
+ * RFC 8446, the server sends a new ticket on the resumed connection.
+ */
+
+typedef struct _ZProxySSLSessionCacheEntry
+{
+  gchar *key;
+  SSL_SESSION *session;
+  GList lru_link;
+} ZProxySSLSessionCacheEntry;
+
+G_LOCK_DEFINE_STATIC(z_proxy_ssl_session_cache);
+static GHashTable *z_proxy_ssl_session_cache;
+/* most recently used entry at the head */
+static GQueue z_proxy_ssl_session_cache_lru = G_QUEUE_INIT;
+
+/* statistics, protected by the cache lock */
+static glong z_proxy_ssl_session_cache_hits;
+static glong z_proxy_ssl_session_cache_misses;
+static glong z_proxy_ssl_session_cache_evicted;
+
+static void
+z_proxy_ssl_session_cache_free_key(void * /* parent */, void *ptr, CRYPTO_EX_DATA * /* ad */,
+                                   int /* idx */, long /* argl */, void * /* argp */)
+{
+  g_free(ptr);
+}
+
+/**
+ * z_proxy_ssl_session_cache_key_index:
+ *
+ * Return the ex_data index storing the cache key of an SSL object.
+ **/
+static int
+z_proxy_ssl_session_cache_key_index(void)
+{
+  static gsize key_index = 0;
+
+  if (g_once_init_enter(&key_index))
+    {
+      int idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, z_proxy_ssl_session_cache_free_key);
+
+      g_assert(idx >= 0);
+      g_once_init_leave(&key_index, idx + 1);
+    }
+
+  return key_index - 1;
+}
+
+static void
+z_proxy_ssl_session_cache_entry_free(ZProxySSLSessionCacheEntry *entry)
+{
+  if (entry->session)
+    SSL_SESSION_free(entry->session);
+  g_free(entry->key);
+  g_free(entry);
+}
+
+static gboolean
+z_proxy_ssl_session_cache_entry_expired(ZProxySSLSessionCacheEntry *entry, time_t now)
+{
+  return SSL_SESSION_get_time(entry->session) + SSL_SESSION_get_timeout(entry->session) <= now;
+}
+
+/**
+ * z_proxy_ssl_session_cache_remove:
+ * @entry: cache entry
+ * @removed: list to move the entry to
+ *
+ * Unlink @entry from the cache, it is freed by the caller after the cache
+ * lock is released.
+ *
+ * NOTE: must be called with the cache lock held.
+ **/
+static void
+z_proxy_ssl_session_cache_remove(ZProxySSLSessionCacheEntry *entry, GList **removed)
+{
+  g_queue_unlink(&z_proxy_ssl_session_cache_lru, &entry->lru_link);
+  g_hash_table_remove(z_proxy_ssl_session_cache, entry->key);
+  *removed = g_list_prepend(*removed, entry);
+}
+
+/**
+ * z_proxy_ssl_session_cache_report:
+ *
+ * Publish the cache statistics as stats.ssl_session_cache.server.* in
+ * SZIG.
+ **/
+static void
+z_proxy_ssl_session_cache_report(glong entries, glong hits, glong misses, glong evicted)
+{
+  z_szig_event(Z_SZIG_SSL_SESSION_CACHE,
+               z_szig_value_new_props("server",
+                                      "entries", z_szig_value_new_long(entries),
+                                      "hits", z_szig_value_new_long(hits),
+                                      "misses", z_szig_value_new_long(misses),
+                                      "evicted", z_szig_value_new_long(evicted),
+                                      NULL));
+}
+
+/**
+ * z_proxy_ssl_session_cache_store:
+ * @key: cache key
+ * @session: session to store, the reference is passed to the cache
+ *
+ * Store @session as the most recent session of @key, replacing the
+ * previous one.  If the cache is full the least recently used entries are
+ * evicted.
+ **/
+static void
+z_proxy_ssl_session_cache_store(const gchar *key, SSL_SESSION *session)
+{
+  ZProxySSLSessionCacheEntry *entry;
+  GList *removed = NULL;
+  glong entries, hits, misses, evicted;
+
+  G_LOCK(z_proxy_ssl_session_cache);
+
+  if (!z_proxy_ssl_session_cache)
+    z_proxy_ssl_session_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+  entry = static_cast<ZProxySSLSessionCacheEntry *>(g_hash_table_lookup(z_proxy_ssl_session_cache, key));
+  if (entry)
+    {
+      /* the old session is freed outside of the lock */
+      ZProxySSLSessionCacheEntry *old = g_new0(ZProxySSLSessionCacheEntry, 1);
+
+      old->session = entry->session;
+      removed = g_list_prepend(removed, old);
+
+      entry->session = session;
+      g_queue_unlink(&z_proxy_ssl_session_cache_lru, &entry->lru_link);
+    }
+  else
+    {
+      entry = g_new0(ZProxySSLSessionCacheEntry, 1);
+      entry->key = g_strdup(key);
+      entry->session = session;
+      entry->lru_link.data = entry;
+      g_hash_table_insert(z_proxy_ssl_session_cache, entry->key, entry);
+    }
+
+  g_queue_push_head_link(&z_proxy_ssl_session_cache_lru, &entry->lru_link);
+
+  while (g_queue_get_length(&z_proxy_ssl_session_cache_lru) > Z_PROXY_SSL_SESSION_CACHE_SIZE)
+    {
+      z_proxy_ssl_session_cache_remove(static_cast<ZProxySSLSessionCacheEntry *>(g_queue_peek_tail(&z_proxy_ssl_session_cache_lru)),
+                                       &removed);
+      z_proxy_ssl_session_cache_evicted++;
+    }
+
+  entries = g_queue_get_length(&z_proxy_ssl_session_cache_lru);
+  hits = z_proxy_ssl_session_cache_hits;
+  misses = z_proxy_ssl_session_cache_misses;
+  evicted = z_proxy_ssl_session_cache_evicted;
+  G_UNLOCK(z_proxy_ssl_session_cache);
+
+  g_list_free_full(removed, (GDestroyNotify) z_proxy_ssl_session_cache_entry_free);
+  z_proxy_ssl_session_cache_report(entries, hits, misses, evicted);
+}
+
+/**
+ * z_proxy_ssl_session_cache_new_cb:
+ * @ssl: server side SSL connection
+ * @session: new session of @ssl
+ *
+ * New session callback of the server side SSL context, stores @session
+ * in the cache if @ssl has a cache key attached.
+ **/
+static int
+z_proxy_ssl_session_cache_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+  const gchar *key = static_cast<const gchar *>(SSL_get_ex_data(ssl, z_proxy_ssl_session_cache_key_index()));
+
+  if (!key)
+    return 0;
+
+#ifdef TLS1_3_VERSION
+  if (!SSL_SESSION_is_resumable(session))
+    return 0;
+#endif
+
+  SSL_SESSION_up_ref(session);
+  z_proxy_ssl_session_cache_store(key, session);
+
+  /* we hold our own reference */
+  return 0;
+}
+
+/**
+ * z_proxy_ssl_session_cache_setup:
+ * @ctx: server side SSL context
+ *
+ * Make OpenSSL report the sessions established with @ctx to the cache.
+ * OpenSSL's internal cache is not used, sessions are only offered by
+ * z_proxy_ssl_session_cache_attach().
+ **/
+void
+z_proxy_ssl_session_cache_setup(SSL_CTX *ctx)
+{
+  z_proxy_ssl_session_cache_key_index();
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, z_proxy_ssl_session_cache_new_cb);
+}
+
+/**
+ * z_proxy_ssl_session_cache_attach:
+ * @ssl: server side SSL connection, before the handshake
+ * @key: cache key of the connection
+ *
+ * Offer the cached session of @key to the server, and remember @key so
+ * that the session established by @ssl is stored in the cache.  Returns
+ * TRUE if a session was offered.
+ **/
+gboolean
+z_proxy_ssl_session_cache_attach(SSL *ssl, const gchar *key)
+{
+  ZProxySSLSessionCacheEntry *entry = NULL;
+  SSL_SESSION *session = NULL;
+  GList *removed = NULL;
+  glong entries, hits, misses, evicted;
+
+  G_LOCK(z_proxy_ssl_session_cache);
+
+  if (z_proxy_ssl_session_cache)
+    entry = static_cast<ZProxySSLSessionCacheEntry *>(g_hash_table_lookup(z_proxy_ssl_session_cache, key));
+
+  if (entry && z_proxy_ssl_session_cache_entry_expired(entry, time(NULL)))
+    {
+      z_proxy_ssl_session_cache_remove(entry, &removed);
+      z_proxy_ssl_session_cache_evicted++;
+      entry = NULL;
+    }
+
+  if (entry)
+    {
+      session = entry->session;
+
+#ifdef TLS1_3_VERSION
+      if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION)
+        {
+          /* single use, the reference of the cache is passed to the caller */
+          entry->session = NULL;
+          z_proxy_ssl_session_cache_remove(entry, &removed);
+        }
+      else
+#endif
+        {
+          SSL_SESSION_up_ref(session);
+          g_queue_unlink(&z_proxy_ssl_session_cache_lru, &entry->lru_link);
+          g_queue_push_head_link(&z_proxy_ssl_session_cache_lru, &entry->lru_link);
+        }
+
+      z_proxy_ssl_session_cache_hits++;
+    }
+  else
+    {
+      z_proxy_ssl_session_cache_misses++;
+    }
+
+  entries = g_queue_get_length(&z_proxy_ssl_session_cache_lru);
+  hits = z_proxy_ssl_session_cache_hits;
+  misses = z_proxy_ssl_session_cache_misses;
+  evicted = z_proxy_ssl_session_cache_evicted;
+  G_UNLOCK(z_proxy_ssl_session_cache);
+
+  g_list_free_full(removed, (GDestroyNotify) z_proxy_ssl_session_cache_entry_free);
+  z_proxy_ssl_session_cache_report(entries, hits, misses, evicted);
+
+  SSL_set_ex_data(ssl, z_proxy_ssl_session_cache_key_index(), g_strdup(key));
+
+  if (!session)
+    return FALSE;
+
+  SSL_set_session(ssl, session);
+  SSL_SESSION_free(session);
+  return TRUE;
+}
+
+/**
+ * z_proxy_ssl_session_cache_detach:
+ * @ssl: server side SSL connection
+ *
+ * Do not store the sessions of @ssl in the cache, used when the server
+ * certificate was accepted without being trusted, so that resumed
+ * connections never skip a verification that needed a policy decision.
+ **/
+void
+z_proxy_ssl_session_cache_detach(SSL *ssl)
+{
+  int idx = z_proxy_ssl_session_cache_key_index();
+
+  g_free(SSL_get_ex_data(ssl, idx));
+  SSL_set_ex_data(ssl, idx, NULL);
+}
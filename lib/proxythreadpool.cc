@@ -0,0 +1,302 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include <zorp/proxythreadpool.h>
+#include <zorp/szig.h>
+#include <zorpll/thread.h>
+#include <zorpll/log.h>
+
+#include <string.h>
+
+#if HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/*
+ * Proxy thread pool
+ *
+ * Blocking proxies used to get a brand new thread for every session,
+ * which makes short lived sessions pay for thread creation and teardown.
+ * The pool keeps at least z_proxy_thread_pool_min_threads threads around,
+ * each waiting for jobs on a shared queue. New threads are only started
+ * when no idle thread is available, up to z_proxy_thread_pool_max_threads;
+ * beyond that limit jobs wait in the queue until a thread becomes free.
+ * Threads above the minimum exit after being idle for
+ * z_proxy_thread_pool_idle_timeout milliseconds.
+ *
+ * The minimum number of threads is started by z_proxy_thread_pool_init()
+ * at startup, so that the first sessions do not wait for thread creation.
+ *
+ * Pool threads are ordinary ZThreads, thus they are accounted for in the
+ * thread statistics and use the stack size configured for ZThread. While
+ * running a job the thread carries the name of the job (the session id of
+ * the proxy), so that it can be identified in ps and top.
+ */
+
+/* minimum number of threads kept running even if idle */
+gint z_proxy_thread_pool_min_threads = 16;
+/* maximum number of pool threads, 0 disables the pool */
+gint z_proxy_thread_pool_max_threads = 1000;
+/* idle threads above the minimum exit after this many milliseconds */
+gint z_proxy_thread_pool_idle_timeout = 60000;
+
+/* the kernel limits thread names to 15 characters */
+#define Z_PROXY_THREAD_POOL_NAME_LEN 16
+
+/**
+ * ZProxyThreadPoolJob:
+ *
+ * A single unit of work waiting in the pool queue.
+ **/
+typedef struct _ZProxyThreadPoolJob
+{
+  GThreadFunc func;
+  gpointer data;
+  gint64 queued;
+  gchar name[Z_PROXY_THREAD_POOL_NAME_LEN];
+} ZProxyThreadPoolJob;
+
+/* protects the counters below */
+G_LOCK_DEFINE_STATIC(pool_lock);
+static GAsyncQueue *pool_queue = NULL;
+static gint pool_threads = 0;
+static gint pool_idle_threads = 0;
+static gint pool_queued_jobs = 0;
+static gint64 pool_max_queue_delay = 0;
+
+/**
+ * z_proxy_thread_pool_report:
+ * @queue_delay: time in microseconds the last job spent in the queue
+ *
+ * Publish pool occupancy as stats.proxy_thread_pool.* in SZIG.
+ *
+ * NOTE: must be called with pool_lock held.
+ **/
+static void
+z_proxy_thread_pool_report(gint64 queue_delay)
+{
+  if (queue_delay > pool_max_queue_delay)
+    pool_max_queue_delay = queue_delay;
+
+  z_szig_event(Z_SZIG_PROXY_THREAD_POOL,
+               z_szig_value_new_props("proxy_thread_pool",
+                                      "threads", z_szig_value_new_long(pool_threads),
+                                      "busy", z_szig_value_new_long(pool_threads - pool_idle_threads),
+                                      "queued", z_szig_value_new_long(pool_queued_jobs),
+                                      "queue_delay", z_szig_value_new_long(queue_delay),
+                                      "queue_delay_max", z_szig_value_new_long(pool_max_queue_delay),
+                                      NULL));
+}
+
+/**
+ * z_proxy_thread_pool_set_name:
+ * @name: new name of the current thread
+ *
+ * Set the name of the current thread as shown by ps and top.
+ **/
+static void
+z_proxy_thread_pool_set_name(const gchar *name)
+{
+#if HAVE_PRCTL
+  prctl(PR_SET_NAME, (unsigned long) name, 0, 0, 0);
+#else
+  (void) name;
+#endif
+}
+
+/**
+ * z_proxy_thread_pool_thread:
+ * @s: not used
+ *
+ * Main function of pool threads, runs jobs until the thread becomes
+ * superfluous.
+ **/
+static gpointer
+z_proxy_thread_pool_thread(gpointer  /* s */)
+{
+  ZProxyThreadPoolJob *job;
+
+  z_enter();
+  while (1)
+    {
+      job = static_cast<ZProxyThreadPoolJob *>(g_async_queue_timeout_pop(pool_queue, (guint64) z_proxy_thread_pool_idle_timeout * 1000));
+
+      G_LOCK(pool_lock);
+      if (!job)
+        {
+          /* jobs are pushed with pool_lock held, thus a job queued after
+           * the pop timed out is counted here; leave it to the other idle
+           * threads only if there are enough of them */
+          if (pool_threads > z_proxy_thread_pool_min_threads &&
+              pool_idle_threads > pool_queued_jobs)
+            {
+              pool_threads--;
+              pool_idle_threads--;
+              z_proxy_thread_pool_report(0);
+              G_UNLOCK(pool_lock);
+              break;
+            }
+          G_UNLOCK(pool_lock);
+          continue;
+        }
+
+      pool_idle_threads--;
+      pool_queued_jobs--;
+      z_proxy_thread_pool_report(g_get_monotonic_time() - job->queued);
+      G_UNLOCK(pool_lock);
+
+      z_proxy_thread_pool_set_name(job->name);
+      job->func(job->data);
+      z_proxy_thread_pool_set_name("proxy");
+      g_free(job);
+
+      G_LOCK(pool_lock);
+      pool_idle_threads++;
+      G_UNLOCK(pool_lock);
+    }
+  z_leave();
+  return NULL;
+}
+
+/**
+ * z_proxy_thread_pool_init:
+ *
+ * Start the minimum number of pool threads. Called once the global
+ * options of the policy have been read.
+ **/
+void
+z_proxy_thread_pool_init(void)
+{
+  gint count, i;
+
+  z_enter();
+  if (z_proxy_thread_pool_max_threads <= 0)
+    z_return();
+
+  G_LOCK(pool_lock);
+  if (!pool_queue)
+    pool_queue = g_async_queue_new();
+
+  count = MIN(z_proxy_thread_pool_min_threads, z_proxy_thread_pool_max_threads) - pool_threads;
+  if (count > 0)
+    {
+      pool_threads += count;
+      pool_idle_threads += count;
+      z_proxy_thread_pool_report(0);
+    }
+  G_UNLOCK(pool_lock);
+
+  for (i = 0; i < count; i++)
+    {
+      if (!z_thread_new("proxy", z_proxy_thread_pool_thread, NULL))
+        {
+          G_LOCK(pool_lock);
+          pool_threads -= count - i;
+          pool_idle_threads -= count - i;
+          z_proxy_thread_pool_report(0);
+          G_UNLOCK(pool_lock);
+
+          /*LOG
+            This message indicates that the proxy thread pool could not
+            start all of its threads at startup, the rest is started on
+            demand.
+           */
+          z_log(NULL, CORE_ERROR, 2, "Error starting proxy pool threads; started='%d', requested='%d'", i, count);
+          break;
+        }
+    }
+  z_return();
+}
+
+/**
+ * z_proxy_thread_pool_run:
+ * @name: name of the job, usually the session id of the proxy
+ * @func: function to run
+ * @data: argument to @func
+ *
+ * Run @func in one of the pool threads, starting a new thread if none is
+ * idle and the limit has not been reached yet. If the pool is disabled
+ * a dedicated thread is started for @func. The thread is named after
+ * @name while it runs @func; as thread names are short, only the end of
+ * a longer @name is kept, which holds the session number.
+ *
+ * Returns: FALSE if the job could not be scheduled
+ **/
+gboolean
+z_proxy_thread_pool_run(const gchar *name, GThreadFunc func, gpointer data)
+{
+  ZProxyThreadPoolJob *job;
+  gboolean start_thread = FALSE;
+  gsize len;
+
+  z_enter();
+  if (z_proxy_thread_pool_max_threads <= 0)
+    {
+      if (!z_thread_new(name ? name : "proxy", func, data))
+        z_return(FALSE);
+      z_return(TRUE);
+    }
+
+  job = g_new0(ZProxyThreadPoolJob, 1);
+  job->func = func;
+  job->data = data;
+  job->queued = g_get_monotonic_time();
+  if (!name)
+    name = "proxy";
+  len = strlen(name);
+  if (len >= sizeof(job->name))
+    name += len - (sizeof(job->name) - 1);
+  g_strlcpy(job->name, name, sizeof(job->name));
+
+  /* the job is counted and pushed in the same critical section, so that
+   * idle threads deciding to exit always see it */
+  G_LOCK(pool_lock);
+  if (!pool_queue)
+    pool_queue = g_async_queue_new();
+
+  if (pool_idle_threads <= pool_queued_jobs && pool_threads < z_proxy_thread_pool_max_threads)
+    {
+      pool_threads++;
+      pool_idle_threads++;
+      start_thread = TRUE;
+    }
+  pool_queued_jobs++;
+  g_async_queue_push(pool_queue, job);
+  G_UNLOCK(pool_lock);
+
+  if (start_thread && !z_thread_new("proxy", z_proxy_thread_pool_thread, NULL))
+    {
+      G_LOCK(pool_lock);
+      pool_threads--;
+      pool_idle_threads--;
+      if (pool_threads == 0 && g_async_queue_remove(pool_queue, job))
+        {
+          /* nobody would ever pick up the job */
+          pool_queued_jobs--;
+          G_UNLOCK(pool_lock);
+          g_free(job);
+          z_return(FALSE);
+        }
+      G_UNLOCK(pool_lock);
+    }
+
+  z_return(TRUE);
+}
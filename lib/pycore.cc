@@ -32,6 +32,7 @@
 #include <zorp/szig.h>
 #include <zorpll/io.h>
 #include <zorp/proxystack.h>
+#include <zorp/tlshello.h>
 
 #include <zorp/pystream.h>
 #include <zorp/pysockaddr.h>
@@ -358,6 +359,85 @@ z_py_is_initial_policy_load(PyObject * /* self */, PyObject * /* args */)
   return PyInt_FromLong(z_main_loop_is_initial_policy_load() ? TRUE : FALSE);
 }
 
+static void
+z_py_dict_set_item_steal(PyObject *dict, const gchar *key, PyObject *value)
+{
+  PyDict_SetItemString(dict, (gchar *) key, value);
+  Py_DECREF(value);
+}
+
+static PyObject *
+z_py_convert_uint16_array_to_list(GArray *array)
+{
+  PyObject *list = PyList_New(array->len);
+
+  for (guint i = 0; i < array->len; i++)
+    PyList_SET_ITEM(list, i, PyInt_FromLong(g_array_index(array, guint16, i)));
+
+  return list;
+}
+
+/**
+ * z_py_parse_tls_client_hello:
+ * @self: Python self argument
+ * @args: Python args tuple, the data received from the client
+ *
+ * Called by the detectors to parse the TLS ClientHello message at the
+ * beginning of the data.
+ *
+ * Returns: None if more data is needed, a dict with the version,
+ * server_name, alpn, supported_versions and cipher_suites keys otherwise.
+ * ValueError is raised if the data is not a ClientHello.
+ */
+static PyObject *
+z_py_parse_tls_client_hello(PyObject * /* self */, PyObject *args)
+{
+  ZTlsClientHello *hello;
+  ZTlsHelloParseResult result;
+  const gchar *error = NULL;
+  PyObject *res, *alpn;
+  gchar *data;
+  guint length;
+
+  if (!PyArg_ParseTuple(args, "s#", &data, &length))
+    return NULL;
+
+  hello = z_tls_client_hello_new();
+
+  result = z_tls_client_hello_parse(hello, (const guchar *) data, length, &error);
+
+  switch (result)
+    {
+    case Z_TLS_HELLO_INCOMPLETE:
+      res = z_policy_none_ref();
+      break;
+
+    case Z_TLS_HELLO_INVALID:
+      PyErr_SetString(PyExc_ValueError, error);
+      res = NULL;
+      break;
+
+    default:
+      res = PyDict_New();
+      z_py_dict_set_item_steal(res, "version", PyInt_FromLong(hello->legacy_version));
+      z_py_dict_set_item_steal(res, "server_name",
+                               hello->server_name->len ? PyString_FromStringAndSize(hello->server_name->str, hello->server_name->len)
+                                                       : z_policy_none_ref());
+
+      alpn = PyList_New(hello->alpn_protocols->len);
+      for (guint i = 0; i < hello->alpn_protocols->len; i++)
+        PyList_SET_ITEM(alpn, i, PyString_FromString((const gchar *) g_ptr_array_index(hello->alpn_protocols, i)));
+      z_py_dict_set_item_steal(res, "alpn", alpn);
+
+      z_py_dict_set_item_steal(res, "supported_versions", z_py_convert_uint16_array_to_list(hello->supported_versions));
+      z_py_dict_set_item_steal(res, "cipher_suites", z_py_convert_uint16_array_to_list(hello->cipher_suites));
+      break;
+    }
+
+  z_tls_client_hello_free(hello);
+  return res;
+}
+
 static PyMethodDef common_funcs[] =
 {
   { "log", z_py_log, METH_VARARGS, NULL },
@@ -371,6 +451,7 @@ static PyMethodDef zorp_funcs[] =
   { "szigEvent", z_py_szig_event, METH_VARARGS, NULL },
   { "isInitialPolicyLoad", z_py_is_initial_policy_load, METH_NOARGS, NULL },
   { "notifyEvent", z_policy_notify_event, METH_VARARGS, NULL },
+  { "parseTlsClientHello", z_py_parse_tls_client_hello, METH_VARARGS, NULL },
   { NULL, NULL, 0, NULL }
 };
 
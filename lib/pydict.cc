@@ -175,6 +175,8 @@ struct _ZPolicyDict
   GHashTable *vars;
   gpointer app_data;
   GDestroyNotify app_data_free;
+  /* bumped whenever an item of a hash attribute is changed from Python */
+  gint hash_generation;
 };
 
 /* support functions for types above */
@@ -992,6 +994,7 @@ z_policy_hash_ass_subscript(ZPolicyHash *self, ZPolicyObj *u, ZPolicyObj *v)
   if (!PyArg_Parse(u, "s", &key))
     return -1;
 
+  g_atomic_int_inc(&self->dict->hash_generation);
   res = static_cast<ZPolicyObj *>(g_hash_table_lookup(self->hash, key));
   if (v == NULL)
     {
@@ -1317,6 +1320,7 @@ z_policy_dim_hash_ass_subscript(ZPolicyDimHash *self, ZPolicyObj *u, ZPolicyObj
       else
         return -1;
     }
+  g_atomic_int_inc(&self->dict->hash_generation);
   res = static_cast<ZPolicyObj *>(z_dim_hash_table_lookup(self->hash, keynum, keys));
 
   if (v == NULL)
@@ -1885,6 +1889,21 @@ z_policy_dict_get_app_data(ZPolicyDict *self)
   return self->app_data;
 }
 
+/**
+ * z_policy_dict_get_hash_generation:
+ * @self: ZPolicyDict instance
+ *
+ * Return a counter that changes whenever an item of one of the hash or
+ * dimhash attributes of @self is assigned or deleted from Python. C code
+ * caching information derived from these hashes can compare it to decide
+ * whether the cache is still valid, without taking the interpreter lock.
+ **/
+guint
+z_policy_dict_get_hash_generation(ZPolicyDict *self)
+{
+  return (guint) g_atomic_int_get(&self->hash_generation);
+}
+
 static void
 z_policy_dict_call_iter(gpointer key, gpointer  /* value */, gpointer user_data)
 {
@@ -263,6 +263,7 @@ typedef struct _ZPolicyDispatch
   PyObject_HEAD
   ZPolicy *policy;
   ZPolicyThread *policy_thread;
+  GMutex policy_thread_lock;
   ZDispatchEntry *dispatch;
   gboolean threaded;
   PyObject *handler;
@@ -316,18 +317,36 @@ static PyMethodDef z_policy_dispatch_methods[] =
  * on new incoming connections, passes the connection to self->handler, which
  * will end up in the 'accepted' method of AbstractDispatch.
  *
- * Called by the main thread, so it locks using the global python state
+ * Called by the main thread, so it locks using the global python state.
+ * The dispatch chain does not serialize its callbacks, so concurrent
+ * callers (dispatch and shard threads) are serialized here to keep them
+ * from sharing self->policy_thread.
  *
- * Returns: TRUE
+ * Returns: TRUE if the connection was passed to the handler, FALSE if the
+ * dispatcher was already destroyed
  */
 static gboolean
 z_policy_dispatch_accept(ZConnection *conn, gpointer user_data)
 {
   ZPolicyDispatch *self = (ZPolicyDispatch *) user_data;
-  PyObject *res, *addr, *local, *pystream, *bound;
+  PyObject *res, *addr, *local, *pystream, *bound, *handler;
 
   z_enter();
+  g_mutex_lock(&self->policy_thread_lock);
   z_policy_thread_acquire(self->policy_thread);
+
+  /* the callback may run on a snapshot of the chain taken before destroy()
+   * was called, the handler is only valid while the interpreter is locked;
+   * the connection is left to the lower priority entries of the chain */
+  handler = self->handler;
+  if (!handler)
+    {
+      z_policy_thread_release(self->policy_thread);
+      g_mutex_unlock(&self->policy_thread_lock);
+      z_return(FALSE);
+    }
+  Py_INCREF(handler);
+
   if (conn)
     {
       ZSockAddr *tmpsa;
@@ -356,11 +375,13 @@ z_policy_dispatch_accept(ZConnection *conn, gpointer user_data)
   cap_t saved_caps = cap_save();
   cap_enable(CAP_NET_ADMIN);
 
-  res = PyEval_CallFunction(self->handler, "(OOOO)",
+  res = PyEval_CallFunction(handler, "(OOOO)",
 			    pystream, addr, local, bound);
 
   cap_restore(saved_caps);
 
+  Py_DECREF(handler);
+
   Py_XDECREF(bound);
   Py_XDECREF(addr);
   Py_XDECREF(local);
@@ -388,6 +409,7 @@ z_policy_dispatch_accept(ZConnection *conn, gpointer user_data)
   Py_XDECREF(res);
 
   z_policy_thread_release(self->policy_thread);
+  g_mutex_unlock(&self->policy_thread_lock);
   if (conn)
     z_connection_destroy(conn, FALSE);
   z_return(TRUE);
@@ -490,7 +512,7 @@ z_policy_dispatch_new_instance(PyObject * /* o */, PyObject *args)
   gchar buf[MAX_SOCKADDR_STRING], *session_id;
   ZDispatchParams params;
   gint session_limit_dummy; /* session_limit is a noop */
-  const gchar *tcp_keywords[] = { "accept_one", "backlog", "threaded", "mark_tproxy", "transparent", NULL };
+  const gchar *tcp_keywords[] = { "accept_one", "backlog", "threaded", "mark_tproxy", "transparent", "accept_shards", NULL };
   const gchar *udp_keywords[] = {"session_limit", "rcvbuf", "threaded", "mark_tproxy", "transparent", NULL };
 
   /* called by python, so interpreter is locked */
@@ -525,17 +547,19 @@ z_policy_dispatch_new_instance(PyObject * /* o */, PyObject *args)
   params.common.threaded = FALSE;
   params.common.mark_tproxy = FALSE;
   params.common.transparent = FALSE;
+  params.common.accept_shards = 0;
   switch (db->protocol)
     {
     case ZD_PROTO_TCP:
       params.tcp.accept_one = FALSE;
       params.tcp.backlog = 255;
-      if (!PyArg_ParseTupleAndKeywords(fake_args, keywords, "|iiiii", const_cast<char**>(tcp_keywords),
+      if (!PyArg_ParseTupleAndKeywords(fake_args, keywords, "|iiiiii", const_cast<char**>(tcp_keywords),
                                        &params.tcp.accept_one,
                                        &params.tcp.backlog,
                                        &params.common.threaded,
                                        &params.common.mark_tproxy,
-                                       &params.common.transparent))
+                                       &params.common.transparent,
+                                       &params.common.accept_shards))
         {
           goto error_exit;
         }
@@ -564,6 +588,7 @@ z_policy_dispatch_new_instance(PyObject * /* o */, PyObject *args)
   self = PyObject_New(ZPolicyDispatch, &z_policy_dispatch_type);
   if (!self)
     goto error_exit;
+  g_mutex_init(&self->policy_thread_lock);
 
   /*LOG
     This message indicates that a Dispatcher on the given local address is
@@ -579,6 +604,7 @@ z_policy_dispatch_new_instance(PyObject * /* o */, PyObject *args)
   self->threaded = ((ZDispatchCommonParams *) &params)->threaded;
 
   self->policy_thread = z_policy_thread_new(self->policy);
+  z_policy_thread_set_profile_name(self->policy_thread, "Dispatcher");
   z_policy_thread_ready(self->policy_thread);
 
   /* z_dispatch_register uses a lock also locked by the callback mechanism which keeps it locked
@@ -654,6 +680,7 @@ z_policy_dispatch_free(ZPolicyDispatch *self)
       self->policy = NULL;
     }
 
+  g_mutex_clear(&self->policy_thread_lock);
   PyObject_Del(self);
 }
 
@@ -3,11 +3,19 @@
 
 #include <zorp/pyx509.h>
 #include <zorp/pyx509chain.h>
+#include <zorp/pykeybridge.h>
 #include <zorp/proxyssl.h>
+#include <zorp/proxysslcache.h>
 #include <zorp/x509lookup_crl_reloader.h>
+#include <zorpll/socket.h>
 #include <openssl/rand.h>
 #include <cstring>
 
+#ifdef TLS1_3_VERSION
+#define Z_POLICY_ENCRYPTION_MAX_PROTO_VERSION TLS1_3_VERSION
+#else
+#define Z_POLICY_ENCRYPTION_MAX_PROTO_VERSION TLS1_2_VERSION
+#endif
 
 static void
 z_policy_encryption_free(ZPolicyEncryption *self)
@@ -38,6 +46,16 @@ z_policy_encryption_free(ZPolicyEncryption *self)
       self->x509_lookup_crl_reloader = nullptr;
     }
 
+  delete self->random_ticket_key_manager;
+  self->random_ticket_key_manager = nullptr;
+  self->ticket_key_manager = nullptr;
+
+  for (ZEndpoint side = EP_CLIENT; side < EP_MAX; ++side)
+    {
+      delete self->keybridge[side];
+      self->keybridge[side] = nullptr;
+    }
+
   z_policy_var_unref(self->ssl_opts.ssl_struct);
   self->ssl_opts.ssl_struct = nullptr;
 
@@ -102,7 +120,7 @@ z_policy_encryption_set_methods_and_security(ZPolicyEncryption *self,
       if (!SSL_CTX_set_min_proto_version(self->ssl_client_context, TLS1_VERSION))
         z_policy_encryption_log_set_version_error("client", "min");
 
-      if (!SSL_CTX_set_max_proto_version(self->ssl_client_context, TLS1_2_VERSION))
+      if (!SSL_CTX_set_max_proto_version(self->ssl_client_context, Z_POLICY_ENCRYPTION_MAX_PROTO_VERSION))
         z_policy_encryption_log_set_version_error("client", "max");
 
       SSL_CTX_set_app_data(self->ssl_client_context, self);
@@ -124,11 +142,12 @@ z_policy_encryption_set_methods_and_security(ZPolicyEncryption *self,
       if (!SSL_CTX_set_min_proto_version(self->ssl_server_context, TLS1_VERSION))
         z_policy_encryption_log_set_version_error("server", "min");
 
-      if (!SSL_CTX_set_max_proto_version(self->ssl_server_context, TLS1_2_VERSION))
+      if (!SSL_CTX_set_max_proto_version(self->ssl_server_context, Z_POLICY_ENCRYPTION_MAX_PROTO_VERSION))
         z_policy_encryption_log_set_version_error("server", "max");
 
 
       SSL_CTX_set_timeout(self->ssl_server_context, self->ssl_server_context_timeout);
+      z_proxy_ssl_session_cache_setup(self->ssl_server_context);
     }
   return true;
 }
@@ -184,17 +203,33 @@ z_policy_encryption_register_vars(ZPolicyEncryption *self)
                          &self->ssl_opts.disable_proto_tlsv1_1[EP_CLIENT]);
   z_policy_dict_register(dict, Z_VT_INT, "client_disable_proto_tlsv1_2", Z_VF_RW,
                          &self->ssl_opts.disable_proto_tlsv1_2[EP_CLIENT]);
+  z_policy_dict_register(dict, Z_VT_INT, "client_disable_proto_tlsv1_3", Z_VF_RW,
+                         &self->ssl_opts.disable_proto_tlsv1_3[EP_CLIENT]);
   z_policy_dict_register(dict, Z_VT_INT, "client_disable_compression", Z_VF_RW,
                          &self->ssl_opts.disable_compression[EP_CLIENT]);
+  z_policy_dict_register(dict, Z_VT_INT, "client_enable_ktls", Z_VF_RW,
+                         &self->ssl_opts.enable_ktls[EP_CLIENT]);
 
   z_policy_dict_register(dict, Z_VT_INT, "client_keypair_generate", Z_VF_RW,
                          &self->ssl_opts.keypair_generate[EP_CLIENT]);
+  z_policy_dict_register(dict, Z_VT_OBJECT, "client_keybridge", Z_VF_RW | Z_VF_CONSUME,
+                         &self->ssl_opts.keybridge[EP_CLIENT]);
 
   z_policy_dict_register(dict, Z_VT_STRING, "client_ssl_cipher",
                          Z_VF_RW | Z_VF_CONSUME,
                          self->ssl_opts.ssl_cipher[EP_CLIENT]);
+  z_policy_dict_register(dict, Z_VT_STRING, "client_ssl_ciphersuites",
+                         Z_VF_RW | Z_VF_CONSUME,
+                         self->ssl_opts.ssl_ciphersuites[EP_CLIENT]);
   z_policy_dict_register(dict, Z_VT_INT, "cipher_server_preference", Z_VF_RW,
                          &self->ssl_opts.cipher_server_preference);
+  z_policy_dict_register(dict, Z_VT_INT, "num_session_tickets", Z_VF_RW,
+                         &self->ssl_opts.num_session_tickets);
+  z_policy_dict_register(dict, Z_VT_STRING, "session_ticket_key_file",
+                         Z_VF_RW | Z_VF_CONSUME,
+                         self->ssl_opts.session_ticket_key_file);
+  z_policy_dict_register(dict, Z_VT_INT, "session_ticket_key_lifetime", Z_VF_RW,
+                         &self->ssl_opts.session_ticket_key_lifetime);
   z_policy_dict_register(dict, Z_VT_STRING, "dh_params",
                          Z_VF_RW | Z_VF_CONSUME,
                          self->ssl_opts.dh_params);
@@ -228,18 +263,29 @@ z_policy_encryption_register_vars(ZPolicyEncryption *self)
                          &self->ssl_opts.disable_proto_tlsv1_1[EP_SERVER]);
   z_policy_dict_register(dict, Z_VT_INT, "server_disable_proto_tlsv1_2", Z_VF_RW,
                          &self->ssl_opts.disable_proto_tlsv1_2[EP_SERVER]);
+  z_policy_dict_register(dict, Z_VT_INT, "server_disable_proto_tlsv1_3", Z_VF_RW,
+                         &self->ssl_opts.disable_proto_tlsv1_3[EP_SERVER]);
   z_policy_dict_register(dict, Z_VT_INT, "server_disable_compression", Z_VF_RW,
                          &self->ssl_opts.disable_compression[EP_SERVER]);
+  z_policy_dict_register(dict, Z_VT_INT, "server_enable_ktls", Z_VF_RW,
+                         &self->ssl_opts.enable_ktls[EP_SERVER]);
 
   z_policy_dict_register(dict, Z_VT_INT, "server_keypair_generate", Z_VF_RW,
                          &self->ssl_opts.keypair_generate[EP_SERVER]);
+  z_policy_dict_register(dict, Z_VT_OBJECT, "server_keybridge", Z_VF_RW | Z_VF_CONSUME,
+                         &self->ssl_opts.keybridge[EP_SERVER]);
 
 
   z_policy_dict_register(dict, Z_VT_STRING, "server_ssl_cipher",
                          Z_VF_RW | Z_VF_CONSUME,
                          self->ssl_opts.ssl_cipher[EP_SERVER]);
+  z_policy_dict_register(dict, Z_VT_STRING, "server_ssl_ciphersuites",
+                         Z_VF_RW | Z_VF_CONSUME,
+                         self->ssl_opts.ssl_ciphersuites[EP_SERVER]);
   z_policy_dict_register(dict, Z_VT_INT, "server_check_subject", Z_VF_RW,
                          &self->ssl_opts.server_check_subject);
+  z_policy_dict_register(dict, Z_VT_INT, "server_session_cache", Z_VF_RW,
+                         &self->ssl_opts.server_session_cache);
   z_policy_dict_register(dict, Z_VT_INT, "disable_renegotiation", Z_VF_RW,
                          &self->ssl_opts.disable_renegotiation);
 }
@@ -256,6 +302,8 @@ z_policy_encryption_set_config_defaults(ZPolicyEncryption *self)
 {
   self->ssl_client_context = NULL;
   self->ssl_server_context = NULL;
+  self->ticket_key_manager = NULL;
+  self->random_ticket_key_manager = NULL;
 
   self->ssl_opts.handshake_timeout = 30000;
   self->ssl_opts.handshake_seq = PROXY_SSL_HS_CLIENT_SERVER;
@@ -272,11 +320,16 @@ z_policy_encryption_set_config_defaults(ZPolicyEncryption *self)
       self->ssl_opts.handshake_hash[side] = g_hash_table_new(g_str_hash, g_str_equal);
       //self->ssl_opts.ssl_cipher[side] = g_string_new("ALL:!aNULL:@STRENGTH");
       self->ssl_opts.ssl_cipher[side] = g_string_new("HIGH:!aNULL:@STRENGTH");
+      self->ssl_opts.ssl_ciphersuites[side] = g_string_new("TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256");
       self->ssl_opts.disable_proto_tlsv1[side] = FALSE;
       self->ssl_opts.disable_proto_tlsv1_1[side] = FALSE;
       self->ssl_opts.disable_proto_tlsv1_2[side] = FALSE;
+      self->ssl_opts.disable_proto_tlsv1_3[side] = FALSE;
       self->ssl_opts.keypair_generate[side] = FALSE;
+      self->ssl_opts.keybridge[side] = z_policy_none_ref();
+      self->keybridge[side] = nullptr;
       self->ssl_opts.disable_compression[side] = FALSE;
+      self->ssl_opts.enable_ktls[side] = FALSE;
     }
 
   self->ssl_opts.cipher_server_preference = FALSE;
@@ -289,7 +342,11 @@ z_policy_encryption_set_config_defaults(ZPolicyEncryption *self)
   self->ssl_opts.client_verify_cert_cb = NULL;
 
   self->ssl_opts.server_check_subject = TRUE;
+  self->ssl_opts.server_session_cache = TRUE;
   self->ssl_opts.disable_renegotiation = TRUE;
+  self->ssl_opts.num_session_tickets = 2;
+  self->ssl_opts.session_ticket_key_file = g_string_new("");
+  self->ssl_opts.session_ticket_key_lifetime = 3600;
   self->ssl_opts.ca_hint_directory = g_string_new("");
 
   self->ssl_opts.ssl_dict = z_policy_dict_new();
@@ -305,8 +362,11 @@ z_policy_encryption_init_instance(ZPolicyEncryption *self, PyObject *args, PyObj
   encryption_security_type client_security = ENCRYPTION_SEC_NONE;
   encryption_security_type server_security = ENCRYPTION_SEC_NONE;
 
+  static gint instance_count;
+
   self->ssl_client_context_timeout = 300;
   self->ssl_server_context_timeout = 300;
+  self->instance_id = g_atomic_int_add(&instance_count, 1);
 
   const gchar *keywords[] = {
                         "client_security", "server_security",
@@ -366,6 +426,9 @@ z_policy_encryption_setup_ctx_options(ZPolicyEncryption *self, SSL_CTX *ctx, ZEn
                       (self->ssl_opts.disable_proto_tlsv1[side] ? SSL_OP_NO_TLSv1 : 0) |
                       (self->ssl_opts.disable_proto_tlsv1_1[side] ? SSL_OP_NO_TLSv1_1 : 0) |
                       (self->ssl_opts.disable_proto_tlsv1_2[side] ? SSL_OP_NO_TLSv1_2 : 0) |
+#ifdef TLS1_3_VERSION
+                      (self->ssl_opts.disable_proto_tlsv1_3[side] ? SSL_OP_NO_TLSv1_3 : 0) |
+#endif
                       (self->ssl_opts.disable_compression[side] ? SSL_OP_NO_COMPRESSION : 0);
 
   SSL_CTX_set_options(ctx, options);
@@ -432,12 +495,76 @@ z_policy_encryption_set_dh_params(SSL_CTX *ctx, const ZProxySsl &ssl_opts)
     throw_openssl_error<std::invalid_argument>();
 }
 
+static inline bool
+z_policy_encryption_is_tlsv1_3(const SSL *ssl)
+{
+#ifdef TLS1_3_VERSION
+  return SSL_version(ssl) == TLS1_3_VERSION;
+#else
+  return false;
+#endif
+}
+
+#ifdef TLS1_3_VERSION
+/**
+ * Decide whether a session ticket sent by the client may be used.
+ *
+ * The key and certificate presented to the client are chosen for the
+ * server name it requested, thus a session is only resumed for the same
+ * name it was established for, otherwise a full handshake is done.  The
+ * server name is taken from the proxy, as for TLS 1.2 OpenSSL decrypts
+ * the ticket before parsing the SNI extension.
+ */
+static SSL_TICKET_RETURN
+z_policy_encryption_decrypt_session_ticket_cb(SSL *ssl, SSL_SESSION *session,
+                                              const unsigned char * /* keyname */, size_t /* keyname_length */,
+                                              SSL_TICKET_STATUS status, void * /* arg */)
+{
+  ZProxySSLHandshake *handshake = (ZProxySSLHandshake *) SSL_get_app_data(ssl);
+  ZProxy *self = handshake->proxy;
+  const char *server_name, *session_server_name;
+
+  switch (status)
+    {
+    case SSL_TICKET_SUCCESS:
+    case SSL_TICKET_SUCCESS_RENEW:
+      break;
+
+    case SSL_TICKET_EMPTY:
+    case SSL_TICKET_NO_DECRYPT:
+      return SSL_TICKET_RETURN_IGNORE_RENEW;
+
+    default:
+      return SSL_TICKET_RETURN_ABORT;
+    }
+
+  if (self->tls_opts.tlsext_server_host_name->len)
+    server_name = self->tls_opts.tlsext_server_host_name->str;
+  else
+    server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+  session_server_name = SSL_SESSION_get0_hostname(session);
+
+  if (g_strcmp0(server_name ? server_name : "", session_server_name ? session_server_name : "") != 0)
+    {
+      z_proxy_log(self, CORE_DEBUG, 6, "Not resuming TLS session established for a different server name; "
+                  "server_name='%s', session_server_name='%s'",
+                  server_name ? server_name : "", session_server_name ? session_server_name : "");
+      return SSL_TICKET_RETURN_IGNORE_RENEW;
+    }
+
+  return status == SSL_TICKET_SUCCESS_RENEW ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
+}
+#endif
+
 static void
 z_policy_encryption_info_callback(const SSL *ssl, int where, int  /* rc */)
 {
     ZProxySSLHandshake *handshake = (ZProxySSLHandshake *) SSL_get_app_data(ssl);
 
-    if ((where & SSL_CB_HANDSHAKE_START) && handshake->completed)
+    /* TLS 1.3 has no renegotiation, the callback is called there for
+       post-handshake messages like KeyUpdate */
+    if ((where & SSL_CB_HANDSHAKE_START) && handshake->completed && !z_policy_encryption_is_tlsv1_3(ssl))
       {
         z_proxy_log(handshake->proxy, CORE_ERROR, 3, "Client initiated renegotiation terminated; side='%s'",
                     EP_STR(handshake->side));
@@ -475,12 +602,37 @@ z_policy_encryption_setup_method(ZPolicyEncryption *self, PyObject * /* args */)
 
           Py_RETURN_FALSE;
         }
+
+#ifdef TLS1_3_VERSION
+      if (!SSL_CTX_set_ciphersuites(ctx, self->ssl_opts.ssl_ciphersuites[side]->str))
+        {
+          z_log(NULL, CORE_ERROR, 1, "Error setting TLSv1.3 ciphersuites; ciphersuites='%s', side='%s'",
+                      self->ssl_opts.ssl_ciphersuites[side]->str, EP_STR(side));
+
+          Py_RETURN_FALSE;
+        }
+#endif
+
       if (self->ssl_opts.disable_renegotiation && side == EP_CLIENT)
         SSL_CTX_set_info_callback(ctx, z_policy_encryption_info_callback);
 
       z_policy_encryption_setup_ctx_options(self, ctx, side);
       z_policy_encryption_setup_set_verify(self, ctx, side);
 
+      if (self->ssl_opts.keybridge[side] != z_policy_none)
+        {
+          if (!z_policy_keybridge_check(self->ssl_opts.keybridge[side]))
+            {
+              z_log(NULL, CORE_ERROR, 1, "Invalid keybridge, it must be a Zorp.Keybridge_.KeyBridge instance; side='%s'",
+                    EP_STR(side));
+              Py_RETURN_FALSE;
+            }
+
+          /* keep a reference of our own, the attribute can be changed by the policy anytime */
+          delete self->keybridge[side];
+          self->keybridge[side] = new std::shared_ptr<X509KeyBridge>(z_policy_keybridge_get_keybridge(self->ssl_opts.keybridge[side]));
+        }
+
       switch (side)
         {
         case EP_CLIENT:
@@ -495,6 +647,42 @@ z_policy_encryption_setup_method(ZPolicyEncryption *self, PyObject * /* args */)
                      EP_STR(side), e.what());
               Py_RETURN_FALSE;
             }
+
+          if (self->ssl_opts.session_ticket_key_lifetime <= 0)
+            {
+              z_log(NULL, CORE_ERROR, 1, "Invalid session ticket key lifetime; lifetime='%d'",
+                    self->ssl_opts.session_ticket_key_lifetime);
+              Py_RETURN_FALSE;
+            }
+
+          if (self->ssl_opts.session_ticket_key_file->len == 0)
+            {
+              /* random keys are private to this instance, tickets must not
+               * be accepted by the contexts of other services */
+              if (!self->random_ticket_key_manager)
+                self->random_ticket_key_manager = new SessionTicketKeyManager("", self->ssl_opts.session_ticket_key_lifetime);
+              else
+                self->random_ticket_key_manager->set_lifetime(self->ssl_opts.session_ticket_key_lifetime);
+
+              self->ticket_key_manager = self->random_ticket_key_manager;
+            }
+          else
+            {
+              self->ticket_key_manager = SessionTicketKeyManager::get_instance(self->ssl_opts.session_ticket_key_file->str,
+                                                                               self->ssl_opts.session_ticket_key_lifetime);
+              if (!self->ticket_key_manager->load())
+                {
+                  /* load() already logged */
+                  Py_RETURN_FALSE;
+                }
+            }
+
+          SSL_CTX_set_tlsext_ticket_key_cb(ctx, SessionTicketKeyManager::ticket_key_cb);
+
+#ifdef TLS1_3_VERSION
+          SSL_CTX_set_num_tickets(ctx, MAX(self->ssl_opts.num_session_tickets, 0));
+          SSL_CTX_set_session_ticket_cb(ctx, nullptr, z_policy_encryption_decrypt_session_ticket_cb, nullptr);
+#endif
         break;
 
         case EP_SERVER:
@@ -603,6 +791,68 @@ z_policy_encryption_type_check(PyObject *ob)
          PyType_IsSubtype(ob->ob_type, &z_policy_encryption_type);
 }
 
+static void
+z_policy_encryption_append_cert_digest(std::string &key, X509 *cert)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  gchar buf[3];
+
+  if (cert && X509_digest(cert, EVP_sha256(), md, &md_len))
+    {
+      for (unsigned int i = 0; i < md_len; i++)
+        {
+          g_snprintf(buf, sizeof(buf), "%02x", md[i]);
+          key += buf;
+        }
+    }
+}
+
+/**
+ * Compose the key of the server side TLS session cache.
+ *
+ * @param self          the proxy connecting to the server
+ *
+ * Sessions are shared between connections to the same server address
+ * requesting the same server name.  The verification settings and the
+ * client certificate come from the encryption policy, thus the key
+ * includes the policy instance.  Certificates generated for the server
+ * from the certificate of the client depend on the client as well, so its
+ * certificate is part of the key too, as is the client certificate the
+ * proxy selected for the server side.  A client certificate chosen by a
+ * setup_key callback is not known yet, such connections do not use the
+ * cache (see z_proxy_ssl_setup_handshake()).
+ *
+ * @return the cache key
+ */
+std::string
+z_policy_encryption_get_server_cache_key(ZProxy *self)
+{
+  std::string key = std::to_string(self->encryption->instance_id);
+  ZSockAddr *server_address = NULL;
+  gchar buf[128];
+
+  key += ':';
+  if (self->endpoints[EP_SERVER] &&
+      z_getpeername(z_stream_get_fd(self->endpoints[EP_SERVER]), &server_address, 0) == G_IO_STATUS_NORMAL)
+    {
+      key += z_sockaddr_format(server_address, buf, sizeof(buf));
+      z_sockaddr_unref(server_address);
+    }
+
+  key += ':';
+  key += self->tls_opts.tlsext_server_host_name->str;
+
+  key += ':';
+  z_policy_encryption_append_cert_digest(key, self->tls_opts.peer_cert[EP_CLIENT]);
+
+  key += ':';
+  if (self->tls_opts.local_cert[EP_SERVER])
+    z_policy_encryption_append_cert_digest(key, z_certificate_chain_get_cert(self->tls_opts.local_cert[EP_SERVER]));
+
+  return key;
+}
+
 /**
  * z_policy_encryption_module_init:
  *
@@ -0,0 +1,248 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include <zorp/pykeybridge.h>
+#include <zorp/policy.h>
+
+#include <zorpll/log.h>
+
+#include <openssl/pem.h>
+#include <stdexcept>
+
+static void
+z_policy_keybridge_free(ZPolicyKeyBridge *self)
+{
+  delete self->keybridge;
+  PyObject_Del(self);
+}
+
+/**
+ * z_policy_keybridge_get_keypair_method:
+ * @self: this
+ * @args: Python args: trusted, certificate, session_id
+ *
+ * Return a (certificate, private key) tuple in PEM format, the
+ * certificate mimicking the certificate passed in @args.  The interpreter
+ * lock is released while the certificate is looked up or generated.
+ **/
+static PyObject *
+z_policy_keybridge_get_keypair_method(ZPolicyKeyBridge *self, PyObject *args)
+{
+  int trusted;
+  const gchar *cert_pem;
+  guint cert_pem_len;
+  const gchar *session_id = NULL;
+
+  if (!PyArg_ParseTuple(args, "is#|z", &trusted, &cert_pem, &cert_pem_len, &session_id))
+    return NULL;
+
+  BIO *bio = BIO_new_mem_buf(cert_pem, cert_pem_len);
+  X509 *orig_cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+
+  if (!orig_cert)
+    {
+      PyErr_SetString(PyExc_ValueError, "Certificate must be specified as string in PEM format.");
+      return NULL;
+    }
+
+  std::shared_ptr<X509KeyBridge> keybridge = *self->keybridge;
+  X509 *cert;
+
+  Py_BEGIN_ALLOW_THREADS
+  cert = keybridge->get_certificate(orig_cert, trusted, session_id);
+  Py_END_ALLOW_THREADS
+
+  X509_free(orig_cert);
+
+  if (!cert)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Error generating keybridged certificate.");
+      return NULL;
+    }
+
+  bio = BIO_new(BIO_s_mem());
+  PEM_write_bio_X509(bio, cert);
+  X509_free(cert);
+
+  gchar *mem;
+  long len = BIO_get_mem_data(bio, &mem);
+  const std::string &key_pem = keybridge->get_private_key_pem();
+
+  PyObject *res = Py_BuildValue("(s#s#)", mem, (gint) len, key_pem.data(), (gint) key_pem.size());
+  BIO_free(bio);
+
+  return res;
+}
+
+static PyMethodDef z_policy_keybridge_methods[] =
+{
+  { "getKeypair",  (PyCFunction) z_policy_keybridge_get_keypair_method, METH_VARARGS, NULL },
+  { NULL,          NULL, 0, NULL }   /* sentinel*/
+};
+
+static PyObject *
+z_policy_keybridge_getattr(PyObject *o, char *name)
+{
+  return Py_FindMethod(z_policy_keybridge_methods, o, name);
+}
+
+PyTypeObject z_policy_keybridge_type =
+{
+  PyObject_HEAD_INIT(&PyType_Type)
+  0,
+  "ZPolicyKeyBridge",                      /* tp_name */
+  sizeof(ZPolicyKeyBridge),                /* tp_basicsize */
+  0,                                       /* tp_itemsize */
+  (destructor) z_policy_keybridge_free,    /* tp_dealloc */
+  0,                                       /* tp_print */
+  z_policy_keybridge_getattr,              /* tp_getattr */
+  0,                                       /* tp_setattr */
+  0,                                       /* tp_compare */
+  0,                                       /* tp_repr */
+  0,                                       /* tp_as_number */
+  0,                                       /* tp_as_sequence */
+  0,                                       /* tp_as_mapping */
+  0,                                       /* tp_hash */
+  0,                                       /* tp_call */
+  0,                                       /* tp_str */
+  0,                                       /* tp_getattro */
+  0,                                       /* tp_setattro */
+  0,                                       /* tp_as_buffer */
+  0,                                       /* flags */
+  "ZPolicyKeyBridge class for Zorp",       /* docstring */
+  0, 0, 0, 0,
+  Z_PYTYPE_TRAILER
+};
+
+static gboolean
+z_policy_keybridge_parse_ca(PyObject *ca, std::string &cert_pem, std::string &key_pem, std::string &passphrase)
+{
+  const gchar *cert, *key, *pass = NULL;
+
+  if (!PyArg_ParseTuple(ca, "ss|z", &cert, &key, &pass))
+    {
+      PyErr_SetString(PyExc_ValueError, "CA must be a tuple of (certificate, private key, passphrase) in PEM format.");
+      return FALSE;
+    }
+
+  cert_pem = cert;
+  key_pem = key;
+  passphrase = pass ? pass : "";
+  return TRUE;
+}
+
+/**
+ * z_policy_keybridge_new_instance:
+ * @s: not used
+ * @args: Python args: key, key_passphrase, trusted_ca, untrusted_ca,
+ *        extension_whitelist, cache_directory, cache_size
+ *
+ * Constructor of Zorp.Keybridge_.KeyBridge.  Instances with the same
+ * arguments share their certificate cache, even across policy reloads.
+ *
+ * Returns:
+ * The new instance
+ **/
+static PyObject *
+z_policy_keybridge_new_instance(PyObject * /* s */, PyObject *args)
+{
+  X509KeyBridgeConfig config;
+  const gchar *key_pem, *key_passphrase, *cache_directory;
+  PyObject *trusted_ca, *untrusted_ca, *extension_whitelist;
+  int cache_size;
+
+  if (!PyArg_ParseTuple(args, "szOOOzi", &key_pem, &key_passphrase, &trusted_ca, &untrusted_ca,
+                        &extension_whitelist, &cache_directory, &cache_size))
+    return NULL;
+
+  if (cache_size <= 0)
+    {
+      PyErr_SetString(PyExc_ValueError, "Cache size must be positive.");
+      return NULL;
+    }
+
+  config.key_pem = key_pem;
+  config.key_passphrase = key_passphrase ? key_passphrase : "";
+  config.cache_directory = cache_directory ? cache_directory : "";
+  config.cache_size = cache_size;
+
+  if (!z_policy_keybridge_parse_ca(trusted_ca, config.trusted_ca_cert_pem, config.trusted_ca_key_pem,
+                                   config.trusted_ca_passphrase))
+    return NULL;
+
+  if (untrusted_ca != Py_None &&
+      !z_policy_keybridge_parse_ca(untrusted_ca, config.untrusted_ca_cert_pem, config.untrusted_ca_key_pem,
+                                   config.untrusted_ca_passphrase))
+    return NULL;
+
+  if (extension_whitelist != Py_None)
+    {
+      for (int i = 0; i < z_policy_seq_length(extension_whitelist); i++)
+        {
+          ZPolicyObj *element = z_policy_seq_getitem(extension_whitelist, i);
+          const gchar *extension = element ? PyString_AsString(element) : NULL;
+
+          if (extension)
+            config.extension_whitelist.emplace(extension);
+          z_policy_var_unref(element);
+
+          if (!extension)
+            {
+              PyErr_SetString(PyExc_ValueError, "extension_whitelist must contain strings");
+              return NULL;
+            }
+        }
+    }
+
+  std::shared_ptr<X509KeyBridge> keybridge;
+
+  try
+    {
+      keybridge = X509KeyBridge::get_instance(config);
+    }
+  catch (const std::exception &e)
+    {
+      PyErr_SetString(PyExc_ValueError, e.what());
+      return NULL;
+    }
+
+  ZPolicyKeyBridge *self = PyObject_New(ZPolicyKeyBridge, &z_policy_keybridge_type);
+  self->keybridge = new std::shared_ptr<X509KeyBridge>(keybridge);
+  return (PyObject *) self;
+}
+
+PyMethodDef z_policy_keybridge_funcs[] =
+{
+  { "KeyBridge",  z_policy_keybridge_new_instance, METH_VARARGS, NULL },
+  { NULL,         NULL, 0, NULL }   /* sentinel*/
+};
+
+/**
+ * z_policy_keybridge_module_init:
+ *
+ * Module initialisation
+ **/
+void
+z_policy_keybridge_module_init(void)
+{
+  Py_InitModule("Zorp.Keybridge_", z_policy_keybridge_funcs);
+}
@@ -38,8 +38,10 @@
 #include <zorp/pyproxy.h>
 #include <zorp/pysockaddr.h>
 #include <zorp/pyx509.h>
+#include <zorp/pykeybridge.h>
 #include <zorp/pyproxygroup.h>
 #include <zorp/pyencryption.h>
+#include <zorp/szig.h>
 
 /* for capability management */
 #include <zorpll/cap.h>
@@ -593,6 +595,7 @@ z_policy_call(PyObject *handler, const char *name, PyObject *args, gboolean *cal
 {
   PyObject *attr;
   PyObject *res;
+  gint64 call_start, profile_start;
 
   z_enter();
   g_assert(PyThreadState_GET());
@@ -616,7 +619,11 @@ z_policy_call(PyObject *handler, const char *name, PyObject *args, gboolean *cal
     {
       if (called)
         *called = TRUE;
+      call_start = g_get_monotonic_time();
+      profile_start = z_policy_profile_start();
       res = z_policy_call_object(attr, args, session_id);
+      z_szig_histogram_add("policy_call", (glong) (g_get_monotonic_time() - call_start));
+      z_policy_profile_event(name, profile_start);
       z_trace(NULL, "Function called; name='%s'", name);
       Py_XDECREF(attr);
     }
@@ -729,10 +736,17 @@ struct _ZPolicyThread
   gboolean startable:1, used:1;
   GMutex   startable_lock;
   GCond    startable_signal;
+  /* interpreter lock profiling */
+  gchar   *profile_name;
+  guint    profile_counter;
+  gint64   profile_acquired;  /* time the current hold started, 0 if it is not sampled */
 };
 
 GPrivate policy_thread = G_PRIVATE_INIT(NULL);
 
+/* profile every Nth interpreter lock acquisition of a thread, 0 disables profiling */
+gint z_policy_profile_sample = 0;
+
 static gboolean z_policy_purge(ZPolicy *self);
 
 /**
@@ -767,6 +781,82 @@ z_policy_thread_wait(ZPolicyThread *self)
   g_mutex_unlock(&self->startable_lock);
 }
 
+/**
+ * z_policy_profile_record:
+ * @metric: histogram family (gil_wait, gil_hold or policy_event)
+ * @profile_name: name of the owner of the policy thread, e.g. the proxy class
+ * @event: policy event name or NULL
+ * @elapsed: measured time in microseconds
+ *
+ * Publishes a profiling sample as stats.latency.<metric>.<profile_name>[.<event>].
+ */
+static void
+z_policy_profile_record(const gchar *metric, const gchar *profile_name, const gchar *event, gint64 elapsed)
+{
+  gchar name[256];
+
+  if (event)
+    g_snprintf(name, sizeof(name), "%s.%s.%s", metric, profile_name, event);
+  else
+    g_snprintf(name, sizeof(name), "%s.%s", metric, profile_name);
+  z_szig_histogram_add(name, (glong) elapsed);
+}
+
+/**
+ * z_policy_thread_set_profile_name:
+ * @self: this
+ * @name: name to attribute the interpreter lock profile of this thread to
+ *
+ * Interpreter lock wait and hold times are only profiled for threads
+ * having a profile name, see z_policy_profile_sample.
+ */
+void
+z_policy_thread_set_profile_name(ZPolicyThread *self, const gchar *name)
+{
+  g_free(self->profile_name);
+  self->profile_name = g_strdup(name);
+}
+
+/**
+ * z_policy_profile_start:
+ *
+ * Start timing a policy event if the current interpreter lock hold is
+ * being profiled. Must be called with the interpreter lock held.
+ *
+ * Returns:
+ * the start timestamp to pass to z_policy_profile_event(), 0 if the event
+ * is not profiled
+ */
+gint64
+z_policy_profile_start(void)
+{
+  ZPolicyThread *self = z_policy_thread_self();
+
+  if (!self || !self->profile_acquired)
+    return 0;
+  return g_get_monotonic_time();
+}
+
+/**
+ * z_policy_profile_event:
+ * @event: name of the policy event
+ * @start: value returned by z_policy_profile_start()
+ *
+ * Record the time spent in the policy event @event.
+ */
+void
+z_policy_profile_event(const gchar *event, gint64 start)
+{
+  ZPolicyThread *self;
+
+  if (!start)
+    return;
+
+  self = z_policy_thread_self();
+  if (self && self->profile_name)
+    z_policy_profile_record("policy_event", self->profile_name, event, g_get_monotonic_time() - start);
+}
+
 /**
  * z_policy_thread_acquire:
  * @self: this
@@ -778,11 +868,23 @@ z_policy_thread_wait(ZPolicyThread *self)
 void
 z_policy_thread_acquire(ZPolicyThread *self)
 {
+  gint64 wait_start = 0;
+
   z_policy_thread_wait(self);
 
   g_private_set(&policy_thread, self);
+  if (z_policy_profile_sample > 0 && self->profile_name &&
+      ++self->profile_counter % z_policy_profile_sample == 0)
+    wait_start = g_get_monotonic_time();
+
   PyEval_AcquireThread(self->thread);
 
+  if (wait_start)
+    {
+      self->profile_acquired = g_get_monotonic_time();
+      z_policy_profile_record("gil_wait", self->profile_name, NULL, self->profile_acquired - wait_start);
+    }
+
   /* NOTE: this is currently a warning, but it'd probably make sense to
    * actually exclude parallel execution in the same thread by using a mutex
    * in ZPolicyThread. However as this is a risky change at 3.1.x, x >= 14 I
@@ -807,6 +909,12 @@ z_policy_thread_acquire(ZPolicyThread *self)
 void
 z_policy_thread_release(ZPolicyThread *self)
 {
+  if (self->profile_acquired)
+    {
+      z_policy_profile_record("gil_hold", self->profile_name, NULL, g_get_monotonic_time() - self->profile_acquired);
+      self->profile_acquired = 0;
+    }
+
   self->used = FALSE;
   PyEval_ReleaseThread(self->thread);
   g_private_set(&policy_thread, NULL);
@@ -915,6 +1023,7 @@ z_policy_thread_destroy(ZPolicyThread *self)
     }
   g_mutex_clear(&self->startable_lock);
   g_cond_clear(&self->startable_signal);
+  g_free(self->profile_name);
   g_free(self);
 }
 
@@ -1117,6 +1226,7 @@ z_policy_boot(ZPolicy *self)
   z_policy_sockaddr_module_init();
   z_policy_proxy_group_module_init();
   z_policy_zorp_certificate_module_init();
+  z_policy_keybridge_module_init();
   z_policy_encryption_module_init();
 
 
@@ -108,14 +108,15 @@ static ZPolicyObj *
 z_policy_proxy_group_new_instance(PyObject * /* o */, PyObject *args)
 {
   gint max_sessions;
+  gint threads = 0;
   ZProxyGroup *proxy_group;
   ZPolicyDict *dict;
   ZPolicyObj *res;
 
-  if (!PyArg_Parse(args, "(i)", &max_sessions))
+  if (!PyArg_ParseTuple(args, "i|i", &max_sessions, &threads))
     return NULL;
 
-  proxy_group = z_proxy_group_new(max_sessions);
+  proxy_group = z_proxy_group_new(max_sessions, threads);
 
   dict = z_policy_dict_new();
 
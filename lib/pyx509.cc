@@ -23,6 +23,7 @@
 #include <zorp/pyx509.h>
 #include <zorp/zpython.h>
 #include <zorp/pystruct.h>
+#include <zorp/x509keybridge.h>
 
 #include <zorpll/log.h>
 
@@ -145,49 +146,6 @@ z_py_zorp_certificate_free(ZorpCertificate *self)
   PyObject_Del(self);
 }
 
-static void
-zorp_certificate_delete_extensions(X509 *certificate, std::set<std::string> white_list_set)
-{
-  int extension_location = 0;
-  while (extension_location < X509_get_ext_count(certificate))
-    {
-      X509_EXTENSION *ext = X509_get_ext(certificate, extension_location);
-      ASN1_OBJECT *obj = X509_EXTENSION_get_object(ext);
-      std::string extension_name(OBJ_nid2sn(OBJ_obj2nid(obj)));
-
-      if (white_list_set.find(extension_name) == white_list_set.end())
-        {
-          X509_EXTENSION *return_ext = X509_delete_ext(certificate, extension_location);
-          X509_EXTENSION_free(return_ext);
-          extension_location--;
-        }
-      extension_location++;
-    }
-}
-
-static void
-zorp_certificate_fix_key_usage(X509 *certificate)
-{
-  ASN1_BIT_STRING *usage;
-  int usage_crit;
-  if ((usage = (ASN1_BIT_STRING *)X509_get_ext_d2i(certificate, NID_key_usage, &usage_crit, NULL)))
-    {
-      char16_t usage_data = 0;
-      if (usage->length > 0)
-        {
-          usage_data = usage->data[0];
-          if (usage->length > 1)
-          {
-            usage_data |= usage->data[1] << 8;
-          }
-        }
-      usage_data |= KU_KEY_ENCIPHERMENT | KU_DIGITAL_SIGNATURE;
-      unsigned char usage_data_bytes[2] = {(unsigned char)usage_data, (unsigned char)(usage_data >> 8)};
-      ASN1_OCTET_STRING_set(usage, usage_data_bytes, 2);
-      X509_add1_ext_i2d(certificate, NID_key_usage, usage, usage_crit, X509V3_ADD_REPLACE);
-    }
-}
-
 static ZPolicyObj *
 z_py_zorp_certificate_handle_extensions(gpointer user_data, ZPolicyObj *args, ZPolicyObj * /* kw */)
 {
@@ -274,7 +232,7 @@ PyMethodDef z_policy_zorp_certificate_funcs[] =
 /**
  * z_policy_zorp_certificate_module_init
  *
- * Module initialisation - This is used only in Keybridge.py to delete extensions
+ * Module initialisation - provides deleting extensions of certificates to the policy
  */
 void
 z_policy_zorp_certificate_module_init(void)
@@ -62,6 +62,16 @@
  *   thread is started, but a similar event can be generated when a new
  *   entry becomes available in the licensed IPs hash.
  *
+ *   Events are passed to the SZIG thread through per-thread, single
+ *   producer/single consumer rings, so generating an event never takes a
+ *   lock. Each event is stamped with a global sequence number, the SZIG
+ *   thread drains the rings in batches and processes the events in
+ *   sequence order, across all threads: an event is held back until all
+ *   the events with lower sequence numbers have been processed. If a ring
+ *   is full and the SZIG thread does not catch
+ *   up quickly, the event is dropped and counted in
+ *   stats.szig_events_dropped.
+ *
  * Data aggregation:
  *
  *   Aggregator functions are generic functions to be applied to events. When
@@ -156,10 +166,30 @@ typedef struct _ZSzigEventDesc
  **/
 typedef struct _ZSzigQueueItem
 {
+  guint seq;
   ZSzigEvent event;
   ZSzigValue *param;
 } ZSzigQueueItem;
 
+#define Z_SZIG_RING_SIZE    2048  /**< events buffered per thread, must be a power of 2 */
+#define Z_SZIG_RING_RETRIES  100  /**< times a producer yields to the SZIG thread before dropping an event */
+#define Z_SZIG_DRAIN_BATCH   256  /**< events taken from a single ring in one round */
+
+/**
+ * ZSzigRing:
+ *
+ * Event ring of a single thread. @head is only written by the owner
+ * thread, @tail only by the SZIG thread. @orphaned is set when the owner
+ * thread exits, the SZIG thread frees the ring once it is drained.
+ **/
+typedef struct _ZSzigRing
+{
+  ZSzigQueueItem items[Z_SZIG_RING_SIZE];
+  gint head;
+  gint tail;
+  gboolean orphaned;
+} ZSzigRing;
+
 /**
  * ZSzigConnection:
  *
@@ -179,8 +209,18 @@ static ZSzigNode *result_tree_root;
 /* protects tree structure changes (adding/removing nodes, but not value changes) */
 G_LOCK_DEFINE_STATIC(result_tree_structure_lock);
 G_LOCK_DEFINE_STATIC(result_node_gstring_lock);
-/* queue to serialize requests through */
-static GAsyncQueue *szig_queue = NULL;
+/* per-thread event rings */
+static gboolean szig_running = FALSE;
+static void z_szig_ring_orphan(gpointer r);
+static GPrivate szig_thread_ring = G_PRIVATE_INIT(z_szig_ring_orphan);
+static GList *szig_rings = NULL;
+G_LOCK_DEFINE_STATIC(szig_rings_lock);
+static guint szig_event_seq = 0;
+static gint szig_events_dropped = 0;
+/* the SZIG thread sleeps on this condition when all rings are empty */
+static GMutex szig_wait_lock;
+static GCond szig_wait_cond;
+static gint szig_thread_sleeping = FALSE;
 
 /* SZIG values */
 
@@ -1568,6 +1608,289 @@ z_szig_agr_flat_props(ZSzigNode *target_node, ZSzigEvent  /* ev */, ZSzigValue *
   z_return();
 }
 
+/**
+ * Number of buckets of a latency histogram.
+ *
+ * Values below Z_SZIG_HISTOGRAM_LINEAR get a bucket of their own, larger
+ * values are split into Z_SZIG_HISTOGRAM_SUB_BUCKETS buckets per power of
+ * two, which keeps the relative error of the reported percentiles below
+ * 12.5% over the whole glong range.
+ **/
+#define Z_SZIG_HISTOGRAM_LINEAR       16
+#define Z_SZIG_HISTOGRAM_SUB_BITS     3
+#define Z_SZIG_HISTOGRAM_SUB_BUCKETS  (1 << Z_SZIG_HISTOGRAM_SUB_BITS)
+#define Z_SZIG_HISTOGRAM_LINEAR_BITS  4
+#define Z_SZIG_HISTOGRAM_BUCKETS      (Z_SZIG_HISTOGRAM_LINEAR + (63 - Z_SZIG_HISTOGRAM_LINEAR_BITS) * Z_SZIG_HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * State of the histogram aggregator, stored in the node of the metric.
+ **/
+typedef struct _ZSzigHistogram
+{
+  guint64 count;
+  guint64 buckets[Z_SZIG_HISTOGRAM_BUCKETS];
+} ZSzigHistogram;
+
+/**
+ * Percentiles published for each histogram, in 1/10000 units.
+ **/
+static const struct
+{
+  const gchar *name;
+  guint64 rank;
+} z_szig_histogram_percentiles[] =
+{
+  { "p50",  5000 },
+  { "p90",  9000 },
+  { "p99",  9900 },
+  { "p999", 9990 },
+};
+
+/**
+ * Map a sample to the index of its histogram bucket.
+ *
+ * @param[in] value sample, negative values are counted as 0
+ **/
+static inline guint
+z_szig_histogram_bucket(glong value)
+{
+  guint64 v = value > 0 ? (guint64) value : 0;
+  guint msb;
+
+  if (v < Z_SZIG_HISTOGRAM_LINEAR)
+    return (guint) v;
+
+  msb = 63 - __builtin_clzll(v);
+  return Z_SZIG_HISTOGRAM_LINEAR +
+         (msb - Z_SZIG_HISTOGRAM_LINEAR_BITS) * Z_SZIG_HISTOGRAM_SUB_BUCKETS +
+         (guint) ((v >> (msb - Z_SZIG_HISTOGRAM_SUB_BITS)) & (Z_SZIG_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Return the largest value that falls into the given histogram bucket.
+ *
+ * @param[in] bucket bucket index
+ **/
+static inline glong
+z_szig_histogram_bucket_limit(guint bucket)
+{
+  guint msb, sub;
+  guint64 lower;
+
+  if (bucket < Z_SZIG_HISTOGRAM_LINEAR)
+    return bucket;
+
+  msb = (bucket - Z_SZIG_HISTOGRAM_LINEAR) / Z_SZIG_HISTOGRAM_SUB_BUCKETS + Z_SZIG_HISTOGRAM_LINEAR_BITS;
+  sub = (bucket - Z_SZIG_HISTOGRAM_LINEAR) % Z_SZIG_HISTOGRAM_SUB_BUCKETS;
+  lower = ((guint64) (Z_SZIG_HISTOGRAM_SUB_BUCKETS + sub)) << (msb - Z_SZIG_HISTOGRAM_SUB_BITS);
+  return (glong) MIN(lower + (G_GUINT64_CONSTANT(1) << (msb - Z_SZIG_HISTOGRAM_SUB_BITS)) - 1, (guint64) G_MAXLONG);
+}
+
+/**
+ * Free the state of a histogram, also used to recognize histogram nodes.
+ **/
+static void
+z_szig_histogram_free(gpointer data)
+{
+  g_free(data);
+}
+
+/**
+ * Record a sample in the histogram stored in a metric node, creating its
+ * percentile children when the metric is first seen.
+ *
+ * @param[in] metric node of the metric
+ * @param[in] value sample
+ *
+ * Must be called with result_tree_structure_lock held.
+ **/
+static void
+z_szig_histogram_record_node(ZSzigNode *metric, glong value)
+{
+  ZSzigHistogram *hist;
+  guint i;
+
+  hist = (ZSzigHistogram *) z_szig_node_get_data(metric);
+  if (!hist)
+    {
+      hist = g_new0(ZSzigHistogram, 1);
+      z_szig_node_set_data(metric, hist, z_szig_histogram_free);
+
+      z_szig_node_add_named_child(metric, "count")->value.type = Z_SZIG_TYPE_LONG;
+      for (i = 0; i < G_N_ELEMENTS(z_szig_histogram_percentiles); i++)
+        z_szig_node_add_named_child(metric, z_szig_histogram_percentiles[i].name)->value.type = Z_SZIG_TYPE_LONG;
+    }
+
+  hist->buckets[z_szig_histogram_bucket(value)]++;
+  hist->count++;
+}
+
+/**
+ * Record a sample in the histogram stored under a metric node, creating the
+ * node when the metric is first seen.
+ *
+ * @param[in] target_node node holding the metrics (e.g. stats.latency)
+ * @param[in] name name of the metric, dots separate nested levels
+ * @param[in] value sample
+ *
+ * Must be called with result_tree_structure_lock held.
+ **/
+static void
+z_szig_histogram_record(ZSzigNode *target_node, const gchar *name, glong value)
+{
+  ZSzigNode *metric = target_node;
+  gchar **components;
+  guint i;
+
+  components = g_strsplit(name, ".", 0);
+  for (i = 0; components[i]; i++)
+    metric = z_szig_node_add_named_child(metric, components[i]);
+  g_strfreev(components);
+
+  z_szig_histogram_record_node(metric, value);
+}
+
+/**
+ * Recalculate the count and percentile nodes of the histogram stored in
+ * @metric, or of the histograms below it.
+ **/
+static void
+z_szig_histogram_update(ZSzigNode *metric)
+{
+  ZSzigHistogram *hist;
+  guint64 seen;
+  guint i, bucket;
+
+  if (metric->agr_notify != z_szig_histogram_free)
+    {
+      for (i = 0; i < metric->children->len; i++)
+        z_szig_histogram_update((ZSzigNode *) metric->children->pdata[i]);
+      return;
+    }
+
+  hist = (ZSzigHistogram *) z_szig_node_get_data(metric);
+  if (!hist->count)
+    return;
+
+  z_szig_node_lookup_child(metric, "count", NULL)->value.u.long_value = (glong) hist->count;
+
+  seen = 0;
+  bucket = 0;
+  for (i = 0; i < G_N_ELEMENTS(z_szig_histogram_percentiles); i++)
+    {
+      guint64 rank = (hist->count * z_szig_histogram_percentiles[i].rank + 9999) / 10000;
+
+      while (bucket < Z_SZIG_HISTOGRAM_BUCKETS - 1 && seen + hist->buckets[bucket] < rank)
+        seen += hist->buckets[bucket++];
+
+      z_szig_node_lookup_child(metric, z_szig_histogram_percentiles[i].name, NULL)->value.u.long_value =
+        z_szig_histogram_bucket_limit(bucket);
+    }
+}
+
+/**
+ * z_szig_agr_histogram:
+ * @target_node: result node
+ * @ev: event, not used
+ * @p: event parameter, a props value named after the metric with a "value" prop
+ * @user_data: not used
+ *
+ * This aggregator adds the sample in @p to the histogram of the metric
+ * named in @p. The percentiles themselves are recalculated on every tick by
+ * z_szig_agr_histogram_percentiles().
+ **/
+static void
+z_szig_agr_histogram(ZSzigNode *target_node, ZSzigEvent  /* ev */, ZSzigValue *p, gpointer  /* user_data */)
+{
+  ZSzigProps *props;
+  gint i;
+
+  z_enter();
+  g_return_if_fail(p->type == Z_SZIG_TYPE_PROPS);
+  props = &p->u.props_value;
+
+  for (i = 0; i < props->value_count; i++)
+    {
+      if (strcmp(props->name_list[i], "value") == 0 && props->value_list[i]->type == Z_SZIG_TYPE_LONG)
+        {
+          G_LOCK(result_tree_structure_lock);
+          z_szig_histogram_record(target_node, props->name, z_szig_value_as_long(props->value_list[i]));
+          G_UNLOCK(result_tree_structure_lock);
+          break;
+        }
+    }
+  z_return();
+}
+
+/**
+ * z_szig_agr_histogram_percentiles:
+ * @target_node: result node, the parent of the metric nodes
+ * @ev: event, not used
+ * @p: event parameter, not used
+ * @user_data: not used
+ *
+ * This aggregator recalculates the count and percentile nodes of each
+ * histogram under @target_node. Percentiles are reported as the upper limit
+ * of the bucket they fall in.
+ **/
+static void
+z_szig_agr_histogram_percentiles(ZSzigNode *target_node, ZSzigEvent  /* ev */, ZSzigValue * /* p */, gpointer  /* user_data */)
+{
+  z_enter();
+  z_szig_histogram_update(target_node);
+  z_return();
+}
+
+/**
+ * z_szig_agr_connection_lifetime:
+ * @target_node: result node holding the latency histograms
+ * @ev: event, not used
+ * @p: event parameter, a connection props value of the stopping connection
+ * @user_data: not used
+ *
+ * This aggregator records the lifetime of a connection in the
+ * "connection_lifetime.<service>" histogram, based on the "started"
+ * property stored under conns. It has to run before
+ * z_szig_agr_del_connection_props() removes that property.
+ **/
+static void
+z_szig_agr_connection_lifetime(ZSzigNode *target_node, ZSzigEvent  /* ev */, ZSzigValue *p, gpointer  /* user_data */)
+{
+  ZSzigServiceProps *props;
+  ZSzigNode *node;
+  gchar buf[16];
+  gdouble started;
+
+  z_enter();
+  g_return_if_fail(p->type == Z_SZIG_TYPE_CONNECTION_PROPS);
+  props = &p->u.service_props;
+
+  node = z_szig_tree_lookup("conns", FALSE, NULL, NULL);
+  node = z_szig_node_lookup_child(node, props->name, NULL);
+  g_snprintf(buf, sizeof(buf), "%d", props->instance_id);
+  node = z_szig_node_lookup_child(node, buf, NULL);
+  g_snprintf(buf, sizeof(buf), "%d", props->sec_conn_id);
+  node = z_szig_node_lookup_child(node, buf, NULL);
+  g_snprintf(buf, sizeof(buf), "%d", props->related_id);
+  node = z_szig_node_lookup_child(node, buf, NULL);
+  node = z_szig_node_lookup_child(node, "started", NULL);
+
+  if (!node || node->value.type != Z_SZIG_TYPE_STRING)
+    z_return();
+
+  started = g_ascii_strtod(z_szig_value_as_string(&node->value), NULL);
+  if (started <= 0)
+    z_return();
+
+  G_LOCK(result_tree_structure_lock);
+  /* the service name may contain dots, it is a single level */
+  node = z_szig_node_add_named_child(target_node, "connection_lifetime");
+  node = z_szig_node_add_named_child(node, props->name);
+  z_szig_histogram_record_node(node, (glong) (g_get_real_time() - (gint64) (started * G_USEC_PER_SEC)));
+  G_UNLOCK(result_tree_structure_lock);
+  z_return();
+}
+
 /**
  * This function aggregates the results of z_szig_agr_maximum_diff for all services.
  **/
@@ -1672,37 +1995,121 @@ z_szig_event_get_desc(ZSzigEvent ev)
 }
 
 /**
- * z_szig_process_event:
+ * z_szig_ring_orphan:
+ * @r: ZSzigRing of the exiting thread
+ *
+ * GPrivate destructor, marks the ring of an exiting thread so that the
+ * SZIG thread frees it once it has been drained.
+ **/
+static void
+z_szig_ring_orphan(gpointer r)
+{
+  ZSzigRing *ring = (ZSzigRing *) r;
+
+  g_atomic_int_set(&ring->orphaned, TRUE);
+}
+
+/**
+ * z_szig_ring_get:
+ *
+ * Returns the event ring of the calling thread, creating and registering
+ * it on first use.
+ **/
+static ZSzigRing *
+z_szig_ring_get(void)
+{
+  ZSzigRing *ring = (ZSzigRing *) g_private_get(&szig_thread_ring);
+
+  if (G_UNLIKELY(!ring))
+    {
+      ring = g_new0(ZSzigRing, 1);
+      g_private_set(&szig_thread_ring, ring);
+      G_LOCK(szig_rings_lock);
+      szig_rings = g_list_prepend(szig_rings, ring);
+      G_UNLOCK(szig_rings_lock);
+    }
+  return ring;
+}
+
+/**
+ * z_szig_wakeup:
+ *
+ * Wake up the SZIG thread if it is waiting for events.
+ **/
+static inline void
+z_szig_wakeup(void)
+{
+  if (g_atomic_int_get(&szig_thread_sleeping))
+    {
+      g_mutex_lock(&szig_wait_lock);
+      g_cond_signal(&szig_wait_cond);
+      g_mutex_unlock(&szig_wait_lock);
+    }
+}
+
+/**
+ * z_szig_event:
  * @ev: szig event (Z_SZIG_*)
  * @param: a ZSzigValue parameter for event
  *
  * Main SZIG entry point used by various parts of Zorp to inform SZIG about
  * an interesting event. It can be called from all threads, information is
- * sent through a GAsyncQueue.
+ * sent through the event ring of the calling thread.
  **/
 void
 z_szig_event(ZSzigEvent ev, ZSzigValue *param)
 {
-  ZSzigQueueItem *q = g_new(ZSzigQueueItem, 1);
+  ZSzigRing *ring;
+  ZSzigQueueItem *q;
+  guint head;
+  gint retries = 0;
 
   z_enter();
-  q->event = ev;
-  q->param = param;
-  if (szig_queue)
+  if (!szig_running)
     {
-      static gint warn_counter = 1;
+      z_szig_value_free(param, TRUE);
+      z_return();
+    }
 
-      z_trace(NULL, "Sending szig event; object='%p'", q);
-      if (g_async_queue_length(szig_queue) > 1000 * warn_counter)
+  ring = z_szig_ring_get();
+  head = (guint) ring->head;
+  while (head - (guint) g_atomic_int_get(&ring->tail) >= Z_SZIG_RING_SIZE)
+    {
+      if (retries++ >= Z_SZIG_RING_RETRIES)
         {
-          z_log(NULL, CORE_ERROR, 1, "Internal error, SZIG queue overflow;");
-          warn_counter++;
+          g_atomic_int_inc(&szig_events_dropped);
+          z_szig_value_free(param, TRUE);
+          z_return();
         }
-      g_async_queue_push(szig_queue, q);
+      z_szig_wakeup();
+      g_thread_yield();
     }
+
+  q = &ring->items[head & (Z_SZIG_RING_SIZE - 1)];
+  q->seq = (guint) g_atomic_int_add((gint *) &szig_event_seq, 1);
+  q->event = ev;
+  q->param = param;
+  z_trace(NULL, "Sending szig event; object='%p'", q);
+  g_atomic_int_set(&ring->head, (gint) (head + 1));
+  z_szig_wakeup();
   z_return();
 }
 
+/**
+ * z_szig_histogram_add:
+ * @name: name of the histogram under stats.latency, dots separate nested levels
+ * @value: sample to record, in microseconds
+ *
+ * Record a latency sample, the percentiles of each histogram are published
+ * as stats.latency.<name>.{count,p50,p90,p99,p999}.
+ **/
+void
+z_szig_histogram_add(const gchar *name, glong value)
+{
+  z_szig_event(Z_SZIG_HISTOGRAM,
+               z_szig_value_new_props(name, "value", z_szig_value_new_long(value), NULL));
+}
+
 /**
  * z_szig_process_event:
  * @ev: szig event to handle
@@ -1802,25 +2209,174 @@ z_szig_tick_callback(GSource * /* source */)
   return TRUE;
 }
 
+/**
+ * z_szig_ring_drain:
+ * @ring: event ring
+ * @batch: array to append the events to
+ *
+ * Move the events currently available in @ring to @batch.
+ *
+ * Returns: TRUE if the ring became empty
+ **/
+static gboolean
+z_szig_ring_drain(ZSzigRing *ring, GArray *batch)
+{
+  guint tail = (guint) ring->tail;
+  guint head = (guint) g_atomic_int_get(&ring->head);
+  guint count = 0;
+
+  while (tail != head && count < Z_SZIG_DRAIN_BATCH)
+    {
+      g_array_append_val(batch, ring->items[tail & (Z_SZIG_RING_SIZE - 1)]);
+      tail++;
+      count++;
+    }
+  g_atomic_int_set(&ring->tail, (gint) tail);
+  return tail == head;
+}
+
+/**
+ * z_szig_rings_drain:
+ * @batch: array to append the events to
+ *
+ * Collect events from the ring of every thread and free the rings of
+ * exited threads once they are empty.
+ **/
+static void
+z_szig_rings_drain(GArray *batch)
+{
+  GList *p, *next;
+
+  G_LOCK(szig_rings_lock);
+  for (p = szig_rings; p; p = next)
+    {
+      ZSzigRing *ring = (ZSzigRing *) p->data;
+      gboolean orphaned = g_atomic_int_get(&ring->orphaned);
+
+      next = p->next;
+      if (z_szig_ring_drain(ring, batch) && orphaned)
+        {
+          szig_rings = g_list_delete_link(szig_rings, p);
+          g_free(ring);
+        }
+    }
+  G_UNLOCK(szig_rings_lock);
+}
+
+/**
+ * z_szig_rings_empty:
+ *
+ * Returns: TRUE if there are no pending events in any of the rings
+ **/
+static gboolean
+z_szig_rings_empty(void)
+{
+  gboolean empty = TRUE;
+  GList *p;
+
+  G_LOCK(szig_rings_lock);
+  for (p = szig_rings; p && empty; p = p->next)
+    {
+      ZSzigRing *ring = (ZSzigRing *) p->data;
+
+      empty = g_atomic_int_get(&ring->head) == ring->tail;
+    }
+  G_UNLOCK(szig_rings_lock);
+  return empty;
+}
+
+static gint
+z_szig_queue_item_compare(gconstpointer a, gconstpointer b)
+{
+  const ZSzigQueueItem *qa = (const ZSzigQueueItem *) a;
+  const ZSzigQueueItem *qb = (const ZSzigQueueItem *) b;
+
+  return (gint) (qa->seq - qb->seq);
+}
+
+/**
+ * z_szig_update_dropped:
+ * @node: the stats.szig_events_dropped node
+ *
+ * Publish the number of events dropped because of full rings.
+ **/
+static void
+z_szig_update_dropped(ZSzigNode *node)
+{
+  static gint warn_limit = 1;
+  gint dropped = g_atomic_int_get(&szig_events_dropped);
+
+  if (node->value.u.long_value == dropped)
+    return;
+
+  node->value.u.long_value = dropped;
+  if (dropped >= warn_limit)
+    {
+      /*LOG
+        This message indicates that SZIG events were generated faster than
+        the SZIG thread could process them and some of them were dropped.
+        The statistics published through SZIG may be inaccurate.
+       */
+      z_log(NULL, CORE_ERROR, 1, "Internal error, SZIG event ring overflow, events dropped; dropped='%d'", dropped);
+      while (warn_limit <= dropped)
+        warn_limit *= 2;
+    }
+}
+
 /**
  * z_szig_thread:
  * @st: thread parameter, not used
  *
  * This is the SZIG thread main function, it basically waits for and
  * processes SZIG events sent by z_szig_event().
+ *
+ * A producer publishes its event right after taking its sequence number,
+ * but another thread may publish a later one in between.  Events are
+ * processed only up to the first missing sequence number, the rest is
+ * kept for the next round.  Dropped events never take a sequence number,
+ * thus there is no permanent gap.
  **/
 static gpointer
 z_szig_thread(gpointer  /* st */)
 {
-  if (!szig_queue)
+  GArray *batch;
+  ZSzigNode *dropped_node;
+  guint next_seq = 0;
+  guint i;
+
+  if (!szig_running)
     return NULL;
+
+  batch = g_array_sized_new(FALSE, FALSE, sizeof(ZSzigQueueItem), Z_SZIG_DRAIN_BATCH);
+  dropped_node = z_szig_tree_lookup("stats.szig_events_dropped", FALSE, NULL, NULL);
   while (1)
     {
-      ZSzigQueueItem *q = (ZSzigQueueItem *) g_async_queue_pop(szig_queue);
+      z_szig_update_dropped(dropped_node);
+      z_szig_rings_drain(batch);
+      g_array_sort(batch, z_szig_queue_item_compare);
+
+      for (i = 0; i < batch->len; i++)
+        {
+          ZSzigQueueItem *q = &g_array_index(batch, ZSzigQueueItem, i);
+
+          if (q->seq != next_seq)
+            break;
+
+          z_trace(NULL, "Received szig event; object='%p'", q);
+          z_szig_process_event(q->event, q->param);
+          next_seq++;
+        }
+      g_array_remove_range(batch, 0, i);
 
-      z_trace(NULL, "Received szig event; object='%p'", q);
-      z_szig_process_event(q->event, q->param);
-      g_free(q);
+      if (i == 0)
+        {
+          g_mutex_lock(&szig_wait_lock);
+          g_atomic_int_set(&szig_thread_sleeping, TRUE);
+          if (z_szig_rings_empty())
+            g_cond_wait_until(&szig_wait_cond, &szig_wait_lock, g_get_monotonic_time() + G_TIME_SPAN_SECOND);
+          g_atomic_int_set(&szig_thread_sleeping, FALSE);
+          g_mutex_unlock(&szig_wait_lock);
+        }
     }
   return NULL;
 }
@@ -1857,6 +2413,328 @@ z_szig_node_print_full_name(gchar *buf, size_t buflen, gchar *prefix, ZSzigNode
     g_free(escaped_name);
 }
 
+/* OpenMetrics exposition */
+
+/**
+ * Describes how the LONG nodes of a subtree are exported as metrics.
+ *
+ * The first components below @path become the values of @labels, the
+ * remaining ones are appended to @prefix to form the metric name. Subtrees
+ * with a NULL @prefix are not exported by the generic walker.
+ **/
+typedef struct _ZSzigMetricsRule
+{
+  const gchar *path;
+  const gchar *prefix;
+  const gchar *labels[3];
+} ZSzigMetricsRule;
+
+static const ZSzigMetricsRule z_szig_metrics_rules[] =
+{
+  { "service",            "zorp_service",                { "service", NULL } },
+  { "stats",              "zorp",                        { NULL } },
+  { "stats.dispatch",     "zorp_dispatch",               { "bind", NULL } },
+  { "stats.proxy_groups", "zorp_proxy_group_sessions",   { "group", "worker", NULL } },
+  { "stats.latency",      "zorp_latency",                { NULL } },
+  { "stats.latency.gil_wait",     "zorp_latency_gil_wait",     { "proxy", NULL } },
+  { "stats.latency.gil_hold",     "zorp_latency_gil_hold",     { "proxy", NULL } },
+  { "stats.latency.policy_event", "zorp_latency_policy_event", { "proxy", "event", NULL } },
+  { "stats.latency.connection_lifetime", "zorp_latency_connection_lifetime", { "service", NULL } },
+};
+
+/**
+ * Nodes counting events since startup, these are exported as counters.
+ **/
+static const gchar *z_szig_metrics_counters[] =
+{
+  "thread_number",
+  "audit_number",
+  "session_number",
+  "szig_events_dropped",
+};
+
+static const ZSzigMetricsRule *
+z_szig_metrics_rule_lookup(const gchar *path)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(z_szig_metrics_rules); i++)
+    if (strcmp(z_szig_metrics_rules[i].path, path) == 0)
+      return &z_szig_metrics_rules[i];
+  return NULL;
+}
+
+static gboolean
+z_szig_metrics_is_counter(const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(z_szig_metrics_counters); i++)
+    if (strcmp(z_szig_metrics_counters[i], name) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+/**
+ * Append @name to a metric name, replacing characters not allowed in
+ * metric names by underscores.
+ **/
+static void
+z_szig_metrics_append_name(GString *s, const gchar *name)
+{
+  for (; *name; name++)
+    g_string_append_c(s, g_ascii_isalnum(*name) || *name == '_' || *name == ':' ? *name : '_');
+}
+
+/**
+ * Append a label to a comma separated label list, escaping its value.
+ **/
+static void
+z_szig_metrics_append_label(GString *labels, const gchar *label, const gchar *value)
+{
+  if (labels->len)
+    g_string_append_c(labels, ',');
+  g_string_append_printf(labels, "%s=\"", label);
+  for (; *value; value++)
+    {
+      if (*value == '\\' || *value == '"')
+        g_string_append_c(labels, '\\');
+      if (*value == '\n')
+        g_string_append(labels, "\\n");
+      else
+        g_string_append_c(labels, *value);
+    }
+  g_string_append_c(labels, '"');
+}
+
+/**
+ * Add a sample to a metric family, creating the family on first use so
+ * that samples of the same family are printed together.
+ *
+ * @param[in] families families collected so far, indexed by name
+ * @param[in] family name of the metric family
+ * @param[in] type OpenMetrics type of the family
+ * @param[in] suffix appended to the family name in the sample (e.g. "_total")
+ * @param[in] labels comma separated label list
+ * @param[in] value formatted sample value
+ **/
+static void
+z_szig_metrics_add_sample(GTree *families, const gchar *family, const gchar *type,
+                          const gchar *suffix, const gchar *labels, const gchar *value)
+{
+  GString *samples = (GString *) g_tree_lookup(families, family);
+
+  if (!samples)
+    {
+      samples = g_string_new("");
+      g_string_append_printf(samples, "# TYPE %s %s\n", family, type);
+      g_tree_insert(families, g_strdup(family), samples);
+    }
+
+  if (labels[0])
+    g_string_append_printf(samples, "%s%s{%s} %s\n", family, suffix, labels, value);
+  else
+    g_string_append_printf(samples, "%s%s %s\n", family, suffix, value);
+}
+
+/**
+ * Export the per-zone connection counters stored in the hash of @node.
+ **/
+static void
+z_szig_metrics_add_zones(GTree *families, ZSzigNode *node, GString *name, GString *labels)
+{
+  GHashTable *hash = (GHashTable *) z_szig_node_get_data(node);
+  GString *zone_labels = g_string_sized_new(labels->len + 32);
+  GHashTableIter iter;
+  gpointer key, value;
+  gchar buf[32];
+
+  g_hash_table_iter_init(&iter, hash);
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+      g_string_assign(zone_labels, labels->str);
+      z_szig_metrics_append_label(zone_labels, "zone", (const gchar *) key);
+      g_snprintf(buf, sizeof(buf), "%lu", *(gulong *) value);
+      z_szig_metrics_add_sample(families, name->str, "counter", "_total", zone_labels->str, buf);
+    }
+  g_string_free(zone_labels, TRUE);
+}
+
+/**
+ * Export the histogram stored in @node as a summary, in seconds.
+ **/
+static void
+z_szig_metrics_add_summary(GTree *families, ZSzigNode *node, GString *name, GString *labels)
+{
+  GString *family = g_string_new(name->str);
+  GString *quantile_labels = g_string_sized_new(labels->len + 32);
+  ZSzigNode *count;
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+  guint i;
+
+  count = z_szig_node_lookup_child(node, "count", NULL);
+  if (!count || !count->value.u.long_value)
+    goto exit;
+
+  g_string_append(family, "_seconds");
+  for (i = 0; i < G_N_ELEMENTS(z_szig_histogram_percentiles); i++)
+    {
+      ZSzigNode *percentile = z_szig_node_lookup_child(node, z_szig_histogram_percentiles[i].name, NULL);
+
+      g_string_assign(quantile_labels, labels->str);
+      z_szig_metrics_append_label(quantile_labels, "quantile",
+                                  g_ascii_formatd(buf, sizeof(buf), "%g", z_szig_histogram_percentiles[i].rank / 10000.0));
+      z_szig_metrics_add_sample(families, family->str, "summary", "", quantile_labels->str,
+                                g_ascii_formatd(buf, sizeof(buf), "%.6f", percentile->value.u.long_value / (gdouble) G_USEC_PER_SEC));
+    }
+
+  g_snprintf(buf, sizeof(buf), "%ld", count->value.u.long_value);
+  z_szig_metrics_add_sample(families, family->str, "summary", "_count", labels->str, buf);
+
+ exit:
+  g_string_free(family, TRUE);
+  g_string_free(quantile_labels, TRUE);
+}
+
+/**
+ * Export the value of @node and its children according to @rule.
+ *
+ * @param[in] families metric families collected so far
+ * @param[in] rule the rule of the subtree being walked
+ * @param[in] node current node
+ * @param[in] path full name of the parent of @node
+ * @param[in] name metric name derived from the path of the parent
+ * @param[in] labels labels derived from the path of the parent
+ * @param[in] depth depth of @node below the root of @rule
+ **/
+static void
+z_szig_metrics_walk(GTree *families, const ZSzigMetricsRule *rule, ZSzigNode *node,
+                    GString *path, GString *name, GString *labels, guint depth)
+{
+  gsize path_len = path->len, name_len = name->len, labels_len = labels->len;
+  const ZSzigMetricsRule *subtree_rule;
+  gchar buf[64];
+  guint i;
+
+  g_string_append_c(path, '.');
+  g_string_append(path, node->name);
+
+  subtree_rule = z_szig_metrics_rule_lookup(path->str);
+  if (subtree_rule && subtree_rule != rule)
+    goto exit;
+
+  if (depth < G_N_ELEMENTS(rule->labels) && rule->labels[depth])
+    {
+      z_szig_metrics_append_label(labels, rule->labels[depth], node->name);
+    }
+  else
+    {
+      g_string_append_c(name, '_');
+      z_szig_metrics_append_name(name, node->name);
+    }
+
+  if (node->agr_notify == z_szig_histogram_free)
+    {
+      z_szig_metrics_add_summary(families, node, name, labels);
+      goto exit;
+    }
+
+  switch (node->value.type)
+    {
+    case Z_SZIG_TYPE_LONG:
+      g_snprintf(buf, sizeof(buf), "%ld", node->value.u.long_value);
+      if (z_szig_metrics_is_counter(node->name))
+        z_szig_metrics_add_sample(families, name->str, "counter", "_total", labels->str, buf);
+      else
+        z_szig_metrics_add_sample(families, name->str, "gauge", "", labels->str, buf);
+      break;
+
+    case Z_SZIG_TYPE_TIME:
+      g_snprintf(buf, sizeof(buf), "%ld.%06ld", node->value.u.time_value.tv_sec, node->value.u.time_value.tv_usec);
+      z_szig_metrics_add_sample(families, name->str, "gauge", "", labels->str, buf);
+      break;
+
+    case Z_SZIG_TYPE_STRING:
+      /* per-zone connection counters keep their state in a hash */
+      if (node->agr_notify == z_hash_table_free)
+        z_szig_metrics_add_zones(families, node, name, labels);
+      break;
+
+    default:
+      break;
+    }
+
+  for (i = 0; i < node->children->len; i++)
+    z_szig_metrics_walk(families, rule, (ZSzigNode *) node->children->pdata[i], path, name, labels, depth + 1);
+
+ exit:
+  g_string_truncate(path, path_len);
+  g_string_truncate(name, name_len);
+  g_string_truncate(labels, labels_len);
+}
+
+static gboolean
+z_szig_metrics_append_family(gpointer  /* key */, gpointer value, gpointer user_data)
+{
+  g_string_append_len((GString *) user_data, ((GString *) value)->str, ((GString *) value)->len);
+  return FALSE;
+}
+
+static void
+z_szig_metrics_free_family(gpointer value)
+{
+  g_string_free((GString *) value, TRUE);
+}
+
+/**
+ * z_szig_metrics_format:
+ * @out: the exposition is appended to this string
+ *
+ * Serialize the aggregated SZIG tree in OpenMetrics text format in a single
+ * pass. Services, dispatchers and proxy group workers are exported as
+ * labels, the latency histograms as summaries. Per-connection information
+ * under "conns" and string values are not exported.
+ **/
+void
+z_szig_metrics_format(GString *out)
+{
+  GTree *families;
+  GString *path, *name, *labels;
+  ZSzigNode *root;
+  guint i, j;
+
+  families = g_tree_new_full((GCompareDataFunc) strcmp, NULL, g_free, z_szig_metrics_free_family);
+  path = g_string_sized_new(128);
+  name = g_string_sized_new(128);
+  labels = g_string_sized_new(128);
+
+  G_LOCK(result_tree_structure_lock);
+  for (i = 0; i < G_N_ELEMENTS(z_szig_metrics_rules); i++)
+    {
+      const ZSzigMetricsRule *rule = &z_szig_metrics_rules[i];
+
+      if (!rule->prefix || !(root = z_szig_tree_lookup(rule->path, FALSE, NULL, NULL)))
+        continue;
+
+      for (j = 0; j < root->children->len; j++)
+        {
+          g_string_assign(path, rule->path);
+          g_string_assign(name, rule->prefix);
+          g_string_truncate(labels, 0);
+          z_szig_metrics_walk(families, rule, (ZSzigNode *) root->children->pdata[j], path, name, labels, 0);
+        }
+    }
+  G_UNLOCK(result_tree_structure_lock);
+
+  g_tree_foreach(families, z_szig_metrics_append_family, out);
+  g_string_append(out, "# EOF\n");
+
+  g_tree_destroy(families);
+  g_string_free(path, TRUE);
+  g_string_free(name, TRUE);
+  g_string_free(labels, TRUE);
+}
+
 /**
  * z_szig_handle_command:
  * @conn: ZSzigConnection instance
@@ -2028,6 +2906,17 @@ z_szig_handle_command(ZSzigConnection *conn, gchar *cmd_line)
           g_strlcpy(response, "FAIL Unknown RELOAD subcommand", sizeof(response));
         }
     }
+  else if (strcmp(cmd, "METRICS") == 0)
+    {
+      GString *metrics = g_string_sized_new(sizeof(response));
+      GIOStatus res;
+
+      z_szig_metrics_format(metrics);
+      g_strfreev(argv);
+      res = z_stream_write_buf(conn->stream, metrics->str, metrics->len, TRUE, FALSE);
+      g_string_free(metrics, TRUE);
+      z_return(res == G_IO_STATUS_NORMAL);
+    }
   else if (strcmp(cmd, "COREDUMP") == 0)
     {
       if (z_coredump_create() < 0)
@@ -2154,7 +3043,10 @@ z_szig_init(const gchar *instance_name)
 
   result_tree_root = z_szig_node_new(instance_name);
   memset(event_desc, 0, sizeof(event_desc));
-  szig_queue = g_async_queue_new();
+  g_mutex_init(&szig_wait_lock);
+  g_cond_init(&szig_wait_cond);
+  szig_running = TRUE;
+  z_szig_tree_lookup("stats.szig_events_dropped", TRUE, NULL, NULL)->value.type = Z_SZIG_TYPE_LONG;
 
   z_szig_register_handler(Z_SZIG_CONNECTION_START, z_szig_agr_count_inc, "stats.sessions_running", NULL);
   z_szig_register_handler(Z_SZIG_CONNECTION_STOP, z_szig_agr_count_dec, "stats.sessions_running", NULL);
@@ -2169,6 +3061,7 @@ z_szig_init(const gchar *instance_name)
   z_szig_register_handler(Z_SZIG_TICK, z_szig_agr_average_rate, "stats.thread_rate_avg15", "stats.thread_number");
   z_szig_register_handler(Z_SZIG_TICK, z_szig_agr_maximum_diff, "stats.thread_rate_max", "stats.thread_number");
   z_szig_register_handler(Z_SZIG_CONNECTION_PROPS, z_szig_agr_flat_connection_props, "conns", NULL);
+  z_szig_register_handler(Z_SZIG_CONNECTION_STOP, z_szig_agr_connection_lifetime, "stats.latency", NULL);
   z_szig_register_handler(Z_SZIG_CONNECTION_STOP, z_szig_agr_del_connection_props, "conns", NULL);
 
   z_szig_register_handler(Z_SZIG_SERVICE_COUNT, z_szig_agr_flat_props, "service", NULL);
@@ -2184,6 +3077,15 @@ z_szig_init(const gchar *instance_name)
 
   z_szig_register_handler(Z_SZIG_RELOAD, z_szig_agr_flat_props, "info", NULL);
 
+  z_szig_register_handler(Z_SZIG_PROXY_GROUP_WORKERS, z_szig_agr_flat_props, "stats.proxy_groups", NULL);
+  z_szig_register_handler(Z_SZIG_PROXY_THREAD_POOL, z_szig_agr_flat_props, "stats", NULL);
+  z_szig_register_handler(Z_SZIG_DISPATCH_QUEUE, z_szig_agr_flat_props, "stats.dispatch", NULL);
+  z_szig_register_handler(Z_SZIG_CONNECTION_POOL, z_szig_agr_flat_props, "stats.connection_pool", NULL);
+  z_szig_register_handler(Z_SZIG_SSL_SESSION_CACHE, z_szig_agr_flat_props, "stats.ssl_session_cache", NULL);
+  z_szig_register_handler(Z_SZIG_KEYBRIDGE_CACHE, z_szig_agr_flat_props, "stats.keybridge_cache", NULL);
+  z_szig_register_handler(Z_SZIG_HISTOGRAM, z_szig_agr_histogram, "stats.latency", NULL);
+  z_szig_register_handler(Z_SZIG_TICK, z_szig_agr_histogram_percentiles, "stats.latency", NULL);
+
 
   /* we need an offset of 2 to count the number of threads that were started before SZIG init */
   z_szig_thread_started(NULL, NULL);
@@ -0,0 +1,308 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *
+ ***************************************************************************/
+#include <zorp/ticket_key_manager.h>
+#include <zorp/pyencryption.h>
+#include <zorpll/log.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+
+/*
+ * Session ticket keys of the client side SSL contexts.
+ *
+ * The keys are either read from a key file, or generated randomly.  The
+ * key file consists of 48 byte records, each holding a key name, an HMAC
+ * secret and an AES key of 16 bytes (the format used by nginx).  The
+ * first key encrypts new tickets, all of them decrypt.  The file is
+ * checked for changes every few seconds, so the keys can be rotated by
+ * rewriting it, and all processes using the same file accept each other's
+ * tickets.  Keys removed from the file are still accepted for the key
+ * lifetime, so that tickets issued just before the rotation remain usable.
+ *
+ * Without a key file a random key is generated, replaced when it is older
+ * than the key lifetime and accepted for another key lifetime after that.
+ *
+ * There is one manager for each key file in the process, kept across
+ * policy reloads, so tickets remain valid after a reload too.  Random keys
+ * are never shared: each Encryption policy has a manager of its own, so
+ * that a ticket issued by one service cannot be used to resume a session
+ * at another one with a different certificate or verification policy.
+ */
+
+static std::array<unsigned char, 16>
+session_ticket_key_part(const unsigned char *data)
+{
+  std::array<unsigned char, 16> part;
+
+  std::copy(data, data + part.size(), part.begin());
+  return part;
+}
+
+SessionTicketKeyManager::SessionTicketKeyManager(const std::filesystem::path &key_file, int lifetime, int check_interval)
+  : key_file(key_file), lifetime(lifetime), check_interval(check_interval),
+    next_check(SessionTicketKey::time_point::min())
+{
+}
+
+/**
+ * Get the manager of a key file, shared by all the SSL contexts using it.
+ *
+ * @param key_file      the session ticket key file
+ * @param lifetime      lifetime of the keys in seconds
+ *
+ * @return the manager of @key_file
+ */
+SessionTicketKeyManager *
+SessionTicketKeyManager::get_instance(const std::string &key_file, int lifetime)
+{
+  static std::mutex instances_lock;
+  static std::map<std::string, std::unique_ptr<SessionTicketKeyManager>> instances;
+
+  std::lock_guard<std::mutex> guard(instances_lock);
+  std::unique_ptr<SessionTicketKeyManager> &instance = instances[key_file];
+
+  if (!instance)
+    instance.reset(new SessionTicketKeyManager(key_file, lifetime));
+  else
+    instance->set_lifetime(lifetime);
+
+  return instance.get();
+}
+
+void
+SessionTicketKeyManager::set_lifetime(int lifetime)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  this->lifetime = std::chrono::seconds(lifetime);
+}
+
+/**
+ * Load the keys right away, without waiting for the next check.
+ *
+ * @return false if the key file cannot be read or is malformed
+ */
+bool
+SessionTicketKeyManager::load()
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (key_file.empty())
+    return true;
+
+  next_check = std::chrono::steady_clock::now() + check_interval;
+  return load_key_file();
+}
+
+SessionTicketKey *
+SessionTicketKeyManager::find_encryption_key()
+{
+  if (keys.empty() || !keys.front().can_be_used_to_encrypt())
+    return nullptr;
+
+  return &keys.front();
+}
+
+SessionTicketKey *
+SessionTicketKeyManager::find_decryption_key(const std::array<unsigned char, 16> &key_name)
+{
+  for (SessionTicketKey &key : keys)
+    {
+      if (key.find_key(key_name) && key.can_be_used_to_decrypt())
+        return &key;
+    }
+
+  return nullptr;
+}
+
+bool
+SessionTicketKeyManager::load_key_file()
+{
+  std::error_code error_code;
+  std::filesystem::file_time_type modification = std::filesystem::last_write_time(key_file, error_code);
+
+  if (error_code)
+    {
+      z_log(NULL, CORE_ERROR, 3, "Error accessing session ticket key file; filename='%s', error='%s'",
+            key_file.c_str(), error_code.message().c_str());
+      return false;
+    }
+
+  if (!keys.empty() && modification == last_modification)
+    return true;
+
+  std::ifstream stream(key_file, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+  if (data.empty() || data.size() % key_record_size != 0)
+    {
+      z_log(NULL, CORE_ERROR, 3, "Invalid session ticket key file, it must contain %zu byte records; filename='%s', size='%zu'",
+            key_record_size, key_file.c_str(), data.size());
+      return false;
+    }
+
+  last_modification = modification;
+
+  SessionTicketKey::time_point now = std::chrono::steady_clock::now();
+  std::deque<SessionTicketKey> loaded;
+
+  for (size_t offset = 0; offset < data.size(); offset += key_record_size)
+    {
+      const unsigned char *record = reinterpret_cast<const unsigned char *>(data.data()) + offset;
+
+      loaded.emplace_back(session_ticket_key_part(record + 16), session_ticket_key_part(record + 32),
+                          session_ticket_key_part(record),
+                          offset == 0 ? SessionTicketKey::time_point::max() : SessionTicketKey::time_point::min(),
+                          SessionTicketKey::time_point::max());
+    }
+
+  /* keys removed from the file are accepted for a while */
+  for (SessionTicketKey &key : keys)
+    {
+      std::array<unsigned char, 16> key_name = session_ticket_key_part(key.get_key_name());
+      bool in_file = std::any_of(loaded.begin(), loaded.end(),
+                                 [&key_name](SessionTicketKey &other) { return other.find_key(key_name); });
+
+      if (!in_file && key.can_be_used_to_decrypt())
+        {
+          key.expire_at(SessionTicketKey::time_point::min(), now + lifetime);
+          loaded.push_back(key);
+        }
+    }
+
+  keys.swap(loaded);
+
+  /*LOG
+    This message reports that the session ticket keys were (re)loaded from
+    the key file.
+   */
+  z_log(NULL, CORE_INFO, 4, "Session ticket keys loaded; filename='%s', keys='%zu'",
+        key_file.c_str(), data.size() / key_record_size);
+  return true;
+}
+
+void
+SessionTicketKeyManager::rotate_random_key()
+{
+  std::array<unsigned char, 16> key_name, hmac_key, aes_key;
+
+  if (RAND_bytes(key_name.data(), key_name.size()) <= 0 ||
+      RAND_bytes(hmac_key.data(), hmac_key.size()) <= 0 ||
+      RAND_bytes(aes_key.data(), aes_key.size()) <= 0)
+    {
+      z_log(NULL, CORE_ERROR, 3, "Error generating session ticket key;");
+      return;
+    }
+
+  keys.emplace_front(hmac_key, aes_key, key_name, static_cast<int>(lifetime.count()));
+  z_log(NULL, CORE_DEBUG, 6, "Session ticket key rotated;");
+}
+
+/* NOTE: must be called with the lock held */
+void
+SessionTicketKeyManager::refresh()
+{
+  SessionTicketKey::time_point now = std::chrono::steady_clock::now();
+
+  if (key_file.empty())
+    {
+      if (!find_encryption_key())
+        rotate_random_key();
+    }
+  else if (now >= next_check)
+    {
+      next_check = now + check_interval;
+      load_key_file();
+    }
+
+  keys.erase(std::remove_if(keys.begin(), keys.end(),
+                            [](SessionTicketKey &key) { return !key.can_be_used_to_decrypt(); }),
+             keys.end());
+}
+
+/**
+ * Set up the cipher and HMAC contexts protecting a session ticket.
+ *
+ * @param key_name      name of the key, filled in when @enc is set
+ * @param iv            IV of the ticket, filled in when @enc is set
+ * @param cipher_ctx    cipher context to set up
+ * @param hmac_ctx      HMAC context to set up
+ * @param enc           whether a ticket is encrypted or decrypted
+ *
+ * @return the value expected from the ticket key callback of OpenSSL: 1
+ * on success, 2 if the ticket should be renewed, 0 if there is no usable
+ * key and -1 on error
+ */
+int
+SessionTicketKeyManager::setup_ticket_crypto(unsigned char *key_name, unsigned char *iv,
+                                             EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, bool enc)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  SessionTicketKey *key;
+
+  refresh();
+
+  if (enc)
+    {
+      key = find_encryption_key();
+      if (!key)
+        return 0;
+
+      if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) <= 0)
+        return -1;
+
+      memcpy(key_name, key->get_key_name(), 16);
+
+      if (!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key->get_aes_key(), iv) ||
+          !HMAC_Init_ex(hmac_ctx, key->get_hmac_key(), 16, EVP_sha256(), NULL))
+        return -1;
+
+      return 1;
+    }
+
+  key = find_decryption_key(session_ticket_key_part(key_name));
+  if (!key)
+    return 0;
+
+  if (!HMAC_Init_ex(hmac_ctx, key->get_hmac_key(), 16, EVP_sha256(), NULL) ||
+      !EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key->get_aes_key(), iv))
+    return -1;
+
+  /* tickets of keys not encrypting anymore are replaced */
+  return key->can_be_used_to_encrypt() ? 1 : 2;
+}
+
+int
+SessionTicketKeyManager::ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                       EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+{
+  ZPolicyEncryption *encryption = static_cast<ZPolicyEncryption *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+
+  if (!encryption || !encryption->ticket_key_manager)
+    return 0;
+
+  return encryption->ticket_key_manager->setup_ticket_crypto(key_name, iv, cipher_ctx, hmac_ctx, enc);
+}
@@ -0,0 +1,373 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include <zorp/tlshello.h>
+
+/*
+ * Parser of the TLS ClientHello message, used to find out the requested
+ * server name (and whatever else the policy is interested in) before
+ * the handshake is started.  Every length field is checked against the
+ * enclosing one, the input is never read beyond @length.
+ *
+ * Running out of data in the record header or the record body is
+ * reported as Z_TLS_HELLO_INCOMPLETE, so that the caller can read more
+ * data.  The ClientHello has to fit into the first record, a malformed
+ * or fragmented message is reported as Z_TLS_HELLO_INVALID.
+ */
+
+#define Z_TLS_CONTENT_TYPE_HANDSHAKE            0x16
+#define Z_TLS_HANDSHAKE_TYPE_CLIENT_HELLO       0x01
+#define Z_TLS_HELLO_RANDOM_LEN                  32
+#define Z_TLS_HELLO_SESSION_ID_MAX_LEN          32
+
+#define Z_TLS_EXTENSION_SERVER_NAME             0
+#define Z_TLS_EXTENSION_ALPN                    16
+#define Z_TLS_EXTENSION_SUPPORTED_VERSIONS      43
+
+#define Z_TLS_SERVER_NAME_TYPE_HOST_NAME        0
+
+typedef struct _ZTlsReader
+{
+  const guchar *data;
+  gsize length;
+  gsize offset;
+} ZTlsReader;
+
+static inline void
+z_tls_reader_init(ZTlsReader *self, const guchar *data, gsize length)
+{
+  self->data = data;
+  self->length = length;
+  self->offset = 0;
+}
+
+static inline gsize
+z_tls_reader_remaining(const ZTlsReader *self)
+{
+  return self->length - self->offset;
+}
+
+static gboolean
+z_tls_reader_get_uint(ZTlsReader *self, gsize size, guint *value)
+{
+  if (z_tls_reader_remaining(self) < size)
+    return FALSE;
+
+  *value = 0;
+  for (gsize i = 0; i < size; i++)
+    *value = (*value << 8) | self->data[self->offset + i];
+
+  self->offset += size;
+  return TRUE;
+}
+
+static gboolean
+z_tls_reader_skip(ZTlsReader *self, gsize size)
+{
+  if (z_tls_reader_remaining(self) < size)
+    return FALSE;
+
+  self->offset += size;
+  return TRUE;
+}
+
+/**
+ * z_tls_reader_get_vector:
+ * @self: reader
+ * @length_size: size of the length prefix in bytes
+ * @vector: reader initialized to the contents of the vector
+ *
+ * Read a variable length vector, @self is advanced past its end.
+ **/
+static gboolean
+z_tls_reader_get_vector(ZTlsReader *self, gsize length_size, ZTlsReader *vector)
+{
+  guint length;
+
+  if (!z_tls_reader_get_uint(self, length_size, &length) ||
+      z_tls_reader_remaining(self) < length)
+    return FALSE;
+
+  z_tls_reader_init(vector, self->data + self->offset, length);
+  self->offset += length;
+  return TRUE;
+}
+
+static inline gboolean
+z_tls_version_valid(guint version)
+{
+  return version >= 0x0301 && version <= 0x0304;
+}
+
+static gboolean
+z_tls_client_hello_parse_server_name(ZTlsClientHello *self, ZTlsReader *extension)
+{
+  ZTlsReader list, name;
+  guint name_type;
+
+  if (!z_tls_reader_get_vector(extension, 2, &list) || z_tls_reader_remaining(extension))
+    return FALSE;
+
+  while (z_tls_reader_remaining(&list))
+    {
+      if (!z_tls_reader_get_uint(&list, 1, &name_type) ||
+          !z_tls_reader_get_vector(&list, 2, &name))
+        return FALSE;
+
+      if (name_type != Z_TLS_SERVER_NAME_TYPE_HOST_NAME || self->server_name->len)
+        continue;
+
+      if (name.length == 0 || memchr(name.data, '\0', name.length))
+        return FALSE;
+
+      g_string_append_len(self->server_name, (const gchar *) name.data, name.length);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+z_tls_client_hello_parse_alpn(ZTlsClientHello *self, ZTlsReader *extension)
+{
+  ZTlsReader list, protocol;
+
+  if (!z_tls_reader_get_vector(extension, 2, &list) || z_tls_reader_remaining(extension))
+    return FALSE;
+
+  while (z_tls_reader_remaining(&list))
+    {
+      if (!z_tls_reader_get_vector(&list, 1, &protocol) || protocol.length == 0)
+        return FALSE;
+
+      g_ptr_array_add(self->alpn_protocols, g_strndup((const gchar *) protocol.data, protocol.length));
+    }
+
+  return TRUE;
+}
+
+static gboolean
+z_tls_client_hello_parse_supported_versions(ZTlsClientHello *self, ZTlsReader *extension)
+{
+  ZTlsReader list;
+  guint version;
+
+  if (!z_tls_reader_get_vector(extension, 1, &list) || z_tls_reader_remaining(extension) ||
+      list.length % 2)
+    return FALSE;
+
+  while (z_tls_reader_get_uint(&list, 2, &version))
+    {
+      guint16 value = version;
+      g_array_append_val(self->supported_versions, value);
+    }
+
+  return TRUE;
+}
+
+static ZTlsHelloParseResult
+z_tls_client_hello_parse_message(ZTlsClientHello *self, ZTlsReader *hello, const gchar **error)
+{
+  ZTlsReader session_id, cipher_suites, compression_methods, extensions, extension;
+  guint version, cipher_suite, extension_type;
+
+  if (!z_tls_reader_get_uint(hello, 2, &version) || !z_tls_version_valid(version))
+    {
+      *error = "TLS version cannot be parsed";
+      return Z_TLS_HELLO_INVALID;
+    }
+  self->legacy_version = version;
+
+  if (!z_tls_reader_skip(hello, Z_TLS_HELLO_RANDOM_LEN) ||
+      !z_tls_reader_get_vector(hello, 1, &session_id) ||
+      session_id.length > Z_TLS_HELLO_SESSION_ID_MAX_LEN)
+    {
+      *error = "Invalid session id";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  if (!z_tls_reader_get_vector(hello, 2, &cipher_suites) ||
+      cipher_suites.length == 0 || cipher_suites.length % 2)
+    {
+      *error = "Invalid cipher suite list";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  while (z_tls_reader_get_uint(&cipher_suites, 2, &cipher_suite))
+    {
+      guint16 value = cipher_suite;
+      g_array_append_val(self->cipher_suites, value);
+    }
+
+  if (!z_tls_reader_get_vector(hello, 1, &compression_methods) || compression_methods.length == 0)
+    {
+      *error = "Invalid compression method list";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  /* extensions are optional */
+  if (!z_tls_reader_remaining(hello))
+    return Z_TLS_HELLO_OK;
+
+  if (!z_tls_reader_get_vector(hello, 2, &extensions) || z_tls_reader_remaining(hello))
+    {
+      *error = "Invalid extension list";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  while (z_tls_reader_remaining(&extensions))
+    {
+      gboolean valid = TRUE;
+
+      if (!z_tls_reader_get_uint(&extensions, 2, &extension_type) ||
+          !z_tls_reader_get_vector(&extensions, 2, &extension))
+        {
+          *error = "Invalid extension";
+          return Z_TLS_HELLO_INVALID;
+        }
+
+      switch (extension_type)
+        {
+        case Z_TLS_EXTENSION_SERVER_NAME:
+          valid = z_tls_client_hello_parse_server_name(self, &extension);
+          break;
+
+        case Z_TLS_EXTENSION_ALPN:
+          valid = z_tls_client_hello_parse_alpn(self, &extension);
+          break;
+
+        case Z_TLS_EXTENSION_SUPPORTED_VERSIONS:
+          valid = z_tls_client_hello_parse_supported_versions(self, &extension);
+          break;
+
+        default:
+          break;
+        }
+
+      if (!valid)
+        {
+          *error = "Invalid extension";
+          return Z_TLS_HELLO_INVALID;
+        }
+    }
+
+  return Z_TLS_HELLO_OK;
+}
+
+ZTlsClientHello *
+z_tls_client_hello_new(void)
+{
+  ZTlsClientHello *self = g_new0(ZTlsClientHello, 1);
+
+  self->cipher_suites = g_array_new(FALSE, FALSE, sizeof(guint16));
+  self->supported_versions = g_array_new(FALSE, FALSE, sizeof(guint16));
+  self->alpn_protocols = g_ptr_array_new_with_free_func(g_free);
+  self->server_name = g_string_new("");
+  return self;
+}
+
+void
+z_tls_client_hello_free(ZTlsClientHello *self)
+{
+  g_array_free(self->cipher_suites, TRUE);
+  g_array_free(self->supported_versions, TRUE);
+  g_ptr_array_free(self->alpn_protocols, TRUE);
+  g_string_free(self->server_name, TRUE);
+  g_free(self);
+}
+
+/**
+ * z_tls_client_hello_parse:
+ * @self: ZTlsClientHello instance to store the result in
+ * @data: data received from the client
+ * @length: length of @data
+ * @error: set to the reason of the failure if Z_TLS_HELLO_INVALID is returned
+ *
+ * Parse the ClientHello message at the beginning of @data.  The previous
+ * contents of @self are discarded.
+ **/
+ZTlsHelloParseResult
+z_tls_client_hello_parse(ZTlsClientHello *self, const guchar *data, gsize length, const gchar **error)
+{
+  ZTlsReader input, record, hello;
+  guint content_type, version, record_length, handshake_type;
+  const gchar *dummy_error;
+
+  if (!error)
+    error = &dummy_error;
+
+  *error = NULL;
+  self->record_version = 0;
+  self->legacy_version = 0;
+  g_array_set_size(self->cipher_suites, 0);
+  g_array_set_size(self->supported_versions, 0);
+  g_ptr_array_set_size(self->alpn_protocols, 0);
+  g_string_truncate(self->server_name, 0);
+
+  z_tls_reader_init(&input, data, length);
+
+  if (!z_tls_reader_get_uint(&input, 1, &content_type))
+    return Z_TLS_HELLO_INCOMPLETE;
+
+  if (content_type != Z_TLS_CONTENT_TYPE_HANDSHAKE)
+    {
+      *error = "TLS content type is not HANDSHAKE";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  if (!z_tls_reader_get_uint(&input, 2, &version))
+    return Z_TLS_HELLO_INCOMPLETE;
+
+  if (!z_tls_version_valid(version))
+    {
+      *error = "TLS version cannot be parsed";
+      return Z_TLS_HELLO_INVALID;
+    }
+  self->record_version = version;
+
+  if (!z_tls_reader_get_uint(&input, 2, &record_length))
+    return Z_TLS_HELLO_INCOMPLETE;
+
+  if (record_length > Z_TLS_RECORD_MAX_LEN)
+    {
+      *error = "TLS record too long";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  if (z_tls_reader_remaining(&input) < record_length)
+    return Z_TLS_HELLO_INCOMPLETE;
+
+  z_tls_reader_init(&record, input.data + input.offset, record_length);
+
+  if (!z_tls_reader_get_uint(&record, 1, &handshake_type) ||
+      handshake_type != Z_TLS_HANDSHAKE_TYPE_CLIENT_HELLO)
+    {
+      *error = "TLS handshake type is not CLIENT_HELLO";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  if (!z_tls_reader_get_vector(&record, 3, &hello))
+    {
+      *error = "TLS ClientHello does not fit in the first record";
+      return Z_TLS_HELLO_INVALID;
+    }
+
+  return z_tls_client_hello_parse_message(self, &hello, error);
+}
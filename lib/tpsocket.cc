@@ -31,6 +31,10 @@
 
 #include <netinet/in.h>
 
+/* the ZSF_ flag space belongs to zorpll, thus SO_REUSEPORT is requested
+ * for the binds of the current thread separately */
+static GPrivate tp_socket_reuseport = G_PRIVATE_INIT(NULL);
+
 static gint
 z_do_ll_getdestname(gint fd, struct sockaddr *sa, socklen_t *salen, guint32  /* sock_flags */)
 {
@@ -61,6 +65,14 @@ z_do_tp40_bind(gint fd, struct sockaddr *sa, socklen_t salen, guint32 sock_flags
 #endif
 #endif
     }
+#ifdef SO_REUSEPORT
+  if (g_private_get(&tp_socket_reuseport))
+    {
+      /* bind fails with errno set by setsockopt */
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        z_return(-1);
+    }
+#endif
   res = z_do_ll_bind(fd, sa, salen, sock_flags);
   z_return(res);
 }
@@ -82,3 +94,16 @@ z_tp_socket_init(void)
   socket_funcs = &z_tp40_socket_funcs;
   return TRUE;
 }
+
+/**
+ * z_tp_socket_set_reuseport:
+ * @reuseport: whether to set SO_REUSEPORT
+ *
+ * Set SO_REUSEPORT on the sockets bound by the current thread until it is
+ * turned off again, so that several listeners can share an address.
+ **/
+void
+z_tp_socket_set_reuseport(gboolean reuseport)
+{
+  g_private_set(&tp_socket_reuseport, GINT_TO_POINTER(reuseport));
+}
@@ -0,0 +1,599 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+#include <zorp/x509keybridge.h>
+#include <zorp/szig.h>
+#include <zorpll/log.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Keybridging: certificates mimicking the certificate of the peer are
+ * generated with the public key of the keybridge key and signed by the
+ * trusted or the untrusted keybridge CA, depending on whether the
+ * certificate of the peer could be verified.
+ *
+ * Generated certificates are kept in an LRU cache indexed by the SHA256
+ * fingerprint of the original certificate.  The cache is split to
+ * shards, each with its own lock, so that threads looking up different
+ * certificates do not contend.  Certificates are generated without
+ * holding any of the locks, if two threads happen to generate the same
+ * certificate at the same time, the one inserted first is kept.
+ *
+ * If a cache directory is configured, the generated certificates are
+ * stored there as well, along with the original certificate, and are
+ * reused after restarts.  The file names and contents are the same as
+ * the ones of the former Python implementation.
+ *
+ * Serial numbers are made of a random 63 bit value chosen when the
+ * instance is created and a 32 bit counter, so they are unique without
+ * having to store the last serial anywhere.
+ *
+ * Instances with the same configuration are shared, so the cache is kept
+ * across policy reloads.
+ */
+
+static std::atomic<long> x509_keybridge_entries;
+static std::atomic<long> x509_keybridge_hits;
+static std::atomic<long> x509_keybridge_misses;
+static std::atomic<long> x509_keybridge_evicted;
+
+void
+zorp_certificate_delete_extensions(X509 *certificate, const std::set<std::string> &white_list_set)
+{
+  int extension_location = 0;
+  while (extension_location < X509_get_ext_count(certificate))
+    {
+      X509_EXTENSION *ext = X509_get_ext(certificate, extension_location);
+      ASN1_OBJECT *obj = X509_EXTENSION_get_object(ext);
+      std::string extension_name(OBJ_nid2sn(OBJ_obj2nid(obj)));
+
+      if (white_list_set.find(extension_name) == white_list_set.end())
+        {
+          X509_EXTENSION *return_ext = X509_delete_ext(certificate, extension_location);
+          X509_EXTENSION_free(return_ext);
+          extension_location--;
+        }
+      extension_location++;
+    }
+}
+
+void
+zorp_certificate_fix_key_usage(X509 *certificate)
+{
+  ASN1_BIT_STRING *usage;
+  int usage_crit;
+  if ((usage = (ASN1_BIT_STRING *)X509_get_ext_d2i(certificate, NID_key_usage, &usage_crit, NULL)))
+    {
+      char16_t usage_data = 0;
+      if (usage->length > 0)
+        {
+          usage_data = usage->data[0];
+          if (usage->length > 1)
+          {
+            usage_data |= usage->data[1] << 8;
+          }
+        }
+      usage_data |= KU_KEY_ENCIPHERMENT | KU_DIGITAL_SIGNATURE;
+      unsigned char usage_data_bytes[2] = {(unsigned char)usage_data, (unsigned char)(usage_data >> 8)};
+      ASN1_OCTET_STRING_set(usage, usage_data_bytes, 2);
+      X509_add1_ext_i2d(certificate, NID_key_usage, usage, usage_crit, X509V3_ADD_REPLACE);
+      ASN1_BIT_STRING_free(usage);
+    }
+}
+
+static std::string
+x509_keybridge_cert_to_pem(X509 *cert)
+{
+  BIO *bio = BIO_new(BIO_s_mem());
+  gchar *mem;
+  std::string pem;
+
+  if (PEM_write_bio_X509(bio, cert))
+    {
+      long len = BIO_get_mem_data(bio, &mem);
+      pem.assign(mem, len);
+    }
+
+  BIO_free(bio);
+  return pem;
+}
+
+static bool
+x509_keybridge_is_md5_signed(X509 *cert)
+{
+  int md_nid;
+
+  return OBJ_find_sigid_algs(X509_get_signature_nid(cert), &md_nid, nullptr) && md_nid == NID_md5;
+}
+
+/**
+ * x509_keybridge_report:
+ *
+ * Publish the cache statistics as stats.keybridge_cache.certificates.* in SZIG.
+ **/
+static void
+x509_keybridge_report()
+{
+  z_szig_event(Z_SZIG_KEYBRIDGE_CACHE,
+               z_szig_value_new_props("certificates",
+                                      "entries", z_szig_value_new_long(x509_keybridge_entries),
+                                      "hits", z_szig_value_new_long(x509_keybridge_hits),
+                                      "misses", z_szig_value_new_long(x509_keybridge_misses),
+                                      "evicted", z_szig_value_new_long(x509_keybridge_evicted),
+                                      NULL));
+}
+
+X509KeyBridge::X509KeyBridge(const X509KeyBridgeConfig &config)
+  : config(config), key(nullptr), serial_counter(0)
+{
+  try
+    {
+      BIO *bio = BIO_new_mem_buf(config.key_pem.data(), config.key_pem.size());
+      key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, const_cast<char *>(config.key_passphrase.c_str()));
+      BIO_free(bio);
+
+      if (!key)
+        throw std::invalid_argument("Error loading keybridge private key");
+
+      bio = BIO_new(BIO_s_mem());
+      if (PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr))
+        {
+          gchar *mem;
+          long len = BIO_get_mem_data(bio, &mem);
+          key_pem.assign(mem, len);
+        }
+      BIO_free(bio);
+
+      load_ca(trusted_ca, config.trusted_ca_cert_pem, config.trusted_ca_key_pem, config.trusted_ca_passphrase);
+      if (!config.untrusted_ca_cert_pem.empty())
+        load_ca(untrusted_ca, config.untrusted_ca_cert_pem, config.untrusted_ca_key_pem, config.untrusted_ca_passphrase);
+
+      if (config.cache_size == 0)
+        throw std::invalid_argument("Keybridge cache size must be positive");
+
+      unsigned char random[sizeof(serial_base)];
+      if (RAND_bytes(random, sizeof(random)) != 1)
+        throw std::runtime_error("Error generating keybridge serial number base");
+
+      serial_base = 0;
+      for (unsigned char byte : random)
+        serial_base = (serial_base << 8) | byte;
+      serial_base = (serial_base & INT64_MAX) | 1;
+    }
+  catch (...)
+    {
+      release();
+      throw;
+    }
+
+  shard_size = (config.cache_size + shard_count - 1) / shard_count;
+}
+
+X509KeyBridge::~X509KeyBridge()
+{
+  for (CacheShard &shard : shards)
+    {
+      for (auto &entry : shard.entries)
+        X509_free(entry.second);
+      x509_keybridge_entries -= shard.entries.size();
+    }
+
+  release();
+}
+
+void
+X509KeyBridge::release()
+{
+  for (CertificateAuthority *ca : {&trusted_ca, &untrusted_ca})
+    {
+      X509_free(ca->cert);
+      EVP_PKEY_free(ca->key);
+      ca->cert = nullptr;
+      ca->key = nullptr;
+    }
+
+  EVP_PKEY_free(key);
+  key = nullptr;
+}
+
+void
+X509KeyBridge::load_ca(CertificateAuthority &ca, const std::string &cert_pem,
+                       const std::string &key_pem, const std::string &passphrase)
+{
+  BIO *bio = BIO_new_mem_buf(cert_pem.data(), cert_pem.size());
+  ca.cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+
+  bio = BIO_new_mem_buf(key_pem.data(), key_pem.size());
+  ca.key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, const_cast<char *>(passphrase.c_str()));
+  BIO_free(bio);
+
+  if (!ca.cert || !ca.key)
+    throw std::invalid_argument("Error loading keybridge CA certificate or key");
+
+  ca.cert_pem = cert_pem;
+}
+
+/**
+ * X509KeyBridge::get_instance:
+ * @config: keybridge configuration
+ *
+ * Return the instance for @config, creating it if there is none yet.
+ * Throws std::invalid_argument if the keys or certificates cannot be
+ * loaded.
+ **/
+std::shared_ptr<X509KeyBridge>
+X509KeyBridge::get_instance(const X509KeyBridgeConfig &config)
+{
+  static std::mutex instances_lock;
+  static std::map<std::string, std::weak_ptr<X509KeyBridge>> instances;
+
+  std::string instance_key;
+  for (const std::string *field : {&config.key_pem, &config.key_passphrase,
+                                   &config.trusted_ca_cert_pem, &config.trusted_ca_key_pem, &config.trusted_ca_passphrase,
+                                   &config.untrusted_ca_cert_pem, &config.untrusted_ca_key_pem, &config.untrusted_ca_passphrase,
+                                   &config.cache_directory})
+    {
+      instance_key += std::to_string(field->size()) + ":" + *field;
+    }
+  for (const std::string &extension : config.extension_whitelist)
+    instance_key += std::to_string(extension.size()) + ":" + extension;
+  instance_key += std::to_string(config.cache_size);
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  EVP_Digest(instance_key.data(), instance_key.size(), digest, &digest_len, EVP_sha256(), nullptr);
+  instance_key.assign(reinterpret_cast<char *>(digest), digest_len);
+
+  std::lock_guard<std::mutex> guard(instances_lock);
+
+  for (auto it = instances.begin(); it != instances.end(); )
+    {
+      if (it->second.expired())
+        it = instances.erase(it);
+      else
+        ++it;
+    }
+
+  std::shared_ptr<X509KeyBridge> instance = instances[instance_key].lock();
+  if (!instance)
+    {
+      instance = std::make_shared<X509KeyBridge>(config);
+      instances[instance_key] = instance;
+    }
+
+  return instance;
+}
+
+X509 *
+X509KeyBridge::cache_lookup(CacheShard &shard, const std::string &fingerprint)
+{
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.index.find(fingerprint);
+
+  if (it == shard.index.end())
+    return nullptr;
+
+  shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+  X509_up_ref(it->second->second);
+  return it->second->second;
+}
+
+/**
+ * X509KeyBridge::cache_insert:
+ * @shard: cache shard of @fingerprint
+ * @fingerprint: cache key of the original certificate
+ * @cert: generated certificate, the reference is passed to the cache
+ *
+ * Insert @cert to the cache, evicting the least recently used
+ * certificates above the shard size.  Returns a new reference to the
+ * cached certificate, which is a different one than @cert if another
+ * thread inserted it first.
+ **/
+X509 *
+X509KeyBridge::cache_insert(CacheShard &shard, const std::string &fingerprint, X509 *cert)
+{
+  std::vector<X509 *> evicted_certs;
+  X509 *cached;
+
+  {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.index.find(fingerprint);
+
+    if (it != shard.index.end())
+      {
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        evicted_certs.push_back(cert);
+        cached = it->second->second;
+      }
+    else
+      {
+        shard.entries.emplace_front(fingerprint, cert);
+        shard.index.emplace(fingerprint, shard.entries.begin());
+        x509_keybridge_entries++;
+        cached = cert;
+
+        while (shard.entries.size() > shard_size)
+          {
+            evicted_certs.push_back(shard.entries.back().second);
+            shard.index.erase(shard.entries.back().first);
+            shard.entries.pop_back();
+            x509_keybridge_entries--;
+            x509_keybridge_evicted++;
+          }
+      }
+
+    X509_up_ref(cached);
+  }
+
+  for (X509 *evicted_cert : evicted_certs)
+    X509_free(evicted_cert);
+
+  return cached;
+}
+
+bool
+X509KeyBridge::allocate_serial(X509 *cert)
+{
+  uint32_t counter = ++serial_counter;
+  unsigned char serial_bytes[sizeof(serial_base) + sizeof(counter)];
+  size_t i = 0;
+
+  for (int shift = 56; shift >= 0; shift -= 8)
+    serial_bytes[i++] = serial_base >> shift;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    serial_bytes[i++] = counter >> shift;
+
+  BIGNUM *bn = BN_bin2bn(serial_bytes, sizeof(serial_bytes), nullptr);
+  ASN1_INTEGER *serial = bn ? BN_to_ASN1_INTEGER(bn, nullptr) : nullptr;
+  bool result = serial && X509_set_serialNumber(cert, serial);
+
+  ASN1_INTEGER_free(serial);
+  BN_free(bn);
+  return result;
+}
+
+X509 *
+X509KeyBridge::forge(X509 *orig_cert, const CertificateAuthority &ca, const char *session_id)
+{
+  X509 *cert = X509_dup(orig_cert);
+
+  if (!cert)
+    return nullptr;
+
+  if (!config.extension_whitelist.empty())
+    {
+      zorp_certificate_delete_extensions(cert, config.extension_whitelist);
+      zorp_certificate_fix_key_usage(cert);
+    }
+
+  if (!allocate_serial(cert) ||
+      !X509_set_issuer_name(cert, X509_get_subject_name(ca.cert)) ||
+      !X509_set_pubkey(cert, key))
+    {
+      X509_free(cert);
+      return nullptr;
+    }
+
+  /* sign with the digest of the original certificate if possible */
+  const EVP_MD *md = nullptr;
+  int md_nid;
+
+  if (OBJ_find_sigid_algs(X509_get_signature_nid(orig_cert), &md_nid, nullptr) && md_nid != NID_undef)
+    md = EVP_get_digestbynid(md_nid);
+
+  if (!md || !X509_sign(cert, ca.key, md))
+    {
+      /*LOG
+        This message indicates that the keybridged certificate could not be
+        signed with the hash algorithm of the original certificate, SHA256
+        is used instead.
+       */
+      z_log(session_id, CORE_INFO, 3, "Could not sign cert with hash algorithm, falling back to SHA256; hash_alg='%s'",
+            OBJ_nid2sn(X509_get_signature_nid(orig_cert)));
+      if (!X509_sign(cert, ca.key, EVP_sha256()))
+        {
+          X509_free(cert);
+          return nullptr;
+        }
+    }
+
+  return cert;
+}
+
+std::string
+X509KeyBridge::get_cache_file(const std::string &orig_pem, const CertificateAuthority &ca, bool trusted)
+{
+  std::string hash_key = orig_pem + ca.cert_pem + config.key_pem;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  gchar hex[EVP_MAX_MD_SIZE * 2 + 1];
+
+  EVP_Digest(hash_key.data(), hash_key.size(), digest, &digest_len, EVP_sha256(), nullptr);
+  for (unsigned int i = 0; i < digest_len; i++)
+    g_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+
+  return config.cache_directory + (trusted ? "/trusted-" : "/untrusted-") + hex + ".crt";
+}
+
+X509 *
+X509KeyBridge::load_cached(const std::string &cert_file, const std::string &orig_pem, X509 *orig_cert, const char *session_id)
+{
+  gchar *contents;
+  gsize length;
+  GError *error = nullptr;
+
+  z_log(session_id, CORE_DEBUG, 5, "Loading cached certificate; file='%s'", cert_file.c_str());
+
+  if (!g_file_get_contents((cert_file + ".orig").c_str(), &contents, &length, &error))
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Original keybridged certificate cannot be read, regenerating; file='%s', error='%s'",
+            cert_file.c_str(), error->message);
+      g_error_free(error);
+      return nullptr;
+    }
+
+  bool orig_matches = orig_pem.compare(0, std::string::npos, contents, length) == 0;
+  g_free(contents);
+
+  if (!orig_matches)
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Cached certificate changed, regenerating; file='%s'", cert_file.c_str());
+      return nullptr;
+    }
+
+  if (!g_file_get_contents(cert_file.c_str(), &contents, &length, &error))
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Cached certificate cannot be read, regenerating; file='%s', error='%s'",
+            cert_file.c_str(), error->message);
+      g_error_free(error);
+      return nullptr;
+    }
+
+  BIO *bio = BIO_new_mem_buf(contents, length);
+  X509 *cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  g_free(contents);
+
+  if (!cert)
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Cached certificate is not valid, regenerating; file='%s'", cert_file.c_str());
+      return nullptr;
+    }
+
+  /* Originally we signed every cert using md5, regardless of the server cert's algo.
+   * We regenerate every cert if the cached version uses md5 while the server cert uses a different algo. */
+  if (x509_keybridge_is_md5_signed(cert) && !x509_keybridge_is_md5_signed(orig_cert))
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Cached certificate is MD5 signed while server's certificate is not, regenerating; file='%s'",
+            cert_file.c_str());
+      X509_free(cert);
+      return nullptr;
+    }
+
+  z_log(session_id, CORE_DEBUG, 5, "Cached certificate ok, reusing; file='%s'", cert_file.c_str());
+  return cert;
+}
+
+void
+X509KeyBridge::store_cached(const std::string &cert_file, const std::string &orig_pem, X509 *cert, const char *session_id)
+{
+  std::string cert_pem = x509_keybridge_cert_to_pem(cert);
+  GError *error = nullptr;
+
+  z_log(session_id, CORE_DEBUG, 5, "Storing cached certificate; file='%s'", cert_file.c_str());
+
+  /* g_file_set_contents() replaces the files atomically, concurrent readers
+   * see either the old or the new contents */
+  if (!g_file_set_contents(cert_file.c_str(), cert_pem.data(), cert_pem.size(), &error) ||
+      !g_file_set_contents((cert_file + ".orig").c_str(), orig_pem.data(), orig_pem.size(), &error))
+    {
+      /*LOG
+        This message indicates that the keybridged certificate could not be
+        stored in the cache directory.  It is generated again after a restart.
+       */
+      z_log(session_id, CORE_ERROR, 2, "Error storing generated X.509 certificate in the cache; file='%s', error='%s'",
+            cert_file.c_str(), error->message);
+      g_error_free(error);
+    }
+}
+
+/**
+ * X509KeyBridge::get_certificate:
+ * @orig_cert: certificate of the peer
+ * @trusted: whether @orig_cert was verified successfully
+ * @session_id: session id used in log messages
+ *
+ * Return a certificate mimicking @orig_cert, signed by the trusted or the
+ * untrusted keybridge CA, with the public key of get_private_key().  The
+ * certificate is generated if it is found neither in the memory cache nor
+ * in the cache directory.  The caller owns the returned reference.
+ * Returns NULL on failure.
+ *
+ * NOTE: it does not call Python, it must be called without the
+ * interpreter lock held to let other threads proceed while generating.
+ **/
+X509 *
+X509KeyBridge::get_certificate(X509 *orig_cert, bool trusted, const char *session_id)
+{
+  const CertificateAuthority &ca = trusted ? trusted_ca : untrusted_ca;
+
+  if (!ca.cert)
+    {
+      z_log(session_id, CORE_ERROR, 3, "No keybridge CA configured for certificates; trusted='%d'", trusted);
+      return nullptr;
+    }
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+
+  if (!X509_digest(orig_cert, EVP_sha256(), digest, &digest_len))
+    return nullptr;
+
+  std::string fingerprint(1, trusted ? 't' : 'u');
+  fingerprint.append(reinterpret_cast<char *>(digest), digest_len);
+  CacheShard &shard = shards[digest[0] % shard_count];
+
+  X509 *cert = cache_lookup(shard, fingerprint);
+  if (cert)
+    {
+      x509_keybridge_hits++;
+      x509_keybridge_report();
+      return cert;
+    }
+
+  x509_keybridge_misses++;
+
+  std::string orig_pem, cert_file;
+  if (!config.cache_directory.empty())
+    {
+      orig_pem = x509_keybridge_cert_to_pem(orig_cert);
+      cert_file = get_cache_file(orig_pem, ca, trusted);
+      cert = load_cached(cert_file, orig_pem, orig_cert, session_id);
+    }
+
+  if (!cert)
+    {
+      z_log(session_id, CORE_DEBUG, 5, "Certificate not found in the cache, regenerating;");
+      cert = forge(orig_cert, ca, session_id);
+      if (!cert)
+        {
+          /*LOG
+            This message indicates that generating the keybridged
+            certificate failed.
+           */
+          z_log(session_id, CORE_ERROR, 3, "Error generating keybridged certificate; trusted='%d'", trusted);
+          return nullptr;
+        }
+
+      if (!config.cache_directory.empty())
+        store_cached(cert_file, orig_pem, cert, session_id);
+    }
+
+  cert = cache_insert(shard, fingerprint, cert);
+  x509_keybridge_report();
+  return cert;
+}
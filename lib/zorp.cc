@@ -26,6 +26,8 @@
 #include <zorp/zpython.h>
 #include <zorp/policy.h>
 #include <zorp/szig.h>
+#include <zorp/proxygroup.h>
+#include <zorp/proxythreadpool.h>
 
 #include <zorpll/blob.h>
 #include <zorpll/process.h>
@@ -98,6 +100,11 @@ z_read_global_params(ZPolicy *policy)
   z_policy_var_parse_size(z_global_getattr("config.blob.hiwat"), &z_blob_system_default_hiwat);
   z_policy_var_parse_size(z_global_getattr("config.blob.noswap_max"), &z_blob_system_default_noswap_max);
   z_policy_var_parse_boolean(z_global_getattr("config.options.kzorp_enabled"), &is_kzorp_enabled);
+  z_policy_var_parse_int(z_global_getattr("config.options.proxy_group_threads"), &z_proxy_group_default_threads);
+  z_policy_var_parse_int(z_global_getattr("config.options.proxy_threads_min"), &z_proxy_thread_pool_min_threads);
+  z_policy_var_parse_int(z_global_getattr("config.options.proxy_threads_max"), &z_proxy_thread_pool_max_threads);
+  z_policy_var_parse_int(z_global_getattr("config.options.proxy_threads_idle_timeout"), &z_proxy_thread_pool_idle_timeout);
+  z_policy_var_parse_int(z_global_getattr("config.options.policy_profile_sample"), &z_policy_profile_sample);
   z_policy_release_main(policy);
 }
 
@@ -206,6 +213,7 @@ z_main_loop(const gchar *policy_file, const gchar *instance_name,
 
   z_read_global_params(current_policy);
   z_blob_system_default_init();
+  z_proxy_thread_pool_init();
 
   z_generate_policy_load_event(policy_file, TRUE);
 
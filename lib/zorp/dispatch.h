@@ -52,6 +52,7 @@ typedef struct _ZDispatchCommonParams
   gboolean threaded;
   gboolean mark_tproxy;
   gboolean transparent;
+  gint accept_shards;  /* number of SO_REUSEPORT listeners with their own accept thread, 0 disables */
 } ZDispatchCommonParams;
 
 typedef struct _ZDispatchTCPParams
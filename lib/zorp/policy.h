@@ -50,6 +50,12 @@ ZPolicyThread *z_policy_thread_new(ZPolicy *policy);
 void z_policy_thread_destroy(ZPolicyThread *self);
 ZPolicyThread *z_policy_thread_self(void);
 ZPolicy *z_policy_thread_get_policy(ZPolicyThread *self);
+void z_policy_thread_set_profile_name(ZPolicyThread *self, const gchar *name);
+
+extern gint z_policy_profile_sample;
+
+gint64 z_policy_profile_start(void);
+void z_policy_profile_event(const gchar *event, gint64 start);
 
 ZPolicy *z_policy_ref(ZPolicy *self);
 
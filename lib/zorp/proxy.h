@@ -159,6 +159,13 @@ public:
 
   ZPolicyEncryption *encryption;
   ZProxyTls tls_opts;
+
+  /* parking request of the proxy, see z_proxy_park() */
+  struct ZProxyParkEntry *parking;
+
+  /* a nonblocking proxy temporarily running in a proxy thread, its
+   * proxy group worker leaves it alone until it returns */
+  gboolean offloaded;
 };
 
 extern ZClass ZProxy__class;
@@ -243,6 +250,7 @@ void z_proxy_set_group(ZProxy *self, ZProxyGroup *proxy_group);
 /* misc helper functions */
 gboolean z_proxy_set_server_address(ZProxy *self, const gchar *host, gint port);
 gint z_proxy_connect_server(ZProxy *self, const gchar *host, gint port);
+gboolean z_proxy_reuse_server(ZProxy *self, ZStream *stream, const gchar *host, gint port);
 gint z_proxy_user_authenticated(ZProxy *self, const gchar *entity, gchar const **groups, ZProxyUserAuthType type);
 
 /** Wrapper for z_proxy_user_authenticated() with the default #Z_PROXY_USER_AUTHENTICATED_INBAND parameter.
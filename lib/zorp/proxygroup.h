@@ -26,6 +26,8 @@
 #include <zorp/proxy.h>
 #include <zorpll/poll.h>
 
+extern gint z_proxy_group_default_threads;
+
 GMainContext *z_proxy_group_get_context(ZProxyGroup *self);
 ZPoll *z_proxy_group_get_poll(ZProxyGroup *self);
 gboolean z_proxy_group_start_session(ZProxyGroup *self, ZProxy *proxy);
@@ -33,7 +35,7 @@ void z_proxy_group_stop_session(ZProxyGroup *self, ZProxy *proxy);
 gboolean z_proxy_group_iteration(ZProxyGroup *self);
 void z_proxy_group_wakeup(ZProxyGroup *self);
 
-ZProxyGroup *z_proxy_group_new(gint max_session);
+ZProxyGroup *z_proxy_group_new(gint max_session, gint threads);
 void z_proxy_group_orphan(ZProxyGroup *self);
 ZProxyGroup *z_proxy_group_ref(ZProxyGroup *self);
 void z_proxy_group_unref(ZProxyGroup *self);
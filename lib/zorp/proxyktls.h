@@ -0,0 +1,50 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+
+#ifndef ZORP_PROXYKTLS_H_INCLUDED
+#define ZORP_PROXYKTLS_H_INCLUDED
+
+#include <zorp/proxy.h>
+
+#include <openssl/ssl.h>
+
+#define Z_KTLS_MAX_KEY_LEN 32
+#define Z_KTLS_MAX_IV_LEN 12
+#define Z_KTLS_SEQ_LEN 8
+
+/* record protection of one direction of a TLS 1.2 session */
+typedef struct _ZKtlsKeys
+{
+  guchar key[Z_KTLS_MAX_KEY_LEN];
+  gsize key_len;
+  /* the implicit part of the nonce: the salt of AES-GCM, the IV of ChaCha20-Poly1305 */
+  guchar iv[Z_KTLS_MAX_IV_LEN];
+  gsize iv_len;
+  /* sequence number of the first record after the handshake */
+  guchar rec_seq[Z_KTLS_SEQ_LEN];
+} ZKtlsKeys;
+
+gboolean z_ktls_derive_keys(SSL *ssl, gboolean server, ZKtlsKeys *tx, ZKtlsKeys *rx);
+
+gboolean z_proxy_ktls_offload(ZProxy *self, ZEndpoint side);
+
+#endif
@@ -0,0 +1,46 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_PROXYPARK_H_INCLUDED
+#define ZORP_PROXYPARK_H_INCLUDED
+
+#include <zorp/proxy.h>
+
+typedef enum
+{
+  Z_PROXY_PARK_READABLE,
+  Z_PROXY_PARK_TIMEOUT,
+  Z_PROXY_PARK_WAKEUP,
+} ZProxyParkEvent;
+
+typedef void (*ZProxyParkResumeFunc)(ZProxy *self, ZProxyParkEvent event);
+
+void z_proxy_park(ZProxy *self, ZStream *stream, gint timeout, ZProxyParkResumeFunc resume);
+gboolean z_proxy_park_commit(ZProxy *self);
+void z_proxy_park_wakeup(ZProxy *self);
+
+static inline gboolean
+z_proxy_park_requested(ZProxy *self)
+{
+  return self->parking != NULL;
+}
+
+#endif
@@ -83,6 +83,7 @@ ZPolicyObj *z_policy_dict_get_dict(ZPolicyDict *self);
 void  z_policy_dict_register(ZPolicyDict *self, ZVarType first_var, ...);
 void z_policy_dict_set_app_data(ZPolicyDict *self, gpointer data, GDestroyNotify data_free);
 gpointer z_policy_dict_get_app_data(ZPolicyDict *self);
+guint z_policy_dict_get_hash_generation(ZPolicyDict *self);
 void z_policy_dict_iterate(ZPolicyDict *self, ZPolicyDictIterFunc iter, gpointer user_data);
 
 ZPolicyDict *z_policy_dict_new(void);
@@ -33,6 +33,8 @@
 #include <map>
 #include <string>
 #include <zorp/x509lookup_crl_reloader.h>
+#include <zorp/ticket_key_manager.h>
+#include <zorp/x509keybridge.h>
 
 typedef enum
 {
@@ -52,49 +54,6 @@ typedef enum
   ENCRYPTION_VERIFY_REQUIRED_TRUSTED    = 4,
 } proxy_ssl_verify_type;
 
-class SessionTicketKey
-{
-public:
-  SessionTicketKey() : is_set(false)
-    {};
-  SessionTicketKey(const std::array<unsigned char, 16> &hmac_key, const std::array<unsigned char, 16> &aes_key, const std::array<unsigned char, 16> key_name, int timeout) : hmac_key(hmac_key), aes_key(aes_key), key_name(key_name), is_set(true)
-    {
-      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-      encrypt_expire_time = now + std::chrono::duration<int>(timeout);
-      decrypt_expire_time = now + std::chrono::duration<int>(timeout) + std::chrono::duration<int>(timeout);
-    };
-  bool can_be_used_to_encrypt()
-    {
-      return (is_set && encrypt_expire_time >= std::chrono::steady_clock::now());
-    }
-  bool can_be_used_to_decrypt()
-    {
-      return (is_set && decrypt_expire_time >= std::chrono::steady_clock::now());
-    }
-  unsigned char *get_key_name()
-    {
-      return key_name.data();
-    }
-  unsigned char *get_aes_key()
-    {
-      return aes_key.data();
-    }
-  unsigned char *get_hmac_key()
-    {
-      return hmac_key.data();
-    }
-  bool find_key(const std::array<unsigned char, 16> &other_key_name)
-    {
-      return key_name == other_key_name;
-    }
-private:
-  std::array<unsigned char, 16> hmac_key;
-  std::array<unsigned char, 16> aes_key;
-  std::array<unsigned char, 16> key_name;
-  std::chrono::steady_clock::time_point encrypt_expire_time, decrypt_expire_time;
-  bool is_set;
-};
-
 typedef struct _ZProxySsl {
   ZPolicyDict *ssl_dict;
   ZPolicyObj *ssl_struct;
@@ -102,6 +61,7 @@ typedef struct _ZProxySsl {
   encryption_security_type security[EP_MAX];
 
   GString *ssl_cipher[EP_MAX];
+  GString *ssl_ciphersuites[EP_MAX];
 
   ZPolicyObj *server_setup_key_cb, *server_verify_cert_cb;
   ZPolicyObj *client_setup_key_cb, *client_verify_cert_cb;
@@ -118,14 +78,21 @@ typedef struct _ZProxySsl {
   gboolean disable_proto_tlsv1[EP_MAX];
   gboolean disable_proto_tlsv1_1[EP_MAX];
   gboolean disable_proto_tlsv1_2[EP_MAX];
+  gboolean disable_proto_tlsv1_3[EP_MAX];
   gboolean keypair_generate[EP_MAX];
+  ZPolicyObj *keybridge[EP_MAX];
   gboolean cipher_server_preference;
   gboolean disable_compression[EP_MAX];
+  gboolean enable_ktls[EP_MAX];
 
   gboolean permit_invalid_certificates[EP_MAX];
   gboolean permit_missing_crl[EP_MAX];
   gboolean server_check_subject;
   gboolean disable_renegotiation;
+  gint num_session_tickets;
+  gboolean server_session_cache;
+  GString *session_ticket_key_file;
+  gint session_ticket_key_lifetime;
 
   GString *dh_params;
   GString *ca_hint_directory;
@@ -139,9 +106,14 @@ typedef struct _ZPolicyEncryption
   long ssl_client_context_timeout;
   SSL_CTX *ssl_server_context;
   long ssl_server_context_timeout;
+  gint instance_id;
 
   ZProxySsl ssl_opts;
   X509LookupCrlReloader *x509_lookup_crl_reloader;
+  SessionTicketKeyManager *ticket_key_manager;
+  /* the manager of the random keys, owned by this instance */
+  SessionTicketKeyManager *random_ticket_key_manager;
+  std::shared_ptr<X509KeyBridge> *keybridge[EP_MAX];
 } ZPolicyEncryption;
 
 std::string z_policy_encryption_get_server_cache_key(ZProxy *self);
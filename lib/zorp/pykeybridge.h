@@ -0,0 +1,54 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_PYKEYBRIDGE_H_INCLUDED
+#define ZORP_PYKEYBRIDGE_H_INCLUDED
+
+#include <zorp/zpython.h>
+#include <zorp/x509keybridge.h>
+
+/*+
+
+  ZPolicyKeyBridge is the Python interface to X509KeyBridge.
+
+  +*/
+typedef struct _ZPolicyKeyBridge
+{
+  PyObject_HEAD
+  std::shared_ptr<X509KeyBridge> *keybridge;
+} ZPolicyKeyBridge;
+
+extern PyTypeObject z_policy_keybridge_type;
+
+#define z_policy_keybridge_check(ob) ((ob)->ob_type == &z_policy_keybridge_type)
+
+void z_policy_keybridge_module_init(void);
+
+static inline std::shared_ptr<X509KeyBridge>
+z_policy_keybridge_get_keybridge(PyObject *s)
+{
+  ZPolicyKeyBridge *self = (ZPolicyKeyBridge *) s;
+
+  g_assert(z_policy_keybridge_check(s));
+  return *self->keybridge;
+}
+
+#endif
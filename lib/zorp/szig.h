@@ -40,6 +40,13 @@ enum
   Z_SZIG_AUTH_PENDING_FINISH,
   Z_SZIG_SERVICE_COUNT,
   Z_SZIG_CONNECTION_START,
+  Z_SZIG_PROXY_GROUP_WORKERS,
+  Z_SZIG_PROXY_THREAD_POOL,
+  Z_SZIG_DISPATCH_QUEUE,
+  Z_SZIG_HISTOGRAM,
+  Z_SZIG_CONNECTION_POOL,
+  Z_SZIG_SSL_SESSION_CACHE,
+  Z_SZIG_KEYBRIDGE_CACHE,
   Z_SZIG_MAX
 };
 
@@ -117,6 +124,7 @@ struct ZSzigNode
 typedef void (*ZSzigEventHandler)(ZSzigNode *node, ZSzigEvent ev, ZSzigValue *param, gpointer user_data);
 
 void z_szig_event(ZSzigEvent ev, ZSzigValue *param);
+void z_szig_histogram_add(const gchar *name, glong value);
 
 void z_szig_init(const gchar *instance_name);
 
@@ -130,6 +138,7 @@ ZSzigValue *z_szig_value_new_props(const gchar *name, const gchar *first_prop, .
 void z_szig_value_free(ZSzigValue *v, gboolean free_inst);
 
 ZSzigNode *z_szig_tree_lookup(const gchar *node_name, gboolean create, ZSzigNode **parent, gint *parent_ndx);
+void z_szig_metrics_format(GString *out);
 
 void z_szig_value_add_thread_id(ZProxy *proxy);
 
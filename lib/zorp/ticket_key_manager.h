@@ -0,0 +1,126 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_TICKET_KEY_MANAGER_H_INCLUDED
+#define ZORP_TICKET_KEY_MANAGER_H_INCLUDED
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+class SessionTicketKey
+{
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  SessionTicketKey() : is_set(false)
+    {};
+  SessionTicketKey(const std::array<unsigned char, 16> &hmac_key, const std::array<unsigned char, 16> &aes_key, const std::array<unsigned char, 16> key_name, int timeout) : hmac_key(hmac_key), aes_key(aes_key), key_name(key_name), is_set(true)
+    {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      encrypt_expire_time = now + std::chrono::duration<int>(timeout);
+      decrypt_expire_time = now + std::chrono::duration<int>(timeout) + std::chrono::duration<int>(timeout);
+    };
+  SessionTicketKey(const std::array<unsigned char, 16> &hmac_key, const std::array<unsigned char, 16> &aes_key, const std::array<unsigned char, 16> key_name, time_point encrypt_expire_time, time_point decrypt_expire_time) : hmac_key(hmac_key), aes_key(aes_key), key_name(key_name), encrypt_expire_time(encrypt_expire_time), decrypt_expire_time(decrypt_expire_time), is_set(true)
+    {};
+  bool can_be_used_to_encrypt()
+    {
+      return (is_set && encrypt_expire_time >= std::chrono::steady_clock::now());
+    }
+  bool can_be_used_to_decrypt()
+    {
+      return (is_set && decrypt_expire_time >= std::chrono::steady_clock::now());
+    }
+  unsigned char *get_key_name()
+    {
+      return key_name.data();
+    }
+  unsigned char *get_aes_key()
+    {
+      return aes_key.data();
+    }
+  unsigned char *get_hmac_key()
+    {
+      return hmac_key.data();
+    }
+  bool find_key(const std::array<unsigned char, 16> &other_key_name)
+    {
+      return key_name == other_key_name;
+    }
+  void expire_at(time_point encrypt_expire, time_point decrypt_expire)
+    {
+      encrypt_expire_time = std::min(encrypt_expire_time, encrypt_expire);
+      decrypt_expire_time = std::min(decrypt_expire_time, decrypt_expire);
+    }
+private:
+  std::array<unsigned char, 16> hmac_key;
+  std::array<unsigned char, 16> aes_key;
+  std::array<unsigned char, 16> key_name;
+  std::chrono::steady_clock::time_point encrypt_expire_time, decrypt_expire_time;
+  bool is_set;
+};
+
+/* Session ticket keys shared by the client side SSL contexts of the
+ * process, see ticket_key_manager.cc for details. */
+class SessionTicketKeyManager
+{
+public:
+  static constexpr size_t key_record_size = 48;
+
+  SessionTicketKeyManager(const std::filesystem::path &key_file, int lifetime, int check_interval = 10);
+
+  SessionTicketKeyManager(const SessionTicketKeyManager &) = delete;
+  SessionTicketKeyManager &operator=(const SessionTicketKeyManager &) = delete;
+
+  static SessionTicketKeyManager *get_instance(const std::string &key_file, int lifetime);
+  static int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                           EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc);
+
+  int setup_ticket_crypto(unsigned char *key_name, unsigned char *iv,
+                          EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, bool enc);
+  void set_lifetime(int lifetime);
+  bool load();
+
+private:
+  void refresh();
+  bool load_key_file();
+  void rotate_random_key();
+  SessionTicketKey *find_encryption_key();
+  SessionTicketKey *find_decryption_key(const std::array<unsigned char, 16> &key_name);
+
+  std::mutex lock;
+  std::filesystem::path key_file;
+  std::filesystem::file_time_type last_modification;
+  std::chrono::seconds lifetime;
+  std::chrono::seconds check_interval;
+  SessionTicketKey::time_point next_check;
+  /* the key used for encryption at the front */
+  std::deque<SessionTicketKey> keys;
+};
+
+#endif
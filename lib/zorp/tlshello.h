@@ -0,0 +1,53 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_TLSHELLO_H_INCLUDED
+#define ZORP_TLSHELLO_H_INCLUDED
+
+#include <zorp/zorp.h>
+
+#define Z_TLS_RECORD_HEADER_LEN   5
+#define Z_TLS_RECORD_MAX_LEN      16384
+
+typedef enum
+{
+  Z_TLS_HELLO_OK,
+  Z_TLS_HELLO_INCOMPLETE,
+  Z_TLS_HELLO_INVALID,
+} ZTlsHelloParseResult;
+
+typedef struct _ZTlsClientHello
+{
+  guint16 record_version;
+  guint16 legacy_version;
+  GArray *cipher_suites;                /* guint16 */
+  GArray *supported_versions;           /* guint16 */
+  GPtrArray *alpn_protocols;            /* gchar * */
+  GString *server_name;
+} ZTlsClientHello;
+
+ZTlsClientHello *z_tls_client_hello_new(void);
+void z_tls_client_hello_free(ZTlsClientHello *self);
+
+ZTlsHelloParseResult z_tls_client_hello_parse(ZTlsClientHello *self, const guchar *data, gsize length,
+                                              const gchar **error);
+
+#endif
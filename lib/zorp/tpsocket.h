@@ -25,5 +25,6 @@
 #include <zorpll/socket.h>
 
 gboolean z_tp_socket_init(void);
+void z_tp_socket_set_reuseport(gboolean reuseport);
 
 #endif
@@ -0,0 +1,124 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_X509KEYBRIDGE_H_INCLUDED
+#define ZORP_X509KEYBRIDGE_H_INCLUDED
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+void zorp_certificate_delete_extensions(X509 *certificate, const std::set<std::string> &white_list_set);
+void zorp_certificate_fix_key_usage(X509 *certificate);
+
+struct X509KeyBridgeConfig
+{
+  std::string key_pem;
+  std::string key_passphrase;
+  std::string trusted_ca_cert_pem;
+  std::string trusted_ca_key_pem;
+  std::string trusted_ca_passphrase;
+  std::string untrusted_ca_cert_pem;
+  std::string untrusted_ca_key_pem;
+  std::string untrusted_ca_passphrase;
+  std::set<std::string> extension_whitelist;
+  std::string cache_directory;
+  size_t cache_size = 4096;
+};
+
+/* Generates certificates mimicking the certificate of a peer, signed by
+ * the keybridge CA, see x509keybridge.cc for details. */
+class X509KeyBridge
+{
+public:
+  static constexpr size_t shard_count = 16;
+
+  explicit X509KeyBridge(const X509KeyBridgeConfig &config);
+  ~X509KeyBridge();
+
+  X509KeyBridge(const X509KeyBridge &) = delete;
+  X509KeyBridge &operator=(const X509KeyBridge &) = delete;
+
+  static std::shared_ptr<X509KeyBridge> get_instance(const X509KeyBridgeConfig &config);
+
+  X509 *get_certificate(X509 *orig_cert, bool trusted, const char *session_id = nullptr);
+
+  EVP_PKEY *get_private_key()
+    {
+      return key;
+    }
+  const std::string &get_private_key_pem() const
+    {
+      return key_pem;
+    }
+
+private:
+  struct CertificateAuthority
+  {
+    X509 *cert = nullptr;
+    EVP_PKEY *key = nullptr;
+    std::string cert_pem;
+  };
+
+  using CacheEntries = std::list<std::pair<std::string, X509 *>>;
+
+  struct CacheShard
+  {
+    std::mutex lock;
+    /* the most recently used certificate at the front */
+    CacheEntries entries;
+    std::unordered_map<std::string, CacheEntries::iterator> index;
+  };
+
+  void load_ca(CertificateAuthority &ca, const std::string &cert_pem,
+               const std::string &key_pem, const std::string &passphrase);
+  X509 *cache_lookup(CacheShard &shard, const std::string &fingerprint);
+  X509 *cache_insert(CacheShard &shard, const std::string &fingerprint, X509 *cert);
+  void release();
+
+  X509 *forge(X509 *orig_cert, const CertificateAuthority &ca, const char *session_id);
+  bool allocate_serial(X509 *cert);
+  std::string get_cache_file(const std::string &orig_pem, const CertificateAuthority &ca, bool trusted);
+  X509 *load_cached(const std::string &cert_file, const std::string &orig_pem, X509 *orig_cert, const char *session_id);
+  void store_cached(const std::string &cert_file, const std::string &orig_pem, X509 *cert, const char *session_id);
+
+  X509KeyBridgeConfig config;
+  EVP_PKEY *key;
+  std::string key_pem;
+  CertificateAuthority trusted_ca, untrusted_ca;
+
+  uint64_t serial_base;
+  std::atomic<uint32_t> serial_counter;
+
+  size_t shard_size;
+  std::array<CacheShard, shard_count> shards;
+};
+
+#endif
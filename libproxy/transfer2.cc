@@ -22,9 +22,17 @@
 #include <zorp/proxy/transfer2.h>
 #include <zorpll/log.h>
 #include <zorpll/source.h>
+#include <zorpll/streamssl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define MAX_READ_AT_A_TIME 30
 
+/* the default capacity of a pipe on Linux */
+#define MAX_SPLICE_AT_A_TIME 65536
+
 typedef struct _ZTransfer2PSIface
 {
   ZProxyStackIface super;
@@ -309,7 +317,8 @@ z_transfer2_update_cond(ZTransfer2 *self)
       /* no stacking */
       if (!z_transfer2_get_status(self, ZT2S_EOF_SOURCE))
         {
-          if ((z_transfer2_buffer_empty(&self->buffers[0]) || z_transfer2_get_status(self, ZT2S_EOF_DEST) != 0) && !z_transfer2_get_status(self, ZT2S_PROXY_OUT))
+          if (((z_transfer2_buffer_empty(&self->buffers[0]) && self->splice_pending == 0) || z_transfer2_get_status(self, ZT2S_EOF_DEST) != 0) &&
+              !z_transfer2_get_status(self, ZT2S_PROXY_OUT))
             z_stream_set_cond(z_transfer2_get_stream(self, ZT2E_SOURCE), G_IO_IN, TRUE);
           else
             z_stream_set_cond(z_transfer2_get_stream(self, ZT2E_DEST), G_IO_OUT, TRUE);
@@ -456,6 +465,138 @@ z_transfer2_write_dest(ZTransfer2 *self, gint endpoint, ZTransfer2Buffer *buf, G
   return res;
 }
 
+/**
+ * z_transfer2_splice_usable:
+ * @self: ZTransfer2 instance
+ *
+ * This function checks whether the bytes enabled by
+ * z_transfer2_enable_splice() can be moved between the file descriptors of
+ * the endpoints directly: no proxy is stacked, neither endpoint is
+ * encrypted and both have a file descriptor.  The pipe used to move the
+ * data is created here on first use.
+ **/
+static gboolean
+z_transfer2_splice_usable(ZTransfer2 *self)
+{
+#ifdef HAVE_SPLICE
+  ZStream *from = z_transfer2_get_stream(self, ZT2E_SOURCE);
+  ZStream *to = z_transfer2_get_stream(self, ZT2E_DEST);
+
+  if (self->stacked ||
+      z_stream_get_fd(from) < 0 || z_stream_get_fd(to) < 0 ||
+      z_stream_search_stack(from, G_IO_IN, Z_CLASS(ZStreamSsl)) ||
+      z_stream_search_stack(to, G_IO_OUT, Z_CLASS(ZStreamSsl)))
+    return FALSE;
+
+  if (self->splice_pipe[0] < 0 && pipe2(self->splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+      /*LOG
+        This message indicates that the pipe used for zero-copy transfer
+        could not be created, data is copied through the transfer buffer
+        instead.
+       */
+      z_proxy_log(self->owner, CORE_ERROR, 3, "Error creating splice pipe; error='%s'", g_strerror(errno));
+      self->splice_pipe[0] = self->splice_pipe[1] = -1;
+      return FALSE;
+    }
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * z_transfer2_splice_data:
+ * @self: ZTransfer2 instance
+ *
+ * This function is the zero-copy counterpart of the copy loop in
+ * z_transfer2_copy_data(): it moves at most self->splice_left bytes from
+ * the source to the destination through a pipe, without copying them to
+ * userspace.  Bytes read from the source but not yet written are kept in
+ * the pipe, and z_transfer2_update_cond() polls the destination until
+ * they are flushed.  The byte counters of the endpoint streams are
+ * updated, and the spliced method of the subclass is notified of each
+ * chunk written, just like dst_write would have been called.
+ *
+ * Returns FALSE when the transfer was terminated by an I/O error, TRUE
+ * otherwise, even if only part of the data could be transferred.
+ **/
+static gboolean
+z_transfer2_splice_data(ZTransfer2 *self)
+{
+#ifdef HAVE_SPLICE
+  ZStream *from = z_transfer2_get_stream(self, ZT2E_SOURCE);
+  ZStream *to = z_transfer2_get_stream(self, ZT2E_DEST);
+  gint pkt_count = 0;
+  ssize_t len;
+
+  z_proxy_enter(self->owner);
+  while (pkt_count < MAX_READ_AT_A_TIME)
+    {
+      if (self->splice_pending == 0)
+        {
+          if (self->splice_left == 0)
+            break;
+
+          len = splice(z_stream_get_fd(from), NULL, self->splice_pipe[1], NULL,
+                       MIN(self->splice_left, MAX_SPLICE_AT_A_TIME), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+
+          if (len <= 0)
+            {
+              /* let the source side read the EOF or the error itself, so
+               * it is handled exactly as in the buffered case */
+              self->splice_left = 0;
+              break;
+            }
+
+          self->splice_pending = len;
+          self->splice_left -= len;
+          from->bytes_recvd += len;
+        }
+
+      len = splice(self->splice_pipe[0], NULL, z_stream_get_fd(to), NULL, self->splice_pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (self->splice_left ? SPLICE_F_MORE : 0));
+      if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        break;
+
+      if (len < 0)
+        {
+          /*LOG
+            This message indicates that sending data to the destination
+            failed during zero-copy transfer.
+           */
+          z_proxy_log(self->owner, CORE_ERROR, 3, "Error writing spliced data; error='%s'", g_strerror(errno));
+
+          /* the contents of the pipe are lost, just like those of the
+           * buffer in the same case */
+          self->splice_left = 0;
+          close(self->splice_pipe[0]);
+          close(self->splice_pipe[1]);
+          self->splice_pipe[0] = self->splice_pipe[1] = -1;
+          self->splice_pending = 0;
+
+          z_transfer2_update_status(self, ZT2S_FAILED, TRUE);
+          if (self->flags & ZT2F_COMPLETE_COPY)
+            z_transfer2_update_status(self, ZT2S_COPYING_TAIL, TRUE);
+          else
+            z_transfer2_update_status(self, ZT2S_FINISHED, TRUE);
+          z_proxy_return(self->owner, FALSE);
+        }
+
+      self->splice_pending -= len;
+      to->bytes_sent += len;
+      z_transfer2_spliced(self, len);
+      pkt_count++;
+    }
+  z_proxy_return(self->owner, TRUE);
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * z_transfer2_copy_data:
  * @self: ZTransfer2 instance
@@ -490,6 +631,25 @@ z_transfer2_copy_data(ZTransfer2 *self, gint ep_from, gint ep_to, GError **error
   if (self->timeout_source)
     z_timeout_source_set_timeout(self->timeout_source, self->timeout);
 
+  if ((self->splice_left > 0 || self->splice_pending > 0) && ep_from == ZT2E_SOURCE &&
+      !z_transfer2_get_status(self, ZT2S_COPYING_TAIL) && z_transfer2_buffer_empty(buf))
+    {
+      if (!z_transfer2_splice_usable(self))
+        {
+          self->splice_left = 0;
+        }
+      else if (self->splice_pending > 0 || z_stream_get_buffered_bytes(z_transfer2_get_stream(self, ZT2E_SOURCE)) == 0)
+        {
+          /* data still buffered by the source stream is copied first,
+           * splicing takes over in a later round */
+          if (!z_transfer2_splice_data(self) || self->splice_left > 0 || self->splice_pending > 0)
+            {
+              z_transfer2_update_cond(self);
+              z_proxy_return(self->owner, G_IO_STATUS_NORMAL);
+            }
+        }
+    }
+
   while (pkt_count < MAX_READ_AT_A_TIME && !leave_while)
     {
       if (!z_transfer2_get_status(self, ZT2S_COPYING_TAIL))
@@ -938,6 +1098,26 @@ z_transfer2_enable_progress(ZTransfer2 *self, glong progress_interval)
   self->progress_interval = progress_interval;
 }
 
+/**
+ * z_transfer2_enable_splice:
+ * @self: ZTransfer2 instance
+ * @length: number of bytes
+ *
+ * This function can be called by subclasses, typically from their
+ * src_read or dst_write methods, to indicate that the next @length bytes
+ * of the source would pass their filters unchanged.  If the endpoints
+ * permit (see z_transfer2_splice_usable()), those bytes are moved with
+ * splice() instead of being copied through the transfer buffer, and the
+ * spliced method is called instead of src_read/dst_write for them.  The
+ * transfer falls back to the buffered mode when the bytes are
+ * transferred, or when splicing is not possible.
+ **/
+void
+z_transfer2_enable_splice(ZTransfer2 *self, guint64 length)
+{
+  self->splice_left = length;
+}
+
 gboolean
 z_transfer2_simple_run(ZTransfer2 *self)
 {
@@ -1001,6 +1181,7 @@ z_transfer2_new(ZClass *class_,
 
   self->stack_info = g_string_sized_new(32);
   self->stack_decision = ZV_ACCEPT;
+  self->splice_pipe[0] = self->splice_pipe[1] = -1;
 
   z_proxy_leave(owner);
   return self;
@@ -1062,6 +1243,11 @@ z_transfer2_free_method(ZObject *s)
       if (self->transfer_contexts[i].stream_extra)
         z_stream_context_destroy(&self->transfer_contexts[i]);
     }
+  if (self->splice_pipe[0] >= 0)
+    {
+      close(self->splice_pipe[0]);
+      close(self->splice_pipe[1]);
+    }
   z_poll_unref(self->poll);
   g_string_free(self->stack_info, TRUE);
 
@@ -1084,6 +1270,7 @@ ZTransfer2Funcs z_transfer2_funcs =
   NULL,
   NULL,
   z_transfer2_run_method,
+  NULL,
   NULL
 };
 
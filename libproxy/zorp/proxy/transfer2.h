@@ -101,6 +101,11 @@ struct _ZTransfer2
   guint32 status;
   gint suspend_reason;
 
+  /* zero-copy state, see z_transfer2_enable_splice() */
+  guint64 splice_left;
+  gsize splice_pending;
+  gint splice_pipe[2];
+
   /* info returned by the stacked proxy */
   const gchar *content_format;
   ZVerdict stack_decision;
@@ -130,6 +135,7 @@ typedef struct _ZTransfer2Funcs
   gboolean (*setup)(ZTransfer2 *self);
   ZTransfer2Result (*run)(ZTransfer2 *self);
   gboolean (*progress)(ZTransfer2 *self);
+  void (*spliced)(ZTransfer2 *self, gsize bytes);
 } ZTransfer2Funcs;
 
 extern ZClass ZTransfer2__class;
@@ -139,6 +145,7 @@ void z_transfer2_suspend(ZTransfer2 *self, gint suspend_reason);
 gboolean z_transfer2_rollback(ZTransfer2 *self);
 gboolean z_transfer2_cancel(ZTransfer2 *self);
 void z_transfer2_enable_progress(ZTransfer2 *elf, glong progress_interval);
+void z_transfer2_enable_splice(ZTransfer2 *self, guint64 length);
 gboolean z_transfer2_simple_run(ZTransfer2 *self);
 
 ZTransfer2 *
@@ -281,4 +288,11 @@ z_transfer2_progress(ZTransfer2 *self)
     return TRUE;
 }
 
+static inline void
+z_transfer2_spliced(ZTransfer2 *self, gsize bytes)
+{
+  if (Z_FUNCS(self, ZTransfer2)->spliced)
+    Z_FUNCS(self, ZTransfer2)->spliced(self, bytes);
+}
+
 #endif
@@ -87,6 +87,10 @@ ftp_transfer_dst_write(ZTransfer2 *s, ZStream *stream, const gchar *buf, gsize c
           goto propagate_exit;
         }
       self->dst_write_state = FTP_DW_WRITE_DATA;
+
+      /* the data is not filtered, once the preamble is out the rest of it
+       * can be moved by ZTransfer2 without copying, up to the EOF */
+      z_transfer2_enable_splice(s, G_MAXUINT64);
     }
 
   res = z_stream_write(stream, buf, count, bytes_written, err);
@@ -36,8 +36,10 @@
 #include <zorpll/random.h>
 #include <zorpll/code.h>
 #include <zorpll/code_base64.h>
+#include <zorpll/source.h>
 
 #include <zorp/proxy/errorloader.h>
+#include <zorp/proxythreadpool.h>
 
 #include <ctype.h>
 #include <sys/socket.h>
@@ -146,6 +148,13 @@ http_config_set_defaults(HttpProxy *self)
   self->max_body_length = 0;
   self->buffer_size = 1500;
   self->rerequest_attempts = 0;
+  self->server_connection_pool = FALSE;
+  self->server_connection_pool_max = 8;
+  self->server_connection_pool_timeout = 30000;
+  self->park_idle_sessions = TRUE;
+  self->pipelining = FALSE;
+  self->pipeline_depth = 4;
+  self->pipeline = g_queue_new();
 
   http_init_headers(&self->headers[EP_CLIENT]);
   http_init_headers(&self->headers[EP_SERVER]);
@@ -223,6 +232,10 @@ http_config_init(HttpProxy *self)
 
   self->super.endpoints[EP_CLIENT]->timeout = self->timeout_request;
   self->poll = z_poll_new();
+
+  z_policy_lock(self->super.thread);
+  http_policy_verdicts_compile(self);
+  z_policy_unlock(self->super.thread);
   z_proxy_return(self);
 }
 
@@ -663,6 +676,36 @@ http_register_vars(HttpProxy *self)
                   Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET | Z_VAR_GET_CONFIG | Z_VAR_SET_CONFIG,
                   &self->rerequest_attempts);
 
+  /* whether to share idle server connections with other sessions */
+  z_proxy_var_new(&self->super, "server_connection_pool",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET | Z_VAR_GET_CONFIG | Z_VAR_SET_CONFIG,
+                  &self->server_connection_pool);
+
+  /* maximum number of idle pooled connections to the same server */
+  z_proxy_var_new(&self->super, "server_connection_pool_max",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET | Z_VAR_GET_CONFIG | Z_VAR_SET_CONFIG,
+                  &self->server_connection_pool_max);
+
+  /* idle timeout of pooled server connections in milliseconds */
+  z_proxy_var_new(&self->super, "server_connection_pool_timeout",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET | Z_VAR_GET_CONFIG | Z_VAR_SET_CONFIG,
+                  &self->server_connection_pool_timeout);
+
+  /* release the thread of idle keep-alive sessions */
+  z_proxy_var_new(&self->super, "park_idle_sessions",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET_CONFIG | Z_VAR_GET_CONFIG,
+                  &self->park_idle_sessions);
+
+  /* process and forward pipelined requests ahead of their turn */
+  z_proxy_var_new(&self->super, "pipelining",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET_CONFIG | Z_VAR_GET_CONFIG,
+                  &self->pipelining);
+
+  /* maximum number of requests forwarded ahead of their turn */
+  z_proxy_var_new(&self->super, "pipeline_depth",
+                  Z_VAR_TYPE_INT | Z_VAR_GET | Z_VAR_SET_CONFIG | Z_VAR_GET_CONFIG,
+                  &self->pipeline_depth);
+
   /* hash indexed by request method */
   z_proxy_var_new(&self->super, "request",
                   Z_VAR_TYPE_HASH | Z_VAR_GET | Z_VAR_GET_CONFIG,
@@ -1670,28 +1713,42 @@ http_get_form_auth(HttpProxy *self, ZorpAuthInfo *auth_info, std::string &redire
   return res;
 }
 
-static gboolean
-http_fetch_request(HttpProxy *self)
+/**
+ * http_fetch_request_line:
+ * @self: HttpProxy instance
+ * @line: returns the request line
+ * @line_length: returns the length of @line
+ *
+ * Reads the request line from the client, skipping at most
+ * HTTP_MAX_EMPTY_REQUESTS empty lines. If the client stream is in
+ * nonblocking mode, G_IO_STATUS_AGAIN is returned when the request line is
+ * not complete yet; the partial line is kept in the line buffer and this
+ * function should be called again when the client becomes readable.
+ **/
+static GIOStatus
+http_fetch_request_line(HttpProxy *self, gchar **line, gsize *line_length)
 {
-  gchar *line;
-  gsize line_length;
-  gint empty_lines = 0;
-  guint res;
+  GIOStatus res;
 
   z_proxy_enter(self);
-  /* FIXME: this can probably be removed as http_fetch_header does this */
-  http_clear_headers(&self->headers[EP_CLIENT]);
+  *line_length = 0;
 
-  while (empty_lines < HTTP_MAX_EMPTY_REQUESTS)
+  while (self->empty_lines < HTTP_MAX_EMPTY_REQUESTS)
     {
       self->super.endpoints[EP_CLIENT]->timeout = self->timeout_request;
-      res = z_stream_line_get(self->super.endpoints[EP_CLIENT], &line, &line_length, NULL);
+      res = z_stream_line_get(self->super.endpoints[EP_CLIENT], line, line_length, NULL);
       self->super.endpoints[EP_CLIENT]->timeout = self->timeout;
 
+      /* the empty lines already skipped count towards the limit when the
+       * read is retried */
+      if (res == G_IO_STATUS_AGAIN)
+        z_proxy_return(self, G_IO_STATUS_AGAIN);
+
       if (res == G_IO_STATUS_EOF)
         {
+          self->empty_lines = 0;
           self->error_code = HTTP_MSG_OK;
-          z_proxy_return(self, FALSE);
+          z_proxy_return(self, G_IO_STATUS_EOF);
         }
 
       if (res != G_IO_STATUS_NORMAL)
@@ -1707,15 +1764,51 @@ http_fetch_request(HttpProxy *self)
                 }
             }
 
-          z_proxy_return(self, FALSE);
+          self->empty_lines = 0;
+          z_proxy_return(self, G_IO_STATUS_ERROR);
         }
 
-      if (line_length != 0)
+      if (*line_length != 0)
         break;
 
-      empty_lines++;
+      self->empty_lines++;
     }
 
+  self->empty_lines = 0;
+  z_proxy_return(self, G_IO_STATUS_NORMAL);
+}
+
+/**
+ * http_fetch_request:
+ * @self: HttpProxy instance
+ *
+ * Fetches and parses the request line and the request headers.
+ *
+ * Returns: G_IO_STATUS_NORMAL on success, G_IO_STATUS_AGAIN if the client
+ * stream is nonblocking and the request line has not arrived yet,
+ * G_IO_STATUS_ERROR otherwise.
+ **/
+static GIOStatus
+http_fetch_request(HttpProxy *self)
+{
+  gchar *line;
+  gsize line_length;
+  GIOStatus res;
+
+  z_proxy_enter(self);
+  /* FIXME: this can probably be removed as http_fetch_header does this */
+  http_clear_headers(&self->headers[EP_CLIENT]);
+
+  res = http_fetch_request_line(self, &line, &line_length);
+  if (res == G_IO_STATUS_AGAIN)
+    z_proxy_return(self, G_IO_STATUS_AGAIN);
+
+  if (res != G_IO_STATUS_NORMAL)
+    z_proxy_return(self, G_IO_STATUS_ERROR);
+
+  /* the rest of the request is read in blocking mode */
+  z_stream_set_nonblock(self->super.endpoints[EP_CLIENT], FALSE);
+
   if (!http_split_request(self, line, line_length))
     {
       g_string_assign(self->error_info, "Invalid request line.");
@@ -1724,16 +1817,16 @@ http_fetch_request(HttpProxy *self)
         to the proxy.
       */
       z_proxy_log(self, HTTP_VIOLATION, 2, "Invalid HTTP request received; line='%.*s'", (gint)line_length, line);
-      z_proxy_return(self, FALSE);
+      z_proxy_return(self, G_IO_STATUS_ERROR);
     }
 
   self->request_flags = http_proto_request_lookup(self->request_method->str);
 
   if (!http_parse_version(self, EP_CLIENT, self->request_version))
-    z_proxy_return(self, FALSE); /* parse version already logged */
+    z_proxy_return(self, G_IO_STATUS_ERROR); /* parse version already logged */
 
   if (!http_fetch_headers(self, EP_CLIENT))
-    z_proxy_return(self, FALSE); /* fetch headers already logged */
+    z_proxy_return(self, G_IO_STATUS_ERROR); /* fetch headers already logged */
 
   if (self->rerequest_attempts > 0)
     {
@@ -1761,7 +1854,7 @@ http_fetch_request(HttpProxy *self)
             self->request_data = z_blob_new(NULL, 0);
 
           if (!self->request_data)
-            z_proxy_return(self, FALSE);
+            z_proxy_return(self, G_IO_STATUS_ERROR);
 
           g_snprintf(session_id, sizeof(session_id), "%s/post", self->super.session_id);
           blob_stream = z_stream_blob_new(self->request_data, session_id);
@@ -1771,11 +1864,11 @@ http_fetch_request(HttpProxy *self)
           z_stream_unref(blob_stream);
 
           if (!success)
-            z_proxy_return(self, FALSE);
+            z_proxy_return(self, G_IO_STATUS_ERROR);
         }
     }
 
-  z_proxy_return(self, TRUE);
+  z_proxy_return(self, G_IO_STATUS_NORMAL);
 }
 
 static gboolean
@@ -2636,13 +2729,13 @@ http_filter_request(HttpProxy *self)
 
   if (f)
     {
-      ZPolicyObj *handler, *res;
-      gchar *errmsg;
-      guint filter_type;
+      HttpPolicyVerdict *verdict;
+      ZPolicyObj *res;
+      gint64 profile_start;
 
-      z_policy_lock(self->super.thread);
+      verdict = http_policy_verdict_lookup(self, HTTP_POLICY_REQUEST, f);
 
-      if (!z_policy_tuple_get_verdict(f, &filter_type))
+      if (verdict->action < 0)
         {
           /*LOG
             This message indicates that the request hash contains an invalid
@@ -2650,21 +2743,19 @@ http_filter_request(HttpProxy *self)
             configuration.
           */
           z_proxy_log(self, HTTP_POLICY, 1, "Invalid item in request hash; method='%s'", self->request_method->str);
+          z_policy_lock(self->super.thread);
           z_proxy_report_invalid_policy(&(self->super));
           z_policy_unlock(self->super.thread);
           z_proxy_return(self, FALSE);
 
         }
 
-      z_policy_unlock(self->super.thread);
       g_string_sprintf(self->error_info, "Method %s denied by policy", self->request_method->str);
 
-      switch (filter_type)
+      switch (verdict->action)
         {
         case HTTP_REQ_POLICY:
-          z_policy_lock(self->super.thread);
-
-          if (!z_policy_var_parse(f, "(iO)", &filter_type, &handler))
+          if (!verdict->valid)
             {
               /*LOG
                 This message indicates that the request hash contains an
@@ -2672,15 +2763,19 @@ http_filter_request(HttpProxy *self)
                 should contain a valid call-back function in the tuple.
               */
               z_proxy_log(self, HTTP_POLICY, 1, "Error parsing HTTP_REQ_POLICY tuple in request hash; method='%s'", self->request_method->str);
+              z_policy_lock(self->super.thread);
               z_proxy_report_invalid_policy(&(self->super));
               z_policy_unlock(self->super.thread);
               z_proxy_return(self, FALSE);
             }
 
-          res = z_policy_call_object(handler,
+          z_policy_lock(self->super.thread);
+          profile_start = z_policy_profile_start();
+          res = z_policy_call_object(verdict->handler,
                                      z_policy_var_build("(sss)",
                                                         self->request_method->str, self->request_url->str, self->request_version),
                                      self->super.session_id);
+          z_policy_profile_event("request_method_policy", profile_start);
 
           if (!res || !z_policy_var_parse(res, "i", &rc))
             {
@@ -2694,10 +2789,7 @@ http_filter_request(HttpProxy *self)
           break;
 
         case HTTP_REQ_REJECT:
-          errmsg = NULL;
-          z_policy_lock(self->super.thread);
-
-          if (!z_policy_var_parse_tuple(f, "i|s", &filter_type, &errmsg))
+          if (!verdict->valid)
             {
               /*LOG
                 This message indicates that the request hash contains an
@@ -2706,15 +2798,14 @@ http_filter_request(HttpProxy *self)
                 client.
               */
               z_proxy_log(self, HTTP_POLICY, 1, "Error parsing HTTP_REQ_REJECT in request hash; req='%s'", self->request_method->str);
+              z_policy_lock(self->super.thread);
               z_proxy_report_invalid_policy(&(self->super));
               z_policy_unlock(self->super.thread);
               z_proxy_return(self, FALSE);
             }
 
-          z_policy_unlock(self->super.thread);
-
-          if (errmsg)
-            g_string_assign(self->error_info, errmsg);
+          if (verdict->value)
+            g_string_assign(self->error_info, verdict->value);
 
           /* fallthrough */
 
@@ -2722,7 +2813,7 @@ http_filter_request(HttpProxy *self)
         case HTTP_REQ_DENY:
         case HTTP_REQ_ABORT:
           /* dropped command */
-          rc = filter_type;
+          rc = verdict->action;
           break;
 
         default:
@@ -2810,22 +2901,228 @@ http_server_stream_ready(HttpProxy *self)
   z_proxy_return(self, res);
 }
 
+/**
+ * http_server_pool_usable:
+ * @self: HttpProxy instance
+ *
+ * Whether the server connection of the current request may be shared with
+ * other sessions through the connection pool.  Only plain HTTP connections
+ * of non-transparent proxies are pooled, as the target of transparent
+ * connections is decided by the router, and TLS sessions carry the state
+ * of the proxy that established them.
+ **/
+static gboolean
+http_server_pool_usable(HttpProxy *self)
+{
+  return self->server_connection_pool &&
+         !self->transparent_mode &&
+         self->server_protocol == HTTP_PROTO_HTTP &&
+         self->super.encryption->ssl_opts.security[EP_SERVER] == ENCRYPTION_SEC_NONE;
+}
+
+/**
+ * http_server_pool_key:
+ * @self: HttpProxy instance
+ * @host: server or parent proxy host name
+ * @port: server or parent proxy port
+ * @parent: whether @host is a parent proxy
+ *
+ * Format the connection pool key of a connection to @host:@port.  The
+ * service name is part of the key, as the service determines the router,
+ * the chainer and thus the bind address of the connection.
+ **/
+static gchar *
+http_server_pool_key(HttpProxy *self, const gchar *host, guint port, gboolean parent)
+{
+  const gchar *session_id = self->super.session_id;
+  const gchar *instance_sep = strrchr(session_id, ':');
+  gint service_len = instance_sep ? instance_sep - session_id : strlen(session_id);
+  gchar *host_lower = g_ascii_strdown(host, -1);
+  gchar *key;
+
+  key = g_strdup_printf("%.*s %s %s:%u", service_len, session_id,
+                        parent ? "parent" : "direct", host_lower, port);
+  g_free(host_lower);
+  return key;
+}
+
+/**
+ * http_server_pool_forged:
+ * @self: HttpProxy instance
+ *
+ * Check whether the server connection uses the address of the client, in
+ * which case it must not be reused by other clients.
+ **/
+static gboolean
+http_server_pool_forged(HttpProxy *self)
+{
+  struct sockaddr_storage local, peer;
+  socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+  gint server_fd, client_fd;
+
+  if (!self->super.endpoints[EP_CLIENT])
+    return TRUE;
+
+  server_fd = z_stream_get_fd(self->super.endpoints[EP_SERVER]);
+  client_fd = z_stream_get_fd(self->super.endpoints[EP_CLIENT]);
+
+  if (server_fd < 0 || client_fd < 0 ||
+      getsockname(server_fd, (struct sockaddr *) &local, &local_len) < 0 ||
+      getpeername(client_fd, (struct sockaddr *) &peer, &peer_len) < 0)
+    return TRUE;
+
+  if (local.ss_family != peer.ss_family)
+    return FALSE;
+  else if (local.ss_family == AF_INET)
+    return ((struct sockaddr_in *) &local)->sin_addr.s_addr == ((struct sockaddr_in *) &peer)->sin_addr.s_addr;
+  else if (local.ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6 *) &local)->sin6_addr, &((struct sockaddr_in6 *) &peer)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+
+  return TRUE;
+}
+
+/**
+ * http_server_pool_checkin:
+ * @self: HttpProxy instance
+ *
+ * Return the server connection to the connection pool instead of closing
+ * it, provided the last response was completely read and the server
+ * permitted keep-alive.  Returns TRUE if the pool took the connection.
+ **/
+static gboolean
+http_server_pool_checkin(HttpProxy *self)
+{
+  gchar *key;
+  gboolean res;
+
+  z_proxy_enter(self);
+
+  if (!self->super.endpoints[EP_SERVER] || !self->server_idle ||
+      !http_server_pool_usable(self) || http_server_pool_forged(self))
+    z_proxy_return(self, FALSE);
+
+  /* the policy may have changed the parent proxy since the connection was
+   * established */
+  key = http_server_pool_key(self, self->connected_server->str, self->connected_port, self->connected_parent);
+
+  res = http_conn_pool_checkin(key, self->super.endpoints[EP_SERVER],
+                               self->server_connection_pool_max, self->server_connection_pool_timeout);
+
+  if (res)
+    {
+      /*LOG
+        This message reports that the idle server connection was returned
+        to the connection pool, so that other sessions can reuse it.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Server connection returned to the pool; key='%s'", key);
+      self->super.endpoints[EP_SERVER] = NULL;
+      self->server_idle = FALSE;
+      g_string_truncate(self->connected_server, 0);
+    }
+
+  g_free(key);
+  z_proxy_return(self, res);
+}
+
+/**
+ * http_server_pool_connect:
+ * @self: HttpProxy instance
+ * @host: server or parent proxy host name
+ * @port: server or parent proxy port
+ *
+ * Reuse an idle pooled connection to @host:@port if there is one,
+ * otherwise connect the server through the policy layer.  A pooled
+ * connection is taken over without calling connectServer, only
+ * setServerAddress is called.
+ **/
+static gboolean
+http_server_pool_connect(HttpProxy *self, const gchar *host, guint port)
+{
+  ZStream *stream;
+  gchar *key;
+
+  z_proxy_enter(self);
+
+  if (!http_server_pool_usable(self))
+    z_proxy_return(self, z_proxy_connect_server(&self->super, host, port));
+
+  key = http_server_pool_key(self, host, port, http_parent_proxy_enabled(self));
+  stream = http_conn_pool_checkout(key);
+
+  if (!stream)
+    {
+      g_free(key);
+      z_proxy_return(self, z_proxy_connect_server(&self->super, host, port));
+    }
+
+  /*LOG
+    This message reports that an idle server connection of an earlier
+    session was taken from the connection pool.
+  */
+  z_proxy_log(self, HTTP_DEBUG, 6, "Reusing pooled server connection; key='%s'", key);
+  g_free(key);
+
+  /* connectServer is not called for the pooled connection, but the policy
+   * is still told the server address */
+  if (!z_proxy_reuse_server(&self->super, stream, host, port))
+    {
+      z_stream_close(stream, NULL);
+      z_stream_unref(stream);
+      z_proxy_return(self, FALSE);
+    }
+
+  stream->timeout = self->timeout;
+  z_proxy_return(self, TRUE);
+}
+
+/**
+ * http_server_route_matches:
+ * @self: HttpProxy instance
+ *
+ * Check whether the server connection leads where the current request has
+ * to be sent: to the parent proxy if the policy set one, otherwise to the
+ * server of the request.
+ **/
+gboolean
+http_server_route_matches(HttpProxy *self)
+{
+  if (self->transparent_mode)
+    return TRUE;
+
+  if (http_parent_proxy_enabled(self))
+    return strcasecmp(self->parent_proxy->str, self->connected_server->str) == 0 &&
+           self->parent_proxy_port == self->connected_port;
+
+  return strcasecmp(self->remote_server->str, self->connected_server->str) == 0 &&
+         self->remote_port == self->connected_port;
+}
+
 gboolean
 http_connect_server(HttpProxy *self)
 {
+  gboolean reconnect = self->force_reconnect;
+
   z_proxy_enter(self);
 
   if (!self->super.endpoints[EP_SERVER] ||
       !http_server_stream_ready(self) ||
-      (!self->transparent_mode &&
-       (strcasecmp(self->remote_server->str, self->connected_server->str) != 0 ||
-        self->remote_port != self->connected_port)) ||
+      !http_server_route_matches(self) ||
       self->force_reconnect)
     {
       gboolean success = FALSE;
 
       self->force_reconnect = FALSE;
 
+      /* requests sent ahead on the old connection have to be sent again */
+      self->pipeline_server_ok = FALSE;
+      http_pipeline_unsend(self);
+
+      /* the connection to the previous server might still be useful for
+       * other sessions */
+      if (self->super.endpoints[EP_SERVER] && !reconnect)
+        http_server_pool_checkin(self);
+
       if (self->super.endpoints[EP_SERVER])
         {
           z_stream_shutdown(self->super.endpoints[EP_SERVER], SHUT_RDWR, NULL);
@@ -2840,7 +3137,7 @@ http_connect_server(HttpProxy *self)
 
       if (http_parent_proxy_enabled(self))
         {
-          success = z_proxy_connect_server(&self->super, self->parent_proxy->str, self->parent_proxy_port);
+          success = http_server_pool_connect(self, self->parent_proxy->str, self->parent_proxy_port);
         }
       else if (self->transparent_mode && self->use_default_port_in_transparent_mode)
         {
@@ -2848,7 +3145,7 @@ http_connect_server(HttpProxy *self)
         }
       else if (z_port_enabled(self->target_port_range->str, self->remote_port))
         {
-          success = z_proxy_connect_server(&self->super, self->remote_server->str, self->remote_port);
+          success = http_server_pool_connect(self, self->remote_server->str, self->remote_port);
         }
       else
         {
@@ -2871,8 +3168,18 @@ http_connect_server(HttpProxy *self)
           z_proxy_return(self, FALSE);
         }
 
-      g_string_assign(self->connected_server, self->remote_server->str);
-      self->connected_port = self->remote_port;
+      if (http_parent_proxy_enabled(self))
+        {
+          g_string_assign(self->connected_server, self->parent_proxy->str);
+          self->connected_port = self->parent_proxy_port;
+          self->connected_parent = TRUE;
+        }
+      else
+        {
+          g_string_assign(self->connected_server, self->remote_server->str);
+          self->connected_port = self->remote_port;
+          self->connected_parent = FALSE;
+        }
     }
 
   if (!http_server_stream_is_initialized(self)
@@ -2888,24 +3195,19 @@ http_connect_server(HttpProxy *self)
       z_proxy_return(self, FALSE);
     }
 
+  /* a request is about to be sent, the connection is not idle until the
+   * response is completely read */
+  self->server_idle = FALSE;
   z_proxy_return(self, TRUE);
 }
 
 static gboolean
-http_copy_request(HttpProxy *self)
+http_send_request(HttpProxy *self)
 {
   ZStream *blob_stream = NULL;
 
   z_proxy_enter(self);
 
-  if (!http_connect_server(self))
-    z_proxy_return(self, FALSE); /* connect_server already logs */
-
-  if (!http_check_name(self))
-    {
-      z_proxy_return(self, FALSE);
-    }
-
   if (self->request_data_stored && self->request_data && self->request_data->size > 0)
     {
       gchar session_id[MAX_SESSION_ID];
@@ -2926,6 +3228,22 @@ http_copy_request(HttpProxy *self)
   z_proxy_return(self, TRUE);
 }
 
+static gboolean
+http_copy_request(HttpProxy *self)
+{
+  z_proxy_enter(self);
+
+  if (!http_connect_server(self))
+    z_proxy_return(self, FALSE); /* connect_server already logs */
+
+  if (!http_check_name(self))
+    {
+      z_proxy_return(self, FALSE);
+    }
+
+  z_proxy_return(self, http_send_request(self));
+}
+
 static gboolean
 http_fetch_response(HttpProxy *self)
 {
@@ -3200,13 +3518,12 @@ http_filter_response(HttpProxy *self)
 
       if (f)
         {
-          ZPolicyObj *handler;
-          guint filter_type;
-          gchar *errmsg;
+          HttpPolicyVerdict *verdict;
+          gint64 profile_start;
 
-          z_policy_lock(self->super.thread);
+          verdict = http_policy_verdict_lookup(self, HTTP_POLICY_RESPONSE, f);
 
-          if (!z_policy_tuple_get_verdict(f, &filter_type))
+          if (verdict->action < 0)
             {
               /*LOG
                 This message indicates that the response hash contains an
@@ -3214,21 +3531,18 @@ http_filter_response(HttpProxy *self)
                 configuration.
               */
               z_proxy_log(self, HTTP_POLICY, 1, "Invalid response hash item; request='%s', response='%d'", self->request_method->str, self->response_code);
+              z_policy_lock(self->super.thread);
               z_proxy_report_invalid_policy(&(self->super));
               z_policy_unlock(self->super.thread);
               z_proxy_return(self, FALSE);
             }
 
-          z_policy_unlock(self->super.thread);
-
           g_string_sprintf(self->error_info, "Response %d for %s denied by policy.", self->response_code, self->request_method->str);
 
-          switch (filter_type)
+          switch (verdict->action)
             {
             case HTTP_RSP_POLICY:
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse(f, "(iO)", &filter_type, &handler))
+              if (!verdict->valid)
                 {
                   /*LOG
                     This message indicates that the response hash contains
@@ -3238,12 +3552,16 @@ http_filter_response(HttpProxy *self)
                   z_proxy_log(self, HTTP_POLICY, 1,
                               "Error parsing HTTP_RSP_POLICY in response hash; request='%s', response='%d'",
                               self->request_method->str, self->response_code);
+                  z_policy_lock(self->super.thread);
                   z_proxy_report_invalid_policy(&(self->super));
                   z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              res = z_policy_call_object(handler, z_policy_var_build("(sssi)", self->request_method->str, self->request_url->str, self->request_version, self->response_code), self->super.session_id);
+              z_policy_lock(self->super.thread);
+              profile_start = z_policy_profile_start();
+              res = z_policy_call_object(verdict->handler, z_policy_var_build("(sssi)", self->request_method->str, self->request_url->str, self->request_version, self->response_code), self->super.session_id);
+              z_policy_profile_event("response_policy", profile_start);
 
               if (!z_policy_var_parse(res, "i", &rc))
                 {
@@ -3257,10 +3575,7 @@ http_filter_response(HttpProxy *self)
               break;
 
             case HTTP_RSP_REJECT:
-              errmsg = NULL;
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse_tuple(f, "i|s", &filter_type, &errmsg))
+              if (!verdict->valid)
                 {
                   /*LOG
                     This message indicates that the response hash contains
@@ -3271,14 +3586,11 @@ http_filter_response(HttpProxy *self)
                   z_proxy_log(self, HTTP_POLICY, 1,
                               "Error parsing HTTP_RSP_REJECT in response hash; request='%s', response='%d'",
                               self->request_method->str, self->response_code);
-                  z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              z_policy_unlock(self->super.thread);
-
-              if (errmsg)
-                g_string_assign(self->error_info, errmsg);
+              if (verdict->value)
+                g_string_assign(self->error_info, verdict->value);
 
               /* fallthrough */
 
@@ -3286,7 +3598,7 @@ http_filter_response(HttpProxy *self)
             case HTTP_RSP_DENY:
             case HTTP_RSP_ABORT:
               /* dropped command */
-              rc = filter_type;
+              rc = verdict->action;
               break;
 
             default:
@@ -3547,205 +3859,392 @@ http_handle_connect(HttpProxy *self)
   z_proxy_return(self, TRUE);
 }
 
+/**
+ * http_exit_request_loop:
+ * @self: HttpProxy instance
+ *
+ * Called when the keep-alive loop is exited, sends the error page or the
+ * custom response (if any) and prepares the client stream for closing.
+ **/
 static void
-http_main(ZProxy *s)
+http_exit_request_loop(HttpProxy *self)
 {
-  HttpProxy *self = Z_CAST(s, HttpProxy);
-  gint rerequest_attempts;
-
   z_proxy_enter(self);
-  self->request_count = 0;
-  http_client_stream_init(self);
 
-  /* loop for keep-alive */
-  while (1)
+  /*LOG
+    This message reports that Zorp is exiting the keep-alive loop and
+    closing the connection.
+  */
+  z_proxy_log(self, HTTP_DEBUG, 6, "exiting keep-alive loop;");
+
+  if (self->error_code > 0)
     {
-      self->error_code = HTTP_MSG_NOT_ASSIGNED;
+      http_error_message(self, self->error_status, self->error_code, self->error_info);
+    }
+  else if (self->send_custom_response)
+    {
+      self->send_custom_response = FALSE;
+      http_send_custom_response(self, self->error_status, self->error_msg, self->error_headers, self->custom_response_body);
+    }
 
-      /*LOG
-        This message reports that Zorp is fetching the request and the
-        headers from the client.
-      */
-      z_proxy_log(self, HTTP_DEBUG, 6, "Fetching request and headers;");
+  /* in some cases the client might still have some data already queued to us,
+   * fetch and ignore that data to avoid the RST sent in these cases
+   */
+  http_fetch_buffered_data(self);
+
+  if (self->error_code <= 0 && self->reset_on_close)
+    {
+      int fd;
+
+      fd = z_stream_get_fd(self->super.endpoints[EP_CLIENT]);
 
-      /* fetch request */
-      if (!http_fetch_request(self))
+      if (fd >= 0)
         {
-          if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-            self->error_code = HTTP_MSG_CLIENT_SYNTAX;
+          struct linger l;
 
-          goto exit_request_loop;
+          l.l_onoff = 1;
+          l.l_linger = 0;
+          setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
         }
 
-      if (!z_proxy_loop_iteration(s))
-        break;
-
-      /*LOG
-        This message reports that Zorp is processing the fetched request and
-        the headers.
-      */
-      z_proxy_log(self, HTTP_DEBUG, 6, "processing request and headers;");
+      /* avoid z_stream_shutdown in the destroy path */
+      z_stream_close(self->super.endpoints[EP_CLIENT], NULL);
+      z_stream_unref(self->super.endpoints[EP_CLIENT]);
+      self->super.endpoints[EP_CLIENT] = NULL;
+    }
 
-      if (!http_process_request(self))
-        {
-          if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-            self->error_code = HTTP_MSG_CLIENT_SYNTAX;
+  z_proxy_return(self);
+}
 
-          goto exit_request_loop;
-        }
+static HttpStepResult http_step(HttpProxy *self);
 
-      if (self->max_keepalive_requests != 0 &&
-          self->request_count >= self->max_keepalive_requests - 1)
+/**
+ * http_pipeline_can_send:
+ * @self: HttpProxy instance
+ *
+ * Check whether the request read ahead can be sent on the connection the
+ * current request was sent on, without connecting to the server again.
+ **/
+static gboolean
+http_pipeline_can_send(HttpProxy *self)
+{
+  if (self->state != HTTP_STATE_CONNECT ||
+      (self->request_flags & HTTP_REQ_FLG_CONNECT) ||
+      !http_pipeline_request_eligible(self))
+    return FALSE;
+
+  if (self->force_reconnect || !http_server_stream_ready(self))
+    return FALSE;
+
+  return http_server_route_matches(self);
+}
+
+/**
+ * http_pipeline_fill:
+ * @self: HttpProxy instance
+ *
+ * Called right after the current request was sent to the server.  Reads
+ * the requests the client has already pipelined behind it, processes and
+ * filters them, and sends them to the server on the same connection, at
+ * most pipeline_depth of them.  Requests which cannot be sent ahead (or
+ * were rejected) stop the look-ahead, they are queued in their processed
+ * state and continue on their turn.  The responses are processed in the
+ * order of the queue, thus the client receives them in order.
+ **/
+static void
+http_pipeline_fill(HttpProxy *self)
+{
+  HttpPipelineRequest *current, *req, *tail;
+  HttpState state = self->state;
+  HttpStepResult res;
+
+  z_proxy_enter(self);
+  tail = static_cast<HttpPipelineRequest *>(g_queue_peek_tail(self->pipeline));
+
+  if (!self->pipelining || !self->pipeline_server_ok ||
+      g_queue_get_length(self->pipeline) >= self->pipeline_depth ||
+      (tail && !tail->sent) ||
+      self->max_keepalive_requests != 0 ||
+      self->auth || self->auth_by_form || self->auth_by_cookie ||
+      !http_pipeline_request_eligible(self))
+    z_proxy_return(self);
+
+  current = http_pipeline_lookahead_begin(self);
+
+  while (g_queue_get_length(self->pipeline) < self->pipeline_depth)
+    {
+      /* only requests the client has already sent are processed */
+      self->state = HTTP_STATE_FETCH_REQUEST;
+      z_stream_set_nonblock(self->super.endpoints[EP_CLIENT], TRUE);
+
+      do
+        res = http_step(self);
+      while (res == HTTP_STEP_CONTINUE &&
+             (self->state == HTTP_STATE_PROCESS_REQUEST ||
+              (self->state == HTTP_STATE_FILTER_REQUEST && self->server_protocol != HTTP_PROTO_FTP)));
+
+      z_stream_set_nonblock(self->super.endpoints[EP_CLIENT], FALSE);
+
+      if (res == HTTP_STEP_SUSPEND)
+        break;
+
+      req = http_pipeline_request_new();
+
+      if (http_pipeline_can_send(self) && http_check_name(self))
         {
           /*LOG
-            This message reports that the maximum number of requests in a keep-alive loop is
-            reached, and Zorp is closing after this request. Check the max_keepalive_request
-            attribute.
+            This message reports that Zorp is sending a pipelined request
+            to the server before the response to the previous one arrived.
           */
-          z_proxy_log(self, HTTP_POLICY, 3,
-                      "Maximum keep-alive request reached, setting connection mode to close; count='%d', max='%d'",
-                      self->request_count, self->max_keepalive_requests);
-          self->connection_mode = HTTP_CONNECTION_CLOSE;
+          z_proxy_log(self, HTTP_DEBUG, 6, "Sending pipelined request; req='%s', url='%s', depth='%d'",
+                      self->request_method->str, self->request_url->str, g_queue_get_length(self->pipeline) + 1);
+          req->sent = http_send_request(self);
+          /* the connection owes a response from now on */
+          self->server_idle = FALSE;
+
+          if (!req->sent)
+            self->error_code = HTTP_MSG_NOT_ASSIGNED;
         }
 
+      http_pipeline_lookahead_queue(self, req);
+
+      if (!req->sent)
+        break;
+    }
+
+  http_pipeline_lookahead_end(self, current);
+  self->state = state;
+  z_proxy_return(self);
+}
+
+/**
+ * http_exchange_with_server:
+ * @self: HttpProxy instance
+ *
+ * Sends the request to the server and fetches the response status line
+ * and headers, retrying at most rerequest_attempts times.
+ **/
+static gboolean
+http_exchange_with_server(HttpProxy *self)
+{
+  gint rerequest_attempts;
+  gboolean retry;
+
+  z_proxy_enter(self);
+  rerequest_attempts = self->rerequest_attempts;
+
+  while (1)
+    {
+      retry = FALSE;
       /*LOG
-        This message reports that Zorp is filtering the processed
-        request and the headers.
+        This message reports that Zorp is sending the filtered request and
+        headers, and copies the requests data to the server.
       */
-      z_proxy_log(self, HTTP_DEBUG, 6, "Filtering request and headers;");
+      z_proxy_log(self, HTTP_DEBUG, 6, "Sending request and headers, copying request data;");
 
-      if (!http_filter_request(self))
+      if (!retry && !http_copy_request(self))
         {
           if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-            self->error_code = HTTP_MSG_POLICY_SYNTAX;
+            self->error_code = HTTP_MSG_CLIENT_SYNTAX;
 
-          goto exit_request_loop;
+          retry = TRUE;
         }
 
-      if (self->send_custom_response)
-        goto exit_request_loop;
+      if (!retry)
+        http_pipeline_fill(self);
 
       /*LOG
-        This message indicates that Zorp is recechecking the HTTP request
-        after possible changes performed by the policy layer.
+        This message reports that Zorp is fetching the response and headers
+        from the server.
       */
-      z_proxy_log(self, HTTP_DEBUG, 6, "Reprocessing filtered request;");
+      z_proxy_log(self, HTTP_DEBUG, 6, "Fetching response and headers;");
 
-      if (!http_process_filtered_request(self))
+      if (!retry && !http_fetch_response(self))
         {
           if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-            self->error_code = HTTP_MSG_CLIENT_SYNTAX;
+            self->error_code = HTTP_MSG_SERVER_SYNTAX;
 
-          goto exit_request_loop;
+          retry = TRUE;
         }
 
-      if (self->server_protocol == HTTP_PROTO_HTTP || self->server_protocol == HTTP_PROTO_HTTPS)
+      if (retry && rerequest_attempts > 1)
         {
-          gboolean retry;
+          z_proxy_log(self, HTTP_ERROR, 3, "Server request failed, retrying; attempts='%d'", rerequest_attempts);
+          self->force_reconnect = TRUE;
+          self->error_code = HTTP_MSG_NOT_ASSIGNED;
+          rerequest_attempts--;
+          continue;
+        }
 
-          if ((self->request_flags & HTTP_REQ_FLG_CONNECT))
-            {
-              if (http_handle_connect(self))
-                z_proxy_return(self); /* connect method was successful, we can now safely quit */
+      z_proxy_return(self, !retry);
+    }
+}
 
-              goto exit_request_loop;
-            }
+/**
+ * http_exchange_pipelined:
+ * @self: HttpProxy instance
+ *
+ * Fetches the response to a request which was sent ahead of its turn.  If
+ * the server closed the connection before responding to it, the request
+ * is sent again on a new connection, just like a request which was not
+ * pipelined.
+ **/
+static gboolean
+http_exchange_pipelined(HttpProxy *self)
+{
+  z_proxy_enter(self);
 
-          rerequest_attempts = self->rerequest_attempts;
+  /* the response to this request is still due, the connection must not be
+   * pooled until it has been read */
+  self->server_idle = FALSE;
 
-          while (1)
-            {
-              retry = FALSE;
-              /*LOG
-                This message reports that Zorp is sending the filtered request and
-                headers, and copies the requests data to the server.
-              */
-              z_proxy_log(self, HTTP_DEBUG, 6, "Sending request and headers, copying request data;");
+  if (!self->force_reconnect)
+    {
+      /*LOG
+        This message reports that Zorp is fetching the response to a
+        pipelined request from the server.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Fetching response to pipelined request;");
 
-              if (!retry && !http_copy_request(self))
-                {
-                  if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-                    self->error_code = HTTP_MSG_CLIENT_SYNTAX;
+      if (http_fetch_response(self))
+        z_proxy_return(self, TRUE);
 
-                  retry = TRUE;
-                }
+      /*LOG
+        This message indicates that the server did not respond to a
+        pipelined request, it is sent again on a new connection.
+      */
+      z_proxy_log(self, HTTP_ERROR, 4, "Server did not respond to pipelined request, resending; req='%s', url='%s'",
+                  self->request_method->str, self->request_url->str);
+      self->force_reconnect = TRUE;
+      self->error_code = HTTP_MSG_NOT_ASSIGNED;
+    }
 
-              /*LOG
-                This message reports that Zorp is fetching the response and headers
-                from the server.
-              */
-              z_proxy_log(self, HTTP_DEBUG, 6, "Fetching response and headers;");
+  z_proxy_return(self, http_exchange_with_server(self));
+}
 
-              if (!retry && !http_fetch_response(self))
-                {
-                  if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-                    self->error_code = HTTP_MSG_SERVER_SYNTAX;
+/**
+ * http_step_fail:
+ * @self: HttpProxy instance
+ * @default_error: error code to use if the failing stage did not set one
+ *
+ * Helper for http_step(), records the error and moves the state machine
+ * to the exit state.
+ **/
+static inline HttpStepResult
+http_step_fail(HttpProxy *self, gint default_error)
+{
+  if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
+    self->error_code = default_error;
 
-                  retry = TRUE;
-                }
+  self->state = HTTP_STATE_EXIT;
+  return HTTP_STEP_CONTINUE;
+}
 
-              if (retry && rerequest_attempts > 1)
-                {
-                  z_proxy_log(self, HTTP_ERROR, 3, "Server request failed, retrying; attempts='%d'", rerequest_attempts);
-                  self->force_reconnect = TRUE;
-                  self->error_code = HTTP_MSG_NOT_ASSIGNED;
-                  rerequest_attempts--;
-                  continue;
-                }
-              else if (retry)
-                {
-                  goto exit_request_loop;
-                }
-              else
-                {
-                  break;
-                }
-            }
+/**
+ * http_step:
+ * @self: HttpProxy instance
+ *
+ * Runs the current stage of the request processing state machine and
+ * advances to the next one. Each stage performs its own I/O in blocking
+ * mode, except for fetching the request line, which returns
+ * HTTP_STEP_SUSPEND if the client stream is nonblocking and no complete
+ * request line is available yet. This makes the state machine resumable at
+ * request boundaries, which is where keep-alive sessions spend most of
+ * their time.
+ *
+ * Returns: HTTP_STEP_CONTINUE if http_step() should be called again,
+ * HTTP_STEP_SUSPEND if the session waits for the client and
+ * HTTP_STEP_FINISHED if the session has ended.
+ **/
+static HttpStepResult
+http_step(HttpProxy *self)
+{
+  GIOStatus res;
 
-          if (!z_proxy_loop_iteration(s))
-            goto exit_request_loop;
+  z_proxy_enter(self);
 
-          /*LOG
-            This message reports that Zorp is processing the fetched response
-            and the headers.
-          */
-          z_proxy_log(self, HTTP_DEBUG, 6, "Processing response and headers;");
+  switch (self->state)
+    {
+    case HTTP_STATE_FETCH_REQUEST:
+      self->error_code = HTTP_MSG_NOT_ASSIGNED;
 
-          if (!http_process_response(self))
-            {
-              if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-                self->error_code = HTTP_MSG_SERVER_SYNTAX;
+      /*LOG
+        This message reports that Zorp is fetching the request and the
+        headers from the client.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Fetching request and headers;");
 
-              goto exit_request_loop;
-            }
+      res = http_fetch_request(self);
+      if (res == G_IO_STATUS_AGAIN)
+        z_proxy_return(self, HTTP_STEP_SUSPEND);
 
-          /*LOG
-            This message reports that Zorp is filtering the processed
-            response and the headers.
-          */
-          z_proxy_log(self, HTTP_DEBUG, 6, "Filtering response and headers;");
+      if (res != G_IO_STATUS_NORMAL)
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_CLIENT_SYNTAX));
 
-          if (!http_filter_response(self))
-            {
-              if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-                self->error_code = HTTP_MSG_POLICY_SYNTAX;
+      if (!z_proxy_loop_iteration(&self->super))
+        {
+          self->state = HTTP_STATE_EXIT;
+          break;
+        }
 
-              goto exit_request_loop;
-            }
+      self->state = HTTP_STATE_PROCESS_REQUEST;
+      break;
 
+    case HTTP_STATE_PROCESS_REQUEST:
+      /*LOG
+        This message reports that Zorp is processing the fetched request and
+        the headers.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "processing request and headers;");
+
+      if (!http_process_request(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_CLIENT_SYNTAX));
+
+      if (self->max_keepalive_requests != 0 &&
+          self->request_count >= self->max_keepalive_requests - 1)
+        {
           /*LOG
-            This message reports that Zorp is sending the filtered
-            response and headers, and copies the response data to the client.
+            This message reports that the maximum number of requests in a keep-alive loop is
+            reached, and Zorp is closing after this request. Check the max_keepalive_request
+            attribute.
           */
-          z_proxy_log(self, HTTP_DEBUG, 6, "Copying response and headers, copying response data;");
+          z_proxy_log(self, HTTP_POLICY, 3,
+                      "Maximum keep-alive request reached, setting connection mode to close; count='%d', max='%d'",
+                      self->request_count, self->max_keepalive_requests);
+          self->connection_mode = HTTP_CONNECTION_CLOSE;
+        }
 
-          if (!http_copy_response(self))
-            {
-              if (self->error_code == HTTP_MSG_NOT_ASSIGNED)
-                self->error_code = HTTP_MSG_SERVER_SYNTAX;
+      self->state = HTTP_STATE_FILTER_REQUEST;
+      break;
 
-              goto exit_request_loop;
-            }
+    case HTTP_STATE_FILTER_REQUEST:
+      /*LOG
+        This message reports that Zorp is filtering the processed
+        request and the headers.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Filtering request and headers;");
+
+      if (!http_filter_request(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_POLICY_SYNTAX));
+
+      if (self->send_custom_response)
+        {
+          self->state = HTTP_STATE_EXIT;
+          break;
+        }
+
+      /*LOG
+        This message indicates that Zorp is recechecking the HTTP request
+        after possible changes performed by the policy layer.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Reprocessing filtered request;");
+
+      if (!http_process_filtered_request(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_CLIENT_SYNTAX));
+
+      if (self->server_protocol == HTTP_PROTO_HTTP || self->server_protocol == HTTP_PROTO_HTTPS)
+        {
+          self->state = HTTP_STATE_CONNECT;
         }
       else if (self->server_protocol == HTTP_PROTO_FTP)
         {
@@ -3756,19 +4255,109 @@ http_main(ZProxy *s)
             }
 
           self->connection_mode = HTTP_CONNECTION_CLOSE;
+          self->state = HTTP_STATE_FINISH_REQUEST;
         }
       else
         {
           /*LOG
             This message indicates an internal error in HTTP proxy. Please
             report this event to the BalaSys Development Team (at
-	    devel@balasys.hu).
+            devel@balasys.hu).
           */
           z_proxy_log(self, CORE_ERROR, 1, "Internal error, invalid server_protocol; server_protocol='%d'", self->server_protocol);
+          self->state = HTTP_STATE_FINISH_REQUEST;
+        }
+      break;
+
+    case HTTP_STATE_CONNECT:
+      if ((self->request_flags & HTTP_REQ_FLG_CONNECT))
+        {
+          if (http_handle_connect(self))
+            {
+              /* connect method was successful, we can now safely quit */
+              self->state = HTTP_STATE_DONE;
+              break;
+            }
+
+          self->state = HTTP_STATE_EXIT;
+          break;
+        }
+
+      if (self->pipeline_sent)
+        {
+          self->pipeline_sent = FALSE;
+
+          if (!http_exchange_pipelined(self))
+            {
+              self->state = HTTP_STATE_EXIT;
+              break;
+            }
+        }
+      else if (!http_exchange_with_server(self))
+        {
+          self->state = HTTP_STATE_EXIT;
+          break;
+        }
+
+      if (!z_proxy_loop_iteration(&self->super))
+        {
+          self->state = HTTP_STATE_EXIT;
+          break;
         }
 
+      self->state = HTTP_STATE_PROCESS_RESPONSE;
+      break;
+
+    case HTTP_STATE_PROCESS_RESPONSE:
+      /*LOG
+        This message reports that Zorp is processing the fetched response
+        and the headers.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Processing response and headers;");
+
+      if (!http_process_response(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_SERVER_SYNTAX));
+
+      self->state = HTTP_STATE_FILTER_RESPONSE;
+      break;
+
+    case HTTP_STATE_FILTER_RESPONSE:
+      /*LOG
+        This message reports that Zorp is filtering the processed
+        response and the headers.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Filtering response and headers;");
+
+      if (!http_filter_response(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_POLICY_SYNTAX));
+
+      self->state = HTTP_STATE_COPY_RESPONSE;
+      break;
+
+    case HTTP_STATE_COPY_RESPONSE:
+      /*LOG
+        This message reports that Zorp is sending the filtered
+        response and headers, and copies the response data to the client.
+      */
+      z_proxy_log(self, HTTP_DEBUG, 6, "Copying response and headers, copying response data;");
+
+      if (!http_copy_response(self))
+        z_proxy_return(self, http_step_fail(self, HTTP_MSG_SERVER_SYNTAX));
+
+      self->state = HTTP_STATE_FINISH_REQUEST;
+      break;
+
+    case HTTP_STATE_FINISH_REQUEST:
+      self->server_idle = (self->server_protocol == HTTP_PROTO_HTTP &&
+                           self->server_connection_mode == HTTP_CONNECTION_KEEPALIVE);
+      self->pipeline_server_ok = (self->server_connection_mode == HTTP_CONNECTION_KEEPALIVE &&
+                                  self->proto_version[EP_SERVER] >= 0x0101);
+
       if (self->connection_mode == HTTP_CONNECTION_CLOSE)
-        goto exit_request_loop;
+        {
+          self->state = HTTP_STATE_EXIT;
+          break;
+        }
 
       if (self->server_connection_mode == HTTP_CONNECTION_CLOSE)
         {
@@ -3790,54 +4379,442 @@ http_main(ZProxy *s)
 
           z_policy_unlock(self->super.thread);
         }
+
+      /* requests read ahead continue where they were left */
+      if (!http_pipeline_next(self))
+        self->state = HTTP_STATE_FETCH_REQUEST;
+      break;
+
+    case HTTP_STATE_EXIT:
+      /* responses to requests sent ahead would be delivered to the next
+       * user of a pooled connection */
+      if (http_pipeline_clear(self) && self->super.endpoints[EP_SERVER])
+        {
+          z_stream_shutdown(self->super.endpoints[EP_SERVER], SHUT_RDWR, NULL);
+          z_stream_close(self->super.endpoints[EP_SERVER], NULL);
+          z_stream_unref(self->super.endpoints[EP_SERVER]);
+          self->super.endpoints[EP_SERVER] = NULL;
+          self->server_idle = FALSE;
+
+          z_proxy_ssl_clear_session(&self->super, EP_SERVER);
+        }
+
+      http_server_pool_checkin(self);
+      http_exit_request_loop(self);
+      self->state = HTTP_STATE_DONE;
+      z_proxy_return(self, HTTP_STEP_FINISHED);
+
+    case HTTP_STATE_DONE:
+      z_proxy_return(self, HTTP_STEP_FINISHED);
     }
 
- exit_request_loop:
-  /*LOG
-    This message reports that Zorp is exiting the keep-alive loop and
-    closing the connection.
-  */
-  z_proxy_log(self, HTTP_DEBUG, 6, "exiting keep-alive loop;");
+  z_proxy_return(self, HTTP_STEP_CONTINUE);
+}
 
-  if (self->error_code > 0)
+static void http_threaded_resume(ZProxy *s, ZProxyParkEvent event);
+
+/**
+ * http_threaded_run:
+ * @self: HttpProxy instance
+ *
+ * Drives the request processing state machine of a threaded HttpProxy.
+ * With park_idle_sessions enabled the request line is read in nonblocking
+ * mode, and if it has not arrived yet the session is parked: the thread is
+ * released and the session continues in http_threaded_resume() once the
+ * client becomes readable or timeout_request elapses.
+ **/
+static void
+http_threaded_run(HttpProxy *self)
+{
+  HttpStepResult res;
+
+  z_proxy_enter(self);
+  do
     {
-      http_error_message(self, self->error_status, self->error_code, self->error_info);
+      /* http_fetch_request() switches back to blocking mode as soon as the
+       * request line is complete */
+      if (self->park_idle_sessions && self->state == HTTP_STATE_FETCH_REQUEST)
+        z_stream_set_nonblock(self->super.endpoints[EP_CLIENT], TRUE);
+      else if (self->park_idle_sessions && self->state == HTTP_STATE_EXIT)
+        z_stream_set_nonblock(self->super.endpoints[EP_CLIENT], FALSE);
+
+      res = http_step(self);
     }
-  else if (self->send_custom_response)
+  while (res == HTTP_STEP_CONTINUE);
+
+  /* no request data is buffered in the stream stack when the nonblocking
+   * read returns G_IO_STATUS_AGAIN, thus waiting for the fd is enough */
+  if (res == HTTP_STEP_SUSPEND)
+    z_proxy_park(&self->super, self->super.endpoints[EP_CLIENT], self->timeout_request, http_threaded_resume);
+
+  z_proxy_return(self);
+}
+
+/**
+ * http_threaded_resume:
+ * @s: HttpProxy instance
+ * @event: the reason the session was resumed
+ *
+ * Continues a parked threaded session in a thread of the proxy thread
+ * pool.
+ **/
+static void
+http_threaded_resume(ZProxy *s, ZProxyParkEvent event)
+{
+  HttpProxy *self = Z_CAST(s, HttpProxy);
+
+  z_proxy_enter(self);
+  if (event == Z_PROXY_PARK_TIMEOUT)
     {
-      self->send_custom_response = FALSE;
-      http_send_custom_response(self, self->error_status, self->error_msg, self->error_headers, self->custom_response_body);
+      self->error_code = HTTP_MSG_OK;
+      if (self->request_count == 0)
+        {
+          self->error_code = HTTP_MSG_CLIENT_TIMEOUT;
+          self->error_status = 408;
+        }
+      self->state = HTTP_STATE_EXIT;
+    }
+  else if (event == Z_PROXY_PARK_WAKEUP && !z_proxy_loop_iteration(s))
+    {
+      self->state = HTTP_STATE_EXIT;
     }
 
-  /* in some cases the client might still have some data already queued to us,
-   * fetch and ignore that data to avoid the RST sent in these cases
-   */
-  http_fetch_buffered_data(self);
+  http_threaded_run(self);
+  z_proxy_return(self);
+}
 
-  if (self->error_code <= 0 && self->reset_on_close)
+/**
+ * http_main:
+ * @s: HttpProxy instance
+ *
+ * Main function of the threaded HttpProxy, drives the request processing
+ * state machine with blocking I/O until the session ends or gets parked.
+ **/
+static void
+http_main(ZProxy *s)
+{
+  HttpProxy *self = Z_CAST(s, HttpProxy);
+
+  z_proxy_enter(self);
+  self->request_count = 0;
+  self->state = HTTP_STATE_FETCH_REQUEST;
+  http_client_stream_init(self);
+  http_threaded_run(self);
+  z_proxy_return(self);
+}
+
+static void http_nonblocking_run(HttpProxy *self);
+
+/**
+ * http_nonblocking_idle_timeout:
+ * @user_data: HttpProxy instance
+ *
+ * Timeout callback fired when the client did not send a complete request
+ * within timeout_request while the session was waiting in the proxy
+ * group's poll loop.
+ **/
+static gboolean
+http_nonblocking_idle_timeout(gpointer user_data)
+{
+  HttpProxy *self = (HttpProxy *) user_data;
+
+  z_proxy_enter(self);
+  self->error_code = HTTP_MSG_OK;
+  if (self->request_count == 0)
     {
-      int fd;
+      self->error_code = HTTP_MSG_CLIENT_TIMEOUT;
+      self->error_status = 408;
+    }
+  self->state = HTTP_STATE_EXIT;
+  http_nonblocking_run(self);
+  z_proxy_return(self, FALSE);
+}
 
-      fd = z_stream_get_fd(self->super.endpoints[EP_CLIENT]);
+/**
+ * http_nonblocking_unpark:
+ * @self: HttpProxy instance
+ *
+ * Removes the client stream from the proxy group's poll loop, so that the
+ * request can be processed using the usual blocking stream operations.
+ * Safe to call when the session is not parked.
+ **/
+static void
+http_nonblocking_unpark(HttpProxy *self)
+{
+  z_proxy_enter(self);
+  if (self->parked_stream)
+    {
+      z_stream_set_cond(self->parked_stream, G_IO_IN, FALSE);
+      z_stream_set_callback(self->parked_stream, G_IO_IN, NULL, NULL, NULL);
+      z_poll_remove_stream(self->group_poll, self->parked_stream);
+      z_stream_set_nonblock(self->parked_stream, FALSE);
+      z_stream_unref(self->parked_stream);
+      self->parked_stream = NULL;
+    }
+  z_proxy_return(self);
+}
 
-      if (fd >= 0)
-        {
-          struct linger l;
+/**
+ * http_nonblocking_client_readable:
+ * @stream: client stream
+ * @cond: condition that triggered the callback
+ * @user_data: HttpProxy instance
+ *
+ * Called by the proxy group's poll loop when the client sent data while the
+ * session was waiting for the next request.
+ **/
+static gboolean
+http_nonblocking_client_readable(ZStream * /* stream */, GIOCondition  /* cond */, gpointer user_data)
+{
+  HttpProxy *self = (HttpProxy *) user_data;
 
-          l.l_onoff = 1;
-          l.l_linger = 0;
-          setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
-        }
+  z_proxy_enter(self);
+  http_nonblocking_run(self);
+  z_proxy_return(self, TRUE);
+}
 
-      /* avoid z_stream_shutdown in the destroy path */
-      z_stream_close(self->super.endpoints[EP_CLIENT], NULL);
-      z_stream_unref(self->super.endpoints[EP_CLIENT]);
-      self->super.endpoints[EP_CLIENT] = NULL;
+/**
+ * http_nonblocking_park:
+ * @self: HttpProxy instance
+ *
+ * Parks the session in the proxy group's poll loop until the next request
+ * arrives or timeout_request elapses.
+ **/
+static void
+http_nonblocking_park(HttpProxy *self)
+{
+  GMainContext *context;
+
+  z_proxy_enter(self);
+  if (!self->idle_timeout)
+    {
+      self->idle_timeout = z_timeout_source_new(self->timeout_request);
+      g_source_set_callback(self->idle_timeout, http_nonblocking_idle_timeout, self, NULL);
+      context = z_poll_get_context(self->group_poll);
+      g_source_attach(self->idle_timeout, context);
+    }
+  else
+    {
+      z_timeout_source_set_timeout(self->idle_timeout, self->timeout_request);
     }
 
+  if (!self->parked_stream)
+    {
+      z_stream_ref(self->super.endpoints[EP_CLIENT]);
+      self->parked_stream = self->super.endpoints[EP_CLIENT];
+      z_stream_set_nonblock(self->parked_stream, TRUE);
+      z_stream_set_callback(self->parked_stream, G_IO_IN, http_nonblocking_client_readable, self, NULL);
+      z_stream_set_cond(self->parked_stream, G_IO_IN, TRUE);
+      z_poll_add_stream(self->group_poll, self->parked_stream);
+    }
   z_proxy_return(self);
 }
 
+/**
+ * http_nonblocking_detach:
+ * @self: HttpProxy instance
+ *
+ * Removes every trace of the session from the proxy group's poll loop.
+ * Safe to call multiple times.
+ **/
+static void
+http_nonblocking_detach(HttpProxy *self)
+{
+  z_proxy_enter(self);
+  if (self->idle_timeout)
+    {
+      g_source_destroy(self->idle_timeout);
+      g_source_unref(self->idle_timeout);
+      self->idle_timeout = NULL;
+    }
+
+  http_nonblocking_unpark(self);
+
+  if (self->group_poll)
+    {
+      z_poll_unref(self->group_poll);
+      self->group_poll = NULL;
+    }
+  z_proxy_return(self);
+}
+
+/**
+ * http_nonblocking_handback:
+ * @user_data: HttpProxy instance
+ *
+ * Idle callback run in the proxy group's poll loop when the proxy thread
+ * has finished processing a request, continues the state machine where
+ * the thread left it.
+ **/
+static gboolean
+http_nonblocking_handback(gpointer user_data)
+{
+  HttpProxy *self = (HttpProxy *) user_data;
+
+  z_proxy_enter(self);
+  self->super.offloaded = FALSE;
+  z_proxy_leave(self);
+  http_nonblocking_run(self);
+  return FALSE;
+}
+
+/**
+ * http_nonblocking_thread:
+ * @s: HttpProxy instance
+ *
+ * Runs in a thread of the proxy thread pool and processes the request
+ * with blocking I/O, until the session waits for the next request or
+ * ends. The session is then handed back to the proxy group's poll loop,
+ * as the poll loop is the only one allowed to park or stop it.
+ **/
+static gpointer
+http_nonblocking_thread(gpointer s)
+{
+  HttpProxy *self = (HttpProxy *) s;
+  HttpStepResult res;
+  GSource *source;
+
+  z_proxy_enter(self);
+  do
+    res = http_step(self);
+  while (res == HTTP_STEP_CONTINUE && self->state != HTTP_STATE_FETCH_REQUEST);
+
+  source = g_idle_source_new();
+  g_source_set_callback(source, http_nonblocking_handback, self, (GDestroyNotify) z_proxy_unref);
+  g_source_attach(source, z_poll_get_context(self->group_poll));
+  g_source_unref(source);
+  z_proxy_leave(self);
+  return NULL;
+}
+
+/**
+ * http_nonblocking_offload:
+ * @self: HttpProxy instance
+ *
+ * Removes the session from the proxy group's poll loop and continues
+ * processing the current request in a proxy thread, so that slow clients
+ * or servers do not stall the other sessions of the group.
+ *
+ * Returns: FALSE if no thread could be scheduled, the request has to be
+ * processed in the poll loop then
+ **/
+static gboolean
+http_nonblocking_offload(HttpProxy *self)
+{
+  z_proxy_enter(self);
+  http_nonblocking_unpark(self);
+  if (self->idle_timeout)
+    {
+      g_source_destroy(self->idle_timeout);
+      g_source_unref(self->idle_timeout);
+      self->idle_timeout = NULL;
+    }
+
+  self->super.offloaded = TRUE;
+  z_proxy_ref(&self->super);
+  if (!z_proxy_thread_pool_run(self->super.session_id, http_nonblocking_thread, self))
+    {
+      /*LOG
+        This message indicates that no proxy thread could be started to
+        process the request, thus it is processed in the poll loop of the
+        proxy group, blocking the other sessions of the group meanwhile.
+      */
+      z_proxy_log(self, HTTP_ERROR, 3, "Error scheduling request processing to a proxy thread;");
+      self->super.offloaded = FALSE;
+      z_proxy_unref(&self->super);
+      z_proxy_return(self, FALSE);
+    }
+  z_proxy_return(self, TRUE);
+}
+
+/**
+ * http_nonblocking_run:
+ * @self: HttpProxy instance
+ *
+ * Drives the request processing state machine from the proxy group's poll
+ * loop. The request line is read in nonblocking mode in the poll loop;
+ * once it is complete, the rest of the request (headers, body, policy
+ * calls, connecting the server and copying the response) is processed in
+ * a proxy thread, and the session is parked in the poll loop again when
+ * the thread hands it back. When the session ends the proxy is stopped,
+ * @self must not be referenced afterwards.
+ **/
+static void
+http_nonblocking_run(HttpProxy *self)
+{
+  HttpStepResult res;
+
+  z_proxy_enter(self);
+  do
+    {
+      if (self->state == HTTP_STATE_FETCH_REQUEST)
+        {
+          http_nonblocking_park(self);
+        }
+      else if (self->state != HTTP_STATE_DONE && http_nonblocking_offload(self))
+        {
+          z_proxy_return(self);
+        }
+      else
+        {
+          http_nonblocking_unpark(self);
+        }
+
+      res = http_step(self);
+    }
+  while (res == HTTP_STEP_CONTINUE);
+
+  if (res == HTTP_STEP_SUSPEND)
+    z_proxy_return(self);
+
+  http_nonblocking_detach(self);
+  z_proxy_leave(self);
+  z_proxy_nonblocking_stop(&self->super);
+}
+
+/**
+ * http_nonblocking_init:
+ * @s: HttpProxy instance
+ * @poll: the poll loop of the proxy group
+ *
+ * Nonblocking counterpart of http_main(), registers the client stream in
+ * the proxy group's poll loop, so that idle keep-alive sessions do not
+ * occupy a thread of their own.
+ **/
+static gboolean
+http_nonblocking_init(ZProxy *s, ZPoll *poll)
+{
+  HttpProxy *self = Z_CAST(s, HttpProxy);
+
+  z_proxy_enter(self);
+  self->request_count = 0;
+  self->state = HTTP_STATE_FETCH_REQUEST;
+  http_client_stream_init(self);
+
+  z_poll_ref(poll);
+  self->group_poll = poll;
+
+  /* the first request is waited for in the poll loop, just like the
+   * subsequent keep-alive ones */
+  http_nonblocking_park(self);
+  z_proxy_return(self, TRUE);
+}
+
+/**
+ * http_nonblocking_deinit:
+ * @s: HttpProxy instance
+ *
+ * Called when a nonblocking HttpProxy is stopped, unregisters the session
+ * from the proxy group's poll loop.
+ **/
+static void
+http_nonblocking_deinit(ZProxy *s)
+{
+  HttpProxy *self = Z_CAST(s, HttpProxy);
+
+  http_nonblocking_detach(self);
+}
+
 static gboolean
 http_config(ZProxy *s)
 {
@@ -3867,6 +4844,9 @@ http_proxy_free(ZObject *s)
 
   z_enter();
 
+  http_pipeline_clear(self);
+  g_queue_free(self->pipeline);
+
   for (i = EP_CLIENT; i < EP_MAX; i++)
     http_destroy_headers(&self->headers[i]);
 
@@ -3881,6 +4861,7 @@ http_proxy_free(ZObject *s)
   g_string_free(self->request_url, TRUE);
   http_destroy_url(&self->request_url_parts);
   /* NOTE: hashes are freed up by pyvars */
+  http_policy_verdicts_free(self);
   z_poll_unref(self->poll);
   z_proxy_free_method(s);
   z_return();
@@ -3891,8 +4872,20 @@ http_proxy_new(ZProxyParams *params)
 {
   HttpProxy *self;
 
+  gboolean nonblocking = FALSE;
+
   z_enter();
   self = Z_CAST(z_proxy_new(Z_CLASS(HttpProxy), params), HttpProxy);
+
+  /* the execution model has to be known before the proxy is started in
+   * its group, thus it cannot be a regular config-time attribute */
+  z_python_lock();
+  z_policy_var_parse_boolean(z_policy_getattr(params->handler, "nonblocking"), &nonblocking);
+  z_python_unlock();
+
+  if (nonblocking)
+    self->super.flags |= ZPF_NONBLOCKING;
+
   z_return((&self->super));
 }
 
@@ -3909,8 +4902,8 @@ ZProxyFuncs http_proxy_funcs =
     http_main,   /* main */
     NULL,        /* shutdown */
     NULL,        /* destroy */
-    NULL,        /* nonblocking_init */
-    NULL,        /* nonblocking_deinit */
+    http_nonblocking_init,   /* nonblocking_init */
+    http_nonblocking_deinit, /* nonblocking_deinit */
     NULL,        /* wakeup */
   };
 
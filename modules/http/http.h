@@ -182,6 +182,28 @@ typedef enum _HttpMessageCode
 #define HTTP_TRANSFER_TO_BLOB            1
 #define HTTP_TRANSFER_FROM_BLOB          2
 
+/* stages of the request processing state machine, see http_step() */
+typedef enum _HttpState
+{
+  HTTP_STATE_FETCH_REQUEST,
+  HTTP_STATE_PROCESS_REQUEST,
+  HTTP_STATE_FILTER_REQUEST,
+  HTTP_STATE_CONNECT,
+  HTTP_STATE_PROCESS_RESPONSE,
+  HTTP_STATE_FILTER_RESPONSE,
+  HTTP_STATE_COPY_RESPONSE,
+  HTTP_STATE_FINISH_REQUEST,
+  HTTP_STATE_EXIT,
+  HTTP_STATE_DONE,
+} HttpState;
+
+typedef enum _HttpStepResult
+{
+  HTTP_STEP_CONTINUE,
+  HTTP_STEP_SUSPEND,
+  HTTP_STEP_FINISHED,
+} HttpStepResult;
+
 typedef struct _HttpHeader HttpHeader;
 typedef struct _HttpHeaders HttpHeaders;
 typedef struct _HttpURL HttpURL;
@@ -200,19 +222,35 @@ struct _HttpHeader
   GString *name;
   GString *value;
   gboolean present;
+
+  /* hash of the name at the time the header was added */
+  guint hash;
+
+  /* whether this is the first header with this name, e.g. it is in the index */
+  gboolean indexed;
 };
 
 /* This structure represents a set of headers with possibility to quickly
- * look headers up (through a GHashTable indexed by the header name), and also
- * retain original order, using a linked list.
+ * look headers up (through an open addressing index on the header names),
+ * and also retain original order, using a flat array.  Header slots and
+ * their name/value buffers are allocated in blocks and reused by the next
+ * message, so a keep-alive connection does not allocate memory for its
+ * headers once the buffers have grown large enough.
  */
 struct _HttpHeaders
 {
-  /* linked list of HttpHeader structures */
-  GList *list;
+  /* headers in the order they were added, slots up to @size are allocated */
+  HttpHeader **headers;
+  guint count;
+  guint size;
 
-  /* hash table for quick lookups */
-  GHashTable *hash;
+  /* blocks of HttpHeader structures @headers point into */
+  GSList *blocks;
+
+  /* position + 1 of the first header with a given name, 0 if the slot is empty */
+  guint *index;
+  guint index_mask;
+  guint indexed;
 
   /* flattened representation of the headers */
   GString *flat;
@@ -234,13 +272,91 @@ struct _HttpURL
   gboolean need_brackets; /* IPv6 addresses are surrounded by brackets, this information needs to be preserved for formatting */
 };
 
+/* set of characters permitted by a combination of HTTP_HDR_CF_* flags */
+typedef struct _HttpCharset
+{
+  /* one bit for each byte value */
+  guint8 bitmap[32];
+
+  /* the same for ASCII, indexed by the low nibble, one bit for each high nibble */
+  guint8 rows[16];
+} HttpCharset;
+
+typedef enum _HttpCharsetKernel
+{
+  HTTP_CHARSET_KERNEL_SCALAR,
+  HTTP_CHARSET_KERNEL_SSSE3,
+  HTTP_CHARSET_KERNEL_AVX2,
+} HttpCharsetKernel;
+
 typedef struct _HttpElementInfo
 {
   const gchar *name;
   guint32 flags;
   gssize max_len; /* only used for headers */
+  const HttpCharset *charset; /* only used for headers, compiled from flags */
 } HttpElementInfo;
 
+/* the kind of policy hash a verdict was compiled from */
+typedef enum _HttpPolicyKind
+{
+  HTTP_POLICY_REQUEST,
+  HTTP_POLICY_RESPONSE,
+  HTTP_POLICY_HEADER,
+  HTTP_POLICY_MAX
+} HttpPolicyKind;
+
+/* native representation of a single policy hash item */
+typedef struct _HttpPolicyVerdict
+{
+  gint action;          /* HTTP_REQ_*, HTTP_RSP_* or HTTP_HDR_*, -1 if the item has no verdict */
+  gboolean valid;       /* whether the tuple has the arguments required by @action */
+  gchar *name;          /* header name for CHANGE_NAME, CHANGE_BOTH and INSERT/REPLACE */
+  gchar *value;         /* header value or error message of a REJECT */
+  ZPolicyObj *handler;  /* call-back of *_POLICY items, borrowed from the hash */
+} HttpPolicyVerdict;
+
+/* a pipelined request read ahead of its turn, holding the request specific
+ * state of the proxy while the responses to the earlier requests are
+ * processed, see httppipeline.cc */
+typedef struct _HttpPipelineRequest
+{
+  /* the stage to continue the request at */
+  HttpState state;
+
+  /* whether the request has already been sent to the server */
+  gboolean sent;
+
+  GString *request_method;
+  guint request_flags;
+  GString *request_url;
+  HttpURL request_url_parts;
+  gchar request_version[16];
+  guint request_type;
+  guint server_protocol;
+  GString *remote_server;
+  guint remote_port;
+  GString *parent_proxy;
+  guint parent_proxy_port;
+  guint proto_version;
+  guint connection_mode;
+  HttpHeaders headers;
+  HttpHeader *connection_hdr;
+  gboolean request_data_stored;
+  ZBlob *request_data;
+  GString *auth_header_value;
+  GString *append_cookie;
+  ZPolicyObj *request_categories;
+
+  gint error_code;
+  guint error_status;
+  GString *error_info;
+  GString *error_msg;
+  GString *error_headers;
+  gboolean send_custom_response;
+  GString *custom_response_body;
+} HttpPipelineRequest;
+
 /* This structure represents an HTTP proxy */
 struct _HttpProxy
 {
@@ -251,6 +367,19 @@ struct _HttpProxy
   /* poll is used during transfers */
   ZPoll *poll;
 
+  /* current stage of the request processing state machine */
+  HttpState state;
+
+  /* empty lines skipped before the request line, kept across nonblocking
+   * reads */
+  gint empty_lines;
+
+  /* nonblocking mode: the poll loop of our proxy group, the client stream
+   * while it is registered there and the timer for timeout_request */
+  ZPoll *group_poll;
+  ZStream *parked_stream;
+  GSource *idle_timeout;
+
   /* stacked proxy */
   ZStackedProxy *stacked;
 
@@ -264,6 +393,34 @@ struct _HttpProxy
   guint timeout_response;
 
   guint rerequest_attempts;
+
+  /* idle keep-alive server connections are returned to a process-wide
+   * pool and reused by other sessions, see httpconnpool.cc */
+  gboolean server_connection_pool;
+  guint server_connection_pool_max;
+  guint server_connection_pool_timeout;
+
+  /* the response to the last request was read completely from the server
+   * connection, and the server permitted keep-alive */
+  gboolean server_idle;
+
+  /* threaded sessions waiting for the next request return their thread
+   * and wait in the proxy parking loop, see z_proxy_park() */
+  gboolean park_idle_sessions;
+
+  /* HTTP/1.1 pipelining: requests the client sent behind the current one
+   * are processed and forwarded before the current response arrives, the
+   * queue holds them in the order of their responses */
+  gboolean pipelining;
+  guint pipeline_depth;
+  GQueue *pipeline;
+
+  /* the current request was sent to the server ahead of its turn */
+  gboolean pipeline_sent;
+
+  /* the server connection answered a request with HTTP/1.1 keep-alive */
+  gboolean pipeline_server_ok;
+
   gboolean request_data_stored;
   ZBlob *request_data;
 
@@ -331,6 +488,9 @@ struct _HttpProxy
   /* port we are connected to */
   guint connected_port;
 
+  /* whether connected_server is a parent proxy */
+  gboolean connected_parent;
+
   /* the target server as derived from the request (URL and Host header) */
   GString *remote_server;
 
@@ -444,6 +604,16 @@ struct _HttpProxy
   /* policy hash to process on response headers */
   GHashTable *response_header_policy;
 
+  /* verdicts compiled from the policy hashes above, indexed by the
+   * policy hash item, see httppolicy.cc */
+  GHashTable *policy_verdicts[HTTP_POLICY_MAX];
+
+  /* HTTP_HDR_INSERT and HTTP_HDR_REPLACE items of the header hashes */
+  GList *header_inserts[EP_MAX];
+
+  /* hash generation of the policy dict the verdicts were compiled at */
+  guint policy_generation;
+
   /* hack: when transfer feels the connection to the server should be
    * reestablished, it sets this value to TRUE */
 
@@ -558,6 +728,39 @@ http_log_headers(HttpProxy *self, ZEndpoint side, const gchar *tag);
 gint http_filter_hash_compare(gconstpointer a, gconstpointer b);
 gint http_filter_hash_bucket(gconstpointer a);
 
+/* compiled policy verdicts */
+
+void http_policy_verdicts_compile(HttpProxy *self);
+void http_policy_verdicts_free(HttpProxy *self);
+HttpPolicyVerdict *http_policy_verdict_lookup(HttpProxy *self, HttpPolicyKind kind, ZPolicyObj *f);
+GList *http_policy_header_inserts(HttpProxy *self, ZEndpoint side);
+
+/* server connection pool */
+
+ZStream *http_conn_pool_checkout(const gchar *key);
+gboolean http_conn_pool_checkin(const gchar *key, ZStream *stream, guint max_idle, guint timeout);
+gboolean http_server_route_matches(HttpProxy *self);
+
+/* request pipelining */
+
+HttpPipelineRequest *http_pipeline_request_new(void);
+void http_pipeline_request_free(HttpProxy *self, HttpPipelineRequest *req);
+void http_pipeline_request_swap(HttpProxy *self, HttpPipelineRequest *req);
+gboolean http_pipeline_request_eligible(HttpProxy *self);
+HttpPipelineRequest *http_pipeline_lookahead_begin(HttpProxy *self);
+void http_pipeline_lookahead_queue(HttpProxy *self, HttpPipelineRequest *req);
+void http_pipeline_lookahead_end(HttpProxy *self, HttpPipelineRequest *current);
+gboolean http_pipeline_next(HttpProxy *self);
+void http_pipeline_unsend(HttpProxy *self);
+gboolean http_pipeline_clear(HttpProxy *self);
+
+/* header charset validation */
+
+const HttpCharset *http_charset_lookup(guint32 flags);
+gboolean http_charset_check(const HttpCharset *charset, const gchar *value, gsize len);
+gboolean http_charset_check_with(HttpCharsetKernel kernel, const HttpCharset *charset, const gchar *value, gsize len,
+                                 gboolean *supported);
+
 /* URL processing */
 
 gboolean http_parse_url(HttpURL *url, gboolean permit_unicode_url, gboolean permit_invalid_hex_escape,
@@ -0,0 +1,295 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include "http.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HTTP_CHARSET_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Header values are validated against the set of characters permitted by
+ * the HTTP_HDR_CF_* flags of their HttpElementInfo.  Each flag combination
+ * is compiled into a bitmap once, and shared between the header
+ * descriptions using the same flags.
+ *
+ * As none of the flags permits non-ASCII characters, the vectorized
+ * kernels use the nibble lookup technique: the low nibble of each byte
+ * selects a row of 8 bits (one for each possible ASCII high nibble) with a
+ * byte shuffle, the high nibble selects the bit in that row.  Bytes with
+ * the top bit set select an empty bit mask, thus they are always rejected.
+ */
+
+static const struct
+{
+  guint32 flag;
+  const gchar *chars;
+} http_charset_classes[] =
+  {
+    { HTTP_HDR_CF_ALPHA,        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ" },
+    { HTTP_HDR_CF_NUMERIC,      "0123456789" },
+    { HTTP_HDR_CF_SPACE,        " " },
+    { HTTP_HDR_CF_COMMA,        "," },
+    { HTTP_HDR_CF_DOT,          "." },
+    { HTTP_HDR_CF_BRACKET,      "[]{}()" },
+    { HTTP_HDR_CF_EQUAL,        "=" },
+    { HTTP_HDR_CF_DASH,         "-" },
+    { HTTP_HDR_CF_SLASH,        "/" },
+    { HTTP_HDR_CF_COLON,        ":" },
+    { HTTP_HDR_CF_SEMICOLON,    ";" },
+    { HTTP_HDR_CF_AT,           "@" },
+    { HTTP_HDR_CF_UNDERLINE,    "_" },
+    { HTTP_HDR_CF_AND,          "&" },
+    { HTTP_HDR_CF_BACKSLASH,    "\\" },
+    { HTTP_HDR_CF_ASTERIX,      "*" },
+    { HTTP_HDR_CF_DOLLAR,       "$" },
+    { HTTP_HDR_CF_HASHMARK,     "#" },
+    { HTTP_HDR_CF_PLUS,         "+" },
+    { HTTP_HDR_CF_QUOTE,        "\"'" },
+    { HTTP_HDR_CF_QUESTIONMARK, "?" },
+    { HTTP_HDR_CF_PERCENT,      "%" },
+    { HTTP_HDR_CF_TILDE,        "~" },
+    { HTTP_HDR_CF_EXCLAM,       "!" },
+  };
+
+static GHashTable *http_charsets;
+G_LOCK_DEFINE_STATIC(http_charsets);
+
+static gboolean (*http_charset_check_func)(const HttpCharset *charset, const gchar *value, gsize len);
+
+/**
+ * http_charset_new:
+ * @flags: HTTP_HDR_CF_* flags
+ *
+ * Compile the set of characters permitted by @flags.
+ **/
+static HttpCharset *
+http_charset_new(guint32 flags)
+{
+  HttpCharset *charset = g_new0(HttpCharset, 1);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(http_charset_classes); i++)
+    {
+      const gchar *p;
+
+      if (!(flags & http_charset_classes[i].flag))
+        continue;
+
+      for (p = http_charset_classes[i].chars; *p; p++)
+        {
+          guchar c = *p;
+
+          charset->bitmap[c >> 3] |= 1 << (c & 7);
+          charset->rows[c & 0x0f] |= 1 << (c >> 4);
+        }
+    }
+
+  return charset;
+}
+
+static gboolean
+http_charset_check_scalar(const HttpCharset *charset, const gchar *value, gsize len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      guchar c = value[i];
+
+      if (!(charset->bitmap[c >> 3] & (1 << (c & 7))))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#ifdef HTTP_CHARSET_SIMD
+
+__attribute__((target("ssse3")))
+static gboolean
+http_charset_check_ssse3(const HttpCharset *charset, const gchar *value, gsize len)
+{
+  const __m128i rows = _mm_loadu_si128((const __m128i *) charset->rows);
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  gsize i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *) (value + i));
+      __m128i row = _mm_shuffle_epi8(rows, _mm_and_si128(v, nibble));
+      __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128())) != 0)
+        return FALSE;
+    }
+
+  return http_charset_check_scalar(charset, value + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static gboolean
+http_charset_check_avx2(const HttpCharset *charset, const gchar *value, gsize len)
+{
+  const __m256i rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) charset->rows));
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  gsize i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (value + i));
+      __m256i row = _mm256_shuffle_epi8(rows, _mm256_and_si256(v, nibble));
+      __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+
+      if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256())) != 0)
+        return FALSE;
+    }
+
+  /* the remaining half vector is checked here instead of calling the SSSE3
+   * kernel, as mixing VEX and legacy SSE encoded code is expensive */
+  if (i + 16 <= len)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *) (value + i));
+      __m128i row = _mm_shuffle_epi8(_mm256_castsi256_si128(rows), _mm_and_si128(v, _mm256_castsi256_si128(nibble)));
+      __m128i bit = _mm_shuffle_epi8(_mm256_castsi256_si128(bits),
+                                     _mm_and_si128(_mm_srli_epi16(v, 4), _mm256_castsi256_si128(nibble)));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128())) != 0)
+        return FALSE;
+
+      i += 16;
+    }
+
+  return http_charset_check_scalar(charset, value + i, len - i);
+}
+
+#endif
+
+static void
+http_charset_select_kernel(void)
+{
+  http_charset_check_func = http_charset_check_scalar;
+
+#ifdef HTTP_CHARSET_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    http_charset_check_func = http_charset_check_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    http_charset_check_func = http_charset_check_ssse3;
+#endif
+}
+
+/**
+ * http_charset_lookup:
+ * @flags: HTTP_HDR_CF_* flags
+ *
+ * Return the compiled character set for @flags, compiling it on first use.
+ * The result is shared and lives until the process exits.
+ **/
+const HttpCharset *
+http_charset_lookup(guint32 flags)
+{
+  HttpCharset *charset;
+
+  flags &= ~(HTTP_HDR_FF_URL | HTTP_HDR_FF_ANY);
+
+  G_LOCK(http_charsets);
+
+  if (!http_charsets)
+    {
+      http_charsets = g_hash_table_new(g_direct_hash, g_direct_equal);
+      http_charset_select_kernel();
+    }
+
+  charset = static_cast<HttpCharset *>(g_hash_table_lookup(http_charsets, GUINT_TO_POINTER(flags)));
+
+  if (!charset)
+    {
+      charset = http_charset_new(flags);
+      g_hash_table_insert(http_charsets, GUINT_TO_POINTER(flags), charset);
+    }
+
+  G_UNLOCK(http_charsets);
+  return charset;
+}
+
+/**
+ * http_charset_check:
+ * @charset: compiled character set
+ * @value: value to check
+ * @len: length of @value
+ *
+ * Check whether all characters of @value are in @charset, using the
+ * widest vector kernel the CPU supports.
+ **/
+gboolean
+http_charset_check(const HttpCharset *charset, const gchar *value, gsize len)
+{
+  return http_charset_check_func(charset, value, len);
+}
+
+/**
+ * http_charset_check_with:
+ * @kernel: HTTP_CHARSET_KERNEL_* value
+ * @charset: compiled character set
+ * @value: value to check
+ * @len: length of @value
+ * @supported: set to FALSE if the CPU cannot run @kernel
+ *
+ * Same as http_charset_check(), but with an explicitly selected kernel,
+ * falling back to the scalar one if @kernel is not supported.  Used by the
+ * unit tests and the benchmark to compare the implementations.
+ **/
+gboolean
+http_charset_check_with(HttpCharsetKernel kernel, const HttpCharset *charset, const gchar *value, gsize len,
+                        gboolean *supported)
+{
+  *supported = TRUE;
+
+  switch (kernel)
+    {
+#ifdef HTTP_CHARSET_SIMD
+    case HTTP_CHARSET_KERNEL_SSSE3:
+      if (__builtin_cpu_supports("ssse3"))
+        return http_charset_check_ssse3(charset, value, len);
+      break;
+
+    case HTTP_CHARSET_KERNEL_AVX2:
+      if (__builtin_cpu_supports("avx2"))
+        return http_charset_check_avx2(charset, value, len);
+      break;
+#endif
+
+    case HTTP_CHARSET_KERNEL_SCALAR:
+      return http_charset_check_scalar(charset, value, len);
+
+    default:
+      break;
+    }
+
+  *supported = FALSE;
+  return http_charset_check_scalar(charset, value, len);
+}
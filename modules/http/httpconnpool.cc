@@ -0,0 +1,307 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include "http.h"
+
+#include <zorp/szig.h>
+
+/*
+ * Idle keep-alive server connections are kept in a process-wide pool, so
+ * that a session can reuse a connection established by an earlier one
+ * instead of connecting to the same server again.  Connections are
+ * indexed by a key describing everything that determines the connection
+ * (see http_server_pool_key() in http.cc), each key has a list of idle
+ * connections with the most recently used one at its head.
+ *
+ * Connections expire after the idle timeout of the proxy that returned
+ * them.  Expired connections of a key are dropped whenever the key is
+ * used, the whole pool is swept at most every HTTP_CONN_POOL_SWEEP_INTERVAL
+ * to get rid of connections to servers not used anymore.
+ */
+
+#define HTTP_CONN_POOL_SWEEP_INTERVAL (5 * G_USEC_PER_SEC)
+
+typedef struct _HttpConnPoolEntry
+{
+  ZStream *stream;
+  gint64 expires;
+} HttpConnPoolEntry;
+
+G_LOCK_DEFINE_STATIC(http_conn_pool);
+static GHashTable *http_conn_pool;
+static gint64 http_conn_pool_last_sweep;
+
+/* statistics, protected by the pool lock */
+static glong http_conn_pool_idle;
+static glong http_conn_pool_hits;
+static glong http_conn_pool_misses;
+static glong http_conn_pool_evicted;
+
+static void
+http_conn_pool_entry_free(HttpConnPoolEntry *entry)
+{
+  z_stream_shutdown(entry->stream, SHUT_RDWR, NULL);
+  z_stream_close(entry->stream, NULL);
+  z_stream_unref(entry->stream);
+  g_free(entry);
+}
+
+static void
+http_conn_pool_queue_free(GQueue *queue)
+{
+  g_queue_free_full(queue, (GDestroyNotify) http_conn_pool_entry_free);
+}
+
+/**
+ * http_conn_pool_report:
+ *
+ * Publish the pool statistics as stats.connection_pool.http.* in SZIG.
+ **/
+static void
+http_conn_pool_report(glong idle, glong hits, glong misses, glong evicted)
+{
+  z_szig_event(Z_SZIG_CONNECTION_POOL,
+               z_szig_value_new_props("http",
+                                      "idle", z_szig_value_new_long(idle),
+                                      "hits", z_szig_value_new_long(hits),
+                                      "misses", z_szig_value_new_long(misses),
+                                      "evicted", z_szig_value_new_long(evicted),
+                                      NULL));
+}
+
+/**
+ * http_conn_pool_expire:
+ * @queue: idle connections of a key
+ * @now: current monotonic time
+ * @expired: list to move the expired connections to
+ *
+ * Move the expired connections of @queue to @expired, they are closed by
+ * the caller after the pool lock is released.
+ *
+ * NOTE: must be called with the pool lock held.
+ **/
+static void
+http_conn_pool_expire(GQueue *queue, gint64 now, GList **expired)
+{
+  HttpConnPoolEntry *entry;
+
+  /* the least recently returned connections are at the tail */
+  while ((entry = static_cast<HttpConnPoolEntry *>(g_queue_peek_tail(queue))) && entry->expires <= now)
+    {
+      g_queue_pop_tail(queue);
+      *expired = g_list_prepend(*expired, entry);
+      http_conn_pool_idle--;
+      http_conn_pool_evicted++;
+    }
+}
+
+/**
+ * http_conn_pool_sweep:
+ * @now: current monotonic time
+ * @expired: list to move the expired connections to
+ *
+ * Expire idle connections of all keys, at most once every
+ * HTTP_CONN_POOL_SWEEP_INTERVAL.
+ *
+ * NOTE: must be called with the pool lock held.
+ **/
+static void
+http_conn_pool_sweep(gint64 now, GList **expired)
+{
+  GHashTableIter iter;
+  GQueue *queue;
+
+  if (now - http_conn_pool_last_sweep < HTTP_CONN_POOL_SWEEP_INTERVAL)
+    return;
+
+  http_conn_pool_last_sweep = now;
+  g_hash_table_iter_init(&iter, http_conn_pool);
+
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &queue))
+    {
+      http_conn_pool_expire(queue, now, expired);
+
+      if (g_queue_is_empty(queue))
+        g_hash_table_iter_remove(&iter);
+    }
+}
+
+/**
+ * http_conn_pool_stream_idle:
+ * @stream: server stream
+ *
+ * Check whether @stream is still usable: the server has neither closed the
+ * connection nor sent anything since the last response.
+ **/
+static gboolean
+http_conn_pool_stream_idle(ZStream *stream)
+{
+  GIOStatus rc;
+  gchar buf[1];
+  gsize bytes_read;
+
+  if (z_stream_broken(stream))
+    return FALSE;
+
+  z_stream_set_nonblock(stream, TRUE);
+  rc = z_stream_read(stream, &buf, sizeof(buf), &bytes_read, NULL);
+  z_stream_set_nonblock(stream, FALSE);
+
+  return rc == G_IO_STATUS_AGAIN;
+}
+
+/**
+ * http_conn_pool_checkout:
+ * @key: connection key
+ *
+ * Return an idle connection for @key from the pool, or NULL if there is
+ * none.  The reference of the pool is passed to the caller.  Connections
+ * closed by the server while idle are dropped.
+ **/
+ZStream *
+http_conn_pool_checkout(const gchar *key)
+{
+  ZStream *stream = NULL;
+  GList *expired = NULL;
+  GQueue *queue;
+  gint64 now = g_get_monotonic_time();
+  glong idle, hits, misses, evicted_count, dead = 0;
+
+  while (!stream)
+    {
+      HttpConnPoolEntry *entry = NULL;
+
+      G_LOCK(http_conn_pool);
+
+      if (http_conn_pool && (queue = static_cast<GQueue *>(g_hash_table_lookup(http_conn_pool, key))))
+        {
+          http_conn_pool_expire(queue, now, &expired);
+          entry = static_cast<HttpConnPoolEntry *>(g_queue_pop_head(queue));
+
+          if (entry)
+            http_conn_pool_idle--;
+
+          if (g_queue_is_empty(queue))
+            g_hash_table_remove(http_conn_pool, key);
+        }
+
+      G_UNLOCK(http_conn_pool);
+
+      if (!entry)
+        break;
+
+      /* the liveness check is done without holding the lock */
+      if (http_conn_pool_stream_idle(entry->stream))
+        {
+          stream = entry->stream;
+          g_free(entry);
+        }
+      else
+        {
+          expired = g_list_prepend(expired, entry);
+          dead++;
+        }
+    }
+
+  G_LOCK(http_conn_pool);
+
+  if (stream)
+    http_conn_pool_hits++;
+  else
+    http_conn_pool_misses++;
+
+  http_conn_pool_evicted += dead;
+  idle = http_conn_pool_idle;
+  hits = http_conn_pool_hits;
+  misses = http_conn_pool_misses;
+  evicted_count = http_conn_pool_evicted;
+  G_UNLOCK(http_conn_pool);
+
+  g_list_free_full(expired, (GDestroyNotify) http_conn_pool_entry_free);
+  http_conn_pool_report(idle, hits, misses, evicted_count);
+  return stream;
+}
+
+/**
+ * http_conn_pool_checkin:
+ * @key: connection key
+ * @stream: idle server stream, the reference is passed to the pool
+ * @max_idle: maximum number of idle connections for @key
+ * @timeout: idle timeout in milliseconds
+ *
+ * Return an idle connection to the pool.  If the pool already has
+ * @max_idle connections for @key, the least recently used one is closed.
+ * Returns FALSE if the connection is not idle anymore, the caller still
+ * owns @stream in this case.
+ **/
+gboolean
+http_conn_pool_checkin(const gchar *key, ZStream *stream, guint max_idle, guint timeout)
+{
+  HttpConnPoolEntry *entry;
+  GList *expired = NULL;
+  GQueue *queue;
+  gint64 now = g_get_monotonic_time();
+  glong idle, hits, misses, evicted_count;
+
+  if (max_idle == 0 || !http_conn_pool_stream_idle(stream))
+    return FALSE;
+
+  entry = g_new0(HttpConnPoolEntry, 1);
+  entry->stream = stream;
+  entry->expires = now + (gint64) timeout * 1000;
+
+  G_LOCK(http_conn_pool);
+
+  if (!http_conn_pool)
+    {
+      http_conn_pool = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) http_conn_pool_queue_free);
+      http_conn_pool_last_sweep = now;
+    }
+
+  http_conn_pool_sweep(now, &expired);
+  queue = static_cast<GQueue *>(g_hash_table_lookup(http_conn_pool, key));
+
+  if (!queue)
+    {
+      queue = g_queue_new();
+      g_hash_table_insert(http_conn_pool, g_strdup(key), queue);
+    }
+
+  g_queue_push_head(queue, entry);
+  http_conn_pool_idle++;
+
+  while (g_queue_get_length(queue) > max_idle)
+    {
+      expired = g_list_prepend(expired, g_queue_pop_tail(queue));
+      http_conn_pool_idle--;
+      http_conn_pool_evicted++;
+    }
+
+  idle = http_conn_pool_idle;
+  hits = http_conn_pool_hits;
+  misses = http_conn_pool_misses;
+  evicted_count = http_conn_pool_evicted;
+  G_UNLOCK(http_conn_pool);
+
+  g_list_free_full(expired, (GDestroyNotify) http_conn_pool_entry_free);
+  http_conn_pool_report(idle, hits, misses, evicted_count);
+  return TRUE;
+}
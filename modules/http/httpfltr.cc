@@ -540,6 +540,12 @@ http_transfer_dst_write(ZTransfer2 *s, ZStream *stream, const gchar *buf, gsize
         }
 
       self->dst_write_state = HTTP_DW_WRITE_INITIAL;
+
+      /* the rest of an entity with a known length passes unchanged, let
+       * ZTransfer2 move it without copying once this buffer is flushed */
+      if (!self->src_chunked && !self->dst_chunked && !self->super.stacked && self->content_length > 0 &&
+          self->src_read_state == HTTP_SR_READ_ENTITY && (guint64) self->content_length > self->src_whole_length)
+        z_transfer2_enable_splice(&self->super, self->content_length - self->src_whole_length);
     }
 
   /* ok, now take care about the data, and possibly enchunk it on the way */
@@ -703,6 +709,22 @@ http_transfer_dst_shutdown(ZTransfer2 *s, ZStream *stream, GError **err)
   return res;
 }
 
+/**
+ * http_transfer_spliced:
+ * @s: HttpTransfer instance
+ * @bytes: number of bytes moved by ZTransfer2
+ *
+ * Account the entity bytes moved without passing through src_read, so that
+ * it reports EOF once the whole entity has been transferred.
+ **/
+static void
+http_transfer_spliced(ZTransfer2 *s, gsize bytes)
+{
+  HttpTransfer *self = Z_CAST(s, HttpTransfer);
+
+  self->src_whole_length += bytes;
+}
+
 static gboolean
 http_transfer_stack_proxy(ZTransfer2 *s, ZStackedProxy **stacked)
 {
@@ -1115,7 +1137,8 @@ ZTransfer2Funcs http_transfer_funcs =
     /* .stack_proxy = */ http_transfer_stack_proxy,
     /* .setup = */ http_transfer_setup,
     /* .run = */ http_transfer_run,
-    /* .progress = */ NULL
+    /* .progress = */ NULL,
+    /* .spliced = */ http_transfer_spliced
   };
 
 Z_CLASS_DEF(HttpTransfer, ZTransfer2, http_transfer_funcs);
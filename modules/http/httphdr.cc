@@ -43,31 +43,102 @@ static const gchar *smuggle_headers[] =
     "Proxy-Authorization"  /* -"- */
   };
 
-gboolean
-http_header_equal(gconstpointer k1, gconstpointer k2)
+/* number of header slots allocated at once, slots are never freed while
+ * the HttpHeaders instance lives, they are recycled by the next message */
+#define HTTP_HEADERS_BLOCK_SIZE  16
+
+/* initial number of slots in the open addressing index, must be a power of 2 */
+#define HTTP_HEADERS_INDEX_SIZE  64
+
+static inline guint
+http_header_hash(const gchar *name, gsize name_len)
 {
-  return g_ascii_strcasecmp(static_cast<const gchar *>(k1), static_cast<const gchar *>(k2)) == 0;
+  guint h = 0;
+  gsize i;
+
+  for (i = 0; i < name_len; i++)
+    h = (h << 5) - h + g_ascii_toupper(name[i]);
+
+  return h;
 }
 
-guint
-http_header_hash(gconstpointer key)
+static HttpHeader *
+http_headers_index_lookup(HttpHeaders *hdrs, const gchar *name, gsize name_len, guint hash)
 {
-  const char *p = static_cast<const char *>(key);
-  guint h = toupper(*p);
+  guint i = hash & hdrs->index_mask;
+  guint pos;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + toupper(*p);
+  while ((pos = hdrs->index[i]) != 0)
+    {
+      HttpHeader *h = hdrs->headers[pos - 1];
 
-  return h;
+      if (h->hash == hash && h->name->len == name_len &&
+          g_ascii_strncasecmp(h->name->str, name, name_len) == 0)
+        return h;
+
+      i = (i + 1) & hdrs->index_mask;
+    }
+
+  return NULL;
+}
+
+static void
+http_headers_index_insert(HttpHeaders *hdrs, guint pos)
+{
+  guint i = hdrs->headers[pos]->hash & hdrs->index_mask;
+
+  while (hdrs->index[i] != 0)
+    i = (i + 1) & hdrs->index_mask;
+
+  hdrs->index[i] = pos + 1;
+  hdrs->indexed++;
 }
 
 static void
-http_header_free(HttpHeader *h)
+http_headers_index_grow(HttpHeaders *hdrs)
 {
-  g_string_free(h->name, TRUE);
-  g_string_free(h->value, TRUE);
-  g_free(h);
+  guint size = (hdrs->index_mask + 1) * 2;
+  guint i;
+
+  g_free(hdrs->index);
+  hdrs->index = g_new0(guint, size);
+  hdrs->index_mask = size - 1;
+  hdrs->indexed = 0;
+
+  for (i = 0; i < hdrs->count; i++)
+    if (hdrs->headers[i]->indexed)
+      http_headers_index_insert(hdrs, i);
+}
+
+/* returns the next unused slot, without adding it to the header list */
+static HttpHeader *
+http_headers_alloc(HttpHeaders *hdrs)
+{
+  HttpHeader *h;
+
+  if (hdrs->count == hdrs->size)
+    {
+      HttpHeader *block = g_new0(HttpHeader, HTTP_HEADERS_BLOCK_SIZE);
+      guint i;
+
+      hdrs->headers = g_renew(HttpHeader *, hdrs->headers, hdrs->size + HTTP_HEADERS_BLOCK_SIZE);
+
+      for (i = 0; i < HTTP_HEADERS_BLOCK_SIZE; i++)
+        hdrs->headers[hdrs->size + i] = &block[i];
+
+      hdrs->blocks = g_slist_prepend(hdrs->blocks, block);
+      hdrs->size += HTTP_HEADERS_BLOCK_SIZE;
+    }
+
+  h = hdrs->headers[hdrs->count];
+
+  if (!h->name)
+    {
+      h->name = g_string_sized_new(32);
+      h->value = g_string_sized_new(64);
+    }
+
+  return h;
 }
 
 void
@@ -78,11 +149,11 @@ http_log_headers(HttpProxy *self, ZEndpoint side, const gchar *tag)
   if ((side == EP_CLIENT && z_log_enabled(HTTP_REQUEST, 7)) ||
       (side == EP_SERVER && z_log_enabled(HTTP_RESPONSE, 7)))
     {
-      GList *l = g_list_last(hdrs->list);
+      guint i;
 
-      while (l)
+      for (i = 0; i < hdrs->count; i++)
         {
-          HttpHeader *hdr = (HttpHeader *) l->data;
+          HttpHeader *hdr = hdrs->headers[i];
 
           if (hdr->present)
             {
@@ -95,14 +166,12 @@ http_log_headers(HttpProxy *self, ZEndpoint side, const gchar *tag)
                 z_proxy_log(self, HTTP_RESPONSE, 7, "Response %s header; hdr='%s', value='%s'", tag,
                             hdr->name->str, hdr->value->str);
             }
-
-          l = g_list_previous(l);
         }
     }
 }
 
 /* duplicated headers are simply put on the list and not inserted into
-   the hash, thus looking up a header by name always results the first
+   the index, thus looking up a header by name always results the first
    added header */
 
 HttpHeader *
@@ -110,46 +179,41 @@ http_add_header(HttpHeaders *hdrs, const gchar *name, gint name_len, const gchar
 {
   HttpHeader *h;
   HttpHeader *orig;
+  guint hash;
 
-  h = g_new0(HttpHeader, 1);
-  h->name = g_string_sized_new(name_len + 1);
+  hash = http_header_hash(name, name_len);
+  orig = http_headers_index_lookup(hdrs, name, name_len, hash);
 
-  g_string_assign_len(h->name, name, name_len);
-
-  h->value = g_string_sized_new(value_len + 1);
-  g_string_assign_len(h->value, value, value_len);
-  h->present = TRUE;
-
-  if (!http_lookup_header(hdrs, h->name->str, &orig))
-    {
-      hdrs->list = g_list_prepend(hdrs->list, h);
-      g_hash_table_insert(hdrs->hash, h->name->str, hdrs->list);
-    }
-  else
+  if (orig)
     {
       guint i;
 
       for (i = 0; i < sizeof(smuggle_headers) / sizeof(smuggle_headers[0]); i++)
         {
-          if (strcmp(smuggle_headers[i], h->name->str) == 0)
+          if (strncmp(smuggle_headers[i], name, name_len) == 0 && smuggle_headers[i][name_len] == '\0')
             {
-              http_header_free(h);
-              h = NULL;
-              break;
+              z_log(NULL, HTTP_VIOLATION, 3,
+                    "Possible smuggle attack, removing header duplication; header='%.*s', value='%.*s', prev_value='%.*s'",
+                    name_len, name, value_len, value, (gint) orig->value->len, orig->value->str);
+              return NULL;
             }
         }
+    }
 
-      if (h)
-        {
-          /* not found in smuggle_headers */
-          hdrs->list = g_list_prepend(hdrs->list, h);
-        }
-      else
-        {
-          z_log(NULL, HTTP_VIOLATION, 3,
-                "Possible smuggle attack, removing header duplication; header='%.*s', value='%.*s', prev_value='%.*s'",
-                name_len, name, value_len, value, (gint) orig->value->len, orig->value->str);
-        }
+  h = http_headers_alloc(hdrs);
+  g_string_assign_len(h->name, name, name_len);
+  g_string_assign_len(h->value, value, value_len);
+  h->present = TRUE;
+  h->hash = hash;
+  h->indexed = (orig == NULL);
+  hdrs->count++;
+
+  if (h->indexed)
+    {
+      if ((hdrs->indexed + 1) * 2 > hdrs->index_mask + 1)
+        http_headers_index_grow(hdrs);
+
+      http_headers_index_insert(hdrs, hdrs->count - 1);
     }
 
   return h;
@@ -158,171 +222,50 @@ http_add_header(HttpHeaders *hdrs, const gchar *name, gint name_len, const gchar
 void
 http_clear_headers(HttpHeaders *hdrs)
 {
-  GList *l;
+  hdrs->count = 0;
 
-  for (l = hdrs->list; l; l = l->next)
-    http_header_free(static_cast<HttpHeader *>(l->data));
+  if (hdrs->indexed)
+    {
+      memset(hdrs->index, 0, (hdrs->index_mask + 1) * sizeof(hdrs->index[0]));
+      hdrs->indexed = 0;
+    }
 
-  g_list_free(hdrs->list);
-  hdrs->list = NULL;
   g_string_truncate(hdrs->flat, 0);
-  g_hash_table_remove_all(hdrs->hash);
 }
 
 gboolean
 http_lookup_header(HttpHeaders *headers, const gchar *what, HttpHeader **p)
 {
-  GList *l;
-
-  l = static_cast<GList *>(g_hash_table_lookup(headers->hash, what));
-
-  if (l)
-    {
-      *p = static_cast<HttpHeader *>(l->data);
-      return TRUE;
-    }
+  gsize what_len = strlen(what);
 
-  *p = NULL;
-  return FALSE;
-}
-
-static void
-http_insert_headers(gchar *key, ZPolicyObj *f, HttpHeaders *hdrs)
-{
-  guint filter_type;
-  gchar *value;
-
-  if (!z_policy_tuple_get_verdict(f, &filter_type))
-    {
-      /* filter has no type field */
-      return;
-    }
-
-  switch (filter_type)
-    {
-    case HTTP_HDR_INSERT:
-    case HTTP_HDR_REPLACE:
-
-      if (!z_policy_var_parse(f, "(is)", &filter_type, &value))
-        {
-          /* error parsing HTTP_INSERT or HTTP_REPLACE rule */
-          return;
-        }
-
-      http_add_header(hdrs, key, strlen(key), value, strlen(value));
-      break;
-    default:
-      break;
-    }
+  *p = http_headers_index_lookup(headers, what, what_len, http_header_hash(what, what_len));
+  return *p != NULL;
 }
 
 static gboolean
-http_check_header_charset(HttpProxy *self, gchar *header, guint flags, const gchar **reason)
+http_check_header_charset(HttpProxy *self, HttpHeader *h, HttpElementInfo *info, const gchar **reason)
 {
-  gint i;
-
   *reason = FALSE;
 
-  if (flags & HTTP_HDR_FF_ANY)
+  if (info->flags & HTTP_HDR_FF_ANY)
     return TRUE;
 
-  if (flags & HTTP_HDR_FF_URL)
+  if (info->flags & HTTP_HDR_FF_URL)
     {
       HttpURL url;
       gboolean success;
 
       http_init_url(&url);
-      success = http_parse_url(&url, self->permit_unicode_url, self->permit_invalid_hex_escape, TRUE, header, reason);
+      success = http_parse_url(&url, self->permit_unicode_url, self->permit_invalid_hex_escape, TRUE, h->value->str, reason);
       http_destroy_url(&url);
 
       return success;
     }
 
-  for (i = 0; header[i]; i++)
+  if (!http_charset_check(info->charset, h->value->str, h->value->len))
     {
-      gboolean ok;
-      guchar c = header[i];
-
-      ok = FALSE;
-
-      if ((flags & HTTP_HDR_CF_ALPHA) &&
-          ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_NUMERIC) &&
-               (c >= '0' && c <= '9'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_SPACE) &&
-               (c == ' '))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_COMMA) &&
-               (c == ','))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_DOT) &&
-               (c == '.'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_BRACKET) &&
-               (c == '[' || c == ']' || c == '{' || c == '}' || c == '(' || c == ')'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_EQUAL) &&
-               (c == '='))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_DASH) &&
-               (c == '-'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_SLASH) &&
-               (c == '/'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_COLON) &&
-               (c == ':'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_SEMICOLON) &&
-               (c == ';'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_AT) &&
-               (c == '@'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_UNDERLINE) &&
-               (c == '_'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_AND) &&
-               (c == '&'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_BACKSLASH) &&
-               (c == '\\'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_ASTERIX) &&
-               (c == '*'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_DOLLAR) &&
-               (c == '$'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_HASHMARK) &&
-               (c == '#'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_PLUS) &&
-               (c == '+'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_QUOTE) &&
-               (c == '"' || c == '\''))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_QUESTIONMARK) &&
-               (c == '?'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_PERCENT) &&
-               (c == '%'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_TILDE) &&
-               (c == '~'))
-        ok = TRUE;
-      else if ((flags & HTTP_HDR_CF_EXCLAM) &&
-               (c == '!'))
-        ok = TRUE;
-
-      if (!ok)
-        {
-          *reason = "Invalid character found";
-          return FALSE;
-        }
+      *reason = "Invalid character found";
+      return FALSE;
     }
 
   return TRUE;
@@ -335,13 +278,14 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
   GHashTable *hash = (side == EP_CLIENT) ? self->request_header_policy : self->response_header_policy;
   gint action;
   GList *l;
+  guint i;
 
   z_proxy_enter(self);
-  l = headers->list;
 
-  while (l)
+  /* newest header first, headers added meanwhile are not processed */
+  for (i = headers->count; i > 0; i--)
     {
-      HttpHeader *h = (HttpHeader *) l->data;
+      HttpHeader *h = headers->headers[i - 1];
       ZPolicyObj *f;
 
       if (filter)
@@ -359,39 +303,38 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
 
       if (f)
         {
-          guint filter_type;
-          ZPolicyObj *handler, *res;
-          gchar *name, *value;
+          HttpPolicyVerdict *verdict;
+          ZPolicyObj *res;
+          gint64 profile_start;
 
-          z_policy_lock(self->super.thread);
+          verdict = http_policy_verdict_lookup(self, HTTP_POLICY_HEADER, f);
 
-          if (!z_policy_tuple_get_verdict(f, &filter_type))
+          if (verdict->action < 0)
             {
               /* filter has no type field */
-              z_policy_unlock(self->super.thread);
               z_proxy_return(self, FALSE);
             }
 
-          z_policy_unlock(self->super.thread);
-
-          switch (filter_type)
+          switch (verdict->action)
             {
             case HTTP_HDR_POLICY:
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse(f, "(iO)", &filter_type, &handler))
+              if (!verdict->valid)
                 {
                   /* error parsing HTTP_POLICY_CALL rule */
+                  z_policy_lock(self->super.thread);
                   z_proxy_report_invalid_policy(&(self->super));
                   z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              res = z_policy_call_object(handler,
+              z_policy_lock(self->super.thread);
+              profile_start = z_policy_profile_start();
+              res = z_policy_call_object(verdict->handler,
                                          z_policy_var_build("(s#s#)",
                                                             h->name->str, h->name->len,
                                                             h->value->str, h->value->len),
                                          self->super.session_id);
+              z_policy_profile_event(side == EP_CLIENT ? "request_header_policy" : "response_header_policy", profile_start);
 
               if (!z_policy_var_parse(res, "i", &action))
                 {
@@ -427,9 +370,7 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
               break;
 
             case HTTP_HDR_CHANGE_NAME:
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse(f, "(is)", &filter_type, &name))
+              if (!verdict->valid)
                 {
                   /* invalid CHANGE_NAME rule */
                   /*LOG
@@ -438,20 +379,18 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
                     request_headers and response_headers hashes.
                   */
                   z_proxy_log(self, HTTP_POLICY, 1, "Invalid HTTP_HDR_CHANGE_NAME rule in header processing; header='%s'", self->current_header_name->str);
+                  z_policy_lock(self->super.thread);
                   z_proxy_report_invalid_policy(&(self->super));
                   z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              g_string_assign(h->name, name);
-              z_policy_unlock(self->super.thread);
+              g_string_assign(h->name, verdict->name);
               action = HTTP_HDR_ACCEPT;
               break;
 
             case HTTP_HDR_CHANGE_VALUE:
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse(f, "(is)", &filter_type, &value))
+              if (!verdict->valid)
                 {
                   /* invalid CHANGE_VALUE rule */
                   /*LOG
@@ -460,19 +399,15 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
                     request_headers and response_headers hashes.
                   */
                   z_proxy_log(self, HTTP_POLICY, 1, "Invalid HTTP_HDR_CHANGE_VALUE rule in header processing; header='%s'", self->current_header_name->str);
-                  z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              g_string_assign(h->value, value);
-              z_policy_unlock(self->super.thread);
+              g_string_assign(h->value, verdict->value);
               action = HTTP_HDR_ACCEPT;
               break;
 
             case HTTP_HDR_CHANGE_BOTH:
-              z_policy_lock(self->super.thread);
-
-              if (!z_policy_var_parse(f, "(iss)", &filter_type, &name, &value))
+              if (!verdict->valid)
                 {
                   /* invalid CHANGE_BOTH rule */
                   /*LOG
@@ -481,13 +416,11 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
                     request_headers and response_headers hashes.
                   */
                   z_proxy_log(self, HTTP_POLICY, 1, "Invalid HTTP_HDR_CHANGE_BOTH rule in header processing; header='%s'", self->current_header_name->str);
-                  z_policy_unlock(self->super.thread);
                   z_proxy_return(self, FALSE);
                 }
 
-              g_string_assign(h->name, name);
-              g_string_assign(h->value, value);
-              z_policy_unlock(self->super.thread);
+              g_string_assign(h->name, verdict->name);
+              g_string_assign(h->value, verdict->value);
               action = HTTP_HDR_ACCEPT;
               break;
 
@@ -503,7 +436,7 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
                 response_headers hashes.
               */
               z_proxy_log(self, HTTP_POLICY, 1, "Invalid value in header action tuple; header='%s', filter_type='%d'",
-                          self->current_header_name->str, filter_type);
+                          self->current_header_name->str, verdict->action);
               break;
             }
         }
@@ -530,7 +463,7 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
                   goto exit_check;
                 }
 
-              if (!http_check_header_charset(self, h->value->str, info->flags, &reason))
+              if (!http_check_header_charset(self, h, info, &reason))
                 {
                   z_proxy_log(self, HTTP_VIOLATION, 3,
                               "Header failed strict checking, it contains invalid characters; "
@@ -568,14 +501,15 @@ http_filter_headers(HttpProxy *self, ZEndpoint side, HttpHeaderFilter filter)
           z_policy_unlock(self->super.thread);
           z_proxy_return(self, FALSE);
         }
+    }
 
-      l = g_list_next(l);
+  for (l = http_policy_header_inserts(self, side); l; l = g_list_next(l))
+    {
+      HttpPolicyVerdict *insert = (HttpPolicyVerdict *) l->data;
 
+      http_add_header(headers, insert->name, strlen(insert->name), insert->value, strlen(insert->value));
     }
 
-  z_policy_lock(self->super.thread);
-  g_hash_table_foreach(hash, (GHFunc) http_insert_headers, headers);
-  z_policy_unlock(self->super.thread);
   z_proxy_return(self, TRUE);
 }
 
@@ -710,21 +644,28 @@ http_fetch_headers(HttpProxy *self, ZEndpoint side)
 gboolean
 http_flat_headers_into(HttpHeaders *hdrs, GString *into)
 {
-  GList *l = g_list_last(hdrs->list);
+  gsize len = 0;
+  guint i;
+
+  for (i = 0; i < hdrs->count; i++)
+    if (hdrs->headers[i]->present)
+      len += hdrs->headers[i]->name->len + hdrs->headers[i]->value->len + 4;
 
+  /* grow the buffer once instead of on every append */
+  g_string_set_size(into, len);
   g_string_truncate(into, 0);
 
-  while (l)
+  for (i = 0; i < hdrs->count; i++)
     {
-      if (((HttpHeader *) l->data)->present)
+      HttpHeader *h = hdrs->headers[i];
+
+      if (h->present)
         {
-          g_string_append_len(into, ((HttpHeader *) l->data)->name->str, ((HttpHeader *) l->data)->name->len);
+          g_string_append_len(into, h->name->str, h->name->len);
           g_string_append_len(into, ": ", 2);
-          g_string_append_len(into, ((HttpHeader *) l->data)->value->str, ((HttpHeader *) l->data)->value->len);
+          g_string_append_len(into, h->value->str, h->value->len);
           g_string_append_len(into, "\r\n", 2);
         }
-
-      l = g_list_previous(l);
     }
 
   return TRUE;
@@ -739,18 +680,40 @@ http_flat_headers(HttpHeaders *hdrs)
 void
 http_init_headers(HttpHeaders *hdrs)
 {
-  hdrs->list = NULL;
-  hdrs->hash = g_hash_table_new(http_header_hash, http_header_equal);
+  hdrs->headers = NULL;
+  hdrs->count = 0;
+  hdrs->size = 0;
+  hdrs->blocks = NULL;
+  hdrs->index = g_new0(guint, HTTP_HEADERS_INDEX_SIZE);
+  hdrs->index_mask = HTTP_HEADERS_INDEX_SIZE - 1;
+  hdrs->indexed = 0;
   hdrs->flat = g_string_sized_new(256);
 }
 
 void
 http_destroy_headers(HttpHeaders *hdrs)
 {
-  http_clear_headers(hdrs);
+  guint i;
+
+  for (i = 0; i < hdrs->size; i++)
+    {
+      HttpHeader *h = hdrs->headers[i];
+
+      if (h->name)
+        {
+          g_string_free(h->name, TRUE);
+          g_string_free(h->value, TRUE);
+        }
+    }
+
+  g_slist_free_full(hdrs->blocks, g_free);
+  hdrs->blocks = NULL;
+  g_free(hdrs->headers);
+  hdrs->headers = NULL;
+  hdrs->count = hdrs->size = 0;
 
-  g_hash_table_destroy(hdrs->hash);
-  hdrs->hash = NULL;
+  g_free(hdrs->index);
+  hdrs->index = NULL;
 
   g_string_free(hdrs->flat, TRUE);
   hdrs->flat = NULL;
@@ -776,15 +739,26 @@ http_parse_header_cookie(HttpHeaders *hdrs)
 
   if (http_lookup_header(hdrs, "Cookie", &hdr))
     {
-      const std::string cookie_hdr_value(const_cast<const char *>(hdr->value->str));
+      /* scan the header value in place, only the resulting names and
+       * values are copied */
+      const gchar *value_end = hdr->value->str + hdr->value->len;
+      const gchar *pair = hdr->value->str;
 
-      for (std::string &cookie_pair_str: string_split(cookie_hdr_value, "; "))
+      while (pair <= value_end)
         {
-          StringVector cookie_pair(string_split(cookie_pair_str, "=", 2));
+          const gchar *pair_end = g_strstr_len(pair, value_end - pair, "; ");
+
+          if (!pair_end)
+            pair_end = value_end;
+
+          const gchar *eq = static_cast<const gchar *>(memchr(pair, '=', pair_end - pair));
+          const gchar *name_end = eq ? eq : pair_end;
+
+          if (name_end != pair)
+            cookie_vector.emplace_back(std::string(pair, name_end - pair),
+                                       eq ? std::string(eq + 1, pair_end - eq - 1) : std::string());
 
-          if (! cookie_pair[0].empty())
-            cookie_vector.push_back(std::make_pair(cookie_pair[0],
-                                                   (cookie_pair.size() > 1 ? cookie_pair[1] : std::string(""))));
+          pair = pair_end + 2;
         }
     }
 
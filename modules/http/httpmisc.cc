@@ -29,6 +29,10 @@
 #include <ctype.h>
 #include <zorpll/log.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define HTTP_URL_HOST_ESCAPE_CHARS      "/$&+,;=?@ \"'<>#%{}|\\^~[]`"
 #define HTTP_URL_USER_ESCAPE_CHARS      "/$&+,:;=?@ \"'<>#%{}|\\^~[]`"
 #define HTTP_URL_PASSWD_ESCAPE_CHARS    "/$&+,:;=?@ \"'<>#%{}|\\^~[]`"
@@ -96,6 +100,55 @@ http_string_url_decode_hex_byte(guchar *dst, const gchar *src, const gchar **rea
   return TRUE;
 }
 
+/**
+ * http_url_clean_run:
+ * @src: URL part to scan
+ * @len: length of @src
+ * @decode_plus: whether '+' needs decoding
+ *
+ * Return the length of the prefix of @src that is left as is by all URL
+ * decoding and canonicalization functions below: printable US-ASCII
+ * characters except '%' (and '+' if @decode_plus is set).  Such runs can
+ * be copied in bulk, only the remaining characters need to be looked at
+ * one by one.
+ **/
+static inline gsize
+http_url_clean_run(const gchar *src, gsize len, gboolean decode_plus)
+{
+  gsize i = 0;
+
+#ifdef __SSE2__
+  /* bytes above 0x7f are negative as signed chars, thus a single signed
+   * comparison catches both control and non-ASCII characters */
+  const __m128i printable = _mm_set1_epi8(0x1f);
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8(decode_plus ? '+' : '%');
+
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+      __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus));
+      guint mask;
+
+      special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_cmpgt_epi8(v, printable), _mm_setzero_si128()));
+      mask = _mm_movemask_epi8(special);
+
+      if (mask)
+        return i + __builtin_ctz(mask);
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      guchar c = src[i];
+
+      if (c <= 0x1F || c > 0x7F || c == '%' || (decode_plus && c == '+'))
+        break;
+    }
+
+  return i;
+}
+
 /**
  * http_string_assign_url_decode_internal:
  * @part: store the decoded string here
@@ -122,6 +175,19 @@ http_string_assign_url_decode_internal(GString *part, gboolean permit_invalid_he
 
   while (left)
     {
+      gsize run = http_url_clean_run(src, left, decode_plus);
+
+      if (run)
+        {
+          memcpy(dst, src, run);
+          dst += run;
+          src += run;
+          left -= run;
+
+          if (!left)
+            break;
+        }
+
       guchar c = (guchar) * src;
 
       if (*src == '%')
@@ -215,6 +281,20 @@ http_string_assign_url_decode_unicode(GString *part, gboolean permit_invalid_hex
 
   while (left)
     {
+      gsize run = http_url_clean_run(reinterpret_cast<const gchar *>(src), left, FALSE);
+
+      if (run)
+        {
+          /* US-ASCII characters are the same in UTF8 */
+          memcpy(dst, src, run);
+          dst += run;
+          src += run;
+          left -= run;
+
+          if (!left)
+            break;
+        }
+
       gunichar c = (gunichar) * src;
 
       if (*src == '%')
@@ -282,6 +362,34 @@ http_string_assign_url_decode_unicode(GString *part, gboolean permit_invalid_hex
   return TRUE;
 }
 
+/**
+ * http_url_unsafe_bitmap:
+ * @bitmap: 256 bit map to fill
+ * @unsafe_chars: a string of characters to be URL encoded
+ *
+ * Compile the characters to be encoded into a bitmap, so that the encoder
+ * loop does not have to scan @unsafe_chars for each character.
+ **/
+static inline void
+http_url_unsafe_bitmap(guint8 *bitmap, const gchar *unsafe_chars)
+{
+  guint c;
+
+  memset(bitmap, 0, 32);
+
+  for (c = 0; c < 0x20; c++)
+    bitmap[c >> 3] |= 1 << (c & 7);
+
+  for (c = 0x80; c < 0x100; c++)
+    bitmap[c >> 3] |= 1 << (c & 7);
+
+  for (; *unsafe_chars; unsafe_chars++)
+    {
+      c = (guchar) *unsafe_chars;
+      bitmap[c >> 3] |= 1 << (c & 7);
+    }
+}
+
 /**
  * http_string_append_url_encode:
  * @result: store the decoded string here
@@ -299,14 +407,16 @@ http_string_append_url_encode(GString *result, const gchar *unsafe_chars, const
   const guchar *src;
   gchar *dst;
   gsize orig_len = result->len;
+  guint8 unsafe[32];
 
+  http_url_unsafe_bitmap(unsafe, unsafe_chars);
   g_string_set_size(result, orig_len + (len + 1) * 3);
   src = (const guchar *) str;
   dst = result->str + orig_len;
 
   while (*src)
     {
-      if (*src <= 0x1F || *src > 0x7F || strchr(unsafe_chars, *src))
+      if (unsafe[*src >> 3] & (1 << (*src & 7)))
         {
           *dst = '%';
           *(dst + 1) = xdigit_char((*src & 0xf0) >> 4);
@@ -418,6 +528,20 @@ http_string_assign_url_canonicalize(GString *result, gboolean permit_invalid_hex
 
   while (left)
     {
+      gsize run = http_url_clean_run(src, left, FALSE);
+
+      if (run)
+        {
+          /* unescaped unsafe characters are left intact */
+          memcpy(dst, src, run);
+          dst += run;
+          src += run;
+          left -= run;
+
+          if (!left)
+            break;
+        }
+
       guchar c = (guchar) * src;
       gboolean was_encoded = FALSE;
 
@@ -502,6 +626,20 @@ http_string_assign_url_canonicalize_unicode(GString *result, gboolean permit_inv
 
   while (left)
     {
+      gsize run = http_url_clean_run(reinterpret_cast<const gchar *>(src), left, FALSE);
+
+      if (run)
+        {
+          /* unescaped unsafe characters are left intact */
+          memcpy(dst, src, run);
+          dst += run;
+          src += run;
+          left -= run;
+
+          if (!left)
+            break;
+        }
+
       gunichar c = (gunichar) * src;
       gboolean was_encoded = FALSE;
 
@@ -0,0 +1,307 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include "http.h"
+
+#include <utility>
+
+/*
+ * The request processing stages store the request they work on in the
+ * HttpProxy instance itself, as do the policy call-backs reading and
+ * changing it.  To process a pipelined request ahead of its turn, the
+ * request specific part of the proxy state is swapped with a
+ * HttpPipelineRequest: the current request is moved out of the way, the
+ * next one is fetched, processed and filtered as usual, then moved to the
+ * pipeline queue and the current request is moved back.  When a response
+ * has been copied to the client, the next request of the queue is swapped
+ * in and continues where it was left.
+ *
+ * String attributes are exported to the policy by pointer, thus only the
+ * contents of the GStrings are exchanged, never the GString instances.
+ *
+ * The parent proxy is part of the request specific state, as the policy
+ * call-backs of a request may change it: the requests read ahead start
+ * with the parent proxy the previous request left behind, as if they were
+ * processed on their turn, and the changes they make do not affect the
+ * requests before them.
+ */
+
+HttpPipelineRequest *
+http_pipeline_request_new(void)
+{
+  HttpPipelineRequest *req = g_new0(HttpPipelineRequest, 1);
+
+  req->state = HTTP_STATE_FETCH_REQUEST;
+  req->request_method = g_string_sized_new(16);
+  req->request_url = g_string_sized_new(128);
+  http_init_url(&req->request_url_parts);
+  req->remote_server = g_string_sized_new(32);
+  req->parent_proxy = g_string_sized_new(0);
+  req->connection_mode = HTTP_CONNECTION_CLOSE;
+  http_init_headers(&req->headers);
+  req->auth_header_value = g_string_sized_new(32);
+
+  req->error_code = HTTP_MSG_NOT_ASSIGNED;
+  req->error_status = 500;
+  req->error_info = g_string_sized_new(0);
+  req->error_msg = g_string_sized_new(0);
+  req->error_headers = g_string_sized_new(0);
+  req->custom_response_body = g_string_sized_new(0);
+  return req;
+}
+
+void
+http_pipeline_request_free(HttpProxy *self, HttpPipelineRequest *req)
+{
+  if (req->request_categories)
+    {
+      z_policy_lock(self->super.thread);
+      z_policy_var_unref(req->request_categories);
+      z_policy_unlock(self->super.thread);
+    }
+
+  if (req->request_data)
+    z_blob_unref(req->request_data);
+
+  if (req->append_cookie)
+    g_string_free(req->append_cookie, TRUE);
+
+  g_string_free(req->request_method, TRUE);
+  g_string_free(req->request_url, TRUE);
+  http_destroy_url(&req->request_url_parts);
+  g_string_free(req->remote_server, TRUE);
+  g_string_free(req->parent_proxy, TRUE);
+  http_destroy_headers(&req->headers);
+  g_string_free(req->auth_header_value, TRUE);
+  g_string_free(req->error_info, TRUE);
+  g_string_free(req->error_msg, TRUE);
+  g_string_free(req->error_headers, TRUE);
+  g_string_free(req->custom_response_body, TRUE);
+  g_free(req);
+}
+
+static inline void
+http_pipeline_string_swap(GString *a, GString *b)
+{
+  std::swap(*a, *b);
+}
+
+/**
+ * http_pipeline_request_swap:
+ * @self: HttpProxy instance
+ * @req: pipelined request
+ *
+ * Exchange the request specific state of @self with @req.  Calling it
+ * twice restores the original state.
+ **/
+void
+http_pipeline_request_swap(HttpProxy *self, HttpPipelineRequest *req)
+{
+  gchar version[sizeof(req->request_version)];
+
+  http_pipeline_string_swap(self->request_method, req->request_method);
+  std::swap(self->request_flags, req->request_flags);
+  http_pipeline_string_swap(self->request_url, req->request_url);
+  std::swap(self->request_url_parts, req->request_url_parts);
+
+  memcpy(version, self->request_version, sizeof(version));
+  memcpy(self->request_version, req->request_version, sizeof(version));
+  memcpy(req->request_version, version, sizeof(version));
+
+  std::swap(self->request_type, req->request_type);
+  std::swap(self->server_protocol, req->server_protocol);
+  http_pipeline_string_swap(self->remote_server, req->remote_server);
+  std::swap(self->remote_port, req->remote_port);
+  http_pipeline_string_swap(self->parent_proxy, req->parent_proxy);
+  std::swap(self->parent_proxy_port, req->parent_proxy_port);
+  std::swap(self->proto_version[EP_CLIENT], req->proto_version);
+  std::swap(self->connection_mode, req->connection_mode);
+  std::swap(self->headers[EP_CLIENT], req->headers);
+  std::swap(self->connection_hdr, req->connection_hdr);
+  std::swap(self->request_data_stored, req->request_data_stored);
+  std::swap(self->request_data, req->request_data);
+  http_pipeline_string_swap(self->auth_header_value, req->auth_header_value);
+  std::swap(self->append_cookie, req->append_cookie);
+  std::swap(self->request_categories, req->request_categories);
+
+  std::swap(self->error_code, req->error_code);
+  std::swap(self->error_status, req->error_status);
+  http_pipeline_string_swap(self->error_info, req->error_info);
+  http_pipeline_string_swap(self->error_msg, req->error_msg);
+  http_pipeline_string_swap(self->error_headers, req->error_headers);
+  std::swap(self->send_custom_response, req->send_custom_response);
+  http_pipeline_string_swap(self->custom_response_body, req->custom_response_body);
+}
+
+static inline void
+http_pipeline_inherit_route(HttpProxy *self, HttpPipelineRequest *req)
+{
+  g_string_assign(self->parent_proxy, req->parent_proxy->str);
+  self->parent_proxy_port = req->parent_proxy_port;
+}
+
+/**
+ * http_pipeline_lookahead_begin:
+ * @self: HttpProxy instance
+ *
+ * Move the current request out of the way to process the requests behind
+ * it.  Returns the current request, to be restored by
+ * http_pipeline_lookahead_end().
+ **/
+HttpPipelineRequest *
+http_pipeline_lookahead_begin(HttpProxy *self)
+{
+  HttpPipelineRequest *current = http_pipeline_request_new();
+
+  http_pipeline_request_swap(self, current);
+  http_pipeline_inherit_route(self, current);
+  return current;
+}
+
+/**
+ * http_pipeline_lookahead_queue:
+ * @self: HttpProxy instance
+ * @req: empty pipelined request, its sent flag already set
+ *
+ * Move the request processed ahead of its turn to @req and queue it, the
+ * next request starts with the same parent proxy.
+ **/
+void
+http_pipeline_lookahead_queue(HttpProxy *self, HttpPipelineRequest *req)
+{
+  req->state = self->state;
+  http_pipeline_request_swap(self, req);
+  http_pipeline_inherit_route(self, req);
+  g_queue_push_tail(self->pipeline, req);
+}
+
+/**
+ * http_pipeline_lookahead_end:
+ * @self: HttpProxy instance
+ * @current: the request returned by http_pipeline_lookahead_begin()
+ *
+ * Restore the current request after the look-ahead.
+ **/
+void
+http_pipeline_lookahead_end(HttpProxy *self, HttpPipelineRequest *current)
+{
+  http_pipeline_request_swap(self, current);
+  http_pipeline_request_free(self, current);
+}
+
+/**
+ * http_pipeline_next:
+ * @self: HttpProxy instance
+ *
+ * Continue with the next queued request after a response has been copied
+ * to the client.  Returns FALSE if the queue is empty.
+ **/
+gboolean
+http_pipeline_next(HttpProxy *self)
+{
+  HttpPipelineRequest *req;
+
+  req = static_cast<HttpPipelineRequest *>(g_queue_pop_head(self->pipeline));
+  if (!req)
+    return FALSE;
+
+  http_pipeline_request_swap(self, req);
+  self->state = req->state;
+  self->pipeline_sent = req->sent;
+  http_pipeline_request_free(self, req);
+  return TRUE;
+}
+
+/**
+ * http_pipeline_request_eligible:
+ * @self: HttpProxy instance
+ *
+ * Check whether the current request permits the requests behind it to be
+ * sent to the server before its response arrives, or whether it can be
+ * sent ahead itself.  Only idempotent requests without a body qualify, as
+ * they can be sent again if the server closes the connection before
+ * responding to them.
+ **/
+gboolean
+http_pipeline_request_eligible(HttpProxy *self)
+{
+  HttpHeader *hdr;
+
+  if (self->proto_version[EP_CLIENT] < 0x0101 ||
+      self->connection_mode != HTTP_CONNECTION_KEEPALIVE)
+    return FALSE;
+
+  if (self->server_protocol != HTTP_PROTO_HTTP && self->server_protocol != HTTP_PROTO_HTTPS)
+    return FALSE;
+
+  if (strcmp(self->request_method->str, "GET") != 0 &&
+      strcmp(self->request_method->str, "HEAD") != 0)
+    return FALSE;
+
+  if (http_lookup_header(&self->headers[EP_CLIENT], "Content-Length", &hdr) ||
+      http_lookup_header(&self->headers[EP_CLIENT], "Transfer-Encoding", &hdr))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * http_pipeline_unsend:
+ * @self: HttpProxy instance
+ *
+ * Called when the server connection the queued requests were sent on is
+ * closed, they are sent again on their turn.
+ **/
+void
+http_pipeline_unsend(HttpProxy *self)
+{
+  GList *p;
+
+  for (p = self->pipeline->head; p; p = p->next)
+    static_cast<HttpPipelineRequest *>(p->data)->sent = FALSE;
+
+  self->pipeline_sent = FALSE;
+}
+
+/**
+ * http_pipeline_clear:
+ * @self: HttpProxy instance
+ *
+ * Drop the queued requests when the session ends, their responses are
+ * never delivered.  Returns TRUE if any of them was already sent to the
+ * server, in which case the server connection still owes responses and
+ * must not be reused.
+ **/
+gboolean
+http_pipeline_clear(HttpProxy *self)
+{
+  HttpPipelineRequest *req;
+  gboolean sent = FALSE;
+
+  while ((req = static_cast<HttpPipelineRequest *>(g_queue_pop_head(self->pipeline))))
+    {
+      sent = sent || req->sent;
+      http_pipeline_request_free(self, req);
+    }
+
+  self->pipeline_sent = FALSE;
+  return sent;
+}
@@ -0,0 +1,272 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#include "http.h"
+
+#include <zorp/pydict.h>
+
+/*
+ * The request, request_header, response and response_header hashes are
+ * filled by the policy as tuples.  Parsing those tuples requires the
+ * interpreter lock, so instead of doing that for every request we parse
+ * each item once into a HttpPolicyVerdict, and only go back to Python for
+ * *_POLICY call-backs.
+ *
+ * Verdicts are indexed by the ZPolicyObj stored in the hash, thus the
+ * original hashes (with their own wildcard and case-insensitive matching)
+ * are still used for the lookup.  If the policy changes any of the hashes
+ * at runtime the hash generation of the proxy dict changes and the
+ * verdicts are recompiled before their next use.
+ */
+
+static void
+http_policy_verdict_free(HttpPolicyVerdict *verdict)
+{
+  g_free(verdict->name);
+  g_free(verdict->value);
+  g_free(verdict);
+}
+
+/**
+ * http_policy_verdict_new:
+ * @kind: the hash @f was found in
+ * @f: policy hash item
+ *
+ * Parse @f into a native verdict. Must be called with the interpreter
+ * lock held.
+ **/
+static HttpPolicyVerdict *
+http_policy_verdict_new(HttpPolicyKind kind, ZPolicyObj *f)
+{
+  HttpPolicyVerdict *verdict = g_new0(HttpPolicyVerdict, 1);
+  ZPolicyObj *handler = NULL;
+  gchar *name = NULL, *value = NULL;
+  guint action;
+
+  if (!z_policy_tuple_get_verdict(f, &action))
+    {
+      verdict->action = -1;
+      return verdict;
+    }
+
+  verdict->action = action;
+  verdict->valid = TRUE;
+
+  /* HTTP_REQ_POLICY, HTTP_RSP_POLICY and HTTP_HDR_POLICY share their value */
+  if (action == HTTP_REQ_POLICY)
+    {
+      verdict->valid = z_policy_var_parse(f, "(iO)", &action, &handler);
+    }
+  else if (kind == HTTP_POLICY_HEADER)
+    {
+      switch (action)
+        {
+        case HTTP_HDR_CHANGE_NAME:
+          verdict->valid = z_policy_var_parse(f, "(is)", &action, &name);
+          break;
+
+        case HTTP_HDR_CHANGE_VALUE:
+        case HTTP_HDR_INSERT:
+        case HTTP_HDR_REPLACE:
+          verdict->valid = z_policy_var_parse(f, "(is)", &action, &value);
+          break;
+
+        case HTTP_HDR_CHANGE_BOTH:
+          verdict->valid = z_policy_var_parse(f, "(iss)", &action, &name, &value);
+          break;
+
+        default:
+          break;
+        }
+    }
+  else if (action == HTTP_REQ_REJECT)
+    {
+      verdict->valid = z_policy_var_parse_tuple(f, "i|s", &action, &value);
+    }
+
+  if (verdict->valid)
+    {
+      verdict->handler = handler;
+      verdict->name = g_strdup(name);
+      verdict->value = g_strdup(value);
+    }
+
+  return verdict;
+}
+
+typedef struct _HttpPolicyCompileState
+{
+  HttpProxy *self;
+  HttpPolicyKind kind;
+  ZEndpoint side;
+} HttpPolicyCompileState;
+
+static void
+http_policy_compile_item(gchar *key, ZPolicyObj *f, HttpPolicyCompileState *state)
+{
+  HttpProxy *self = state->self;
+  GHashTable *verdicts = self->policy_verdicts[state->kind];
+  HttpPolicyVerdict *verdict;
+
+  verdict = static_cast<HttpPolicyVerdict *>(g_hash_table_lookup(verdicts, f));
+
+  if (!verdict)
+    {
+      verdict = http_policy_verdict_new(state->kind, f);
+      g_hash_table_insert(verdicts, f, verdict);
+    }
+
+  if (state->kind == HTTP_POLICY_HEADER && verdict->valid &&
+      (verdict->action == HTTP_HDR_INSERT || verdict->action == HTTP_HDR_REPLACE))
+    {
+      HttpPolicyVerdict *insert = g_new0(HttpPolicyVerdict, 1);
+
+      insert->action = verdict->action;
+      insert->valid = TRUE;
+      insert->name = g_strdup(key);
+      insert->value = g_strdup(verdict->value);
+      self->header_inserts[state->side] = g_list_prepend(self->header_inserts[state->side], insert);
+    }
+}
+
+/**
+ * http_policy_verdicts_compile:
+ * @self: HttpProxy instance
+ *
+ * (Re)compile the request and header policy hashes into native verdicts.
+ * Items of the response dimhash are compiled on their first use as
+ * dimhashes cannot be iterated.  Must be called with the interpreter lock
+ * held.
+ **/
+void
+http_policy_verdicts_compile(HttpProxy *self)
+{
+  HttpPolicyCompileState state;
+  gint i;
+
+  z_proxy_enter(self);
+  self->policy_generation = z_policy_dict_get_hash_generation(self->super.dict);
+
+  for (i = 0; i < HTTP_POLICY_MAX; i++)
+    {
+      if (self->policy_verdicts[i])
+        g_hash_table_remove_all(self->policy_verdicts[i]);
+      else
+        self->policy_verdicts[i] = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                         NULL, (GDestroyNotify) http_policy_verdict_free);
+    }
+
+  for (i = EP_CLIENT; i < EP_MAX; i++)
+    {
+      g_list_free_full(self->header_inserts[i], (GDestroyNotify) http_policy_verdict_free);
+      self->header_inserts[i] = NULL;
+    }
+
+  state.self = self;
+  state.kind = HTTP_POLICY_REQUEST;
+  state.side = EP_CLIENT;
+  g_hash_table_foreach(self->request_method_policy, (GHFunc) http_policy_compile_item, &state);
+
+  state.kind = HTTP_POLICY_HEADER;
+  g_hash_table_foreach(self->request_header_policy, (GHFunc) http_policy_compile_item, &state);
+  state.side = EP_SERVER;
+  g_hash_table_foreach(self->response_header_policy, (GHFunc) http_policy_compile_item, &state);
+
+  for (i = EP_CLIENT; i < EP_MAX; i++)
+    self->header_inserts[i] = g_list_reverse(self->header_inserts[i]);
+
+  z_proxy_return(self);
+}
+
+void
+http_policy_verdicts_free(HttpProxy *self)
+{
+  gint i;
+
+  for (i = 0; i < HTTP_POLICY_MAX; i++)
+    {
+      if (self->policy_verdicts[i])
+        g_hash_table_destroy(self->policy_verdicts[i]);
+      self->policy_verdicts[i] = NULL;
+    }
+
+  for (i = EP_CLIENT; i < EP_MAX; i++)
+    {
+      g_list_free_full(self->header_inserts[i], (GDestroyNotify) http_policy_verdict_free);
+      self->header_inserts[i] = NULL;
+    }
+}
+
+static inline void
+http_policy_verdicts_refresh(HttpProxy *self)
+{
+  if (G_LIKELY(self->policy_verdicts[HTTP_POLICY_REQUEST] &&
+               self->policy_generation == z_policy_dict_get_hash_generation(self->super.dict)))
+    return;
+
+  z_policy_lock(self->super.thread);
+  http_policy_verdicts_compile(self);
+  z_policy_unlock(self->super.thread);
+}
+
+/**
+ * http_policy_verdict_lookup:
+ * @self: HttpProxy instance
+ * @kind: the hash @f was found in
+ * @f: policy hash item
+ *
+ * Return the compiled verdict for @f.  The interpreter lock is only taken
+ * if the policy hashes were changed since they were last compiled, or
+ * when a response hash item is used for the first time.
+ **/
+HttpPolicyVerdict *
+http_policy_verdict_lookup(HttpProxy *self, HttpPolicyKind kind, ZPolicyObj *f)
+{
+  HttpPolicyVerdict *verdict;
+
+  http_policy_verdicts_refresh(self);
+  verdict = static_cast<HttpPolicyVerdict *>(g_hash_table_lookup(self->policy_verdicts[kind], f));
+
+  if (!verdict)
+    {
+      z_policy_lock(self->super.thread);
+      verdict = http_policy_verdict_new(kind, f);
+      z_policy_unlock(self->super.thread);
+      g_hash_table_insert(self->policy_verdicts[kind], f, verdict);
+    }
+
+  return verdict;
+}
+
+/**
+ * http_policy_header_inserts:
+ * @self: HttpProxy instance
+ * @side: request or response headers
+ *
+ * Return the list of HTTP_HDR_INSERT and HTTP_HDR_REPLACE verdicts of
+ * the header hash of @side, with the header name filled in.
+ **/
+GList *
+http_policy_header_inserts(HttpProxy *self, ZEndpoint side)
+{
+  http_policy_verdicts_refresh(self);
+  return self->header_inserts[side];
+}
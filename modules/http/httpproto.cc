@@ -896,6 +896,14 @@ http_proto_fill_hash(HttpElementInfo *table, gboolean casesens)
   return hash;
 }
 
+static void
+http_proto_compile_charsets(HttpElementInfo *table)
+{
+  gint x;
+
+  for (x = 0; table[x].name; x++)
+    table[x].charset = http_charset_lookup(table[x].flags);
+}
 
 void
 http_proto_init(void)
@@ -904,4 +912,6 @@ http_proto_init(void)
   response_proto_hash = http_proto_fill_hash(response_proto_table, TRUE);
   request_hdr_proto_hash = http_proto_fill_hash(request_hdr_proto_table, FALSE);
   response_hdr_proto_hash = http_proto_fill_hash(response_hdr_proto_table, FALSE);
+  http_proto_compile_charsets(request_hdr_proto_table);
+  http_proto_compile_charsets(response_hdr_proto_table);
 }
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "../http.h"
+
+#include <zorpll/streamfd.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* returns the local end of a connected socket pair, the other end is
+ * stored in @peer to play the role of the server */
+static ZStream *
+new_server_stream(gint *peer)
+{
+  gint fds[2];
+
+  BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  *peer = fds[1];
+  return z_stream_fd_new(fds[0], "server");
+}
+
+BOOST_AUTO_TEST_CASE(test_checkout_returns_checked_in_stream)
+{
+  gint peer;
+  ZStream *stream = new_server_stream(&peer);
+
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct reuse:80") == NULL);
+  BOOST_REQUIRE(http_conn_pool_checkin("svc/test direct reuse:80", stream, 8, 30000));
+
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct other:80") == NULL);
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct reuse:80") == stream);
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct reuse:80") == NULL);
+
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  close(peer);
+}
+
+BOOST_AUTO_TEST_CASE(test_closed_or_busy_stream_is_dropped)
+{
+  gint closed_peer, busy_peer;
+  ZStream *closed_stream = new_server_stream(&closed_peer);
+  ZStream *busy_stream = new_server_stream(&busy_peer);
+
+  BOOST_REQUIRE(http_conn_pool_checkin("svc/test direct dead:80", closed_stream, 8, 30000));
+  BOOST_REQUIRE(http_conn_pool_checkin("svc/test direct dead:80", busy_stream, 8, 30000));
+
+  /* the server closes one of the connections and sends unsolicited data
+   * on the other while they are idle */
+  close(closed_peer);
+  BOOST_REQUIRE(write(busy_peer, "HTTP/1.1 408 Request Timeout\r\n\r\n", 32) == 32);
+
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct dead:80") == NULL);
+  close(busy_peer);
+}
+
+BOOST_AUTO_TEST_CASE(test_per_key_limit_and_timeout)
+{
+  gint peers[3], peer;
+  ZStream *streams[3], *stream;
+  gint i;
+
+  for (i = 0; i < 3; i++)
+    {
+      streams[i] = new_server_stream(&peers[i]);
+      BOOST_REQUIRE(http_conn_pool_checkin("svc/test direct limit:80", streams[i], 2, 30000));
+    }
+
+  /* the least recently returned connection was closed by the pool */
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct limit:80") == streams[2]);
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct limit:80") == streams[1]);
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct limit:80") == NULL);
+
+  for (i = 1; i < 3; i++)
+    {
+      z_stream_close(streams[i], NULL);
+      z_stream_unref(streams[i]);
+    }
+
+  for (i = 0; i < 3; i++)
+    close(peers[i]);
+
+  stream = new_server_stream(&peer);
+
+  BOOST_REQUIRE(http_conn_pool_checkin("svc/test direct timeout:80", stream, 2, 0));
+  BOOST_CHECK(http_conn_pool_checkout("svc/test direct timeout:80") == NULL);
+  close(peer);
+}
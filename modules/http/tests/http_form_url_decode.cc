@@ -58,6 +58,11 @@ std::vector<struct test> test_table =
   { "ab c",   "ab c"},  // not a valid form URL encoded input
   { "%E8%B6%85%E6%96%87%E6%9C%AC%C3%8D%C3%96%C3%9C%C3%93%D0%90%D0%91%D0%92%D0%93%D0%94%C4%91%C3%A4%3C%3E%23%26%40%40",
               "超文本ÍÖÜÓАБВГДđä<>#&@@"},
+  /* escapes and plus signs around and across 16 byte boundaries */
+  { "0123456789abcdefghijklmnopqrstu%20vwxyz0123456789abcdef+0123456789abcde%41",
+              "0123456789abcdefghijklmnopqrstu vwxyz0123456789abcdef 0123456789abcdeA"},
+  { "first_name=John+Smith&comment=Lorem+ipsum+dolor+sit+amet%2C+consectetur",
+              "first_name=John Smith&comment=Lorem ipsum dolor sit amet, consectetur"},
 };
 
 BOOST_AUTO_TEST_CASE(http_parse_query_string)
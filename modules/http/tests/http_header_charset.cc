@@ -0,0 +1,188 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "../http.h"
+
+/* the character classes as they were checked before compiling them to bitmaps */
+static gboolean
+reference_check(guint flags, const std::string &value)
+{
+  for (guchar c : value)
+    {
+      if (!(((flags & HTTP_HDR_CF_ALPHA) && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) ||
+            ((flags & HTTP_HDR_CF_NUMERIC) && (c >= '0' && c <= '9')) ||
+            ((flags & HTTP_HDR_CF_SPACE) && c == ' ') ||
+            ((flags & HTTP_HDR_CF_COMMA) && c == ',') ||
+            ((flags & HTTP_HDR_CF_DOT) && c == '.') ||
+            ((flags & HTTP_HDR_CF_BRACKET) && (c == '[' || c == ']' || c == '{' || c == '}' || c == '(' || c == ')')) ||
+            ((flags & HTTP_HDR_CF_EQUAL) && c == '=') ||
+            ((flags & HTTP_HDR_CF_DASH) && c == '-') ||
+            ((flags & HTTP_HDR_CF_SLASH) && c == '/') ||
+            ((flags & HTTP_HDR_CF_COLON) && c == ':') ||
+            ((flags & HTTP_HDR_CF_SEMICOLON) && c == ';') ||
+            ((flags & HTTP_HDR_CF_AT) && c == '@') ||
+            ((flags & HTTP_HDR_CF_UNDERLINE) && c == '_') ||
+            ((flags & HTTP_HDR_CF_AND) && c == '&') ||
+            ((flags & HTTP_HDR_CF_BACKSLASH) && c == '\\') ||
+            ((flags & HTTP_HDR_CF_ASTERIX) && c == '*') ||
+            ((flags & HTTP_HDR_CF_DOLLAR) && c == '$') ||
+            ((flags & HTTP_HDR_CF_HASHMARK) && c == '#') ||
+            ((flags & HTTP_HDR_CF_PLUS) && c == '+') ||
+            ((flags & HTTP_HDR_CF_QUOTE) && (c == '"' || c == '\'')) ||
+            ((flags & HTTP_HDR_CF_QUESTIONMARK) && c == '?') ||
+            ((flags & HTTP_HDR_CF_PERCENT) && c == '%') ||
+            ((flags & HTTP_HDR_CF_TILDE) && c == '~') ||
+            ((flags & HTTP_HDR_CF_EXCLAM) && c == '!')))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static const HttpCharsetKernel kernels[] =
+  {
+    HTTP_CHARSET_KERNEL_SCALAR,
+    HTTP_CHARSET_KERNEL_SSSE3,
+    HTTP_CHARSET_KERNEL_AVX2,
+  };
+
+static const gchar *kernel_names[] = { "scalar", "ssse3", "avx2" };
+
+/* header values as they typically appear in requests */
+static const struct
+{
+  guint flags;
+  const gchar *value;
+} realistic_headers[] =
+  {
+    { HTTP_HDR_CF_ALPHA | HTTP_HDR_CF_NUMERIC | HTTP_HDR_CF_DOT | HTTP_HDR_CF_DASH | HTTP_HDR_CF_COLON,
+      "www.example.com:8080" },
+    { HTTP_HDR_CF_ALPHA | HTTP_HDR_CF_NUMERIC | HTTP_HDR_CF_SPACE | HTTP_HDR_CF_DOT | HTTP_HDR_CF_SLASH |
+      HTTP_HDR_CF_BRACKET | HTTP_HDR_CF_SEMICOLON | HTTP_HDR_CF_COMMA | HTTP_HDR_CF_UNDERLINE | HTTP_HDR_CF_DASH,
+      "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36" },
+    { HTTP_HDR_CF_ALPHA | HTTP_HDR_CF_NUMERIC | HTTP_HDR_CF_SLASH | HTTP_HDR_CF_COMMA | HTTP_HDR_CF_SEMICOLON |
+      HTTP_HDR_CF_EQUAL | HTTP_HDR_CF_DOT | HTTP_HDR_CF_PLUS | HTTP_HDR_CF_ASTERIX | HTTP_HDR_CF_DASH,
+      "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8" },
+    { HTTP_HDR_CF_ALPHA | HTTP_HDR_CF_NUMERIC | HTTP_HDR_CF_SPACE | HTTP_HDR_CF_EQUAL | HTTP_HDR_CF_PLUS |
+      HTTP_HDR_CF_SLASH,
+      "Basic QWxhZGRpbjpvcGVuIHNlc2FtZQ==" },
+    { HTTP_HDR_CF_NUMERIC, "1048576" },
+  };
+
+BOOST_AUTO_TEST_CASE(test_kernels_match_reference)
+{
+  GRand *rand = g_rand_new_with_seed(42);
+  guint i, round;
+
+  for (round = 0; round < 2000; round++)
+    {
+      guint flags = g_rand_int(rand) & ~(HTTP_HDR_FF_URL | HTTP_HDR_FF_ANY);
+      const HttpCharset *charset = http_charset_lookup(flags);
+      std::string value;
+      guint len = g_rand_int_range(rand, 0, 100);
+
+      for (i = 0; i < len; i++)
+        {
+          /* mostly printable characters, so that long valid runs are common */
+          if (g_rand_int_range(rand, 0, 50) == 0)
+            value.push_back((gchar) g_rand_int_range(rand, 0, 256));
+          else
+            value.push_back((gchar) g_rand_int_range(rand, ' ', 127));
+        }
+
+      gboolean expected = reference_check(flags, value);
+
+      for (i = 0; i < G_N_ELEMENTS(kernels); i++)
+        {
+          gboolean supported;
+          gboolean res = http_charset_check_with(kernels[i], charset, value.data(), value.size(), &supported);
+
+          if (!supported)
+            continue;
+
+          BOOST_REQUIRE_MESSAGE(res == expected,
+                                "kernel=" << kernel_names[i] << ", flags=" << flags << ", value='" << value << "'");
+        }
+    }
+
+  g_rand_free(rand);
+}
+
+BOOST_AUTO_TEST_CASE(test_realistic_headers)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(realistic_headers); i++)
+    {
+      const HttpCharset *charset = http_charset_lookup(realistic_headers[i].flags);
+      const gchar *value = realistic_headers[i].value;
+
+      BOOST_CHECK(http_charset_check(charset, value, strlen(value)));
+      BOOST_CHECK(reference_check(realistic_headers[i].flags, value));
+
+      std::string invalid(value);
+      invalid.push_back('\x80');
+      BOOST_CHECK(!http_charset_check(charset, invalid.data(), invalid.size()));
+    }
+}
+
+/* microbenchmark, prints the throughput of the kernels with --log_level=message */
+BOOST_AUTO_TEST_CASE(benchmark_kernels)
+{
+  const guint iterations = 200000;
+  const HttpCharset *charsets[G_N_ELEMENTS(realistic_headers)];
+  guint i, j, k;
+
+  for (k = 0; k < G_N_ELEMENTS(realistic_headers); k++)
+    charsets[k] = http_charset_lookup(realistic_headers[k].flags);
+
+  for (i = 0; i < G_N_ELEMENTS(kernels); i++)
+    {
+      gboolean supported = TRUE;
+      gsize bytes = 0;
+      gint64 start = g_get_monotonic_time();
+
+      for (j = 0; j < iterations && supported; j++)
+        {
+          for (k = 0; k < G_N_ELEMENTS(realistic_headers); k++)
+            {
+              const gchar *value = realistic_headers[k].value;
+              gsize len = strlen(value);
+
+              http_charset_check_with(kernels[i], charsets[k], value, len, &supported);
+              bytes += len;
+            }
+        }
+
+      if (!supported)
+        continue;
+
+      gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+      BOOST_TEST_MESSAGE("kernel=" << kernel_names[i] << ", bytes=" << bytes
+                         << ", usec=" << elapsed << ", MB/s=" << bytes / elapsed);
+    }
+}
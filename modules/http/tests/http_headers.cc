@@ -0,0 +1,112 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "../http.h"
+
+static void
+add_header(HttpHeaders *hdrs, const gchar *name, const gchar *value)
+{
+  http_add_header(hdrs, name, strlen(name), value, strlen(value));
+}
+
+BOOST_AUTO_TEST_CASE(test_lookup_is_case_insensitive)
+{
+  HttpHeaders hdrs;
+  HttpHeader *h;
+
+  http_init_headers(&hdrs);
+  add_header(&hdrs, "Content-Type", "text/html");
+  add_header(&hdrs, "X-Foo", "bar");
+
+  BOOST_CHECK(http_lookup_header(&hdrs, "content-type", &h));
+  BOOST_CHECK_EQUAL(h->value->str, "text/html");
+  BOOST_CHECK(http_lookup_header(&hdrs, "X-FOO", &h));
+  BOOST_CHECK_EQUAL(h->value->str, "bar");
+  BOOST_CHECK(!http_lookup_header(&hdrs, "X-Fo", &h));
+  BOOST_CHECK(h == NULL);
+
+  http_destroy_headers(&hdrs);
+}
+
+BOOST_AUTO_TEST_CASE(test_duplicates)
+{
+  HttpHeaders hdrs;
+  HttpHeader *h;
+
+  http_init_headers(&hdrs);
+  add_header(&hdrs, "Accept", "text/html");
+  add_header(&hdrs, "accept", "text/plain");
+  add_header(&hdrs, "Host", "example.com");
+
+  /* smuggle headers are not duplicated */
+  BOOST_CHECK(http_add_header(&hdrs, "Host", 4, "example.org", 11) == NULL);
+
+  BOOST_CHECK(http_lookup_header(&hdrs, "Accept", &h));
+  BOOST_CHECK_EQUAL(h->value->str, "text/html");
+  BOOST_CHECK(http_lookup_header(&hdrs, "Host", &h));
+  BOOST_CHECK_EQUAL(h->value->str, "example.com");
+
+  http_flat_headers(&hdrs);
+  BOOST_CHECK_EQUAL(hdrs.flat->str, "Accept: text/html\r\naccept: text/plain\r\nHost: example.com\r\n");
+
+  http_destroy_headers(&hdrs);
+}
+
+BOOST_AUTO_TEST_CASE(test_clear_and_reuse)
+{
+  HttpHeaders hdrs;
+  HttpHeader *h, *first;
+  gchar name[16];
+  guint i;
+
+  http_init_headers(&hdrs);
+
+  /* more headers than the initial block and index size */
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf(name, sizeof(name), "X-Header-%u", i);
+      add_header(&hdrs, name, "value");
+    }
+
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf(name, sizeof(name), "x-header-%u", i);
+      BOOST_CHECK(http_lookup_header(&hdrs, name, &h));
+    }
+
+  first = hdrs.headers[0];
+  http_clear_headers(&hdrs);
+  BOOST_CHECK(!http_lookup_header(&hdrs, "X-Header-0", &h));
+
+  add_header(&hdrs, "Connection", "close");
+  BOOST_CHECK(hdrs.headers[0] == first);
+  BOOST_CHECK(http_lookup_header(&hdrs, "connection", &h));
+  BOOST_CHECK(h == first);
+
+  h->present = FALSE;
+  http_flat_headers(&hdrs);
+  BOOST_CHECK_EQUAL(hdrs.flat->len, 0);
+
+  http_destroy_headers(&hdrs);
+}
@@ -0,0 +1,254 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include "../http.h"
+
+/* only the request specific members of the proxy are set up, that is all
+ * the pipelining helpers touch */
+struct PipelineFixture
+{
+  HttpProxy *self;
+  GString *method_var;
+
+  PipelineFixture()
+  {
+    self = g_new0(HttpProxy, 1);
+    self->request_method = g_string_new("GET");
+    self->request_url = g_string_new("http://example.com/first");
+    http_init_url(&self->request_url_parts);
+    strcpy(self->request_version, "HTTP/1.1");
+    self->remote_server = g_string_new("example.com");
+    self->remote_port = 80;
+    self->parent_proxy = g_string_new("");
+    self->connected_server = g_string_new("example.com");
+    self->connected_port = 80;
+    self->server_protocol = HTTP_PROTO_HTTP;
+    self->proto_version[EP_CLIENT] = 0x0101;
+    self->connection_mode = HTTP_CONNECTION_KEEPALIVE;
+    http_init_headers(&self->headers[EP_CLIENT]);
+    self->auth_header_value = g_string_new("");
+    self->error_code = HTTP_MSG_NOT_ASSIGNED;
+    self->error_info = g_string_new("");
+    self->error_msg = g_string_new("");
+    self->error_headers = g_string_new("");
+    self->custom_response_body = g_string_new("");
+    self->pipeline = g_queue_new();
+
+    /* the policy layer keeps a pointer to the string */
+    method_var = self->request_method;
+  }
+
+  ~PipelineFixture()
+  {
+    http_pipeline_clear(self);
+    g_queue_free(self->pipeline);
+    g_string_free(self->request_method, TRUE);
+    g_string_free(self->request_url, TRUE);
+    http_destroy_url(&self->request_url_parts);
+    g_string_free(self->remote_server, TRUE);
+    g_string_free(self->parent_proxy, TRUE);
+    g_string_free(self->connected_server, TRUE);
+    http_destroy_headers(&self->headers[EP_CLIENT]);
+    g_string_free(self->auth_header_value, TRUE);
+    g_string_free(self->error_info, TRUE);
+    g_string_free(self->error_msg, TRUE);
+    g_string_free(self->error_headers, TRUE);
+    g_string_free(self->custom_response_body, TRUE);
+    g_free(self);
+  }
+
+  void add_header(const gchar *name, const gchar *value)
+  {
+    http_add_header(&self->headers[EP_CLIENT], name, strlen(name), value, strlen(value));
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(test_swap_twice_restores_request, PipelineFixture)
+{
+  HttpPipelineRequest *req = http_pipeline_request_new();
+  HttpHeader *h;
+
+  add_header("Host", "example.com");
+
+  http_pipeline_request_swap(self, req);
+  BOOST_CHECK(self->request_method == method_var);
+  BOOST_CHECK_EQUAL(self->request_method->len, 0U);
+  BOOST_CHECK_EQUAL(self->request_version[0], '\0');
+  BOOST_CHECK_EQUAL(self->connection_mode, (guint) HTTP_CONNECTION_CLOSE);
+  BOOST_CHECK(!http_lookup_header(&self->headers[EP_CLIENT], "Host", &h));
+
+  /* the next request is processed in the proxy itself */
+  g_string_assign(self->request_method, "HEAD");
+  g_string_assign(self->request_url, "http://example.com/second");
+  self->error_code = HTTP_MSG_POLICY_VIOLATION;
+  add_header("Accept", "*/*");
+
+  http_pipeline_request_swap(self, req);
+  BOOST_CHECK(self->request_method == method_var);
+  BOOST_CHECK_EQUAL(self->request_method->str, "GET");
+  BOOST_CHECK_EQUAL(self->request_url->str, "http://example.com/first");
+  BOOST_CHECK_EQUAL(std::string(self->request_version), "HTTP/1.1");
+  BOOST_CHECK_EQUAL(self->error_code, HTTP_MSG_NOT_ASSIGNED);
+  BOOST_CHECK(http_lookup_header(&self->headers[EP_CLIENT], "Host", &h));
+  BOOST_CHECK(!http_lookup_header(&self->headers[EP_CLIENT], "Accept", &h));
+
+  BOOST_CHECK_EQUAL(req->request_method->str, "HEAD");
+  BOOST_CHECK_EQUAL(req->request_url->str, "http://example.com/second");
+  BOOST_CHECK_EQUAL(req->error_code, HTTP_MSG_POLICY_VIOLATION);
+  BOOST_CHECK(http_lookup_header(&req->headers, "Accept", &h));
+
+  http_pipeline_request_free(self, req);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_only_idempotent_requests_without_body_are_eligible, PipelineFixture)
+{
+  BOOST_CHECK(http_pipeline_request_eligible(self));
+
+  g_string_assign(self->request_method, "HEAD");
+  BOOST_CHECK(http_pipeline_request_eligible(self));
+
+  g_string_assign(self->request_method, "POST");
+  BOOST_CHECK(!http_pipeline_request_eligible(self));
+
+  g_string_assign(self->request_method, "GET");
+  add_header("Content-Length", "10");
+  BOOST_CHECK(!http_pipeline_request_eligible(self));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_close_and_http10_requests_are_not_eligible, PipelineFixture)
+{
+  self->connection_mode = HTTP_CONNECTION_CLOSE;
+  BOOST_CHECK(!http_pipeline_request_eligible(self));
+
+  self->connection_mode = HTTP_CONNECTION_KEEPALIVE;
+  self->proto_version[EP_CLIENT] = 0x0100;
+  BOOST_CHECK(!http_pipeline_request_eligible(self));
+
+  self->proto_version[EP_CLIENT] = 0x0101;
+  self->server_protocol = HTTP_PROTO_FTP;
+  BOOST_CHECK(!http_pipeline_request_eligible(self));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_unsend_marks_queued_requests, PipelineFixture)
+{
+  HttpPipelineRequest *first = http_pipeline_request_new();
+  HttpPipelineRequest *second = http_pipeline_request_new();
+
+  first->sent = second->sent = TRUE;
+  g_queue_push_tail(self->pipeline, first);
+  g_queue_push_tail(self->pipeline, second);
+  self->pipeline_sent = TRUE;
+
+  http_pipeline_unsend(self);
+  BOOST_CHECK(!first->sent);
+  BOOST_CHECK(!second->sent);
+  BOOST_CHECK(!self->pipeline_sent);
+
+  http_pipeline_clear(self);
+  BOOST_CHECK(g_queue_is_empty(self->pipeline));
+}
+
+/* on exit the server connection is only pooled if no response is owed on
+ * it, the caller closes it when a dropped request was already sent */
+BOOST_FIXTURE_TEST_CASE(test_clear_reports_requests_sent_ahead, PipelineFixture)
+{
+  HttpPipelineRequest *first = http_pipeline_request_new();
+  HttpPipelineRequest *second = http_pipeline_request_new();
+
+  g_queue_push_tail(self->pipeline, first);
+  g_queue_push_tail(self->pipeline, second);
+  BOOST_CHECK(!http_pipeline_clear(self));
+  BOOST_CHECK(g_queue_is_empty(self->pipeline));
+
+  first = http_pipeline_request_new();
+  second = http_pipeline_request_new();
+  first->sent = TRUE;
+  g_queue_push_tail(self->pipeline, first);
+  g_queue_push_tail(self->pipeline, second);
+  self->pipeline_sent = TRUE;
+
+  BOOST_CHECK(http_pipeline_clear(self));
+  BOOST_CHECK(g_queue_is_empty(self->pipeline));
+  BOOST_CHECK(!self->pipeline_sent);
+
+  BOOST_CHECK(!http_pipeline_clear(self));
+}
+
+/* what http_pipeline_fill does: the requests behind the current one are
+ * processed and queued, sent ahead only if the server connection leads
+ * where they have to go */
+BOOST_FIXTURE_TEST_CASE(test_lookahead_keeps_route_per_request, PipelineFixture)
+{
+  HttpPipelineRequest *current, *req;
+
+  g_string_assign(self->parent_proxy, "proxy1");
+  self->parent_proxy_port = 3128;
+  g_string_assign(self->connected_server, "proxy1");
+  self->connected_port = 3128;
+  BOOST_CHECK(http_server_route_matches(self));
+
+  current = http_pipeline_lookahead_begin(self);
+  BOOST_CHECK_EQUAL(self->request_url->len, 0U);
+  BOOST_CHECK_EQUAL(self->parent_proxy->str, "proxy1");
+
+  /* the second request goes the same way, it is sent ahead */
+  g_string_assign(self->request_url, "http://example.com/second");
+  self->state = HTTP_STATE_CONNECT;
+  BOOST_CHECK(http_server_route_matches(self));
+  req = http_pipeline_request_new();
+  req->sent = TRUE;
+  http_pipeline_lookahead_queue(self, req);
+
+  /* the policy of the third request changes the parent proxy, it has to
+   * wait for its turn and a new connection */
+  BOOST_CHECK_EQUAL(self->parent_proxy->str, "proxy1");
+  g_string_assign(self->request_url, "http://example.com/third");
+  g_string_assign(self->parent_proxy, "proxy2");
+  self->state = HTTP_STATE_CONNECT;
+  BOOST_CHECK(!http_server_route_matches(self));
+  req = http_pipeline_request_new();
+  http_pipeline_lookahead_queue(self, req);
+  BOOST_CHECK_EQUAL(self->parent_proxy->str, "proxy2");
+
+  http_pipeline_lookahead_end(self, current);
+  BOOST_CHECK_EQUAL(self->request_url->str, "http://example.com/first");
+  BOOST_CHECK_EQUAL(self->parent_proxy->str, "proxy1");
+  BOOST_CHECK(http_server_route_matches(self));
+  BOOST_CHECK_EQUAL(g_queue_get_length(self->pipeline), 2U);
+
+  /* the queued requests continue in order, with their own parent proxy */
+  BOOST_REQUIRE(http_pipeline_next(self));
+  BOOST_CHECK_EQUAL(self->request_url->str, "http://example.com/second");
+  BOOST_CHECK(self->pipeline_sent);
+  BOOST_CHECK(http_server_route_matches(self));
+
+  BOOST_REQUIRE(http_pipeline_next(self));
+  BOOST_CHECK_EQUAL(self->request_url->str, "http://example.com/third");
+  BOOST_CHECK_EQUAL(self->state, HTTP_STATE_CONNECT);
+  BOOST_CHECK(!self->pipeline_sent);
+  BOOST_CHECK_EQUAL(self->parent_proxy->str, "proxy2");
+  BOOST_CHECK(!http_server_route_matches(self));
+
+  BOOST_CHECK(!http_pipeline_next(self));
+}
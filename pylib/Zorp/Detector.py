@@ -48,6 +48,12 @@ from Matcher import getMatcher
 import struct
 import os
 
+try:
+    from Zorp import parseTlsClientHello
+except ImportError:
+    # the native parser is only available when running inside Zorp
+    parseTlsClientHello = None
+
 class DetectorPolicy(object):
     """<class maturity="stable" type="detectorpolicy">
       <summary>
@@ -722,9 +728,60 @@ class TlsDetector(AbstractDetector):
 
         return extensions, offset
 
+    def _parse_tls_handshake_extension_server_name(self, data):
+        offset = 0
+
+        server_name_list_length, offset = self._parse_numeric(
+            data, offset,
+            self._TLS_EXTENSION_SERVER_NAME_LIST_LENGTH_SIZE
+        )
+        self._raise_if_not_enough_data(data, offset, server_name_list_length)
+
+        while offset < len(data):
+            hostname_type, offset = self._parse_numeric(data, offset, self._TLS_EXTENSION_SERVER_NAME_TYPE_SIZE)
+            hostname_length, offset = self._parse_numeric(data, offset, self._TLS_EXTENSION_SERVER_NAME_LENGTH_SIZE)
+            self._raise_if_not_enough_data(data, offset, hostname_length)
+            hostname = data[offset:offset + hostname_length]
+            offset += hostname_length
+            if hostname_type == TlsExtensionServerNameType.SERVER_NAME:
+                return hostname
+
+        return None
+
+    def _parse_tls_client_hello_fallback(self, data):
+        try:
+            data = self._parse_tls_record(data)
+        except IndexError:
+            return None
+
+        offset = self._parse_tls_handshake_header(data, 0, TlsHandshakeType.CLIENT_HELLO)
+        offset = self._parse_tls_handshake_hello_header(data, offset)
+        offset = self._parse_tls_handshake_client_hello(data, offset)
+        extensions, offset = self._parse_tls_handshake_extensions(data, offset)
+
+        server_name = None
+        if TlsExtensionType.SERVER_NAME in extensions:
+            server_name = self._parse_tls_handshake_extension_server_name(extensions[TlsExtensionType.SERVER_NAME])
+
+        return {'server_name': server_name}
+
+    def _parse_tls_client_hello(self, data):
+        """
+        Returns a dict of the ClientHello fields (see parseTlsClientHello),
+        or None if more data is needed. Raises ValueError if data is not a
+        ClientHello. Outside of Zorp only the server_name is parsed.
+        """
+        if parseTlsClientHello is not None:
+            return parseTlsClientHello(data)
+
+        return self._parse_tls_client_hello_fallback(data)
+
     @staticmethod
     def _log_exception(message, e):
-        description = ', '.join(["{}='{}'".format(key, value) for key, value in e.args[0].iteritems()])
+        if isinstance(e.args[0], dict):
+            description = ', '.join(["{}='{}'".format(key, value) for key, value in e.args[0].iteritems()])
+        else:
+            description = "error='{}'".format(e.args[0])
         log(None, CORE_DEBUG, 6, "{}; {}".format(message, description))
 
 
@@ -800,25 +857,6 @@ class SniDetector(TlsDetector):
 
         self.server_name_matcher = getMatcher(server_name_matcher)
 
-    def _parse_tls_handshake_extension_server_name(self, data):
-        offset = 0
-
-        server_name_list_length, offset = self._parse_numeric(
-            data, offset,
-            self._TLS_EXTENSION_SERVER_NAME_LIST_LENGTH_SIZE
-        )
-        self._raise_if_not_enough_data(data, offset, server_name_list_length)
-
-        while offset < len(data):
-            hostname_type, offset = self._parse_numeric(data, offset, self._TLS_EXTENSION_SERVER_NAME_TYPE_SIZE)
-            hostname_length, offset = self._parse_numeric(data, offset, self._TLS_EXTENSION_SERVER_NAME_LENGTH_SIZE)
-            hostname = data[offset:offset + hostname_length]
-            offset += hostname_length
-            if hostname_type == TlsExtensionServerNameType.SERVER_NAME:
-                return hostname.decode('idna')
-
-        raise NotImplementedError({'error': 'unknown server name type'})  # pragma: no cover
-
     def detect(self, side, data):
         """<method internal="yes"/>"""
         if side != ZEndpoint.EP_CLIENT:
@@ -827,29 +865,27 @@ class SniDetector(TlsDetector):
             return DetectResult(DetectResultType.NOMATCH)
 
         try:
-            data = self._parse_tls_record(data)
-            offset = self._parse_tls_handshake_header(data, 0, TlsHandshakeType.CLIENT_HELLO)
-            offset = self._parse_tls_handshake_hello_header(data, offset)
-            offset = self._parse_tls_handshake_client_hello(data, offset)
-            extensions, offset = self._parse_tls_handshake_extensions(data, offset)
-        except IndexError as e:
-            self._log_exception("Not enough data for parsing TLS client hello message", e)
-            return DetectResult(DetectResultType.UNDECIDED)
+            client_hello = self._parse_tls_client_hello(data)
         except ValueError as e:
             self._log_exception("TLS client hello message cannot be parsed", e)
             return DetectResult(DetectResultType.NOMATCH)
 
-        if TlsExtensionType.SERVER_NAME not in extensions:
+        if client_hello is None:
+            log(None, CORE_DEBUG, 6, "Not enough data for parsing TLS client hello message;")
+            return DetectResult(DetectResultType.UNDECIDED)
+
+        if client_hello['server_name'] is None:
             log(None, TLS_ACCOUNTING, 4, "Client initiated connection without Server Name Indication (SNI);")
             return DetectResult(DetectResultType.NOMATCH)
 
         try:
-            server_name = self._parse_tls_handshake_extension_server_name(extensions[TlsExtensionType.SERVER_NAME])
-            log(None, TLS_ACCOUNTING, 4, "Client initiated connection with Server Name Indication (SNI); value='{}'".format(server_name))
-        except NotImplementedError:  # pragma: no cover
-            self._log_exception("TLS client hello message cannot be parsed", e)
+            server_name = client_hello['server_name'].decode('idna')
+        except UnicodeError:
+            log(None, CORE_DEBUG, 6, "TLS client hello message cannot be parsed; error='invalid server name'")
             return DetectResult(DetectResultType.NOMATCH)
 
+        log(None, TLS_ACCOUNTING, 4, "Client initiated connection with Server Name Indication (SNI); value='{}'".format(server_name))
+
         try:
             if not self.server_name_matcher.checkMatch(server_name):
                 return DetectResult(DetectResultType.NOMATCH)
@@ -567,6 +567,24 @@ class Dispatcher(BaseDispatch):
             high number of concurrent connections.
             </description>
             </attribute>
+            <attribute>
+            <name>accept_shards</name>
+            <type>
+            <integer/>
+            </type>
+            <description><emphasis>Applies only to TCP connections.</emphasis>
+            Set this parameter to a positive number to open that many
+            listening sockets with the <parameter>SO_REUSEPORT</parameter>
+            socket option, each served by its own accept thread. The kernel
+            distributes the incoming connections between the sockets. As the
+            sockets are opened with <parameter>SO_REUSEPORT</parameter>, the
+            processes of an instance running with multiple processes
+            (<parameter>number_of_processes</parameter>) can share a
+            non-transparent listener if each of them sets this parameter.
+            Only supported for dispatchers bound to a socket address.
+            Default: 0 (a single listener in the main thread).
+            </description>
+            </attribute>
         </attributes>
       </metainfo>
     </class>
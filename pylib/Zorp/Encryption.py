@@ -282,6 +282,8 @@ SSL_CIPHERS_LOW         = "HIGH:MEDIUM:LOW:EXPORT:!aNULL:@STRENGTH"
 
 SSL_CIPHERS_CUSTOM      = ""
 
+SSL_CIPHERSUITES_DEFAULT = "TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256"
+
 # connection security settings
 SSL_NONE                = 0
 SSL_FORCE_SSL           = 1
@@ -495,6 +497,23 @@ class SSLOptions(object):
             <default>FALSE</default>
             <description>Do not allow using TLSv1.2 in the connection.</description>
           </attribute>
+          <attribute>
+            <name>disable_tlsv1_3</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Do not allow using TLSv1.3 in the connection.</description>
+          </attribute>
+          <attribute>
+            <name>ciphersuites</name>
+            <type>
+              <string/>
+            </type>
+            <default>SSL_CIPHERSUITES_DEFAULT</default>
+            <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+            preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+          </attribute>
           <attribute>
             <name>disable_compression</name>
             <type>
@@ -503,6 +522,20 @@ class SSLOptions(object):
             <default>FALSE</default>
             <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
           </attribute>
+          <attribute>
+            <name>enable_ktls</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+            using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+            Connections using other protocol versions or ciphers, or running on kernels without
+            TLS offload support are encrypted by Zorp as usual. A close_notify alert of the peer
+            ends an offloaded connection just like in userspace, and Zorp sends close_notify when
+            it closes the connection. Any other alert, or an attempt to renegotiate, terminates
+            the connection with an error.</description>
+          </attribute>
         </attributes>
       </metainfo>
     </class>
@@ -510,7 +543,8 @@ class SSLOptions(object):
 
     def __init__(self, cipher=SSL_CIPHERS_HIGH, timeout=300,
                        disable_tlsv1=False, disable_tlsv1_1=False, disable_tlsv1_2=False,
-                       disable_compression=False):
+                       disable_compression=False, enable_ktls=False,
+                       disable_tlsv1_3=False, ciphersuites=SSL_CIPHERSUITES_DEFAULT):
         """
         <method maturity="stable">
           <summary>
@@ -563,6 +597,23 @@ class SSLOptions(object):
                 <default>FALSE</default>
                 <description>Do not allow using TLSv1.2 in the connection.</description>
               </argument>
+              <argument maturity="stable">
+                <name>disable_tlsv1_3</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Do not allow using TLSv1.3 in the connection.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>ciphersuites</name>
+                <type>
+                  <string/>
+                </type>
+                <default>SSL_CIPHERSUITES_DEFAULT</default>
+                <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+                preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+              </argument>
               <argument maturity="stable">
                 <name>disable_compression</name>
                 <type>
@@ -571,6 +622,16 @@ class SSLOptions(object):
                 <default>FALSE</default>
                 <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
               </argument>
+              <argument maturity="stable">
+                <name>enable_ktls</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+                using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+                Renegotiation is not possible on offloaded connections.</description>
+              </argument>
             </arguments>
           </metainfo>
         </method>
@@ -582,6 +643,9 @@ class SSLOptions(object):
         self.disable_tlsv1_1 = disable_tlsv1_1
         self.disable_tlsv1_2 = disable_tlsv1_2
         self.disable_compression = disable_compression
+        self.enable_ktls = enable_ktls
+        self.disable_tlsv1_3 = disable_tlsv1_3
+        self.ciphersuites = ciphersuites
 
     def setup(self, encryption):
         """
@@ -643,6 +707,23 @@ class ClientSSLOptions(SSLOptions):
             <default>FALSE</default>
             <description>Do not allow using TLSv1.2 in the connection.</description>
           </attribute>
+          <attribute>
+            <name>disable_tlsv1_3</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Do not allow using TLSv1.3 in the connection.</description>
+          </attribute>
+          <attribute>
+            <name>ciphersuites</name>
+            <type>
+              <string/>
+            </type>
+            <default>SSL_CIPHERSUITES_DEFAULT</default>
+            <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+            preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+          </attribute>
           <attribute>
             <name>disable_compression</name>
             <type>
@@ -651,6 +732,20 @@ class ClientSSLOptions(SSLOptions):
             <default>FALSE</default>
             <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
           </attribute>
+          <attribute>
+            <name>enable_ktls</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+            using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+            Connections using other protocol versions or ciphers, or running on kernels without
+            TLS offload support are encrypted by Zorp as usual. A close_notify alert of the peer
+            ends an offloaded connection just like in userspace, and Zorp sends close_notify when
+            it closes the connection. Any other alert, or an attempt to renegotiate, terminates
+            the connection with an error.</description>
+          </attribute>
           <attribute>
             <name>dh_params</name>
             <type>
@@ -661,6 +756,34 @@ class ClientSSLOptions(SSLOptions):
              The DH parameter used by ephemeral DH key generarion.
             </description>
           </attribute>
+          <attribute>
+            <name>num_session_tickets</name>
+            <type>
+              <integer/>
+            </type>
+            <default>2</default>
+            <description>The number of session tickets sent to the client after a TLSv1.3 handshake, the client
+            can resume the session with them without a full handshake. Set it to 0 to disable TLSv1.3
+            session resumption.</description>
+          </attribute>
+          <attribute>
+            <name>session_ticket_key_file</name>
+            <type>
+              <string/>
+            </type>
+            <default>None</default>
+            <description>The file containing the keys protecting the session tickets, in 48 byte records.
+            The first key encrypts the new tickets, all of them are accepted. Encryption policies using the
+            same file accept each other's tickets.</description>
+          </attribute>
+          <attribute>
+            <name>session_ticket_key_lifetime</name>
+            <type>
+              <integer/>
+            </type>
+            <default>3600</default>
+            <description>The lifetime of the session ticket keys in seconds.</description>
+          </attribute>
         </attributes>
       </metainfo>
     </class>
@@ -668,7 +791,9 @@ class ClientSSLOptions(SSLOptions):
 
     def __init__(self, method=SSL_METHOD_ALL, cipher=SSL_CIPHERS_HIGH, cipher_server_preference=False, timeout=300,
                        disable_sslv2=True, disable_sslv3=True, disable_tlsv1=False, disable_tlsv1_1=False, disable_tlsv1_2=False,
-                       disable_compression=False, dh_params=None, disable_renegotiation=True):
+                       disable_compression=False, dh_params=None, disable_renegotiation=True,
+                       enable_ktls=False, disable_tlsv1_3=False, ciphersuites=SSL_CIPHERSUITES_DEFAULT,
+                       num_session_tickets=2, session_ticket_key_file=None, session_ticket_key_lifetime=3600):
         """
         <method maturity="stable">
           <summary>
@@ -729,6 +854,23 @@ class ClientSSLOptions(SSLOptions):
                 <default>FALSE</default>
                 <description>Do not allow using TLSv1.2 in the connection.</description>
               </argument>
+              <argument maturity="stable">
+                <name>disable_tlsv1_3</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Do not allow using TLSv1.3 in the connection.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>ciphersuites</name>
+                <type>
+                  <string/>
+                </type>
+                <default>SSL_CIPHERSUITES_DEFAULT</default>
+                <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+                preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+              </argument>
               <argument maturity="stable">
                 <name>disable_compression</name>
                 <type>
@@ -737,6 +879,16 @@ class ClientSSLOptions(SSLOptions):
                 <default>FALSE</default>
                 <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
               </argument>
+              <argument maturity="stable">
+                <name>enable_ktls</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+                using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+                Renegotiation is not possible on offloaded connections.</description>
+              </argument>
               <argument>
                 <name>dh_param_file_path</name>
                 <type>
@@ -755,6 +907,41 @@ class ClientSSLOptions(SSLOptions):
                 <default>TRUE</default>
                 <description>Set this to TRUE to disable client initiated renegotiation.</description>
               </argument>
+              <argument maturity="stable">
+                <name>num_session_tickets</name>
+                <type>
+                  <integer/>
+                </type>
+                <default>2</default>
+                <description>The number of session tickets sent to the client after a TLSv1.3 handshake, the client
+                can resume the session with them without a full handshake. Set it to 0 to disable TLSv1.3
+                session resumption.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>session_ticket_key_file</name>
+                <type>
+                  <string/>
+                </type>
+                <default>None</default>
+                <description>The path of the file containing the keys protecting the session tickets. The file
+                consists of 48 byte records, each of them is a 16 byte key name, a 16 byte HMAC secret and a 16 byte
+                AES key. The first key encrypts the new tickets, all of them are accepted. The file is checked for
+                changes every 10 seconds, keys removed from it are still accepted for
+                <parameter>session_ticket_key_lifetime</parameter> seconds. Zorp instances and Encryption policies
+                using the same file can resume each other's sessions, thus services with different certificates or
+                verification settings should use different files. The file must exist and be valid when the policy
+                is loaded. If not set, a random key is generated and replaced after
+                <parameter>session_ticket_key_lifetime</parameter> seconds, the tickets are only accepted by
+                the same Encryption policy then, until the next reload.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>session_ticket_key_lifetime</name>
+                <type>
+                  <integer/>
+                </type>
+                <default>3600</default>
+                <description>The lifetime of the session ticket keys in seconds.</description>
+              </argument>
             </arguments>
           </metainfo>
         </method>
@@ -762,7 +949,8 @@ class ClientSSLOptions(SSLOptions):
 
         super(ClientSSLOptions, self).__init__(cipher, timeout,
                                                disable_tlsv1, disable_tlsv1_1, disable_tlsv1_2,
-                                               disable_compression)
+                                               disable_compression, enable_ktls,
+                                               disable_tlsv1_3, ciphersuites)
         self.cipher_server_preference = cipher_server_preference
         if dh_params is None:
             self.dh_params = ""
@@ -773,6 +961,9 @@ class ClientSSLOptions(SSLOptions):
         else:
             raise TypeError, "Type of dh_params must be string or DHParam"
         self.disable_renegotiation = disable_renegotiation
+        self.num_session_tickets = num_session_tickets
+        self.session_ticket_key_file = session_ticket_key_file or ""
+        self.session_ticket_key_lifetime = session_ticket_key_lifetime
 
     def setup(self, encryption):
         """
@@ -782,11 +973,17 @@ class ClientSSLOptions(SSLOptions):
         encryption.settings.client_disable_proto_tlsv1 = self.disable_tlsv1
         encryption.settings.client_disable_proto_tlsv1_1 = self.disable_tlsv1_1
         encryption.settings.client_disable_proto_tlsv1_2 = self.disable_tlsv1_2
+        encryption.settings.client_disable_proto_tlsv1_3 = self.disable_tlsv1_3
         encryption.settings.client_disable_compression = self.disable_compression
+        encryption.settings.client_enable_ktls = self.enable_ktls
         encryption.settings.client_ssl_cipher = self.cipher
+        encryption.settings.client_ssl_ciphersuites = self.ciphersuites
         encryption.settings.cipher_server_preference = self.cipher_server_preference
         encryption.settings.dh_params = self.dh_params
         encryption.settings.disable_renegotiation = self.disable_renegotiation
+        encryption.settings.num_session_tickets = self.num_session_tickets
+        encryption.settings.session_ticket_key_file = self.session_ticket_key_file
+        encryption.settings.session_ticket_key_lifetime = self.session_ticket_key_lifetime
 
 class ServerSSLOptions(SSLOptions):
     """
@@ -834,6 +1031,23 @@ class ServerSSLOptions(SSLOptions):
             <default>FALSE</default>
             <description>Do not allow using TLSv1.2 in the connection.</description>
           </attribute>
+          <attribute>
+            <name>disable_tlsv1_3</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Do not allow using TLSv1.3 in the connection.</description>
+          </attribute>
+          <attribute>
+            <name>ciphersuites</name>
+            <type>
+              <string/>
+            </type>
+            <default>SSL_CIPHERSUITES_DEFAULT</default>
+            <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+            preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+          </attribute>
           <attribute>
             <name>disable_compression</name>
             <type>
@@ -842,6 +1056,34 @@ class ServerSSLOptions(SSLOptions):
             <default>FALSE</default>
             <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
           </attribute>
+          <attribute>
+            <name>enable_ktls</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>FALSE</default>
+            <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+            using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+            Connections using other protocol versions or ciphers, or running on kernels without
+            TLS offload support are encrypted by Zorp as usual. A close_notify alert of the peer
+            ends an offloaded connection just like in userspace, and Zorp sends close_notify when
+            it closes the connection. Any other alert, or an attempt to renegotiate, terminates
+            the connection with an error.</description>
+          <attribute>
+            <name>session_cache</name>
+            <type>
+              <boolean/>
+            </type>
+            <default>TRUE</default>
+            <description>Resume TLS sessions established with the server by earlier connections, also of
+            other proxy instances, instead of doing a full handshake. Sessions are shared between connections
+            to the same server address and server name using the same encryption policy and client certificate.
+            Only sessions whose server certificate was trusted are resumed, the certificate verification callbacks
+            are not called for resumed sessions. Connections whose client certificate towards the server is selected
+            by a setup_key callback of the policy, for example by a StaticCertificate used as
+            server_certificate_generator, do not use the cache, as the certificate is only known during the handshake. Cache statistics are available under
+            stats.ssl_session_cache.server in SZIG.</description>
+          </attribute>
         </attributes>
       </metainfo>
     </class>
@@ -849,7 +1091,8 @@ class ServerSSLOptions(SSLOptions):
 
     def __init__(self, method=SSL_METHOD_ALL, cipher=SSL_CIPHERS_HIGH, timeout=300,
                        disable_sslv2=True, disable_sslv3=True, disable_tlsv1=False, disable_tlsv1_1=False, disable_tlsv1_2=False,
-                       disable_compression=False):
+                       disable_compression=False, enable_ktls=False,
+                       disable_tlsv1_3=False, ciphersuites=SSL_CIPHERSUITES_DEFAULT, session_cache=True):
         """
         <method maturity="stable">
           <summary>
@@ -902,6 +1145,23 @@ class ServerSSLOptions(SSLOptions):
                 <default>FALSE</default>
                 <description>Do not allow using TLSv1.2 in the connection.</description>
               </argument>
+              <argument maturity="stable">
+                <name>disable_tlsv1_3</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Do not allow using TLSv1.3 in the connection.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>ciphersuites</name>
+                <type>
+                  <string/>
+                </type>
+                <default>SSL_CIPHERSUITES_DEFAULT</default>
+                <description>Colon-separated list of the TLSv1.3 ciphersuites allowed in the connection, in order of
+                preference. The <parameter>cipher</parameter> option only applies to TLSv1.2 and earlier.</description>
+              </argument>
               <argument maturity="stable">
                 <name>disable_compression</name>
                 <type>
@@ -910,6 +1170,25 @@ class ServerSSLOptions(SSLOptions):
                 <default>FALSE</default>
                 <description>Set this to TRUE to disable support for SSL/TLS compression.</description>
               </argument>
+              <argument maturity="stable">
+                <name>enable_ktls</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>FALSE</default>
+                <description>Set this to TRUE to hand the record encryption of TLSv1.2 connections
+                using AES-GCM or ChaCha20-Poly1305 ciphers over to the kernel (kTLS) after the handshake.
+                Renegotiation is not possible on offloaded connections.</description>
+              </argument>
+              <argument maturity="stable">
+                <name>session_cache</name>
+                <type>
+                  <boolean/>
+                </type>
+                <default>TRUE</default>
+                <description>Resume TLS sessions established with the server by earlier connections instead of
+                doing a full handshake, see the session_cache attribute.</description>
+              </argument>
             </arguments>
           </metainfo>
         </method>
@@ -917,7 +1196,9 @@ class ServerSSLOptions(SSLOptions):
 
         super(ServerSSLOptions, self).__init__(cipher, timeout,
                                                disable_tlsv1, disable_tlsv1_1, disable_tlsv1_2,
-                                               disable_compression)
+                                               disable_compression, enable_ktls,
+                                               disable_tlsv1_3, ciphersuites)
+        self.session_cache = session_cache
 
     def setup(self, encryption):
         """
@@ -927,8 +1208,12 @@ class ServerSSLOptions(SSLOptions):
         encryption.settings.server_disable_proto_tlsv1 = self.disable_tlsv1
         encryption.settings.server_disable_proto_tlsv1_1 = self.disable_tlsv1_1
         encryption.settings.server_disable_proto_tlsv1_2 = self.disable_tlsv1_2
+        encryption.settings.server_disable_proto_tlsv1_3 = self.disable_tlsv1_3
         encryption.settings.server_disable_compression = self.disable_compression
+        encryption.settings.server_enable_ktls = self.enable_ktls
         encryption.settings.server_ssl_cipher = self.cipher
+        encryption.settings.server_ssl_ciphersuites = self.ciphersuites
+        encryption.settings.server_session_cache = self.session_cache
 
 class AbstractVerifier(object):
     """
@@ -2589,7 +2874,7 @@ class DynamicCertificate(AbstractCertificateGenerator):
     </metainfo>
     </class>
     """
-    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None):
+    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None, cache_size=4096):
         """
         <method maturity="stable">
           <summary>
@@ -2628,7 +2913,7 @@ class DynamicCertificate(AbstractCertificateGenerator):
                   <string/>
                 </type>
                 <default>None</default>
-                <description>The cache directory to store the keybridged certificates generated by Zorp, for example, <filename>/var/lib/zorp/sslbridge/</filename>. The <parameter>zorp</parameter> user must have write privileges for this directory.</description>
+                <description>The cache directory to store the keybridged certificates generated by Zorp, for example, <filename>/var/lib/zorp/sslbridge/</filename>. The <parameter>zorp</parameter> user must have write privileges for this directory. The generated certificates are always cached in memory, the cache directory lets them be reused after a restart. If not set, the certificates are cached only in memory.</description>
               </argument>
               <argument maturity="stable">
                 <name>extension_whitelist</name>
@@ -2639,6 +2924,14 @@ class DynamicCertificate(AbstractCertificateGenerator):
                 <para>Zorp transfers the following certificate extensions to the client side: <parameter>Key Usage</parameter>, <parameter>Subject Alternative Name</parameter>, <parameter>Extended Key Usage</parameter>. Other extensions will be automatically deleted during keybridging. This is needed because some certificate extensions contain references to the Issuer CA, which references become invalid for keybridged certificates. To transfer other extensions, list them in the <parameter>extension_whitelist</parameter> parameter. Note that modifying this parameter replaces the default values, so to extend the list of transferred extensions, include the <parameter>'keyUsage', 'subjectAltName', 'extendedKeyUsage'</parameter> list as well. For example:</para>
                     <synopsis>self.extension_whitelist = ('keyUsage', 'subjectAltName', 'extendedKeyUsage', 'customExtension')</synopsis>
               </argument>
+              <argument maturity="stable">
+                <name>cache_size</name>
+                <type>
+                  <integer/>
+                </type>
+                <default>4096</default>
+                <description>The maximum number of keybridged certificates kept in the memory cache. Cache statistics are available under stats.keybridge_cache.certificates in SZIG.</description>
+              </argument>
             </arguments>
           </metainfo>
         </method>
@@ -2648,6 +2941,7 @@ class DynamicCertificate(AbstractCertificateGenerator):
         self.private_key = private_key
         self.cache_directory = cache_directory
         self.extension_whitelist = extension_whitelist
+        self.cache_size = cache_size
 
 class ClientDynamicCertificate(AbstractCertificateGenerator):
     """
@@ -2658,7 +2952,7 @@ class ClientDynamicCertificate(AbstractCertificateGenerator):
         <attributes/>
       </metainfo>
     </class>"""
-    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None):
+    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None, cache_size=4096):
         """<method internal="yes">
         </method>
         """
@@ -2667,6 +2961,7 @@ class ClientDynamicCertificate(AbstractCertificateGenerator):
         self.private_key = private_key
         self.cache_directory = cache_directory
         self.extension_whitelist = extension_whitelist
+        self.cache_size = cache_size
 
     def setup(self, encryption):
         """<method internal="yes">
@@ -2682,9 +2977,14 @@ class ClientDynamicCertificate(AbstractCertificateGenerator):
              key_passphrase=passphrase,\
              trusted_ca_files=(self.trusted_ca.getCertificate(), self.trusted_ca.getPrivateKey(), self.trusted_ca.getPassPhrase()),\
              untrusted_ca_files=(self.untrusted_ca.getCertificate(), self.untrusted_ca.getPrivateKey(), self.untrusted_ca.getPassPhrase()),\
-             extension_whitelist=self.extension_whitelist)
+             extension_whitelist=self.extension_whitelist,\
+             cache_size=self.cache_size)
 
-        encryption.settings.client_handshake["setup_key"] = (SSL_HS_POLICY, self.generateKeyClient)
+        if self.key_generator.initialized and self.generateKeyClient.im_func is ClientDynamicCertificate.generateKeyClient.im_func:
+            # generate the certificates natively, without calling the policy
+            encryption.settings.client_keybridge = self.key_generator.bridge
+        else:
+            encryption.settings.client_handshake["setup_key"] = (SSL_HS_POLICY, self.generateKeyClient)
 
     def generateKeyClient(self, side, peer_cert, tlsext_server_name, proxy):
         """<method internal="yes">
@@ -2717,7 +3017,7 @@ class ServerDynamicCertificate(AbstractCertificateGenerator):
         <attributes/>
       </metainfo>
     </class>"""
-    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None):
+    def __init__(self, private_key, trusted_ca, untrusted_ca, cache_directory=None, extension_whitelist=None, cache_size=4096):
         """<method internal="yes">
         </method>
         """
@@ -2726,6 +3026,7 @@ class ServerDynamicCertificate(AbstractCertificateGenerator):
         self.private_key = private_key
         self.cache_directory = cache_directory
         self.extension_whitelist = extension_whitelist
+        self.cache_size = cache_size
 
     def setup(self, encryption):
         """<method internal="yes">
@@ -2741,9 +3042,14 @@ class ServerDynamicCertificate(AbstractCertificateGenerator):
              key_passphrase=passphrase,\
              trusted_ca_files=(self.trusted_ca.getCertificate(), self.trusted_ca.getPrivateKey(), self.trusted_ca.getPassPhrase()),\
              untrusted_ca_files=(self.untrusted_ca.getCertificate(), self.untrusted_ca.getPrivateKey(), self.untrusted_ca.getPassPhrase()),\
-             extension_whitelist=self.extension_whitelist)
+             extension_whitelist=self.extension_whitelist,\
+             cache_size=self.cache_size)
 
-        encryption.settings.server_handshake["setup_key"] = (SSL_HS_POLICY, self.generateKeyServer)
+        if self.key_generator.initialized and self.generateKeyServer.im_func is ServerDynamicCertificate.generateKeyServer.im_func:
+            # generate the certificates natively, without calling the policy
+            encryption.settings.server_keybridge = self.key_generator.bridge
+        else:
+            encryption.settings.server_handshake["setup_key"] = (SSL_HS_POLICY, self.generateKeyServer)
 
     def generateKeyServer(self, side, peer_cert, tlsext_server_name, proxy):
         """<method internal="yes">
@@ -2936,12 +3242,12 @@ class SidedEncryption(Encryption):
         self.server_certificate_generator = server_certificate_generator
 
         if isinstance(client_certificate_generator, DynamicCertificate):
-            self.client_certificate_generator = ClientDynamicCertificate(client_certificate_generator.private_key, client_certificate_generator.trusted_ca, client_certificate_generator.untrusted_ca, client_certificate_generator.cache_directory, client_certificate_generator.extension_whitelist)
+            self.client_certificate_generator = ClientDynamicCertificate(client_certificate_generator.private_key, client_certificate_generator.trusted_ca, client_certificate_generator.untrusted_ca, client_certificate_generator.cache_directory, client_certificate_generator.extension_whitelist, client_certificate_generator.cache_size)
         if isinstance(client_certificate_generator, StaticCertificate):
             self.client_certificate_generator = ClientStaticCertificate(client_certificate_generator.certificate)
 
         if isinstance(server_certificate_generator, DynamicCertificate):
-            self.server_certificate_generator = ServerDynamicCertificate(server_certificate_generator.private_key, server_certificate_generator.trusted_ca, server_certificate_generator.untrusted_ca, server_certificate_generator.cache_directory, server_certificate_generator.extension_whitelist)
+            self.server_certificate_generator = ServerDynamicCertificate(server_certificate_generator.private_key, server_certificate_generator.trusted_ca, server_certificate_generator.untrusted_ca, server_certificate_generator.cache_directory, server_certificate_generator.extension_whitelist, server_certificate_generator.cache_size)
         if isinstance(server_certificate_generator, StaticCertificate):
             self.server_certificate_generator = ServerStaticCertificate(server_certificate_generator.certificate)
 
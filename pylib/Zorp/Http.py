@@ -1710,6 +1710,24 @@ class AbstractHttpProxy(Proxy):
             Time to wait for a request to arrive from the client.
           </description>
         </attribute>
+        <attribute>
+          <name>nonblocking</name>
+          <type>
+            <boolean/>
+          </type>
+          <default>FALSE</default>
+          <conftime/>
+          <runtime/>
+          <description>
+            Run the proxy in the poll loop of its service instead of a
+            dedicated thread. Sessions waiting for a request line are
+            multiplexed in the poll loop, once the request line arrives
+            the request is processed in a thread of the proxy thread pool
+            and the session returns to the poll loop afterwards.
+            This attribute has to be set in the class body, as it is
+            evaluated before the config() event.
+          </description>
+        </attribute>
         <attribute>
           <name>timeout_response</name>
           <type>
@@ -1745,6 +1763,137 @@ class AbstractHttpProxy(Proxy):
             reconnection is made and the complete request is repeated along
             with POST data.</description>
         </attribute>
+        <attribute>
+          <name>server_connection_pool</name>
+          <type>
+            <boolean/>
+          </type>
+          <default>FALSE</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+            <write/>
+          </runtime>
+          <description>
+            Return idle keep-alive server connections to a connection pool
+            shared by all sessions of the service, instead of closing them
+            when the session ends or the target server changes. New requests
+            to the same server or parent proxy reuse the pooled connections.
+            Only plain HTTP connections in non-transparent mode are pooled,
+            connections using the address of the client are never shared.
+            When a pooled connection is reused, setServerAddress is called
+            but connectServer is not, thus the chainer and the router of the
+            service are skipped and session.server_address is not updated.
+            Pool statistics are available under stats.connection_pool.http
+            in SZIG.
+          </description>
+        </attribute>
+        <attribute>
+          <name>server_connection_pool_max</name>
+          <type>
+            <integer/>
+          </type>
+          <default>8</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+            <write/>
+          </runtime>
+          <description>
+            The maximum number of idle pooled connections to the same server,
+            see server_connection_pool.
+          </description>
+        </attribute>
+        <attribute>
+          <name>server_connection_pool_timeout</name>
+          <type>
+            <integer/>
+          </type>
+          <default>30000</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+            <write/>
+          </runtime>
+          <description>
+            Time in milliseconds after which idle pooled server connections
+            are closed, see server_connection_pool.
+          </description>
+        </attribute>
+        <attribute>
+          <name>park_idle_sessions</name>
+          <type>
+            <boolean/>
+          </type>
+          <default>TRUE</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+          </runtime>
+          <description>
+            Release the thread of the session while it waits for the next
+            request of the client. Idle sessions are watched by a single
+            process-wide loop and get a thread again when the client sends
+            data, or when timeout_request elapses. The number of parked
+            sessions is available under stats.proxy_park.parked in SZIG.
+          </description>
+        </attribute>
+        <attribute>
+          <name>pipelining</name>
+          <type>
+            <boolean/>
+          </type>
+          <default>FALSE</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+          </runtime>
+          <description>
+            Process requests pipelined by the client before the response to
+            the previous request arrives, and forward them to the server on
+            the same connection. Every request is filtered as usual, and the
+            responses are sent to the client in the order of the requests.
+            Only GET and HEAD requests without a body are forwarded ahead,
+            and only on server connections that already answered with
+            HTTP/1.1 keep-alive. A request whose policy changes
+            parent_proxy or parent_proxy_port waits for its turn and is sent
+            on a connection to the new parent proxy. Pipelining is not used
+            when authentication or max_keepalive_requests is configured.
+          </description>
+        </attribute>
+        <attribute>
+          <name>pipeline_depth</name>
+          <type>
+            <integer/>
+          </type>
+          <default>4</default>
+          <conftime>
+            <read/>
+            <write/>
+          </conftime>
+          <runtime>
+            <read/>
+          </runtime>
+          <description>
+            The maximum number of requests forwarded to the server ahead of
+            their turn, see pipelining.
+          </description>
+        </attribute>
         <attribute>
           <name>buffer_size</name>
           <type>
@@ -2586,6 +2735,7 @@ class AbstractHttpProxy(Proxy):
     """
     name = "http"
     auth_inband_supported = TRUE
+    nonblocking = FALSE
 
     def __init__(self, session):
         """<method internal="yes">
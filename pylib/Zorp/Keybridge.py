@@ -31,12 +31,7 @@
 """
 
 from Zorp import *
-from Certificate_ import ZorpCertificate
-from FileLock import FileLock
-
-import os
-import OpenSSL
-import hashlib
+from Keybridge_ import KeyBridge
 
 #
 # Key selector is a hash containing one or more ways to
@@ -93,8 +88,16 @@ class X509KeyBridge(X509KeyManager):
             <type>
                 <string/>
             </type>
-            <default>""</default>
-            <description>The directory where all automatically generated certificates are cached.</description>
+            <default>None</default>
+            <description>The directory where all automatically generated certificates are stored in addition to the memory cache, so that they are reused after a restart. If not set, the certificates are cached only in memory.</description>
+          </attribute>
+          <attribute>
+            <name>cache_size</name>
+            <type>
+                <integer/>
+            </type>
+            <default>4096</default>
+            <description>The maximum number of generated certificates kept in the memory cache.</description>
           </attribute>
           <attribute>
             <name>trusted_ca_files</name>
@@ -135,7 +138,7 @@ class X509KeyBridge(X509KeyManager):
     default_extension_whitelist = ('keyUsage', 'subjectAltName', 'extendedKeyUsage')
 
     def _old_init(self, key_file, cache_directory=None, trusted_ca_files=None, untrusted_ca_files=None, key_passphrase = "",
-                 extension_whitelist=None):
+                 extension_whitelist=None, cache_size=4096):
         """<method maturity="stable">
           <metainfo>
             <arguments>
@@ -159,8 +162,8 @@ class X509KeyBridge(X509KeyManager):
                 <type>
                   <string/>
                 </type>
-                <default>"/var/lib/zorp/keybridge-cache"</default>
-                <description>The directory where all automatically generated certificates are cached.</description>
+                <default>None</default>
+                <description>The directory where all automatically generated certificates are stored in addition to the memory cache. If not set, the certificates are cached only in memory.</description>
               </argument>
               <argument>
                 <name>trusted_ca_files</name>
@@ -192,6 +195,14 @@ class X509KeyBridge(X509KeyManager):
                     <synopsis>self.extension_whitelist = ('keyUsage', 'subjectAltName', 'extendedKeyUsage', 'customExtension')</synopsis>
                 </description>
               </argument>
+              <argument>
+                <name>cache_size</name>
+                <type>
+                  <integer/>
+                </type>
+                <default>4096</default>
+                <description>The maximum number of generated certificates kept in the memory cache.</description>
+              </argument>
             </arguments>
           </metainfo>
         </method>"""
@@ -211,14 +222,18 @@ class X509KeyBridge(X509KeyManager):
 
           key_passphrase  -- passphrase to use with private key key_file
 
-          cache_directory -- name of a directory where all automatically generated certificates are cached
+          cache_directory -- name of a directory where all automatically generated certificates are stored, None to cache them only in memory
 
           trusted_ca_files -- a tuple of (cert_file, key_file, passphrase) for a CA to be used for signing certificates
 
           untrusted_ca_files -- a tuple of (cert_file, key_file, passphrase) for a CA to be used for signing untrusted certificates
 
+          cache_size -- maximum number of generated certificates kept in memory
+
         """
         key_pem = self.readPEM(key_file)
+        trusted_ca_pems = None
+        untrusted_ca_pems = None
         if trusted_ca_files:
             (trusted_cert_file, trusted_key_file, trusted_passphrase) = trusted_ca_files
             try:
@@ -235,52 +250,25 @@ class X509KeyBridge(X509KeyManager):
                 passphrase = ""
             untrusted_ca_pems = (self.readPEM(untrusted_cert_file), self.readPEM(untrusted_key_file), passphrase)
 
-        self._new_init(key_pem, cache_directory, trusted_ca_pems, untrusted_ca_pems, key_passphrase, extension_whitelist)
+        self._new_init(key_pem, cache_directory, trusted_ca_pems, untrusted_ca_pems, key_passphrase, extension_whitelist, cache_size)
 
-    def _new_init(self, key_pem, cache_directory=None, trusted_ca_files=None, untrusted_ca_files=None, key_passphrase = "", extension_whitelist=None):
+    def _new_init(self, key_pem, cache_directory=None, trusted_ca_files=None, untrusted_ca_files=None, key_passphrase = "", extension_whitelist=None, cache_size=4096):
         """
         <method internal="yes"/>
         """
-        if cache_directory:
-            self.cache_directory = cache_directory
-        else:
-            self.cache_directory = "/var/lib/zorp/keybridge-cache"
+        self.cache_directory = cache_directory
         if not extension_whitelist:
             extension_whitelist = self.default_extension_whitelist
         self.extension_whitelist = extension_whitelist
         self.initialized = 0
         try:
-            self._load_privatekey(key_pem, trusted_ca_files, untrusted_ca_files, key_passphrase)
+            # certificates are generated and cached by the native keybridge,
+            # which is shared by the instances with the same configuration
+            self.bridge = KeyBridge(key_pem, key_passphrase, trusted_ca_files, untrusted_ca_files,
+                                    tuple(extension_whitelist), cache_directory, cache_size)
             self.initialized = 1
-        except IOError, e:
-            log(None, CORE_ERROR, 3, "Error opening key or certificate file for keybridge; file='%s', error='%s'", (e.filename, e.strerror))
-
-    def _load_privatekey(self, key_pem, trusted_ca_files, untrusted_ca_files, key_passphrase):
-        """<method internal="yes">
-        </method>"""
-
-        if not trusted_ca_files:
-            trusted_ca_files = (None, None, None)
-        (trusted_cert_file, trusted_key_file, trusted_passphrase) = trusted_ca_files
-        self.key = OpenSSL.crypto.load_privatekey(OpenSSL.crypto.FILETYPE_PEM, key_pem, key_passphrase)
-        self.key_pem = key_pem
-        try:
-            passphrase = trusted_passphrase
-        except IndexError:
-            passphrase = ""
-        self.trusted_ca = (OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, trusted_cert_file),
-                           OpenSSL.crypto.load_privatekey(OpenSSL.crypto.FILETYPE_PEM, trusted_key_file, passphrase))
-        self.trusted_ca_pem = trusted_cert_file
-        self.untrusted_ca_pem = ""
-        if untrusted_ca_files:
-            (untrusted_cert_file, untrusted_key_file, untrusted_passphrase) = untrusted_ca_files
-            try:
-                passphrase = untrusted_passphrase
-            except IndexError:
-                passphrase = ""
-            self.untrusted_ca = (OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, untrusted_cert_file),
-                                 OpenSSL.crypto.load_privatekey(OpenSSL.crypto.FILETYPE_PEM, untrusted_key_file, passphrase))
-            self.untrusted_ca_pem = untrusted_cert_file
+        except ValueError, e:
+            log(None, CORE_ERROR, 3, "Error loading key or certificate for keybridge; error='%s'", (str(e),))
 
     def readPEM(self, filename):
         """<method internal="yes">
@@ -292,138 +280,6 @@ class X509KeyBridge(X509KeyManager):
         f.close()
         return res
 
-    def getCachedKey(self, session_id, cert_file, cert_server):
-        """<method internal="yes">
-        </method>"""
-
-        def is_md5(cert):
-            return cert.get_signature_algorithm().lower().find("md5") != -1
-
-        log(session_id, CORE_DEBUG, 5, "Loading cached certificate; file='%s'", cert_file)
-        try:
-            orig_cert = open(cert_file + '.orig', 'r').read()
-        except IOError, e:
-            log(session_id, CORE_DEBUG, 5, "Original keybridged certificate cannot be read, regenerating; file='%s', error='%s'", (cert_file, e.strerror))
-            raise KeyError('not in cache')
-
-        try:
-            cached_cert = open(cert_file, 'r').read()
-            cached_cert_x509 = OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, cached_cert)
-        except IOError, e:
-            log(session_id, CORE_DEBUG, 5, "Cached certificate cannot be read, regenerating; file='%s', error='%s'", (cert_file, e.strerror))
-            raise KeyError('not in cache')
-        except OpenSSL.crypto.Error:
-            log(session_id, CORE_DEBUG, 5, "Cached certificate is not valid, regenerating; file='%s'", cert_file)
-            raise KeyError('not in cache')
-
-        cert_server_x509 = OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, cert_server)
-
-        # Originally we signed every cert using md5, regardless of the server cert's algo.
-        # We regenerate every cert if the cached version uses md5 while the server cert uses a different algo.
-        if orig_cert == cert_server:
-            if is_md5(cached_cert_x509) and not is_md5(cert_server_x509):
-                log(session_id, CORE_DEBUG, 5, "Cached certificate is MD5 signed while server's certificate is not, regenerating; file='%s', cached_algo='%s', server_algo='%s'", (cert_file, cached_cert_x509.get_signature_algorithm(), cert_server_x509.get_signature_algorithm()))
-            else:
-                log(session_id, CORE_DEBUG, 5, "Cached certificate ok, reusing; file='%s'", cert_file)
-                return (cached_cert, OpenSSL.crypto.dump_privatekey(OpenSSL.crypto.FILETYPE_PEM, self.key))
-        else:
-            log(session_id, CORE_DEBUG, 5, "Cached certificate changed, regenerating; file='%s'", cert_file)
-
-        raise KeyError, 'certificate changed'
-
-    def storeCachedKey(self, session_id, cert_file, new_blob, orig_blob):
-        """<method internal="yes">
-        </method>"""
-        try:
-            try:
-                os.unlink(cert_file)
-            except OSError:
-                pass
-            try:
-                os.unlink(cert_file + '.orig')
-            except OSError:
-                pass
-
-            log(session_id, CORE_DEBUG, 5, "Storing cached certificate; file='%s'", cert_file)
-            f = open(cert_file, 'w')
-            f.write(new_blob)
-            f.close()
-            f = open(cert_file + '.orig', 'w')
-            f.write(orig_blob)
-            f.close()
-        except IOError, e:
-            log(session_id, CORE_ERROR, 2, "Error storing generated X.509 certificate in the cache; file='%s', error='%s'", (cert_file, e.strerror))
-
-    def getLastSerial(self):
-        """<method internal="yes">
-        </method>"""
-        serial = 1
-        for file in os.listdir(self.cache_directory):
-            if file[-4:] != '.crt':
-                continue
-
-            f = open("%s/%s" % (self.cache_directory, file), 'r')
-            data = f.read()
-            f.close()
-
-            cert = OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, data)
-            cser = cert.get_serial_number()
-
-            if cser > serial:
-                serial = cser
-        return serial
-
-    def genCert(self, key, orig_cert, ca_cert, ca_key, serial):
-        """<method internal="yes">
-        </method>"""
-        filetype = OpenSSL.crypto.FILETYPE_PEM
-        certificate = OpenSSL.crypto.dump_certificate(filetype, orig_cert)
-
-        if self.extension_whitelist:
-          # delete extensions not on whitelist
-          zorp_certificate = ZorpCertificate(certificate)
-          certificate = zorp_certificate.handle_extensions(self.extension_whitelist)
-
-        new_cert = OpenSSL.crypto.load_certificate(filetype, certificate)
-        new_cert.set_serial_number(serial)
-        new_cert.set_issuer(ca_cert.get_subject())
-        new_cert.set_pubkey(key)
-        hash_alg = orig_cert.get_signature_algorithm()
-
-        try:
-            new_cert.sign(ca_key, hash_alg)
-        except ValueError, e:
-            log(None, CORE_INFO, 3, "Could not sign cert with hash algorithm, falling back to SHA256; hash_alg='%s'", hash_alg)
-            new_cert.sign(ca_key, 'sha256')
-
-        return new_cert
-
-    def _save_new_cert(self, session_id, orig_blob, ca_pair, cert_file, serial):
-        """<method internal="yes">
-        </method>"""
-
-        orig_cert = OpenSSL.crypto.load_certificate(OpenSSL.crypto.FILETYPE_PEM, orig_blob)
-
-        new_cert = self.genCert(self.key, orig_cert, ca_pair[0], ca_pair[1], serial)
-
-        new_blob = OpenSSL.crypto.dump_certificate(OpenSSL.crypto.FILETYPE_PEM, new_cert)
-
-        self.storeCachedKey(session_id, cert_file, new_blob, orig_blob)
-
-        return new_blob
-
-    def _dump_privatekey(self):
-        """<method internal="yes">
-        </method>"""
-
-        return OpenSSL.crypto.dump_privatekey(OpenSSL.crypto.FILETYPE_PEM, self.key)
-
-    def _get_serial_filename(self):
-        """<method internal="yes">
-        </method>"""
-
-        return '%s/serial.txt' % self.cache_directory
-
     def getKeypair(self, session_id, selector):
         """<method internal="yes">
         </method>"""
@@ -434,48 +290,8 @@ class X509KeyBridge(X509KeyManager):
         try:
             trusted = 1
             orig_blob = selector['bridge-trusted-key']
-            hash_key = orig_blob + self.trusted_ca_pem + self.key_pem
         except KeyError:
             trusted = 0
             orig_blob = selector['bridge-untrusted-key']
-            hash_key = orig_blob + self.untrusted_ca_pem + self.key_pem
-
-        hash = hashlib.sha256(hash_key).hexdigest()
-        if trusted:
-            cert_file = '%s/trusted-%s.crt' % (self.cache_directory, hash)
-            ca_pair = self.trusted_ca
-        else:
-            cert_file = '%s/untrusted-%s.crt' % (self.cache_directory, hash)
-            ca_pair = self.untrusted_ca
-
-        with FileLock("%s/.lock" % self.cache_directory):
-            try:
-                return self.getCachedKey(session_id, cert_file, orig_blob)
-            except KeyError:
-                log(session_id, CORE_DEBUG, 5, "Certificate not found in the cache, regenerating;")
-
-            serial_file = self._get_serial_filename()
-
-            serial_pos = ""
-            try:
-                serial_pos = "file open"
-                serial_file_fd = open(serial_file, 'r')
-                serial_pos = "file read"
-                serial_file_data = serial_file_fd.read().strip()
-                serial_pos = "turn to integer"
-                serial = int(serial_file_data)
-                serial_pos = None
-            except (ValueError, IOError):
-                serial = self.getLastSerial()
-                log(session_id, CORE_ERROR, 3, "On-line CA serial file not found, reinitializing; file='%s', serial='%d', pos='%s'", (serial_file, serial, serial_pos))
-
-            serial = serial + 1
-            try:
-                with open(serial_file, 'w') as f:
-                    f.write(str(serial))
-            except IOError, e:
-                log(session_id, CORE_ERROR, 2, "Cannot write serial number of on-line CA; file='%s', error='%s'", (serial_file, e.strerror))
-
-            new_blob = self._save_new_cert(session_id, orig_blob, ca_pair, cert_file, serial)
 
-            return (new_blob, self._dump_privatekey())
+        return self.bridge.getKeypair(trusted, orig_blob, session_id)
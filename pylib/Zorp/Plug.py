@@ -169,6 +169,8 @@ class AbstractPlugProxy(Proxy):
               The time in milliseconds between two successive packetStats() events.
               It can be useful when the Quality of Service for the connection is influenced dynamically.
               Set to 0 to turn packetStats() off.
+              When no proxy is stacked and neither side uses TLS, data is passed in the kernel,
+              and every chunk of at most 64 kilobytes read counts as a package.
             </description>
           </attribute>
           <attribute maturity="stable">
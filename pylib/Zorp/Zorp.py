@@ -317,6 +317,13 @@ Z_SZIG_AUTH_PENDING_BEGIN = 9
 Z_SZIG_AUTH_PENDING_FINISH = 10
 Z_SZIG_SERVICE_COUNT = 11
 Z_SZIG_CONNECTION_START = 12
+Z_SZIG_PROXY_GROUP_WORKERS = 13
+Z_SZIG_PROXY_THREAD_POOL = 14
+Z_SZIG_DISPATCH_QUEUE = 15
+Z_SZIG_HISTOGRAM = 16
+Z_SZIG_CONNECTION_POOL = 17
+Z_SZIG_SSL_SESSION_CACHE = 18
+Z_SZIG_KEYBRIDGE_CACHE = 19
 
 Z_KEEPALIVE_NONE   = 0
 Z_KEEPALIVE_CLIENT = 1
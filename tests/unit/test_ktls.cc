@@ -0,0 +1,255 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+
+#include <zorp/proxyktls.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <string>
+
+namespace {
+
+const size_t record_header_len = 5;
+const size_t tag_len = 16;
+
+/* A TLS 1.2 client and server connected in memory, the records sent by
+ * either of them can be taken from the network BIOs. */
+struct TlsPair
+{
+  explicit TlsPair(const char *cipher_list)
+  {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+
+    EVP_PKEY_keygen_init(pctx);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(pctx, &key);
+    EVP_PKEY_CTX_free(pctx);
+
+    cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>("ktls"), -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    X509_set_pubkey(cert, key);
+    X509_sign(cert, key, EVP_sha256());
+
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    for (SSL_CTX *ctx : { server_ctx, client_ctx })
+      {
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(ctx, cipher_list);
+      }
+    SSL_CTX_use_certificate(server_ctx, cert);
+    SSL_CTX_use_PrivateKey(server_ctx, key);
+
+    server = SSL_new(server_ctx);
+    client = SSL_new(client_ctx);
+
+    BIO *server_bio, *client_bio;
+    BIO_new_bio_pair(&server_bio, 0, &server_network, 0);
+    BIO_new_bio_pair(&client_bio, 0, &client_network, 0);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+  }
+
+  ~TlsPair()
+  {
+    SSL_free(client);
+    SSL_free(server);
+    BIO_free(client_network);
+    BIO_free(server_network);
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(server_ctx);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+  }
+
+  static void
+  forward(BIO *from, BIO *to)
+  {
+    char buf[16384];
+    int len;
+
+    while ((len = BIO_read(from, buf, sizeof(buf))) > 0)
+      BIO_write(to, buf, len);
+  }
+
+  bool
+  handshake()
+  {
+    for (int i = 0; i < 10; i++)
+      {
+        int client_res = SSL_do_handshake(client);
+        forward(client_network, server_network);
+        int server_res = SSL_do_handshake(server);
+        forward(server_network, client_network);
+
+        if (client_res == 1 && server_res == 1)
+          return true;
+      }
+    return false;
+  }
+
+  /* the record sent by @ssl with the payload @data */
+  std::string
+  send(SSL *ssl, BIO *network, const std::string &data)
+  {
+    char buf[16384];
+    int len;
+
+    SSL_write(ssl, data.data(), data.size());
+    len = BIO_read(network, buf, sizeof(buf));
+    return std::string(buf, len > 0 ? len : 0);
+  }
+
+  EVP_PKEY *key = nullptr;
+  X509 *cert = nullptr;
+  SSL_CTX *server_ctx, *client_ctx;
+  SSL *server, *client;
+  BIO *server_network = nullptr, *client_network = nullptr;
+};
+
+/* Decrypt the first application data record of a direction, as the kernel
+ * would with the keys passed to it. */
+std::string
+decrypt_record(const std::string &record, const ZKtlsKeys &keys)
+{
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(record.data());
+  unsigned char nonce[12], aad[13];
+  const EVP_CIPHER *cipher;
+  size_t explicit_nonce_len;
+
+  if (record.size() < record_header_len || data[0] != 23)
+    return "";
+
+  if (keys.iv_len == 4)
+    {
+      /* RFC 5288: the salt and the explicit nonce of the record */
+      cipher = keys.key_len == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+      explicit_nonce_len = 8;
+      memcpy(nonce, keys.iv, 4);
+      memcpy(nonce + 4, data + record_header_len, 8);
+    }
+  else
+    {
+      /* RFC 7905: the IV xored with the sequence number */
+      cipher = EVP_chacha20_poly1305();
+      explicit_nonce_len = 0;
+      memcpy(nonce, keys.iv, 12);
+      for (size_t i = 0; i < Z_KTLS_SEQ_LEN; i++)
+        nonce[4 + i] ^= keys.rec_seq[i];
+    }
+
+  if (record.size() < record_header_len + explicit_nonce_len + tag_len)
+    return "";
+
+  size_t plaintext_len = record.size() - record_header_len - explicit_nonce_len - tag_len;
+  const unsigned char *ciphertext = data + record_header_len + explicit_nonce_len;
+
+  memcpy(aad, keys.rec_seq, Z_KTLS_SEQ_LEN);
+  memcpy(aad + Z_KTLS_SEQ_LEN, data, 3);
+  aad[11] = plaintext_len >> 8;
+  aad[12] = plaintext_len & 0xff;
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  std::string plaintext(plaintext_len, '\0');
+  int len, final_len;
+  bool ok =
+    EVP_DecryptInit_ex(ctx, cipher, nullptr, nullptr, nullptr) &&
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, 12, nullptr) &&
+    EVP_DecryptInit_ex(ctx, nullptr, nullptr, keys.key, nonce) &&
+    EVP_DecryptUpdate(ctx, nullptr, &len, aad, sizeof(aad)) &&
+    EVP_DecryptUpdate(ctx, reinterpret_cast<unsigned char *>(&plaintext[0]), &len, ciphertext, plaintext_len) &&
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, tag_len, const_cast<unsigned char *>(ciphertext + plaintext_len)) &&
+    EVP_DecryptFinal_ex(ctx, reinterpret_cast<unsigned char *>(&plaintext[0]) + len, &final_len) > 0;
+
+  EVP_CIPHER_CTX_free(ctx);
+  return ok ? plaintext : "";
+}
+
+void
+check_derived_keys(const char *cipher_list, size_t key_len, size_t iv_len)
+{
+  TlsPair pair(cipher_list);
+  ZKtlsKeys server_tx, server_rx, client_tx, client_rx;
+  static const unsigned char first_rec_seq[Z_KTLS_SEQ_LEN] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+  BOOST_REQUIRE(pair.handshake());
+  BOOST_REQUIRE(z_ktls_derive_keys(pair.server, TRUE, &server_tx, &server_rx));
+  BOOST_REQUIRE(z_ktls_derive_keys(pair.client, FALSE, &client_tx, &client_rx));
+
+  BOOST_CHECK_EQUAL(server_tx.key_len, key_len);
+  BOOST_CHECK_EQUAL(server_tx.iv_len, iv_len);
+  BOOST_CHECK(memcmp(server_tx.rec_seq, first_rec_seq, Z_KTLS_SEQ_LEN) == 0);
+  BOOST_CHECK(memcmp(server_rx.rec_seq, first_rec_seq, Z_KTLS_SEQ_LEN) == 0);
+
+  /* both ends agree on the keys of each direction */
+  BOOST_CHECK(memcmp(server_rx.key, client_tx.key, key_len) == 0);
+  BOOST_CHECK(memcmp(server_rx.iv, client_tx.iv, iv_len) == 0);
+  BOOST_CHECK(memcmp(server_tx.key, client_rx.key, key_len) == 0);
+  BOOST_CHECK(memcmp(server_tx.iv, client_rx.iv, iv_len) == 0);
+  BOOST_CHECK(memcmp(server_tx.key, server_rx.key, key_len) != 0);
+
+  /* the first records sent by OpenSSL after the handshake can be
+   * decrypted with the derived keys and the starting sequence number */
+  BOOST_CHECK_EQUAL(decrypt_record(pair.send(pair.client, pair.client_network, "GET / HTTP/1.1\r\n"), server_rx),
+                    "GET / HTTP/1.1\r\n");
+  BOOST_CHECK_EQUAL(decrypt_record(pair.send(pair.server, pair.server_network, "HTTP/1.1 200 OK\r\n"), client_rx),
+                    "HTTP/1.1 200 OK\r\n");
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_derive_keys_aes_128_gcm)
+{
+  check_derived_keys("ECDHE-ECDSA-AES128-GCM-SHA256", 16, 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_derive_keys_aes_256_gcm)
+{
+  check_derived_keys("ECDHE-ECDSA-AES256-GCM-SHA384", 32, 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_derive_keys_chacha20_poly1305)
+{
+  check_derived_keys("ECDHE-ECDSA-CHACHA20-POLY1305", 32, 12);
+}
+
+BOOST_AUTO_TEST_CASE(test_derive_keys_unsupported)
+{
+  TlsPair pair("ECDHE-ECDSA-AES128-SHA256");
+  ZKtlsKeys tx, rx;
+
+  BOOST_REQUIRE(pair.handshake());
+  BOOST_CHECK(!z_ktls_derive_keys(pair.server, TRUE, &tx, &rx));
+}
@@ -102,10 +102,13 @@ forward_time(guint ticks)
 static void
 generate_connections(void)
 {
+  gchar started[32];
   guint i;
 
   fprintf(stdout, "generating connection events\n");
 
+  g_ascii_dtostr(started, sizeof(started), g_get_real_time() / (gdouble) G_USEC_PER_SEC);
+
   for (i = 0; i < NUM_CONNS; i++)
     {
       z_szig_event(Z_SZIG_SERVICE_COUNT,
@@ -121,6 +124,7 @@ generate_connections(void)
                                                      "auth_groups", "testgroup",
                                                      "client_zone", "czone",
                                                      "server_zone", "szone",
+                                                     "started", started,
                                                      NULL));
 
       z_szig_event(Z_SZIG_CONNECTION_STOP,
@@ -254,6 +258,84 @@ check_thread_rates(glong avg1, glong avg5, glong avg15)
   return failed;
 }
 
+static gint
+check_histogram(void)
+{
+  gint failed = 0;
+  glong i;
+
+  fprintf(stdout, "checking latency histogram\n");
+
+  for (i = 1; i <= 1000; i++)
+    z_szig_histogram_add("test_metric", i);
+  z_szig_histogram_add("gil_wait.TestProxy", 5);
+
+  forward_time(1);
+  sleep(1);
+
+  /* percentiles are reported as the upper limit of their bucket */
+  failed = check_szig_long("stats.latency.test_metric.count", 1000);
+  if (!failed)
+    failed = check_szig_long("stats.latency.test_metric.p50", 511);
+  if (!failed)
+    failed = check_szig_long("stats.latency.test_metric.p90", 959);
+  if (!failed)
+    failed = check_szig_long("stats.latency.test_metric.p99", 1023);
+  if (!failed)
+    failed = check_szig_long("stats.latency.test_metric.p999", 1023);
+  if (!failed)
+    failed = check_szig_long("stats.latency.gil_wait.TestProxy.count", 1);
+  if (!failed)
+    failed = check_szig_long("stats.latency.gil_wait.TestProxy.p50", 5);
+  if (!failed)
+    failed = check_szig_long("stats.latency.connection_lifetime.test_service.count", NUM_CONNS);
+
+  return failed;
+}
+
+static gint
+check_metric(const gchar *metrics, const gchar *sample)
+{
+  if (!strstr(metrics, sample))
+    {
+      fprintf(stderr, "missing metric sample; sample='%s'\n", sample);
+      return 1;
+    }
+  return 0;
+}
+
+static gint
+check_metrics(void)
+{
+  GString *out = g_string_new("");
+  gint failed = 0;
+
+  fprintf(stdout, "checking OpenMetrics exposition\n");
+
+  z_szig_metrics_format(out);
+
+  failed = check_metric(out->str, "# TYPE zorp_threads_running gauge\nzorp_threads_running 1\n");
+  if (!failed)
+    failed = check_metric(out->str, "# TYPE zorp_thread_number counter\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_service_session_number_total{service=\"test_service\"} 900\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_service_inbound_zones_total{service=\"test_service\",zone=\"szone\"} 900\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_latency_test_metric_seconds{quantile=\"0.5\"} 0.000511\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_latency_test_metric_seconds_count 1000\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_latency_gil_wait_seconds{proxy=\"TestProxy\",quantile=\"0.99\"} 0.000005\n");
+  if (!failed)
+    failed = check_metric(out->str, "zorp_latency_connection_lifetime_seconds_count{service=\"test_service\"} 900\n");
+  if (!failed && !g_str_has_suffix(out->str, "\n# EOF\n"))
+    failed = 1;
+
+  g_string_free(out, TRUE);
+  return failed;
+}
+
 BOOST_AUTO_TEST_CASE(test_szig)
 {
   BOOST_CHECK(!init_szig());
@@ -308,4 +390,10 @@ BOOST_AUTO_TEST_CASE(test_szig)
 
   fprintf(stdout, "checking thread counters\n");
   BOOST_CHECK(!check_thread_counters());
+
+  BOOST_CHECK(!check_histogram());
+  BOOST_CHECK(!check_metrics());
+
+  /* the bursts above must have fit in the per-thread event ring */
+  BOOST_CHECK(!check_szig_long("stats.szig_events_dropped", 0));
 }
@@ -0,0 +1,149 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+
+#include <zorp/ticket_key_manager.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+struct TicketCrypto
+{
+  TicketCrypto() : cipher_ctx(EVP_CIPHER_CTX_new()), hmac_ctx(HMAC_CTX_new())
+  {
+    memset(key_name, 0, sizeof(key_name));
+    memset(iv, 0, sizeof(iv));
+  }
+  ~TicketCrypto()
+  {
+    EVP_CIPHER_CTX_free(cipher_ctx);
+    HMAC_CTX_free(hmac_ctx);
+  }
+
+  int setup(SessionTicketKeyManager &manager, bool enc)
+  {
+    return manager.setup_ticket_crypto(key_name, iv, cipher_ctx, hmac_ctx, enc);
+  }
+
+  unsigned char key_name[16];
+  unsigned char iv[EVP_MAX_IV_LENGTH];
+  EVP_CIPHER_CTX *cipher_ctx;
+  HMAC_CTX *hmac_ctx;
+};
+
+std::filesystem::path
+write_key_file(const std::string &name, const std::string &key_names)
+{
+  std::filesystem::path path = std::filesystem::temp_directory_path() / name;
+  std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+
+  for (char key_name : key_names)
+    {
+      stream << std::string(16, key_name);
+      stream << std::string(32, key_name + 1);
+    }
+
+  return path;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_random_key)
+{
+  SessionTicketKeyManager manager("", 3600);
+  TicketCrypto encrypt, decrypt, unknown;
+
+  BOOST_CHECK_EQUAL(encrypt.setup(manager, true), 1);
+
+  memcpy(decrypt.key_name, encrypt.key_name, sizeof(decrypt.key_name));
+  BOOST_CHECK_EQUAL(decrypt.setup(manager, false), 1);
+
+  BOOST_CHECK_EQUAL(unknown.setup(manager, false), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_key_file)
+{
+  std::filesystem::path path = write_key_file("zorp_test_ticket_keys", "ab");
+  SessionTicketKeyManager manager(path, 3600, 0);
+  TicketCrypto encrypt, decrypt;
+
+  BOOST_CHECK_EQUAL(encrypt.setup(manager, true), 1);
+  BOOST_CHECK_EQUAL(std::string(reinterpret_cast<char *>(encrypt.key_name), 16), std::string(16, 'a'));
+
+  memset(decrypt.key_name, 'b', sizeof(decrypt.key_name));
+  BOOST_CHECK_EQUAL(decrypt.setup(manager, false), 2);
+
+  memset(decrypt.key_name, 'c', sizeof(decrypt.key_name));
+  BOOST_CHECK_EQUAL(decrypt.setup(manager, false), 0);
+
+  /* rotate: a new encryption key, the removed one is still accepted */
+  write_key_file("zorp_test_ticket_keys", "ca");
+  std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(1));
+
+  BOOST_CHECK_EQUAL(encrypt.setup(manager, true), 1);
+  BOOST_CHECK_EQUAL(std::string(reinterpret_cast<char *>(encrypt.key_name), 16), std::string(16, 'c'));
+
+  memset(decrypt.key_name, 'a', sizeof(decrypt.key_name));
+  BOOST_CHECK_EQUAL(decrypt.setup(manager, false), 2);
+
+  memset(decrypt.key_name, 'b', sizeof(decrypt.key_name));
+  BOOST_CHECK_EQUAL(decrypt.setup(manager, false), 2);
+
+  std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid_key_file)
+{
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "zorp_test_ticket_keys_invalid";
+  std::ofstream(path, std::ios::binary) << std::string(47, 'x');
+
+  SessionTicketKeyManager manager(path, 3600, 0);
+  TicketCrypto encrypt;
+
+  BOOST_CHECK(!manager.load());
+  BOOST_CHECK_EQUAL(encrypt.setup(manager, true), 0);
+
+  std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_missing_key_file)
+{
+  SessionTicketKeyManager manager(std::filesystem::temp_directory_path() / "zorp_test_ticket_keys_missing", 3600, 0);
+
+  BOOST_CHECK(!manager.load());
+}
+
+BOOST_AUTO_TEST_CASE(test_load)
+{
+  std::filesystem::path path = write_key_file("zorp_test_ticket_keys_load", "a");
+  SessionTicketKeyManager manager(path, 3600, 0);
+  SessionTicketKeyManager random_manager("", 3600);
+
+  BOOST_CHECK(manager.load());
+  BOOST_CHECK(random_manager.load());
+
+  std::filesystem::remove(path);
+}
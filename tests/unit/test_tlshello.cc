@@ -0,0 +1,107 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+
+#include <zorp/tlshello.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+
+static const std::string client_hello(
+  std::string("\x16\x03\x01\x00\x64", 5) +                      // record header
+  std::string("\x01\x00\x00\x60", 4) +                          // client hello
+  std::string("\x03\x03", 2) +                                  // TLS version
+  std::string(32, '\0') +                                       // random
+  std::string("\x00", 1) +                                      // session id
+  std::string("\x00\x04\x13\x01\xc0\x2f", 6) +                  // cipher suites
+  std::string("\x01\x00", 2) +                                  // compression methods
+  std::string("\x00\x33", 2) +                                  // extensions length
+  std::string("\x00\x00\x00\x14\x00\x12\x00\x00\x0f", 9) +      // server name
+  "www.example.com" +
+  std::string("\x00\x10\x00\x0e\x00\x0c", 6) +                  // ALPN
+  "\x02" "h2" "\x08" "http/1.1" +
+  std::string("\x00\x2b\x00\x05\x04\x03\x04\x03\x03", 9)        // supported versions
+);
+
+static ZTlsHelloParseResult
+parse(ZTlsClientHello *hello, const std::string &data)
+{
+  const gchar *error;
+
+  return z_tls_client_hello_parse(hello, reinterpret_cast<const guchar *>(data.data()), data.size(), &error);
+}
+
+BOOST_AUTO_TEST_CASE(test_client_hello)
+{
+  ZTlsClientHello *hello = z_tls_client_hello_new();
+
+  BOOST_REQUIRE_EQUAL(parse(hello, client_hello), Z_TLS_HELLO_OK);
+  BOOST_CHECK_EQUAL(hello->legacy_version, 0x0303);
+  BOOST_CHECK_EQUAL(hello->server_name->str, "www.example.com");
+
+  BOOST_REQUIRE_EQUAL(hello->cipher_suites->len, 2);
+  BOOST_CHECK_EQUAL(g_array_index(hello->cipher_suites, guint16, 0), 0x1301);
+  BOOST_CHECK_EQUAL(g_array_index(hello->cipher_suites, guint16, 1), 0xc02f);
+
+  BOOST_REQUIRE_EQUAL(hello->alpn_protocols->len, 2);
+  BOOST_CHECK_EQUAL(static_cast<const gchar *>(g_ptr_array_index(hello->alpn_protocols, 0)), "h2");
+  BOOST_CHECK_EQUAL(static_cast<const gchar *>(g_ptr_array_index(hello->alpn_protocols, 1)), "http/1.1");
+
+  BOOST_REQUIRE_EQUAL(hello->supported_versions->len, 2);
+  BOOST_CHECK_EQUAL(g_array_index(hello->supported_versions, guint16, 0), 0x0304);
+  BOOST_CHECK_EQUAL(g_array_index(hello->supported_versions, guint16, 1), 0x0303);
+
+  z_tls_client_hello_free(hello);
+}
+
+BOOST_AUTO_TEST_CASE(test_client_hello_incomplete)
+{
+  ZTlsClientHello *hello = z_tls_client_hello_new();
+
+  for (size_t length = 0; length < client_hello.size(); length++)
+    BOOST_CHECK_EQUAL(parse(hello, client_hello.substr(0, length)), Z_TLS_HELLO_INCOMPLETE);
+
+  z_tls_client_hello_free(hello);
+}
+
+BOOST_AUTO_TEST_CASE(test_client_hello_invalid)
+{
+  ZTlsClientHello *hello = z_tls_client_hello_new();
+  std::string data;
+
+  BOOST_CHECK_EQUAL(parse(hello, "GET / HTTP/1.1\r\n"), Z_TLS_HELLO_INVALID);
+  BOOST_CHECK_EQUAL(parse(hello, std::string("\x16\x03\x05\x00\x00", 5)), Z_TLS_HELLO_INVALID);
+  BOOST_CHECK_EQUAL(parse(hello, std::string("\x16\x03\x01\x00\x00", 5)), Z_TLS_HELLO_INVALID);
+
+  /* handshake length beyond the record */
+  data = client_hello;
+  data[8] = 0x61;
+  BOOST_CHECK_EQUAL(parse(hello, data), Z_TLS_HELLO_INVALID);
+
+  /* server name length beyond the extension */
+  data = client_hello;
+  data[61] = 0x10;
+  BOOST_CHECK_EQUAL(parse(hello, data), Z_TLS_HELLO_INVALID);
+
+  z_tls_client_hello_free(hello);
+}
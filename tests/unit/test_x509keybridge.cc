@@ -0,0 +1,345 @@
+/***************************************************************************
+ *
+ * Copyright (c) 2000-2015 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2015-2018 BalaSys IT Ltd, Budapest, Hungary
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ ***************************************************************************/
+
+#define BOOST_TEST_MAIN
+
+#include <zorp/x509keybridge.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+
+EVP_PKEY *
+generate_key()
+{
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY *key = nullptr;
+
+  EVP_PKEY_keygen_init(ctx);
+  EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+  EVP_PKEY_keygen(ctx, &key);
+  EVP_PKEY_CTX_free(ctx);
+  return key;
+}
+
+void
+add_extension(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+  X509V3_CTX ctx;
+
+  X509V3_set_ctx(&ctx, issuer, cert, nullptr, nullptr, 0);
+  X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &ctx, nid, const_cast<char *>(value));
+  X509_add_ext(cert, ext, -1);
+  X509_EXTENSION_free(ext);
+}
+
+X509 *
+generate_cert(const char *common_name, EVP_PKEY *key, X509 *issuer, EVP_PKEY *issuer_key)
+{
+  X509 *cert = X509_new();
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                             reinterpret_cast<const unsigned char *>(common_name), -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(issuer ? issuer : cert));
+  X509_set_pubkey(cert, key);
+
+  if (issuer)
+    {
+      std::string alt_name = std::string("DNS:") + common_name;
+      add_extension(cert, issuer, NID_subject_alt_name, alt_name.c_str());
+      add_extension(cert, issuer, NID_key_usage, "critical,keyAgreement");
+      add_extension(cert, issuer, NID_crl_distribution_points, "URI:http://ca.example.com/crl.pem");
+    }
+  else
+    {
+      add_extension(cert, cert, NID_basic_constraints, "critical,CA:TRUE");
+    }
+
+  X509_sign(cert, issuer_key ? issuer_key : key, EVP_sha256());
+  return cert;
+}
+
+std::string
+cert_to_pem(X509 *cert)
+{
+  BIO *bio = BIO_new(BIO_s_mem());
+  char *mem;
+
+  PEM_write_bio_X509(bio, cert);
+  long len = BIO_get_mem_data(bio, &mem);
+  std::string pem(mem, len);
+  BIO_free(bio);
+  return pem;
+}
+
+std::string
+key_to_pem(EVP_PKEY *key)
+{
+  BIO *bio = BIO_new(BIO_s_mem());
+  char *mem;
+
+  PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr);
+  long len = BIO_get_mem_data(bio, &mem);
+  std::string pem(mem, len);
+  BIO_free(bio);
+  return pem;
+}
+
+std::string
+serial_of(X509 *cert)
+{
+  BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(cert), nullptr);
+  char *hex = BN_bn2hex(bn);
+  std::string serial(hex);
+
+  OPENSSL_free(hex);
+  BN_free(bn);
+  return serial;
+}
+
+/* the shard is chosen by the first byte of the fingerprint */
+size_t
+shard_of(X509 *cert)
+{
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+
+  X509_digest(cert, EVP_sha256(), digest, &digest_len);
+  return digest[0] % X509KeyBridge::shard_count;
+}
+
+struct KeyBridgeFixture
+{
+  KeyBridgeFixture()
+  {
+    ca_key = generate_key();
+    untrusted_ca_key = generate_key();
+    peer_key = generate_key();
+    bridge_key = generate_key();
+    ca_cert = generate_cert("Trusted CA", ca_key, nullptr, nullptr);
+    untrusted_ca_cert = generate_cert("Untrusted CA", untrusted_ca_key, nullptr, nullptr);
+
+    config.key_pem = key_to_pem(bridge_key);
+    config.trusted_ca_cert_pem = cert_to_pem(ca_cert);
+    config.trusted_ca_key_pem = key_to_pem(ca_key);
+    config.untrusted_ca_cert_pem = cert_to_pem(untrusted_ca_cert);
+    config.untrusted_ca_key_pem = key_to_pem(untrusted_ca_key);
+    config.extension_whitelist = {"keyUsage", "subjectAltName", "extendedKeyUsage"};
+  }
+
+  ~KeyBridgeFixture()
+  {
+    for (EVP_PKEY *key : {ca_key, untrusted_ca_key, peer_key, bridge_key})
+      EVP_PKEY_free(key);
+    X509_free(ca_cert);
+    X509_free(untrusted_ca_cert);
+  }
+
+  X509 *peer_cert(const std::string &common_name)
+  {
+    return generate_cert(common_name.c_str(), peer_key, ca_cert, ca_key);
+  }
+
+  EVP_PKEY *ca_key, *untrusted_ca_key, *peer_key, *bridge_key;
+  X509 *ca_cert, *untrusted_ca_cert;
+  X509KeyBridgeConfig config;
+};
+
+}
+
+BOOST_FIXTURE_TEST_CASE(test_forged_certificate, KeyBridgeFixture)
+{
+  X509KeyBridge keybridge(config);
+  X509 *orig = peer_cert("www.example.com");
+  X509 *cert = keybridge.get_certificate(orig, true);
+
+  BOOST_REQUIRE(cert);
+  BOOST_CHECK_EQUAL(X509_NAME_cmp(X509_get_subject_name(cert), X509_get_subject_name(orig)), 0);
+  BOOST_CHECK_EQUAL(X509_NAME_cmp(X509_get_issuer_name(cert), X509_get_subject_name(ca_cert)), 0);
+  BOOST_CHECK_EQUAL(X509_verify(cert, ca_key), 1);
+  BOOST_CHECK_EQUAL(X509_check_private_key(cert, bridge_key), 1);
+  BOOST_CHECK_NE(serial_of(cert), serial_of(orig));
+
+  BOOST_CHECK_GE(X509_get_ext_by_NID(cert, NID_subject_alt_name, -1), 0);
+  BOOST_CHECK_LT(X509_get_ext_by_NID(cert, NID_crl_distribution_points, -1), 0);
+  BOOST_CHECK(X509_get_key_usage(cert) & KU_DIGITAL_SIGNATURE);
+  BOOST_CHECK(X509_get_key_usage(cert) & KU_KEY_ENCIPHERMENT);
+  BOOST_CHECK(X509_get_key_usage(cert) & KU_KEY_AGREEMENT);
+
+  X509 *untrusted = keybridge.get_certificate(orig, false);
+  BOOST_REQUIRE(untrusted);
+  BOOST_CHECK_EQUAL(X509_verify(untrusted, untrusted_ca_key), 1);
+  BOOST_CHECK_NE(serial_of(cert), serial_of(untrusted));
+
+  X509_free(untrusted);
+  X509_free(cert);
+  X509_free(orig);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_memory_cache, KeyBridgeFixture)
+{
+  X509KeyBridge keybridge(config);
+  X509 *orig = peer_cert("www.example.com");
+  X509 *same = X509_dup(orig);
+  X509 *cert = keybridge.get_certificate(orig, true);
+
+  /* a certificate with the same contents is looked up by its fingerprint */
+  X509 *cached = keybridge.get_certificate(same, true);
+  BOOST_CHECK_EQUAL(cert, cached);
+
+  X509_free(cached);
+  X509_free(cert);
+  X509_free(same);
+  X509_free(orig);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_memory_cache_eviction, KeyBridgeFixture)
+{
+  config.cache_size = X509KeyBridge::shard_count;
+  X509KeyBridge keybridge(config);
+  X509 *orig = peer_cert("www.example.com");
+  X509 *first = keybridge.get_certificate(orig, true);
+
+  /* each shard holds a single certificate, the first one is evicted by
+   * another one in the same shard */
+  for (int i = 0; ; i++)
+    {
+      X509 *other = peer_cert("host" + std::to_string(i) + ".example.com");
+      X509_free(keybridge.get_certificate(other, true));
+      bool evicted = shard_of(other) == shard_of(orig);
+      X509_free(other);
+
+      if (evicted)
+        break;
+    }
+
+  X509 *regenerated = keybridge.get_certificate(orig, true);
+  BOOST_CHECK_NE(serial_of(first), serial_of(regenerated));
+
+  X509_free(regenerated);
+  X509_free(first);
+  X509_free(orig);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_unique_serials, KeyBridgeFixture)
+{
+  X509KeyBridge keybridge(config);
+  std::vector<X509 *> origs;
+  std::vector<std::string> serials(64);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < serials.size(); i++)
+    origs.push_back(peer_cert("host" + std::to_string(i) + ".example.com"));
+
+  for (size_t t = 0; t < 4; t++)
+    {
+      threads.emplace_back([&, t]()
+        {
+          for (size_t i = t; i < serials.size(); i += 4)
+            {
+              X509 *cert = keybridge.get_certificate(origs[i], true);
+              serials[i] = serial_of(cert);
+              X509_free(cert);
+            }
+        });
+    }
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  std::set<std::string> unique_serials(serials.begin(), serials.end());
+  BOOST_CHECK_EQUAL(unique_serials.size(), serials.size());
+
+  for (X509 *orig : origs)
+    X509_free(orig);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_cache_directory, KeyBridgeFixture)
+{
+  std::filesystem::path cache_directory = std::filesystem::temp_directory_path() / "test_x509keybridge";
+  std::filesystem::remove_all(cache_directory);
+  std::filesystem::create_directories(cache_directory);
+  config.cache_directory = cache_directory.string();
+
+  X509 *orig = peer_cert("www.example.com");
+  std::string serial;
+
+  {
+    X509KeyBridge keybridge(config);
+    X509 *cert = keybridge.get_certificate(orig, true);
+    serial = serial_of(cert);
+    X509_free(cert);
+  }
+
+  size_t files = 0;
+  for (const auto &entry : std::filesystem::directory_iterator(cache_directory))
+    {
+      BOOST_CHECK_EQUAL(entry.path().filename().string().rfind("trusted-", 0), 0U);
+      files++;
+    }
+  BOOST_CHECK_EQUAL(files, 2U);
+
+  /* a new instance reuses the stored certificate */
+  {
+    X509KeyBridge keybridge(config);
+    X509 *cert = keybridge.get_certificate(orig, true);
+    BOOST_CHECK_EQUAL(serial_of(cert), serial);
+    X509_free(cert);
+  }
+
+  X509_free(orig);
+  std::filesystem::remove_all(cache_directory);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_shared_instance, KeyBridgeFixture)
+{
+  std::shared_ptr<X509KeyBridge> keybridge = X509KeyBridge::get_instance(config);
+
+  BOOST_CHECK_EQUAL(keybridge, X509KeyBridge::get_instance(config));
+
+  config.cache_size = 1024;
+  BOOST_CHECK_NE(keybridge, X509KeyBridge::get_instance(config));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_invalid_config, KeyBridgeFixture)
+{
+  X509KeyBridgeConfig invalid_key = config;
+  invalid_key.key_pem = "invalid";
+  BOOST_CHECK_THROW(X509KeyBridge keybridge(invalid_key), std::invalid_argument);
+
+  X509KeyBridgeConfig invalid_ca = config;
+  invalid_ca.trusted_ca_key_pem = config.key_pem;
+  invalid_ca.trusted_ca_cert_pem = "";
+  BOOST_CHECK_THROW(X509KeyBridge keybridge(invalid_ca), std::invalid_argument);
+}
@@ -30,6 +30,7 @@ class HandlerMock(object):
         self.deadlockcheck = True
         self.siblings = {}
         self.logspec = ''
+        self.metrics = "# TYPE zorp_threads_running gauge\nzorp_threads_running 4\n# EOF\n"
         self.data = {
             "conns": {
                 "service_http_transparent": {
@@ -142,3 +143,7 @@ class HandlerMock(object):
 
     def recv(self):
         return self.talk(self.sent_message)
+
+    def recv_until(self, terminator):
+        if type(self.sent_message) == MessageGetMetrics:
+            return self.metrics
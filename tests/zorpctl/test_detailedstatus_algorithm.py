@@ -25,6 +25,8 @@
 import tempfile
 import datetime
 import unittest, os
+from HandlerMock import HandlerMock
+from zorpctl.szig import SZIG
 from zorpctl.ProcessAlgorithms import DetailedStatusAlgorithm, ProcessStatus
 
 class TestDetailedStatusAlgorithm(unittest.TestCase):
@@ -114,6 +116,27 @@ class TestDetailedStatusAlgorithm(unittest.TestCase):
         result = self.algorithm.assembleDetails(status, self.procinfo, self.algorithm.getJiffiesPerSec())
         self.assertEquals(result[chop_len:], expected_result)
 
+    def test_latencies(self):
+        szig = SZIG("", HandlerMock)
+        szig.handler.data["stats"]["latency"] = {
+            "server_connect": {
+                "count": 42,
+                "p50": 1279,
+                "p90": 2559,
+                "p99": 6143,
+                "p999": 8191
+            }
+        }
+        status = ProcessStatus("test")
+        status.reload_timestamp = 1367664125
+        status.policy_file = "/etc/zorp/policy.py"
+        status.latencies = self.algorithm.getLatencies(szig)
+        self.assertEquals(status.latencies, [('server_connect', [42, 1279, 2559, 6143, 8191])])
+
+        result = self.algorithm.assembleDetails(status, self.procinfo, self.algorithm.getJiffiesPerSec())
+        self.assertEquals(result.split('\n')[-1],
+                          'latency: server_connect, count=42, p50=1279us, p90=2559us, p99=6143us, p999=8191us')
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -22,9 +22,10 @@
 ##
 ############################################################################
 
+import socket
 import unittest
 from HandlerMock import HandlerMock
-from zorpctl.szig import SZIG
+from zorpctl.szig import SZIG, Handler, SZIGError
 
 
 class TestSzig(unittest.TestCase):
@@ -70,6 +71,20 @@ class TestSzig(unittest.TestCase):
         self.szig.reload()
         self.assertEquals(self.szig.reload_result(), True)
 
+    def test_get_metrics(self):
+        self.assertEquals(self.szig.get_metrics(), self.szig.handler.metrics)
+
+    def test_recv_until(self):
+        handler = Handler.__new__(Handler)
+        handler.response_length = 16
+        (handler.socket, peer) = socket.socketpair()
+        peer.send("# TYPE zorp_threads_running gauge\nzorp_threads_running 4\n# EOF\n")
+        self.assertEquals(handler.recv_until("# EOF\n"),
+                          "# TYPE zorp_threads_running gauge\nzorp_threads_running 4\n# EOF\n")
+
+        peer.send("FAIL No such command")
+        self.assertRaises(SZIGError, handler.recv_until, "# EOF\n")
+
     def test_coredump(self):
         try:
             self.szig.coredump()
@@ -35,6 +35,7 @@ class ProcessStatus(object):
         self.reloaded = True
         self.threads = 0
         self.pid = 0
+        self.latencies = []
 
     def __str__(self):
         status = self.msg
@@ -580,6 +581,8 @@ class GUIStatusAlgorithm(ProcessAlgorithm):
 
 class DetailedStatusAlgorithm(ProcessAlgorithm):
 
+    LATENCY_KEYS = ('count', 'p50', 'p90', 'p99', 'p999')
+
     def __init__(self):
         super(DetailedStatusAlgorithm, self).__init__()
         self.uptime_filename = '/proc/uptime'
@@ -663,13 +666,40 @@ class DetailedStatusAlgorithm(ProcessAlgorithm):
         details += "policy: file=%s, loaded=%s\n" % (status.policy_file, self._getLoaded(status.reload_timestamp))
         details += "cpu: real=%d:%f, user=%d:%f, sys=%d:%f\n" % self._getTimes(proc_info, jps)
         details += "memory: vsz=%skB, rss=%skB" % (int(proc_info["vsize"])/1024, int(proc_info["rss"]) * PAGESIZE)
+        for (name, values) in status.latencies:
+            details += "\nlatency: %s, count=%s, p50=%sus, p90=%sus, p99=%sus, p999=%sus" % ((name,) + tuple(values))
 
         return details
 
+    def getLatencies(self, szig):
+        """
+        Collecting the percentiles of the latency histograms
+        published under stats.latency, in microseconds.
+        """
+        latencies = []
+        self._collectLatencies(szig, szig.get_child('stats.latency'), latencies)
+        return latencies
+
+    def _collectLatencies(self, szig, metric, latencies):
+        while metric:
+            if szig.get_value(metric + '.count') is not None:
+                values = [szig.get_value(metric + '.' + key) for key in self.LATENCY_KEYS]
+                latencies.append((metric[len('stats.latency.'):], values))
+            else:
+                self._collectLatencies(szig, szig.get_child(metric), latencies)
+            metric = szig.get_sibling(metric)
+
     def detailedStatus(self):
         statusalgorithm = StatusAlgorithm()
         statusalgorithm.setInstance(self.instance)
         status = statusalgorithm.run()
+        if not status:
+            return status
+
+        try:
+            status.latencies = self.getLatencies(statusalgorithm.szig)
+        except SZIGError:
+            pass
 
         jps = self.getJiffiesPerSec()
         proc_info = self._getProcInfo()
@@ -789,6 +819,30 @@ class AuthorizeAlgorithm(ProcessAlgorithm):
         except SZIGError as e:
             return CommandResultFailure('Error while communicating through szig: ' + e.msg)
 
+class MetricsAlgorithm(ProcessAlgorithm):
+
+    def __init__(self):
+        super(MetricsAlgorithm, self).__init__()
+
+    def errorHandling(self):
+        running = self.isRunning(self.instance.process_name)
+        if not running:
+            return running
+        try:
+            self.szig = SZIG(self.instance.process_name)
+        except IOError as e:
+            return CommandResultFailure(e.message)
+
+    def execute(self):
+        error = self.errorHandling()
+        if error != None:
+            return error
+
+        try:
+            return CommandResultSuccess(self.szig.get_metrics().rstrip('\n'))
+        except SZIGError as e:
+            return CommandResultFailure('Error while communicating through szig: ' + e.msg)
+
 class StopSessionAlgorithm(ProcessAlgorithm):
 
     def __init__(self, session_id):
@@ -116,6 +116,13 @@ class MessageReloadResult(Message):
     def __init__(self):
         super(MessageReloadResult, self).__init__(self.param_name)
 
+class MessageGetMetrics(Message):
+    command = "METRICS"
+    param_name = ""
+
+    def __init__(self):
+        super(MessageGetMetrics, self).__init__()
+
 class MessageStopSession(Message):
     command = "STOPSESSION"
     param_name = ""
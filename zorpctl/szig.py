@@ -24,7 +24,7 @@ import socket
 from zorpctl.SZIGMessages import (
         MessageAuthorizeAccept, MessageAuthorizeReject,
         MessageGetChild, MessageGetDeadLockCheck,
-        MessageGetLogLevel, MessageGetLogSpec,
+        MessageGetLogLevel, MessageGetLogSpec, MessageGetMetrics,
         MessageGetSibling, MessageGetValue,
         MessageReload, MessageReloadResult,
         MessageSetDeadLockCheck, MessageSetLogLevel,
@@ -85,6 +85,18 @@ class Handler(object):
         resp = self._read_response()
         return Response(self._isSucceeded(resp), self._cutPrefix(resp))
 
+    def recv_until(self, terminator):
+        """
+        Returns the raw response of a multi-line command,
+        reading until the response ends with terminator.
+        """
+        response = ""
+        while not response.endswith(terminator):
+            response += self._read_response_raw()
+            if response.startswith(self._fail_prefix):
+                raise SZIGError(self._cutPrefix(response))
+        return response
+
     def _write_request(self, request):
         """
         Writing a command message to a Unix Domain Socket
@@ -113,11 +125,17 @@ class Handler(object):
         if resp_len < 1:
             raise SZIGError("Response length should be greater than 0")
 
+        response = self._read_response_raw(resp_len)
+        return response[:-1] if response[-1:] == '\n' else response
+
+    def _read_response_raw(self, resp_len = None):
+        if not resp_len:
+            resp_len = self.response_length
         response = self.socket.recv(resp_len)
         if not response:
             raise SZIGError("There was an error while receiving the answer!")
 
-        return response[:-1] if response[-1:] == '\n' else response
+        return response
 
     def _isSucceeded(self, response):
         """
@@ -159,6 +177,13 @@ class SZIG(object):
         response =  self.handler.talk(MessageGetChild(node))
         return None if response.value == "None" else response.value
 
+    def get_metrics(self):
+        """
+        Returns the whole SZIG tree in OpenMetrics text format.
+        """
+        self.handler.send(MessageGetMetrics())
+        return self.handler.recv_until("# EOF\n")
+
     @property
     def loglevel(self):
         self.handler.send(MessageGetLogLevel())